@@ -1,10 +1,41 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <poll.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // Define base paths
 char CURRENT_DIR[PATH_MAX];
@@ -12,6 +43,46 @@ char LOGISTICS_BASE_PATH[PATH_MAX];
 char ADMIN_BASE_PATH[PATH_MAX];
 char WAREHOUSE_BASE_PATH[PATH_MAX];
 char CUSTOMER_BASE_PATH[PATH_MAX];
+char INDEX_SNAPSHOT_PATH[PATH_MAX];
+char TRIGRAM_INDEX_PATH[PATH_MAX];
+char LINE_INDEX_DIR[PATH_MAX];
+char JOURNAL_PATH[PATH_MAX];
+char ORDER_STORE_PATH[PATH_MAX];
+char INVENTORY_PATH[PATH_MAX];
+char STOCK_PATH[PATH_MAX];
+char SCHEDULE_PATH[PATH_MAX];
+char SCHEDULE_LOG_PATH[PATH_MAX];
+char SHIPLOG_DIR[PATH_MAX];
+
+// Directory walker tuning
+#define WALK_MAX_WORKERS 32
+#define WALK_DENTS_BUFFER 32768
+
+// Block size used when viewing files
+#define VIEW_BLOCK_SIZE 65536
+
+// Server socket, relative to the working directory, and longest request line
+#define SERVER_SOCKET_NAME ".logistics.sock"
+#define SERVER_MAX_LINE 65536
+
+// Commands run between two journal commits in batch mode
+#define BATCH_WINDOW 256
+
+// Most base directories that paths can be confined to
+#define CONFINE_MAX_ROOTS 8
+
+// Line offset sidecars: one checkpoint every LINE_INDEX_STRIDE lines
+#define LINE_INDEX_STRIDE 4096
+#define LINE_INDEX_FINGERPRINT 32
+
+// Journal size that triggers a checkpoint once no operation is running
+#define JOURNAL_CHECKPOINT_BYTES (1 << 20)
+
+// Longest find pattern, in compiled tokens
+#define GLOB_MAX_TOKENS 128
+
+// Name of the packfile that holds the small files of a directory
+#define PACK_FILE_NAME ".logistics_pack"
 
 // Alias structures
 typedef struct Alias {
@@ -19,10 +90,276 @@ typedef struct Alias {
     char command[256];
 } Alias;
 
-Alias admin_aliases[10];
-int admin_alias_count = 0;
-Alias warehouse_aliases[10];
-int warehouse_alias_count = 0;
+// Aliases a session can hold. Each session owns its table.
+#define ALIAS_MAX 10
+
+// Result of a file copy, filled in by fsop_copy_file
+typedef struct CopyStats {
+    long long bytes;
+    double seconds;
+    const char *method;  // "reflink", "copy_file_range", "sendfile" or "read/write"
+} CopyStats;
+
+// Operations carried out by fsop_bulk_run
+typedef enum FsBulkOp {
+    FSBULK_STAT,     // statx of path, not following a final symlink
+    FSBULK_CREATE,   // Create path empty, or leave it untouched (touch)
+    FSBULK_UNLINK,   // Remove a non-directory
+    FSBULK_RMDIR,    // Remove an empty directory
+    FSBULK_RENAME,   // Move path to path2, never replacing path2
+    FSBULK_COPY      // Copy the regular file path to path2
+} FsBulkOp;
+
+// One operation of a bulk run and its outcome
+typedef struct FsBulkItem {
+    FsBulkOp op;
+    const char *path;
+    const char *path2;
+    struct statx stx;    // FSBULK_STAT result
+    int result;          // 0 or an errno value
+} FsBulkItem;
+
+typedef enum FsBulkBackend {
+    FSBULK_AUTO,         // LOGISTICS_IO, else io_uring when the kernel has it and CPUs > 1
+    FSBULK_SYNC,         // One blocking system call at a time
+    FSBULK_URING         // Batches submitted and reaped through io_uring
+} FsBulkBackend;
+
+typedef struct FsBulk FsBulk;
+
+// Counts reported while a tree is being removed
+typedef struct RmTreeProgress {
+    long files;          // Entries other than directories unlinked
+    long dirs;           // Directories removed
+    double seconds;
+} RmTreeProgress;
+
+typedef void (*RmTreeProgressFn)(const RmTreeProgress *progress, void *arg);
+
+typedef struct RmTreeOptions {
+    int workers;                  // 0 for the default
+    long rate;                    // Most entries removed per second, 0 for no limit
+    atomic_int *cancel;           // Stops the removal once non-zero; may be NULL
+    RmTreeProgressFn progress;    // Called on the calling thread a few times a second
+    void *progress_arg;
+} RmTreeOptions;
+
+// Something deleted into the trash of a base directory
+typedef struct TrashEntry {
+    char id[64];             // Name inside .trash, SECONDS-PID-COUNTER
+    char origin[PATH_MAX];   // Full path it was deleted from
+    const char *base;
+    time_t deleted;
+    int is_dir;
+} TrashEntry;
+
+// Order status, stored as one byte per order
+typedef enum OrderStatus {
+    ORDER_UNKNOWN,
+    ORDER_PENDING,
+    ORDER_PACKED,
+    ORDER_SHIPPED,
+    ORDER_IN_TRANSIT,
+    ORDER_DELIVERED,
+    ORDER_RETURNED,
+    ORDER_CANCELLED,
+    ORDER_STATUS_COUNT
+} OrderStatus;
+
+// One order of the order store; its free-text note is kept separately
+typedef struct OrderRecord {
+    uint64_t id;             // NNN of order_NNN.track
+    int64_t created;         // Unix seconds
+    int64_t updated;
+    uint32_t warehouse;      // 0 when not assigned
+    uint8_t status;          // OrderStatus
+} OrderRecord;
+
+typedef void (*OrderVisitor)(const OrderRecord *record, void *arg);
+
+// Longest SKU of the inventory files, including the terminating NUL
+#define INVENTORY_SKU_MAX 40
+
+typedef void (*InventoryVisitor)(const char *sku, long long quantity, const char *name, void *arg);
+
+// One delivery of the schedule, keyed by time and route; 64 bytes on disk
+typedef struct ScheduleRecord {
+    int64_t time;            // Unix seconds
+    uint32_t route;
+    uint32_t depot;
+    uint8_t cancelled;       // Set only on the entry that cancels a delivery
+    char note[47];
+} ScheduleRecord;
+
+typedef void (*ScheduleVisitor)(const ScheduleRecord *record, void *arg);
+
+// Outcome of a pack run
+typedef struct PackStats {
+    size_t files;            // Files moved into packfiles
+    size_t packs;            // Directories whose packfile took new files
+    size_t failed;           // Directories that could not be packed
+    long long bytes;         // Size of the files packed
+} PackStats;
+
+// Called with each decompressed block of a sealed shipment log segment
+typedef int (*SegmentBlockFn)(const char *data, size_t n, void *arg);
+
+// One shipment log entry found by a query; text is the line without its newline
+typedef void (*ShiplogVisitor)(const char *file, uint64_t line, const char *text, size_t len, void *arg);
+
+// One file of a glob-driven bulk copy, move or delete
+typedef struct BulkFile {
+    char *source;
+    char *destination;   // NULL for deletes
+    int result;          // 0 or an errno value
+    int dest_exists;     // Dry runs: the destination is already there
+    int packed;          // Dry runs: a member of the directory's packfile
+} BulkFile;
+
+// Files matched by bulk_plan, sorted by name
+typedef struct BulkPlan {
+    FsBulkOp op;         // FSBULK_COPY, FSBULK_RENAME or FSBULK_UNLINK
+    BulkFile *files;
+    size_t count;
+    size_t failed;
+} BulkPlan;
+
+// Directory entry reported by the parallel walker
+typedef struct WalkEntry {
+    int root;              // Index of the root the entry was found under
+    int dirfd;             // Open descriptor of the containing directory
+    const char *name;      // Entry name relative to dirfd
+    const char *path;      // Full path (valid only during the callback)
+    size_t path_len;
+    unsigned char type;    // DT_* value, never DT_UNKNOWN
+    ino_t ino;
+} WalkEntry;
+
+typedef void (*WalkVisitor)(int worker, const WalkEntry *entry, void *arg);
+
+// Metadata kept by the namespace index for every path under the logistics tree
+typedef struct NameIndexInfo {
+    ino_t ino;
+    off_t size;
+    long long mtime_ns;
+    unsigned char type;    // DT_* value
+} NameIndexInfo;
+
+typedef struct NameIndexEntry {
+    struct NameIndexEntry *next;
+    uint64_t hash;
+    NameIndexInfo info;
+    unsigned char unverified;  // Loaded from a snapshot and not stat'd since
+    size_t path_len;
+    char path[];
+} NameIndexEntry;
+
+typedef void (*NameIndexVisitor)(const NameIndexEntry *entry, void *arg);
+
+// One live member of a packfile, by its name within the directory
+typedef void (*PackVisitor)(const char *name, size_t name_len, const NameIndexInfo *info, void *arg);
+
+// Compiled find -name pattern
+enum { GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+typedef struct GlobToken {
+    int kind;
+    size_t offset;        // GLOB_LITERAL: start of the run in GlobPattern.text
+    size_t len;           // GLOB_LITERAL: length of the run
+    uint8_t set[32];      // GLOB_CLASS: bitmap of accepted bytes
+} GlobToken;
+
+typedef struct GlobPattern {
+    GlobToken tokens[GLOB_MAX_TOKENS];
+    int token_count;
+    char text[256];       // Literal runs, lowercased when ignore_case is set
+    int ignore_case;
+    size_t prefix_len;    // Length of the leading literal run, if any
+    size_t min_len;       // Shortest name that can match
+} GlobPattern;
+
+// Name, size and age predicates applied by find_file in a single pass
+typedef struct FindFilter {
+    GlobPattern glob;
+    int has_size;
+    char size_op;         // '+' larger than, '-' smaller than, '=' exactly
+    long long size;
+    int has_mtime;
+    char mtime_op;        // '-' modified after the cutoff, '+' before it
+    long long mtime_cutoff_ns;
+} FindFilter;
+
+// Substring search routine used by the content search
+typedef const char *(*MemSearchFn)(const char *hay, size_t n, const char *needle, size_t k);
+
+// Job run by the parallel task runner
+typedef void (*ParallelTask)(int worker, size_t index, void *arg);
+
+typedef struct ParallelWorker {
+    struct ParallelJob *job;
+    int id;
+} ParallelWorker;
+
+typedef struct ParallelJob {
+    pthread_t threads[WALK_MAX_WORKERS];
+    ParallelWorker workers[WALK_MAX_WORKERS];
+    int started;
+    size_t count;
+    atomic_size_t next;
+    ParallelTask task;
+    void *arg;
+} ParallelJob;
+
+// Distinct trigrams of one file, with the metadata they were read at
+typedef struct TrigramSet {
+    uint32_t *keys;
+    size_t count;
+    size_t cap;
+    NameIndexInfo info;
+    int valid;
+} TrigramSet;
+
+// Growable output buffer
+typedef struct OutBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} OutBuffer;
+
+// Durability asked of the append writer
+typedef enum AppendSync {
+    APPEND_SYNC_NONE,    // Leave the data in the page cache
+    APPEND_SYNC_BATCH,   // One fdatasync per group of concurrent appends
+    APPEND_SYNC_RECORD   // One fdatasync per record
+} AppendSync;
+
+// Where an appended record landed and whether it is on stable storage
+typedef struct AppendReceipt {
+    off_t offset;
+    int synced;
+    size_t batch_records;
+} AppendReceipt;
+
+// Mutating operations recorded in the journal
+typedef enum JournalOp {
+    JOURNAL_OP_NONE,
+    JOURNAL_OP_CHMOD,
+    JOURNAL_OP_MKDIR,
+    JOURNAL_OP_DELETE_TREE,
+    JOURNAL_OP_CREATE,
+    JOURNAL_OP_DELETE,
+    JOURNAL_OP_SYMLINK,
+    JOURNAL_OP_COPY,
+    JOURNAL_OP_MOVE
+} JournalOp;
+
+// One operation to announce in the journal
+typedef struct JournalIntentSpec {
+    JournalOp op;
+    const char *path;
+    const char *path2;
+    mode_t mode;
+} JournalIntentSpec;
 
 // User context structure
 typedef struct UserContext {
@@ -52,19 +389,202 @@ void find_file(UserContext *user_ctx);
 void search_content(UserContext *user_ctx);
 void set_alias(UserContext *user_ctx);
 void use_alias(UserContext *user_ctx);
+void bulk_copy_files(UserContext *user_ctx);
+void bulk_move_files(UserContext *user_ctx);
+void bulk_delete_files(UserContext *user_ctx);
+void restore_from_trash(UserContext *user_ctx);
+void order_store_menu(UserContext *user_ctx);
+void stock_menu(UserContext *user_ctx);
+void delivery_schedule_menu(UserContext *user_ctx);
+void shipment_log_menu(UserContext *user_ctx);
+void pack_small_files(UserContext *user_ctx);
 void main_menu(UserContext *user_ctx);
 void select_user_type();
+int user_context_for_role(const char *role, UserContext *user_ctx, Alias *aliases, int *alias_count);
 char *get_input(const char *prompt, char *buffer, size_t size);
 int login_user();
-const char* select_base_path_with_other(UserContext *user_ctx, const char *prompt);
+int check_credentials(const char *username, const char *password);
+const char* select_base_path_with_other(UserContext *user_ctx, const char *prompt, char *path_buffer);
+
+// Path confinement prototypes
+int confine_add_root(const char *path);
+int confine_open(const char *path, int flags, mode_t mode);
+
+// File operation engine prototypes (return 0 or an errno value)
+int fsop_open_parent(const char *path, const char **leaf);
+int fsop_open_leaf(int dirfd, const char *leaf, const char *path, int flags, mode_t mode);
+int fsop_chmod(const char *path, mode_t mode);
+int fsop_mkdir(const char *path, mode_t mode);
+int fsop_mkdir_p(const char *path, mode_t mode);
+int fsop_create_file(const char *path, mode_t mode);
+int fsop_delete_file(const char *path);
+int fsop_symlink(const char *target, const char *link_path);
+int fsop_rename(const char *source, const char *destination);
+int fsop_copy_file(const char *source, const char *destination, CopyStats *stats);
+int fsop_delete_tree(const char *path);
+
+// Tree remover prototypes
+int rmtree_run(const char *path, const RmTreeOptions *options, RmTreeProgress *progress);
+void rmtree_pace(const struct timespec *start, long done, long rate, atomic_int *cancel);
+
+// Trash prototypes
+void trash_init(const char *retention, const char *rate);
+void trash_shutdown(void);
+int trash_enabled(void);
+int trash_contains(const char *path);
+int trash_is_area(const char *path, size_t len);
+int trash_move(const char *path);
+int trash_list(const UserContext *user_ctx, TrashEntry **entries, size_t *count);
+int trash_restore(const TrashEntry *entry);
+int trash_restore_path(const UserContext *user_ctx, const char *path);
+
+// Order store prototypes (return 0 or an errno value)
+void order_store_open(const char *path);
+void order_store_close(void);
+int order_store_sync(void);
+const char *order_status_name(int status);
+int order_status_parse(const char *name);
+int order_store_put(const OrderRecord *record, const char *notes, size_t notes_len);
+int order_store_get(uint64_t id, OrderRecord *record, char **notes, size_t *notes_len);
+int order_store_scan(int status, OrderVisitor visit, void *arg, size_t *matched);
+int order_store_counts(size_t counts[ORDER_STATUS_COUNT], size_t *total);
+int order_store_import(const char *dir, size_t *imported, size_t *failed);
+int order_store_export(const char *dir, size_t *exported, size_t *failed);
+int bench_orders_main(int argc, char **argv);
+
+// Inventory engine prototypes (return 0 or an errno value)
+void inventory_init(const char *admin_path, const char *warehouse_path, const char *interval);
+void inventory_shutdown(void);
+int inventory_lookup(const char *path, const char *sku, long long *quantity, char *name, size_t name_size);
+int inventory_adjust(const char *path, const char *sku, long long delta, long long *quantity);
+int inventory_low(const char *path, long long max_quantity, InventoryVisitor visit, void *arg);
+int inventory_snapshot(const char *path);
+
+// Delivery schedule prototypes (return 0 or an errno value)
+void schedule_open(const char *path, const char *log_path);
+void schedule_close(void);
+int schedule_put(const ScheduleRecord *record);
+int schedule_cancel(int64_t time, uint32_t route);
+int schedule_range(int64_t from, int64_t to, uint32_t depot, ScheduleVisitor visit, void *arg, size_t *matched);
+int schedule_parse_time(const char *text, int64_t *time_out);
+int schedule_parse_number(const char *text, uint32_t *number);
+
+// Shipment log prototypes (return 0 or an errno value)
+void shiplog_open(const char *dir, const char *max_bytes, const char *max_seconds);
+void shiplog_close(void);
+int shiplog_append(const char *text);
+int shiplog_seal(void);
+int shiplog_compress(size_t *compressed, size_t *failed);
+int shiplog_query(int64_t from, int64_t to, const char *needle, ShiplogVisitor visit, void *arg, size_t *matched);
+int segment_detect(const void *head, size_t n);
+int segment_probe(int fd);
+int segment_sealed(const char *path);
+int segment_view(int fd, int out_fd, int mode, long first, long last);
+int segment_search(int fd, const char *path, const char *needle, size_t k, MemSearchFn search, OutBuffer *out);
+int segment_scan(int fd, SegmentBlockFn visit, void *arg);
+
+// Small-file pack prototypes (return 0 or an errno value unless noted)
+void pack_init(const char *max_bytes, const char *min_age);
+void pack_limits(long long *max_bytes, long long *min_age);
+int pack_reserved_name(const char *name);
+int pack_tree(const char *root, PackStats *stats);
+int pack_for_each(int dir_fd, PackVisitor visit, void *arg);
+int pack_openat(int dir_fd, const char *name, NameIndexInfo *info);
+int pack_open_member(const char *path, NameIndexInfo *info);
+int pack_stat(const char *path, struct stat *sb);
+int pack_unpack(const char *path);
+int pack_unpack_matching(int dir_fd, const GlobPattern *glob, size_t *unpacked);
+
+// Bulk file operation prototypes
+void fsop_bulk_init(const char *policy);
+FsBulk *fsop_bulk_open(FsBulkBackend backend);
+FsBulkBackend fsop_bulk_backend(const FsBulk *bulk);
+void fsop_bulk_run(FsBulk *bulk, FsBulkItem *items, size_t count);
+void fsop_bulk_close(FsBulk *bulk);
+int fsop_bulk(FsBulkItem *items, size_t count, FsBulkBackend backend);
+int bench_io_main(int argc, char **argv);
+
+// Bulk glob operation prototypes
+int bulk_plan(const UserContext *user_ctx, FsBulkOp op, const char *source_dir, const char *pattern,
+              const char *dest_dir, int dry_run, BulkPlan *plan);
+void bulk_run(BulkPlan *plan, int dry_run);
+void bulk_plan_free(BulkPlan *plan);
+
+// Directory walker prototypes
+int walk_default_workers(void);
+int walk_trees(const char **roots, int root_count, int workers, WalkVisitor visit, void *arg);
+int out_append(OutBuffer *buffer, const char *data, size_t len);
+void out_free(OutBuffer *buffer);
+int parallel_start(ParallelJob *job, size_t count, int workers, ParallelTask task, void *arg);
+void parallel_wait(ParallelJob *job);
+int start_service_thread(pthread_t *thread, void *(*run)(void *));
+
+// Namespace index prototypes
+int nsindex_init(const char *root, const char *snapshot_path);
+void nsindex_shutdown(void);
+int nsindex_for_each(const char *prefix, NameIndexVisitor visit, void *arg);
+int nsindex_lookup(const char *path, NameIndexInfo *info);
+int nsindex_lookup_each(char **paths, size_t count, NameIndexInfo *infos, char *known);
+
+// Glob matcher prototypes
+int glob_compile(GlobPattern *glob, const char *pattern, int ignore_case);
+int glob_match(const GlobPattern *glob, const char *name, size_t len);
+int find_filter_accepts(const FindFilter *filter, off_t size, long long mtime_ns);
+
+// Content search prototypes
+int content_search_file(const char *path, const char *needle, size_t k, MemSearchFn search, OutBuffer *out);
+
+// View engine prototypes
+int view_whole(int in_fd, int out_fd);
+int view_head(int in_fd, int out_fd, long lines);
+int view_tail(int in_fd, int out_fd, long lines);
+int view_range(int in_fd, int out_fd, off_t start, off_t end);
+int line_index_range(int fd, const char *cache_dir, long first, long last, off_t *start, off_t *end);
+
+// Append writer prototypes
+void append_writer_init(const char *policy);
+int append_record(const char *path, const char *data, size_t len, AppendReceipt *receipt);
+int append_record_sync(const char *path, const char *data, size_t len, AppendSync sync, AppendReceipt *receipt);
+
+// Operation journal prototypes
+int journal_open(const char *path);
+void journal_close(void);
+int journal_begin(JournalOp op, const char *path, const char *path2, mode_t mode, uint64_t *txn);
+int journal_begin_many(const JournalIntentSpec *specs, size_t count, uint64_t *txns);
+void journal_end(uint64_t txn, int result);
+void journal_end_many(const uint64_t *txns, const int *results, size_t count);
+
+// Batch mode prototypes
+int batch_main(int argc, char **argv);
+
+// Server mode prototypes
+int server_main(int argc, char **argv);
+int client_main(int argc, char **argv);
+
+// Stress mode prototypes
+int stress_main(int argc, char **argv);
+
+// Trigram index prototypes
+void trigram_index_open(const char *path);
+int trigram_index_select(char **files, size_t count, const char *needle, size_t k, char *scan, char *reindex);
+int trigram_scan_file(const char *path, uint64_t *bitmap, TrigramSet *set);
+void trigram_index_update(char **files, size_t count, TrigramSet *sets);
 
 // Base paths arrays
 const char *admin_base_paths[3];
 const char *warehouse_base_paths[2];
 const char *customer_base_paths[1];
 
-int main() {
+int main(int argc, char *argv[]) {
+    // The thin client only talks to a running server
+    if (argc > 1 && strcmp(argv[1], "--connect") == 0) return client_main(argc, argv);
+    // The benchmark builds its own tree and needs none of the logistics state
+    if (argc > 1 && strcmp(argv[1], "--bench-io") == 0) return bench_io_main(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--bench-orders") == 0) return bench_orders_main(argc, argv);
     initialize_paths();
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) return server_main(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0) return stress_main(argc, argv);
+    if (argc > 1) return batch_main(argc, argv);
     select_user_type();
     return 0;
 }
@@ -117,16 +637,121 @@ void initialize_paths() {
 
     customer_base_paths[0] = CUSTOMER_BASE_PATH;
 
-    // Create directories if they do not exist using system commands
-    char command[PATH_MAX + 20];
-    snprintf(command, sizeof(command), "mkdir -p \"%s\"", LOGISTICS_BASE_PATH);
-    system(command);
-    snprintf(command, sizeof(command), "mkdir -p \"%s\"", ADMIN_BASE_PATH);
-    system(command);
-    snprintf(command, sizeof(command), "mkdir -p \"%s\"", WAREHOUSE_BASE_PATH);
-    system(command);
-    snprintf(command, sizeof(command), "mkdir -p \"%s\"", CUSTOMER_BASE_PATH);
-    system(command);
+    // Create directories if they do not exist
+    const char *dirs[] = { LOGISTICS_BASE_PATH, ADMIN_BASE_PATH, WAREHOUSE_BASE_PATH, CUSTOMER_BASE_PATH };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        int err = fsop_mkdir_p(dirs[i], 0777);
+        if (err != 0) {
+            fprintf(stderr, "Error creating %s: %s\n", dirs[i], strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Hold the base directories open: every path check and file operation
+    // beneath them is resolved relative to these descriptors
+    for (size_t i = 1; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        int err = confine_add_root(dirs[i]);
+        if (err != 0) {
+            fprintf(stderr, "Error opening %s: %s\n", dirs[i], strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Finish anything a crash interrupted before the tree is indexed
+    append_writer_init(getenv("LOGISTICS_APPEND_SYNC"));
+    fsop_bulk_init(getenv("LOGISTICS_IO"));
+    ret = snprintf(JOURNAL_PATH, PATH_MAX, "%s/.logistics_journal", CURRENT_DIR);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing JOURNAL_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    int err = journal_open(JOURNAL_PATH);
+    if (err == EBUSY) {
+        fprintf(stderr, "Warning: another running instance owns the operation journal; changes will not be journaled.\n");
+    } else if (err != 0) {
+        fprintf(stderr, "Warning: operation journal unavailable (%s); changes will not be journaled.\n", strerror(err));
+    }
+    atexit(journal_close);
+
+    // Build the namespace index, or load it from the last run's snapshot
+    ret = snprintf(INDEX_SNAPSHOT_PATH, PATH_MAX, "%s/.logistics_index", CURRENT_DIR);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing INDEX_SNAPSHOT_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    err = nsindex_init(LOGISTICS_BASE_PATH, INDEX_SNAPSHOT_PATH);
+    if (err != 0) {
+        fprintf(stderr, "Warning: file index unavailable (%s); listings will scan the disk.\n", strerror(err));
+    }
+    atexit(nsindex_shutdown);
+
+    // Deletions go to the trash; the purger empties it in the background
+    trash_init(getenv("LOGISTICS_TRASH_RETENTION"), getenv("LOGISTICS_PURGE_RATE"));
+    atexit(trash_shutdown);
+
+    // The trigram index is loaded on the first content search
+    ret = snprintf(TRIGRAM_INDEX_PATH, PATH_MAX, "%s/.logistics_trigrams", CURRENT_DIR);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing TRIGRAM_INDEX_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    trigram_index_open(TRIGRAM_INDEX_PATH);
+
+    // Line offset sidecars are created on first use of a line range view
+    ret = snprintf(LINE_INDEX_DIR, PATH_MAX, "%s/.logistics_lines", CURRENT_DIR);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing LINE_INDEX_DIR.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The order store is mapped on first use
+    ret = snprintf(ORDER_STORE_PATH, PATH_MAX, "%s/.logistics_orders", CURRENT_DIR);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing ORDER_STORE_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    order_store_open(ORDER_STORE_PATH);
+    atexit(order_store_close);
+
+    // Stock files are loaded on first use and saved in the background
+    ret = snprintf(INVENTORY_PATH, PATH_MAX, "%s/inventory.txt", ADMIN_BASE_PATH);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing INVENTORY_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret = snprintf(STOCK_PATH, PATH_MAX, "%s/stock.dat", WAREHOUSE_BASE_PATH);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing STOCK_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    inventory_init(INVENTORY_PATH, STOCK_PATH, getenv("LOGISTICS_INVENTORY_SNAPSHOT"));
+    atexit(inventory_shutdown);
+
+    // The delivery schedule is mapped on first use; its log sits with the journal
+    ret = snprintf(SCHEDULE_PATH, PATH_MAX, "%s/delivery_schedules.db", ADMIN_BASE_PATH);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing SCHEDULE_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret = snprintf(SCHEDULE_LOG_PATH, PATH_MAX, "%s/.logistics_schedule_log", CURRENT_DIR);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing SCHEDULE_LOG_PATH.\n");
+        exit(EXIT_FAILURE);
+    }
+    schedule_open(SCHEDULE_PATH, SCHEDULE_LOG_PATH);
+    atexit(schedule_close);
+
+    // Shipment log segments are sealed in the background as they fill or age
+    ret = snprintf(SHIPLOG_DIR, PATH_MAX, "%s/shipment_logs", WAREHOUSE_BASE_PATH);
+    if (ret < 0 || (size_t)ret >= PATH_MAX) {
+        fprintf(stderr, "Error initializing SHIPLOG_DIR.\n");
+        exit(EXIT_FAILURE);
+    }
+    shiplog_open(SHIPLOG_DIR, getenv("LOGISTICS_SEGMENT_BYTES"), getenv("LOGISTICS_SEGMENT_SECONDS"));
+    atexit(shiplog_close);
+
+    // Small files are packed only on request; these limits pick which ones
+    pack_init(getenv("LOGISTICS_PACK_MAX_BYTES"), getenv("LOGISTICS_PACK_AGE"));
 }
 
 // Sanitize filename to prevent directory traversal
@@ -151,8 +776,132 @@ int sanitize_filename(const char *filename, char *sanitized, size_t size) {
     return 1;  // Success
 }
 
-// Check if path is within any of the base paths allowed for the user
-int is_valid_path(const char **base_paths, int base_paths_count, const char *path) {
+// ---------------------------------------------------------------------------
+// Path confinement
+//
+// The base directories are opened once at startup. Paths beneath them are
+// resolved relative to those descriptors with openat2(RESOLVE_BENEATH |
+// RESOLVE_NO_MAGICLINKS), so the kernel rejects any ".." or symlink that
+// would leave the base in the same lookup that opens the file, and there
+// is no window between checking a path and using it. Operations that work
+// on a leaf relative to its parent directory do not follow a symbolic link
+// there (fsop_open_leaf, fsop_chmod, the *at() calls), or follow it only
+// through another confined lookup.
+//
+// RESOLVE_BENEATH refuses every absolute symlink target, and "Create
+// symbolic link" stores absolute targets. A lookup refused that way is
+// resolved with realpath() and retried, confined again, under the root the
+// resolved path lies in; is_valid_path first checks that path against the
+// user's own base directories.
+// ---------------------------------------------------------------------------
+
+typedef struct ConfineRoot {
+    const char *path;
+    size_t len;
+    int fd;
+    char *real;              // path with every symbolic link resolved
+    size_t real_len;
+} ConfineRoot;
+
+static ConfineRoot confine_roots[CONFINE_MAX_ROOTS];
+static int confine_root_count;
+static int confine_has_openat2;
+
+// Register a base directory; all roots are added before any thread starts
+int confine_add_root(const char *path) {
+    if (confine_root_count == CONFINE_MAX_ROOTS) return ENOSPC;
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return errno;
+
+    if (confine_root_count == 0) {
+        // Probe once so lookups never have to handle ENOSYS
+        struct open_how how = { .flags = O_PATH | O_CLOEXEC, .resolve = RESOLVE_BENEATH };
+        int probe = (int)syscall(SYS_openat2, fd, ".", &how, sizeof(how));
+        confine_has_openat2 = probe >= 0;
+        if (probe >= 0) close(probe);
+    }
+    char *real = realpath(path, NULL);
+    if (real == NULL) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    confine_roots[confine_root_count++] = (ConfineRoot){ .path = path, .len = strlen(path), .fd = fd,
+                                                         .real = real, .real_len = strlen(real) };
+    return 0;
+}
+
+// Does path name base itself or something lexically below it?
+static int confine_is_beneath(const char *base, size_t len, const char *path) {
+    return strncmp(base, path, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+// The deepest root that path lies under, with *rel set to the rest of it
+static const ConfineRoot *confine_find_root(const char *path, const char **rel) {
+    const ConfineRoot *best = NULL;
+    for (int i = 0; i < confine_root_count; i++) {
+        if (confine_is_beneath(confine_roots[i].path, confine_roots[i].len, path) &&
+            (best == NULL || confine_roots[i].len > best->len)) {
+            best = &confine_roots[i];
+        }
+    }
+    if (best != NULL) {
+        *rel = path + best->len;
+        while (**rel == '/') (*rel)++;
+        if (**rel == '\0') *rel = ".";
+    }
+    return best;
+}
+
+static int confine_open_beneath(int root_fd, const char *rel, int flags, mode_t mode) {
+    struct open_how how = {
+        .flags = (uint64_t)flags,
+        .mode = (flags & (O_CREAT | O_TMPFILE)) ? mode : 0,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    return (int)syscall(SYS_openat2, root_fd, rel, &how, sizeof(how));
+}
+
+// Open path by its resolved form, beneath whichever root that lies in. For
+// lookups RESOLVE_BENEATH refused because of an absolute symlink target.
+// Returns the fd, or -1 with errno set (EXDEV outside every root).
+static int confine_open_resolved(const char *path, int flags, mode_t mode) {
+    char real[PATH_MAX];
+    if (realpath(path, real) == NULL) {
+        errno = EXDEV;
+        return -1;
+    }
+    const ConfineRoot *best = NULL;
+    for (int i = 0; i < confine_root_count; i++) {
+        if (confine_is_beneath(confine_roots[i].real, confine_roots[i].real_len, real) &&
+            (best == NULL || confine_roots[i].real_len > best->real_len)) {
+            best = &confine_roots[i];
+        }
+    }
+    if (best == NULL) {
+        errno = EXDEV;
+        return -1;
+    }
+    const char *rel = real + best->real_len;
+    while (*rel == '/') rel++;
+    return confine_open_beneath(best->fd, *rel != '\0' ? rel : ".", flags, mode);
+}
+
+// open() that, for paths under a root, cannot resolve to anything outside
+// the roots (EXDEV/ELOOP). Returns the fd, or -1 with errno set.
+int confine_open(const char *path, int flags, mode_t mode) {
+    const char *rel;
+    const ConfineRoot *root = confine_has_openat2 ? confine_find_root(path, &rel) : NULL;
+    if (root == NULL) return open(path, flags, mode);
+
+    int fd = confine_open_beneath(root->fd, rel, flags, mode);
+    if (fd < 0 && errno == EXDEV) fd = confine_open_resolved(path, flags, mode);
+    return fd;
+}
+
+// realpath() based check, for paths outside the confinement roots and for
+// kernels without openat2
+static int is_valid_path_resolved(const char **base_paths, int base_paths_count, const char *path) {
     char real_target[PATH_MAX];
 
     // Attempt to resolve target path
@@ -194,789 +943,13063 @@ int is_valid_path(const char **base_paths, int base_paths_count, const char *pat
     return 0;  // Path is not within allowed base paths
 }
 
-// Get input from user
-char *get_input(const char *prompt, char *buffer, size_t size) {
-    printf("%s", prompt);
-    fflush(stdout);
-    if (fgets(buffer, (int)size, stdin) != NULL) {
-        buffer[strcspn(buffer, "\n")] = '\0';  // Remove newline
-        return buffer;
+// Check if path is within any of the base paths allowed for the user. Under
+// a confinement root this is a single kernel lookup of the target, or of its
+// parent when the target does not exist yet.
+int is_valid_path(const char **base_paths, int base_paths_count, const char *path) {
+    // The trash is only reachable through restore, packfiles through their members
+    if (trash_contains(path)) return 0;
+    const char *slash = strrchr(path, '/');
+    if (pack_reserved_name(slash != NULL ? slash + 1 : path)) return 0;
+
+    const char *rel;
+    const ConfineRoot *root = confine_has_openat2 ? confine_find_root(path, &rel) : NULL;
+    if (root == NULL) return is_valid_path_resolved(base_paths, base_paths_count, path);
+
+    // The user must be allowed into the part of the tree the path names
+    int allowed = 0;
+    for (int i = 0; i < base_paths_count && !allowed; i++) {
+        allowed = confine_is_beneath(base_paths[i], strlen(base_paths[i]), path);
     }
-    return NULL;
+    if (!allowed) return 0;
+
+    int fd = confine_open_beneath(root->fd, rel, O_PATH | O_CLOEXEC, 0);
+    if (fd < 0 && errno == EXDEV) {
+        // Through a symbolic link with an absolute target: where it leads
+        // must be open to the user as well
+        if (!is_valid_path_resolved(base_paths, base_paths_count, path)) return 0;
+        fd = confine_open_resolved(path, O_PATH | O_CLOEXEC, 0);
+    }
+    if (fd < 0 && errno == ENOENT) {
+        const char *leaf;
+        fd = fsop_open_parent(path, &leaf);
+    }
+    if (fd < 0) return 0;
+    close(fd);
+    return 1;
 }
 
-// Function to select base path with 'Other' option
-const char* select_base_path_with_other(UserContext *user_ctx, const char *prompt) {
-    printf("%s\n", prompt);
-    for (int i = 0; i < user_ctx->base_paths_count; i++) {
-        printf("%d. %s\n", i + 1, user_ctx->base_paths[i]);
+// ---------------------------------------------------------------------------
+// File operation engine
+//
+// Native replacements for the touch/rm/cp/mv/ln/rm -rf shell commands. Every
+// operation opens the parent directory once and works relative to it with the
+// *at() system calls. All functions return 0 on success or an errno value.
+// ---------------------------------------------------------------------------
+
+// Open the parent directory of path and point *leaf at the final component.
+// Returns the directory fd, or -1 with errno set.
+int fsop_open_parent(const char *path, const char **leaf) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        *leaf = path;
+        return open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (slash[1] == '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    *leaf = slash + 1;
+    if (slash == path) {
+        return open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
     }
-    printf("%d. Other (specify subdirectory under allowed directories)\n", user_ctx->base_paths_count + 1);
 
-    char dir_choice_str[10];
-    if (get_input("Enter your choice: ", dir_choice_str, sizeof(dir_choice_str)) == NULL) {
-        printf("Error reading input.\n");
-        return NULL;
+    char parent[PATH_MAX];
+    size_t len = (size_t)(slash - path);
+    if (len >= sizeof(parent)) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
-    int dir_choice = atoi(dir_choice_str) - 1;
-    if (dir_choice < 0 || dir_choice > user_ctx->base_paths_count) {
-        printf("Invalid choice.\n");
-        return NULL;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    return confine_open(parent, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+}
+
+// openat(dirfd, leaf) for dirfd, the parent fsop_open_parent returned for
+// path. The parent is confined already; a symbolic link at leaf is only
+// followed by a second, confined lookup of the whole path, and refused
+// (ELOOP) where there is none. Returns the fd, or -1 with errno set.
+int fsop_open_leaf(int dirfd, const char *leaf, const char *path, int flags, mode_t mode) {
+    int fd = openat(dirfd, leaf, flags | O_NOFOLLOW, mode);
+    if (fd >= 0 || errno != ELOOP) return fd;
+    const char *rel;
+    if (!confine_has_openat2 || confine_find_root(path, &rel) == NULL) {
+        errno = ELOOP;
+        return -1;
     }
-    if (dir_choice == user_ctx->base_paths_count) {
-        // 'Other' option selected
-        printf("Select the base directory under which the subdirectory is located:\n");
-        for (int i = 0; i < user_ctx->base_paths_count; i++) {
-            printf("%d. %s\n", i + 1, user_ctx->base_paths[i]);
-        }
-        if (get_input("Enter your choice: ", dir_choice_str, sizeof(dir_choice_str)) == NULL) {
-            printf("Error reading input.\n");
-            return NULL;
-        }
-        int base_dir_choice = atoi(dir_choice_str) - 1;
-        if (base_dir_choice < 0 || base_dir_choice >= user_ctx->base_paths_count) {
-            printf("Invalid choice.\n");
-            return NULL;
-        }
-        const char *selected_base_path = user_ctx->base_paths[base_dir_choice];
-        char subdir_name[256];
-        if (get_input("Enter the subdirectory path under selected base directory: ", subdir_name, sizeof(subdir_name)) == NULL) {
-            printf("Error reading input.\n");
-            return NULL;
-        }
-        // Sanitize subdirectory name
-        char sanitized_subdir[256];
-        if (!sanitize_filename(subdir_name, sanitized_subdir, sizeof(sanitized_subdir))) {
-            printf("Invalid subdirectory name.\n");
-            return NULL;
-        }
-        // Now construct the base path
-        static char temp_path[PATH_MAX];
-        if (snprintf(temp_path, sizeof(temp_path), "%s/%s", selected_base_path, sanitized_subdir) >= (int)sizeof(temp_path)) {
-            printf("Path is too long.\n");
-            return NULL;
-        }
-        // Check that it is a valid path under allowed paths
-        if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, temp_path)) {
-            printf("Invalid or forbidden path.\n");
-            return NULL;
-        }
-        // Check if the directory exists
-        struct stat sb;
-        if (stat(temp_path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
-            return temp_path;
-        } else {
-            printf("Directory does not exist.\n");
-            return NULL;
+    return confine_open(path, flags, mode);
+}
+
+// Change the permission bits of path through a descriptor from a confined
+// lookup, so a symbolic link swapped in cannot redirect the change
+int fsop_chmod(const char *path, mode_t mode) {
+    const char *leaf, *rel;
+    int dirfd = fsop_open_parent(path, &leaf);
+    if (dirfd < 0) return errno;
+    // O_PATH | O_NOFOLLOW opens a symbolic link itself rather than failing
+    int fd = openat(dirfd, leaf, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    int err = fd >= 0 ? 0 : errno;
+    close(dirfd);
+    struct stat sb;
+    if (err == 0 && fstat(fd, &sb) != 0) err = errno;
+    if (err == 0 && S_ISLNK(sb.st_mode)) {
+        close(fd);
+        fd = -1;
+        err = ELOOP;
+        if (confine_has_openat2 && confine_find_root(path, &rel) != NULL) {
+            fd = confine_open(path, O_PATH | O_CLOEXEC, 0);
+            err = fd >= 0 ? 0 : errno;
         }
-    } else {
-        return user_ctx->base_paths[dir_choice];
     }
+    if (err == 0) {
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+        err = chmod(proc_path, mode) == 0 ? 0 : errno;
+    }
+    if (fd >= 0) close(fd);
+    return err;
 }
 
-// Function to list files in allowed directories
-void list_files(UserContext *user_ctx) {
-    printf("Listing files in allowed directories:\n");
-    int total_files = 0;
-    for (int i = 0; i < user_ctx->base_paths_count; i++) {
-        const char *base_path = user_ctx->base_paths[i];
-        printf("\nDirectory: %s\n", base_path);
+// Create a single directory
+int fsop_mkdir(const char *path, mode_t mode) {
+    const char *leaf;
+    int dirfd = fsop_open_parent(path, &leaf);
+    if (dirfd < 0) return errno;
+    int err = mkdirat(dirfd, leaf, mode) == 0 ? 0 : errno;
+    close(dirfd);
+    return err;
+}
 
-        // Construct the find command
-        char command[PATH_MAX + 100];
-        snprintf(command, sizeof(command), "find \"%s\" -type f", base_path);
+// Create a directory and any missing parents (mkdir -p)
+int fsop_mkdir_p(const char *path, mode_t mode) {
+    char buffer[PATH_MAX];
+    if (strlen(path) >= sizeof(buffer)) return ENAMETOOLONG;
+    strcpy(buffer, path);
+
+    for (char *p = buffer + 1; ; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        char saved = *p;
+        *p = '\0';
+        if (mkdir(buffer, mode) != 0 && errno != EEXIST) return errno;
+        *p = saved;
+        if (saved == '\0') break;
+    }
 
-        // Open a pipe to read the output of the command
-        FILE *fp = popen(command, "r");
-        if (fp == NULL) {
-            printf("Failed to execute command.\n");
-            continue;
-        }
+    struct stat sb;
+    if (stat(buffer, &sb) != 0) return errno;
+    return S_ISDIR(sb.st_mode) ? 0 : ENOTDIR;
+}
 
-        char path_buffer[PATH_MAX];
-        int dir_file_count = 0;
-        while (fgets(path_buffer, sizeof(path_buffer), fp) != NULL) {
-            printf("%s", path_buffer);  // Print the file path
-            dir_file_count++;
-        }
-        pclose(fp);
+// Create an empty regular file, or leave an existing one untouched (touch)
+int fsop_create_file(const char *path, mode_t mode) {
+    const char *leaf;
+    int dirfd = fsop_open_parent(path, &leaf);
+    if (dirfd < 0) return errno;
+    int fd = fsop_open_leaf(dirfd, leaf, path, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC, mode);
+    int err = fd >= 0 ? 0 : errno;
+    if (fd >= 0) close(fd);
+    close(dirfd);
+    return err;
+}
 
-        printf("Number of files in %s: %d\n", base_path, dir_file_count);
-        total_files += dir_file_count;
-    }
-    printf("\nTotal number of files: %d\n", total_files);
+// Remove a single non-directory entry
+int fsop_delete_file(const char *path) {
+    const char *leaf;
+    int dirfd = fsop_open_parent(path, &leaf);
+    if (dirfd < 0) return errno;
+    int err = unlinkat(dirfd, leaf, 0) == 0 ? 0 : errno;
+    close(dirfd);
+    return err;
 }
 
-// Function to change file permissions
-void change_permissions(UserContext *user_ctx) {
-    char file_name[256];
-    if (get_input("Enter file name to change permissions: ", file_name, sizeof(file_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Create link_path as a symbolic link pointing to target
+int fsop_symlink(const char *target, const char *link_path) {
+    const char *leaf;
+    int dirfd = fsop_open_parent(link_path, &leaf);
+    if (dirfd < 0) return errno;
+    int err = symlinkat(target, dirfd, leaf) == 0 ? 0 : errno;
+    close(dirfd);
+    return err;
+}
+
+// Write the whole buffer, retrying on short writes and EINTR
+static int fsop_write_all(int fd, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buffer, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        buffer += w;
+        len -= (size_t)w;
     }
-    char sanitized_name[256];
-    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
-        printf("Invalid file name.\n");
-        return;
+    return 0;
+}
+
+// Errors that mean "this copy mechanism is not available here, try the next one"
+static int fsop_copy_unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ||
+           err == ENOTTY || err == EBADF || err == EPERM;
+}
+
+// Copy bytes from in_fd to out_fd, starting at their current offsets. Tries a
+// reflink, then copy_file_range, then sendfile and finally a buffered loop;
+// a later stage resumes where an earlier one stopped.
+static int fsop_copy_data(int in_fd, int out_fd, off_t size, long long *copied, const char **method) {
+    *copied = 0;
+
+    // Same-filesystem clone: shares extents, no data is moved at all
+    if (size > 0 && ioctl(out_fd, FICLONE, in_fd) == 0) {
+        *copied = size;
+        *method = "reflink";
+        return 0;
     }
 
-    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory of the file:");
-    if (base_path == NULL) return;
+    // In-kernel copy, which may still be offloaded to the filesystem
+    *method = "copy_file_range";
+    while (1) {
+        ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+        if (n > 0) {
+            *copied += n;
+            continue;
+        }
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        if (!fsop_copy_unsupported(errno)) return errno;
+        break;
+    }
 
-    char full_path[PATH_MAX];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
-        printf("Path is too long.\n");
-        return;
+    // Page cache to file without a round trip through user space
+    *method = "sendfile";
+    while (1) {
+        ssize_t n = sendfile(out_fd, in_fd, NULL, 1 << 30);
+        if (n > 0) {
+            *copied += n;
+            continue;
+        }
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        if (!fsop_copy_unsupported(errno)) return errno;
+        break;
     }
 
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
-        printf("Invalid path. Operation not allowed.\n");
-        return;
+    // Last resort: plain buffered copy
+    *method = "read/write";
+    char buffer[131072];
+    while (1) {
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        int err = fsop_write_all(out_fd, buffer, (size_t)n);
+        if (err != 0) return err;
+        *copied += n;
     }
+}
 
-    // Check if file exists
+// Empty the destination of a copy, opened without O_TRUNC, once it is known
+// not to be the source file itself; copying a file onto itself is EINVAL
+static int fsop_copy_truncate(const struct stat *source, int out_fd) {
     struct stat sb;
-    if (stat(full_path, &sb) != 0) {
-        printf("File does not exist.\n");
-        return;
+    if (fstat(out_fd, &sb) != 0) return errno;
+    if (sb.st_dev == source->st_dev && sb.st_ino == source->st_ino) return EINVAL;
+    return ftruncate(out_fd, 0) == 0 ? 0 : errno;
+}
+
+// Copy the contents and permission bits of a regular file, which may be a
+// packed one. stats may be NULL.
+int fsop_copy_file(const char *source, const char *destination, CopyStats *stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int in_fd = confine_open(source, O_RDONLY | O_CLOEXEC, 0);
+    if (in_fd < 0 && errno == ENOENT) in_fd = pack_open_member(source, NULL);
+    if (in_fd < 0) return errno;
+
+    struct stat sb;
+    if (fstat(in_fd, &sb) != 0) {
+        int err = errno;
+        close(in_fd);
+        return err;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        close(in_fd);
+        return S_ISDIR(sb.st_mode) ? EISDIR : EINVAL;
     }
 
-    char perm_str[10];
-    if (get_input("Enter new permissions (e.g., 755): ", perm_str, sizeof(perm_str)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+    const char *leaf;
+    int dirfd = fsop_open_parent(destination, &leaf);
+    if (dirfd < 0) {
+        int err = errno;
+        close(in_fd);
+        return err;
+    }
+    int out_fd = fsop_open_leaf(dirfd, leaf, destination, O_WRONLY | O_CREAT | O_CLOEXEC, sb.st_mode & 07777);
+    int err = out_fd >= 0 ? 0 : errno;
+    close(dirfd);
+    if (out_fd < 0) {
+        close(in_fd);
+        return err;
+    }
+    err = fsop_copy_truncate(&sb, out_fd);
+    if (err != 0) {
+        close(in_fd);
+        close(out_fd);
+        return err;
     }
 
-    // Use chmod function
-    mode_t mode = strtol(perm_str, NULL, 8);
-    if (chmod(full_path, mode) == 0) {
-        printf("Permissions changed for %s\n", full_path);
-    } else {
-        perror("Error changing permissions");
+    long long copied = 0;
+    const char *method = NULL;
+    err = fsop_copy_data(in_fd, out_fd, sb.st_size, &copied, &method);
+
+    // The creation mode is filtered by umask and ignored for existing files
+    if (err == 0 && fchmod(out_fd, sb.st_mode & 07777) != 0) err = errno;
+
+    close(in_fd);
+    if (close(out_fd) != 0 && err == 0) err = errno;
+
+    if (stats != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->bytes = copied;
+        stats->method = method;
+        stats->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
     }
+    return err;
 }
 
-// Function to create directory
-void create_directory(UserContext *user_ctx) {
-    char dir_name[256];
-    if (get_input("Enter directory name to create: ", dir_name, sizeof(dir_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// fsync a directory given an O_PATH descriptor for it
+static int fsop_fsync_dir(int dirfd) {
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return errno;
+    int err = fsync(fd) == 0 ? 0 : errno;
+    close(fd);
+    return err;
+}
+
+// Place the fully written, unnamed or temporary file out_fd at dest_leaf
+// without replacing anything that already exists there. The caller removes
+// tmp_leaf afterwards, whatever the outcome.
+static int fsop_publish_no_replace(int out_fd, int dest_dirfd, const char *dest_leaf, const char *tmp_leaf) {
+    if (tmp_leaf == NULL) {
+        // O_TMPFILE: give the inode its final name in one atomic link
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", out_fd);
+        return linkat(AT_FDCWD, proc_path, dest_dirfd, dest_leaf, AT_SYMLINK_FOLLOW) == 0 ? 0 : errno;
     }
-    char sanitized_name[256];
-    if (!sanitize_filename(dir_name, sanitized_name, sizeof(sanitized_name))) {
-        printf("Invalid directory name.\n");
-        return;
+    if (renameat2(dest_dirfd, tmp_leaf, dest_dirfd, dest_leaf, RENAME_NOREPLACE) == 0) return 0;
+    int err = errno;
+    if (err == EINVAL || err == ENOSYS) {
+        // Filesystem without RENAME_NOREPLACE: link() refuses to overwrite too
+        err = linkat(dest_dirfd, tmp_leaf, dest_dirfd, dest_leaf, 0) == 0 ? 0 : errno;
     }
+    return err;
+}
 
-    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory to create the new directory in:");
-    if (base_path == NULL) return;
+// Cross-filesystem move of a regular file. The data is streamed into an
+// unnamed (or hidden temporary) file next to the destination and fsynced,
+// linked into place, the directory is fsynced, and only then is the source
+// unlinked. A crash leaves a complete file at the source, the destination,
+// or briefly both, but never a partial destination.
+static int fsop_move_across_devices(int source_dirfd, const char *source_leaf, int dest_dirfd, const char *dest_leaf) {
+    int in_fd = openat(source_dirfd, source_leaf, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in_fd < 0) return errno == ELOOP ? EXDEV : errno;
 
-    char full_path[PATH_MAX];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
-        printf("Path is too long.\n");
-        return;
+    struct stat sb;
+    if (fstat(in_fd, &sb) != 0) {
+        int err = errno;
+        close(in_fd);
+        return err;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        close(in_fd);
+        return EXDEV;  // Directories cannot be streamed
     }
 
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
-        printf("Invalid path. Operation not allowed.\n");
-        return;
+    char tmp_leaf[NAME_MAX + 1];
+    const char *tmp_name = NULL;
+    int out_fd = openat(dest_dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, sb.st_mode & 07777);
+    if (out_fd < 0) {
+        // No O_TMPFILE support: fall back to a hidden, uniquely named file
+        if (snprintf(tmp_leaf, sizeof(tmp_leaf), ".%.200s.mv.%ld", dest_leaf, (long)getpid()) >= (int)sizeof(tmp_leaf)) {
+            close(in_fd);
+            return ENAMETOOLONG;
+        }
+        tmp_name = tmp_leaf;
+        out_fd = openat(dest_dirfd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, sb.st_mode & 07777);
+        if (out_fd < 0) {
+            int err = errno;
+            close(in_fd);
+            return err;
+        }
     }
 
-    // Check if directory exists
+    long long copied;
+    const char *method;
+    int err = fsop_copy_data(in_fd, out_fd, sb.st_size, &copied, &method);
+    if (err == 0 && fchmod(out_fd, sb.st_mode & 07777) != 0) err = errno;
+    if (err == 0 && fsync(out_fd) != 0) err = errno;
+    if (err == 0) err = fsop_publish_no_replace(out_fd, dest_dirfd, dest_leaf, tmp_name);
+    // Gone already after a rename; a leftover on any other path
+    if (tmp_name != NULL) unlinkat(dest_dirfd, tmp_name, 0);
+    close(out_fd);
+    close(in_fd);
+    if (err != 0) return err;
+
+    // Make the new name durable before the old one goes away
+    err = fsop_fsync_dir(dest_dirfd);
+    if (err != 0) return err;
+    if (unlinkat(source_dirfd, source_leaf, 0) != 0) return errno;
+    fsop_fsync_dir(source_dirfd);
+    return 0;
+}
+
+// Move source to destination. Never replaces an existing destination
+// (EEXIST); uses an atomic rename on the same filesystem and a crash-safe
+// streaming copy across filesystems.
+int fsop_rename(const char *source, const char *destination) {
+    const char *source_leaf, *dest_leaf;
+    int source_dirfd = fsop_open_parent(source, &source_leaf);
+    if (source_dirfd < 0) return errno;
+    int dest_dirfd = fsop_open_parent(destination, &dest_leaf);
+    if (dest_dirfd < 0) {
+        int err = errno;
+        close(source_dirfd);
+        return err;
+    }
+
+    int err = renameat2(source_dirfd, source_leaf, dest_dirfd, dest_leaf, RENAME_NOREPLACE) == 0 ? 0 : errno;
     struct stat sb;
-    if (stat(full_path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
-        printf("Directory already exists.\n");
-        return;
+    if ((err == EINVAL || err == ENOSYS) && fstatat(source_dirfd, source_leaf, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+        !S_ISDIR(sb.st_mode)) {
+        // RENAME_NOREPLACE unsupported here: link + unlink is equally
+        // non-destructive, though not atomic, so a failed unlink takes the
+        // new link back. Directories cannot be linked and keep the error.
+        err = linkat(source_dirfd, source_leaf, dest_dirfd, dest_leaf, 0) == 0 ? 0 : errno;
+        if (err == 0 && unlinkat(source_dirfd, source_leaf, 0) != 0) {
+            err = errno;
+            unlinkat(dest_dirfd, dest_leaf, 0);
+        }
+    }
+    if (err == EXDEV) {
+        err = fsop_move_across_devices(source_dirfd, source_leaf, dest_dirfd, dest_leaf);
     }
 
-    // Create directory
-    if (mkdir(full_path, 0777) == 0) {
-        printf("Directory created: %s\n", full_path);
-    } else {
-        perror("Error creating directory");
+    close(source_dirfd);
+    close(dest_dirfd);
+    return err;
+}
+
+// Recursively delete a directory tree (rm -rf)
+int fsop_delete_tree(const char *path) {
+    return rmtree_run(path, NULL, NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Parallel tree remover
+//
+// rmtree_run deletes a directory tree with unlinkat on directory fds.
+// Directories go on a shared stack that a bounded pool of threads takes
+// work from, so sibling subtrees are removed in parallel. A worker reads one
+// directory, unlinks everything in it that is not a directory, and pushes
+// its subdirectories. Each directory counts the subdirectories it is still
+// waiting for, and the worker that removes its last one removes it too.
+//
+// Directories are opened relative to the top of the tree and never through
+// a symbolic link (RESOLVE_NO_SYMLINKS, or O_NOFOLLOW one component at a
+// time on kernels without openat2). A symlink inside the tree is unlinked
+// like a file and whatever it points to is left alone.
+//
+// A rate limit spreads the unlinks out over time, for background purges.
+// Cancelling stops the workers between two entries. Every step is a
+// single unlinkat, so what is left is an ordinary subset of the tree, with
+// no entry half removed.
+// ---------------------------------------------------------------------------
+
+#define RMTREE_MIN_WORKERS 4
+#define RMTREE_PROGRESS_MS 250
+
+typedef struct RmTreeNode {
+    struct RmTreeNode *parent;   // NULL for the top of the tree
+    struct RmTreeNode *next;     // Work stack link
+    atomic_int pending;          // Subdirectories left, plus one until read
+    char rel[];                  // Path below the top, "" for the top
+} RmTreeNode;
+
+typedef struct RmTree {
+    int top_fd;
+    long rate;
+    struct timespec start;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;         // Work was pushed, or a worker exited
+    pthread_cond_t exit_cond;    // A worker exited
+    RmTreeNode *stack;
+    int active;                  // Workers holding a directory
+    int exited;
+    atomic_long files;
+    atomic_long dirs;
+    atomic_int err;              // First error, 0 if none
+    atomic_int *cancel;
+} RmTree;
+
+static int rmtree_cancelled(RmTree *tree) {
+    return tree->cancel != NULL && atomic_load(tree->cancel) != 0;
+}
+
+// Sleep until done operations fit a budget of rate per second since start.
+// Sleeps in short steps and returns early once *cancel is set.
+void rmtree_pace(const struct timespec *start, long done, long rate, atomic_int *cancel) {
+    if (rate <= 0) return;
+    while (cancel == NULL || atomic_load(cancel) == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double ahead = (double)done / (double)rate - ((double)(now.tv_sec - start->tv_sec) +
+                                                      (double)(now.tv_nsec - start->tv_nsec) / 1e9);
+        if (ahead <= 0) return;
+        if (ahead > 0.1) ahead = 0.1;
+        struct timespec ts = { 0, (long)(ahead * 1e9) };
+        nanosleep(&ts, NULL);
     }
 }
 
-// Function to delete directory
-void delete_directory(UserContext *user_ctx) {
-    char dir_name[256];
-    if (get_input("Enter directory name to delete: ", dir_name, sizeof(dir_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+static void rmtree_error(RmTree *tree, int err) {
+    int expected = 0;
+    if (err != ENOENT) atomic_compare_exchange_strong(&tree->err, &expected, err);
+}
+
+// Open the directory rel below the top of the tree without following any
+// symbolic link. Returns the fd, or -1 with errno set.
+static int rmtree_open(RmTree *tree, const char *rel) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    if (rel[0] == '\0') return openat(tree->top_fd, ".", flags);
+    if (confine_has_openat2) {
+        struct open_how how = { .flags = (uint64_t)flags, .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS };
+        return (int)syscall(SYS_openat2, tree->top_fd, rel, &how, sizeof(how));
     }
-    char sanitized_name[256];
-    if (!sanitize_filename(dir_name, sanitized_name, sizeof(sanitized_name))) {
-        printf("Invalid directory name.\n");
-        return;
+    char component[NAME_MAX + 1];
+    int fd = tree->top_fd;
+    for (const char *p = rel; *p != '\0';) {
+        size_t len = strcspn(p, "/");
+        if (len > NAME_MAX) {
+            if (fd != tree->top_fd) close(fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(component, p, len);
+        component[len] = '\0';
+        int next = openat(fd, component, flags);
+        if (fd != tree->top_fd) close(fd);
+        if (next < 0) return -1;
+        fd = next;
+        p += len;
+        while (*p == '/') p++;
     }
+    return fd;
+}
 
-    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the directory to delete is located:");
-    if (base_path == NULL) return;
+static void rmtree_push(RmTree *tree, RmTreeNode *node) {
+    pthread_mutex_lock(&tree->lock);
+    node->next = tree->stack;
+    tree->stack = node;
+    pthread_cond_signal(&tree->cond);
+    pthread_mutex_unlock(&tree->lock);
+}
 
-    char full_path[PATH_MAX];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
-        printf("Path is too long.\n");
-        return;
+// Drop one reference on node. A directory that is no longer waiting for
+// anything is removed, which may in turn finish its parent. The top is
+// left for rmtree_run.
+static void rmtree_release(RmTree *tree, RmTreeNode *node) {
+    while (1) {
+        // Once the reference is dropped another worker may free node
+        RmTreeNode *parent = node->parent;
+        if (atomic_fetch_sub(&node->pending, 1) != 1 || parent == NULL) return;
+        if (!rmtree_cancelled(tree)) {
+            const char *slash = strrchr(node->rel, '/');
+            int parent_fd = parent->parent == NULL ? tree->top_fd : rmtree_open(tree, parent->rel);
+            if (parent_fd < 0) {
+                rmtree_error(tree, errno);
+            } else {
+                if (unlinkat(parent_fd, slash != NULL ? slash + 1 : node->rel, AT_REMOVEDIR) == 0) {
+                    long dirs = atomic_fetch_add(&tree->dirs, 1) + 1;
+                    rmtree_pace(&tree->start, atomic_load(&tree->files) + dirs, tree->rate, tree->cancel);
+                } else {
+                    rmtree_error(tree, errno);
+                }
+                if (parent_fd != tree->top_fd) close(parent_fd);
+            }
+        }
+        free(node);
+        node = parent;
     }
+}
 
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
-        printf("Invalid path. Operation not allowed.\n");
+// Empty one directory of everything but its subdirectories, which are
+// queued for other workers
+static void rmtree_process(RmTree *tree, RmTreeNode *node) {
+    int fd = rmtree_open(tree, node->rel);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        rmtree_error(tree, errno);
+        if (fd >= 0) close(fd);
+        rmtree_release(tree, node);
         return;
     }
 
-    // Check if the directory exists
-    struct stat sb;
-    if (stat(full_path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
-        printf("Directory does not exist.\n");
-        return;
+    size_t rel_len = strlen(node->rel);
+    struct dirent *entry;
+    while (!rmtree_cancelled(tree) && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat sb;
+            if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) is_dir = S_ISDIR(sb.st_mode);
+        }
+        if (!is_dir) {
+            if (unlinkat(fd, name, 0) == 0) {
+                long files = atomic_fetch_add(&tree->files, 1) + 1;
+                rmtree_pace(&tree->start, files + atomic_load(&tree->dirs), tree->rate, tree->cancel);
+                continue;
+            }
+            // Replaced by a directory since it was read
+            if (errno != EISDIR) {
+                rmtree_error(tree, errno);
+                continue;
+            }
+        }
+
+        size_t name_len = strlen(name);
+        RmTreeNode *child = malloc(sizeof(*child) + rel_len + name_len + 2);
+        if (child == NULL) {
+            rmtree_error(tree, ENOMEM);
+            continue;
+        }
+        child->parent = node;
+        atomic_init(&child->pending, 1);
+        if (rel_len > 0) {
+            memcpy(child->rel, node->rel, rel_len);
+            child->rel[rel_len] = '/';
+            memcpy(child->rel + rel_len + 1, name, name_len + 1);
+        } else {
+            memcpy(child->rel, name, name_len + 1);
+        }
+        atomic_fetch_add(&node->pending, 1);
+        rmtree_push(tree, child);
     }
+    closedir(dir);
+    rmtree_release(tree, node);
+}
 
-    // Delete directory using Linux command
-    char command[PATH_MAX + 20];
-    snprintf(command, sizeof(command), "rm -rf \"%s\"", full_path);
-    int result = system(command);
-    if (result == 0) {
-        printf("Directory deleted: %s\n", full_path);
-    } else {
-        printf("Error deleting directory\n");
+static void *rmtree_worker_main(void *arg) {
+    RmTree *tree = arg;
+    pthread_mutex_lock(&tree->lock);
+    while (1) {
+        // Nothing queued while others still read directories: more may come
+        while (tree->stack == NULL && tree->active > 0) pthread_cond_wait(&tree->cond, &tree->lock);
+        if (tree->stack == NULL) break;
+        RmTreeNode *node = tree->stack;
+        tree->stack = node->next;
+        tree->active++;
+        pthread_mutex_unlock(&tree->lock);
+
+        if (rmtree_cancelled(tree)) {
+            rmtree_release(tree, node);
+        } else {
+            rmtree_process(tree, node);
+        }
+
+        pthread_mutex_lock(&tree->lock);
+        tree->active--;
     }
+    tree->exited++;
+    pthread_cond_broadcast(&tree->cond);
+    pthread_cond_signal(&tree->exit_cond);
+    pthread_mutex_unlock(&tree->lock);
+    return NULL;
 }
 
-// Function to create file
-void create_file(UserContext *user_ctx) {
-    char file_name[256];
-    if (get_input("Enter file name to create: ", file_name, sizeof(file_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Recursively delete path (rm -rf). A path that is not a directory, or is
+// a symlink to one, is unlinked itself. options and progress may be NULL.
+// Returns 0, ECANCELED when options->cancel was set before the tree was
+// gone, or the first errno value met; either way the rest of the tree is
+// still in place.
+int rmtree_run(const char *path, const RmTreeOptions *options, RmTreeProgress *progress) {
+    RmTreeOptions defaults = { 0 };
+    if (options == NULL) options = &defaults;
+    RmTreeProgress local;
+    if (progress == NULL) progress = &local;
+    memset(progress, 0, sizeof(*progress));
+
+    const char *leaf;
+    int parent_fd = fsop_open_parent(path, &leaf);
+    if (parent_fd < 0) return errno;
+    RmTree tree = { .cancel = options->cancel, .rate = options->rate };
+    tree.top_fd = openat(parent_fd, leaf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (tree.top_fd < 0) {
+        int err = errno;
+        if (err == ENOTDIR || err == ELOOP) {
+            err = unlinkat(parent_fd, leaf, 0) == 0 ? 0 : errno;
+            if (err == 0) progress->files = 1;
+        }
+        close(parent_fd);
+        return err;
     }
-    char sanitized_name[256];
-    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
-        printf("Invalid file name.\n");
-        return;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tree.start = start;
+    pthread_mutex_init(&tree.lock, NULL);
+    pthread_cond_init(&tree.cond, NULL);
+    pthread_cond_init(&tree.exit_cond, NULL);
+    atomic_init(&tree.files, 0);
+    atomic_init(&tree.dirs, 0);
+    atomic_init(&tree.err, 0);
+    RmTreeNode top = { .parent = NULL };
+    atomic_init(&top.pending, 1);
+    tree.stack = &top;
+
+    int workers = options->workers;
+    if (workers <= 0) {
+        // Blocking calls leave a core idle while the disk works, so even
+        // small machines get a few workers
+        workers = walk_default_workers();
+        if (workers < RMTREE_MIN_WORKERS) workers = RMTREE_MIN_WORKERS;
+    }
+    if (workers > WALK_MAX_WORKERS) workers = WALK_MAX_WORKERS;
+    pthread_t threads[WALK_MAX_WORKERS];
+    int started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, rmtree_worker_main, &tree) == 0) started++;
+    if (started == 0) {
+        rmtree_worker_main(&tree);
+    } else {
+        // Report progress from this thread while the workers run
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        pthread_mutex_lock(&tree.lock);
+        while (tree.exited < started) {
+            deadline.tv_nsec += RMTREE_PROGRESS_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            int rc = 0;
+            while (tree.exited < started && rc != ETIMEDOUT) {
+                rc = pthread_cond_timedwait(&tree.exit_cond, &tree.lock, &deadline);
+            }
+            if (rc == ETIMEDOUT && options->progress != NULL) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                progress->files = atomic_load(&tree.files);
+                progress->dirs = atomic_load(&tree.dirs);
+                progress->seconds = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+                pthread_mutex_unlock(&tree.lock);
+                options->progress(progress, options->progress_arg);
+                pthread_mutex_lock(&tree.lock);
+            }
+        }
+        pthread_mutex_unlock(&tree.lock);
+        for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
     }
 
-    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory to create the new file in:");
-    if (base_path == NULL) return;
+    int err = atomic_load(&tree.err);
+    if (err == 0 && rmtree_cancelled(&tree)) err = ECANCELED;
+    if (err == 0) {
+        if (unlinkat(parent_fd, leaf, AT_REMOVEDIR) == 0) {
+            atomic_fetch_add(&tree.dirs, 1);
+        } else {
+            err = errno;
+        }
+    }
+    close(tree.top_fd);
+    close(parent_fd);
+    pthread_cond_destroy(&tree.cond);
+    pthread_cond_destroy(&tree.exit_cond);
+    pthread_mutex_destroy(&tree.lock);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    progress->files = atomic_load(&tree.files);
+    progress->dirs = atomic_load(&tree.dirs);
+    progress->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return err;
+}
 
-    char full_path[PATH_MAX];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
-        printf("Path is too long.\n");
-        return;
+// ---------------------------------------------------------------------------
+// Trash area
+//
+// delete_file and delete_directory, and the batch delete and rmdir, move
+// what they delete into .trash at the top of its base directory. That is one
+// rename on the same file system however large the tree, so the user never
+// waits for the data to be reclaimed. Each entry is named
+// SECONDS-PID-COUNTER after the time it was deleted and has a sidecar,
+// ID.origin, holding its path relative to the base, which restore uses.
+// The trash areas cannot be reached through is_valid_path and are skipped by
+// the walker and the index.
+//
+// A background purger removes entries older than the retention period
+// (LOGISTICS_TRASH_RETENTION seconds, default one hour; 0 turns the trash
+// off and deletes at once), removing at most LOGISTICS_PURGE_RATE entries
+// per second (default 2000). A large delete is reclaimed as a steady trickle
+// instead of a burst of I/O.
+// ---------------------------------------------------------------------------
+
+#define TRASH_NAME ".trash"
+#define TRASH_SUFFIX ".origin"
+#define TRASH_SCAN_SECONDS 60
+
+static struct {
+    long retention;              // Seconds; 0 when the trash is off
+    long rate;
+    atomic_ulong counter;
+    pthread_t purger;
+    int purger_running;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int stop;
+} trash = { .retention = 3600, .rate = 2000, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static const char *trash_bases(int i) {
+    const char *bases[] = { ADMIN_BASE_PATH, WAREHOUSE_BASE_PATH, CUSTOMER_BASE_PATH };
+    return i < 3 ? bases[i] : NULL;
+}
+
+// Does path name a trash area, or anything inside one? Empty and "."
+// components are skipped, so base/./.trash counts too.
+int trash_contains(const char *path) {
+    const char *base;
+    for (int i = 0; (base = trash_bases(i)) != NULL; i++) {
+        size_t len = strlen(base);
+        if (strncmp(path, base, len) != 0 || (path[len] != '/' && path[len] != '\0')) continue;
+        const char *p = path + len;
+        while (*p == '/' || (p[0] == '.' && (p[1] == '/' || p[1] == '\0'))) p++;
+        size_t name_len = strcspn(p, "/");
+        return name_len == strlen(TRASH_NAME) && memcmp(p, TRASH_NAME, name_len) == 0;
     }
+    return 0;
+}
 
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
-        printf("Invalid path. Operation not allowed.\n");
-        return;
+// Is path, len bytes long, exactly the trash area of a base directory?
+int trash_is_area(const char *path, size_t len) {
+    const char *base;
+    for (int i = 0; (base = trash_bases(i)) != NULL; i++) {
+        size_t base_len = strlen(base);
+        if (len == base_len + 1 + strlen(TRASH_NAME) && memcmp(path, base, base_len) == 0 && path[base_len] == '/' &&
+            memcmp(path + base_len + 1, TRASH_NAME, strlen(TRASH_NAME)) == 0) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    // Check if file exists
-    struct stat sb;
-    if (stat(full_path, &sb) == 0 && S_ISREG(sb.st_mode)) {
-        printf("File already exists.\n");
-        return;
+int trash_enabled(void) {
+    return trash.retention > 0;
+}
+
+// Open the trash area of the confinement root, creating it if needed
+static int trash_open_area(const ConfineRoot *root) {
+    if (mkdirat(root->fd, TRASH_NAME, 0700) != 0 && errno != EEXIST) return -1;
+    return openat(root->fd, TRASH_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+// Move path into the trash of its base directory. Returns 0 or an errno
+// value; EXDEV means it cannot be trashed (no trash, another file system,
+// or not under a base) and should be deleted directly.
+int trash_move(const char *path) {
+    if (!trash_enabled()) return EXDEV;
+    const char *rel;
+    const ConfineRoot *root = confine_find_root(path, &rel);
+    if (root == NULL || strcmp(rel, ".") == 0) return EXDEV;
+
+    const char *leaf;
+    int parent_fd = fsop_open_parent(path, &leaf);
+    if (parent_fd < 0) return errno;
+    int trash_fd = trash_open_area(root);
+    if (trash_fd < 0) {
+        int err = errno;
+        close(parent_fd);
+        return err;
     }
 
-    // Create file using touch command
-    char command[PATH_MAX + 20];
-    snprintf(command, sizeof(command), "touch \"%s\"", full_path);
-    int result = system(command);
-    if (result == 0) {
-        printf("File created: %s\n", full_path);
+    char id[64], sidecar[80];
+    snprintf(id, sizeof(id), "%lld-%ld-%lu", (long long)time(NULL), (long)getpid(),
+             (unsigned long)atomic_fetch_add(&trash.counter, 1));
+    snprintf(sidecar, sizeof(sidecar), "%s%s", id, TRASH_SUFFIX);
+
+    // The sidecar goes first: a crash in between leaves a stray sidecar,
+    // which the purger removes, never an entry that cannot be restored
+    int err = 0;
+    int fd = openat(trash_fd, sidecar, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = errno;
     } else {
-        printf("Error creating file\n");
+        size_t rel_len = strlen(rel);
+        char *record = malloc(rel_len + 1);
+        err = record == NULL ? ENOMEM : 0;
+        if (err == 0) {
+            memcpy(record, rel, rel_len);
+            record[rel_len] = '\n';
+            err = fsop_write_all(fd, record, rel_len + 1);
+            free(record);
+        }
+        if (close(fd) != 0 && err == 0) err = errno;
+    }
+    if (err == 0 && renameat2(parent_fd, leaf, trash_fd, id, RENAME_NOREPLACE) != 0) {
+        err = errno;
+        if (err == EINVAL || err == ENOSYS) err = renameat(parent_fd, leaf, trash_fd, id) == 0 ? 0 : errno;
     }
+    if (err != 0 && fd >= 0) unlinkat(trash_fd, sidecar, 0);
+    // A mount point cannot be renamed away
+    if (err == EBUSY) err = EXDEV;
+    close(trash_fd);
+    close(parent_fd);
+    return err;
 }
 
-// Function to delete file
-void delete_file(UserContext *user_ctx) {
-    char file_name[256];
-    if (get_input("Enter file name to delete: ", file_name, sizeof(file_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Read the origin recorded for entry id into rel (PATH_MAX bytes)
+static int trash_read_origin(int trash_fd, const char *id, char *rel) {
+    char sidecar[NAME_MAX + 1];
+    if (snprintf(sidecar, sizeof(sidecar), "%s%s", id, TRASH_SUFFIX) >= (int)sizeof(sidecar)) return ENAMETOOLONG;
+    int fd = openat(trash_fd, sidecar, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return errno;
+    ssize_t n = read(fd, rel, PATH_MAX - 1);
+    int err = n < 0 ? errno : 0;
+    close(fd);
+    if (err != 0) return err;
+    rel[n] = '\0';
+    rel[strcspn(rel, "\n")] = '\0';
+    // Only paths below the base are restored
+    if (rel[0] == '\0' || rel[0] == '/' || strstr(rel, "..") != NULL) return EINVAL;
+    return 0;
+}
+
+static int trash_compare_newest(const void *a, const void *b) {
+    const TrashEntry *x = a, *y = b;
+    if (x->deleted != y->deleted) return x->deleted < y->deleted ? 1 : -1;
+    return strcmp(y->id, x->id);
+}
+
+// Everything in the trash of the user's base directories, newest first.
+// Free *entries with free().
+int trash_list(const UserContext *user_ctx, TrashEntry **entries, size_t *count) {
+    *entries = NULL;
+    *count = 0;
+    size_t cap = 0;
+    int err = 0;
+    for (int b = 0; b < user_ctx->base_paths_count && err == 0; b++) {
+        const char *rel;
+        const ConfineRoot *root = confine_find_root(user_ctx->base_paths[b], &rel);
+        if (root == NULL || strcmp(rel, ".") != 0) continue;
+        int trash_fd = openat(root->fd, TRASH_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *dir = trash_fd >= 0 ? fdopendir(trash_fd) : NULL;
+        if (dir == NULL) {
+            if (trash_fd >= 0) close(trash_fd);
+            continue;
+        }
+        struct dirent *de;
+        while (err == 0 && (de = readdir(dir)) != NULL) {
+            size_t len = strlen(de->d_name);
+            if (de->d_name[0] == '.' || len >= sizeof((*entries)->id) ||
+                (len > strlen(TRASH_SUFFIX) && strcmp(de->d_name + len - strlen(TRASH_SUFFIX), TRASH_SUFFIX) == 0)) {
+                continue;
+            }
+            if (*count == cap) {
+                size_t new_cap = cap > 0 ? cap * 2 : 16;
+                TrashEntry *grown = realloc(*entries, new_cap * sizeof(**entries));
+                if (grown == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+                *entries = grown;
+                cap = new_cap;
+            }
+            TrashEntry *entry = &(*entries)[*count];
+            char origin[PATH_MAX];
+            if (trash_read_origin(trash_fd, de->d_name, origin) != 0) continue;
+            struct stat sb;
+            if (fstatat(trash_fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            if (snprintf(entry->origin, sizeof(entry->origin), "%s/%s", root->path, origin) >= (int)sizeof(entry->origin)) {
+                continue;
+            }
+            strcpy(entry->id, de->d_name);
+            entry->base = root->path;
+            entry->deleted = (time_t)strtoll(de->d_name, NULL, 10);
+            entry->is_dir = S_ISDIR(sb.st_mode);
+            (*count)++;
+        }
+        closedir(dir);
     }
-    char sanitized_name[256];
-    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
-        printf("Invalid file name.\n");
-        return;
+    if (err != 0) {
+        free(*entries);
+        *entries = NULL;
+        *count = 0;
+        return err;
     }
+    if (*count > 1) qsort(*entries, *count, sizeof(**entries), trash_compare_newest);
+    return 0;
+}
 
-    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the file is located:");
-    if (base_path == NULL) return;
-
-    char full_path[PATH_MAX];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
-        printf("Path is too long.\n");
-        return;
+// Put an entry back where it was deleted from. Never replaces anything:
+// EEXIST when something new is there, ENOENT when its directory is gone.
+int trash_restore(const TrashEntry *entry) {
+    const char *rel;
+    const ConfineRoot *root = confine_find_root(entry->base, &rel);
+    if (root == NULL) return ENOENT;
+    const char *leaf;
+    int parent_fd = fsop_open_parent(entry->origin, &leaf);
+    if (parent_fd < 0) return errno;
+    int trash_fd = openat(root->fd, TRASH_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int err = trash_fd < 0 ? errno : 0;
+    if (err == 0 && renameat2(trash_fd, entry->id, parent_fd, leaf, RENAME_NOREPLACE) != 0) err = errno;
+    if (err == 0) {
+        char sidecar[NAME_MAX + 1];
+        snprintf(sidecar, sizeof(sidecar), "%s%s", entry->id, TRASH_SUFFIX);
+        unlinkat(trash_fd, sidecar, 0);
     }
+    if (trash_fd >= 0) close(trash_fd);
+    close(parent_fd);
+    return err;
+}
 
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
-        printf("Invalid path. Operation not allowed.\n");
-        return;
+// Restore the most recently deleted entry that came from path
+int trash_restore_path(const UserContext *user_ctx, const char *path) {
+    TrashEntry *entries;
+    size_t count;
+    int err = trash_list(user_ctx, &entries, &count);
+    if (err != 0) return err;
+    err = ENOENT;
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(entries[i].origin, path) == 0) {
+            err = trash_restore(&entries[i]);
+            break;
+        }
     }
+    free(entries);
+    return err;
+}
 
-    // Check if file exists
-    struct stat sb;
-    if (stat(full_path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
-        printf("File does not exist.\n");
+// Remove the expired entries of one trash area, pacing the whole pass at
+// the purge rate. *done counts the entries removed so far in this pass.
+static void trash_purge_area(const char *area, const struct timespec *start, long *done) {
+    int trash_fd = open(area, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = trash_fd >= 0 ? fdopendir(trash_fd) : NULL;
+    if (dir == NULL) {
+        if (trash_fd >= 0) close(trash_fd);
         return;
     }
+    time_t now = time(NULL);
+    struct dirent *de;
+    while (atomic_load(&trash.stop) == 0 && (de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (name[0] == '.') continue;
+        if (now - (time_t)strtoll(name, NULL, 10) < trash.retention) continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", area, name) >= (int)sizeof(path)) continue;
+        size_t len = strlen(name), suffix_len = strlen(TRASH_SUFFIX);
+        if (len > suffix_len && strcmp(name + len - suffix_len, TRASH_SUFFIX) == 0) {
+            // A sidecar whose entry is gone
+            path[strlen(path) - suffix_len] = '\0';
+            struct stat sb;
+            if (lstat(path, &sb) != 0 && errno == ENOENT) unlinkat(trash_fd, name, 0);
+            continue;
+        }
 
-    // Delete file using rm command
-    char command[PATH_MAX + 20];
-    snprintf(command, sizeof(command), "rm \"%s\"", full_path);
-    int result = system(command);
-    if (result == 0) {
-        printf("File deleted: %s\n", full_path);
-    } else {
-        printf("Error deleting file\n");
+        RmTreeOptions options = { .workers = 1, .rate = trash.rate, .cancel = &trash.stop };
+        RmTreeProgress progress;
+        int err = rmtree_run(path, &options, &progress);
+        *done += progress.files + progress.dirs;
+        if (err == 0 || err == ENOENT) {
+            char sidecar[NAME_MAX + 1];
+            if (snprintf(sidecar, sizeof(sidecar), "%s%s", name, TRASH_SUFFIX) < (int)sizeof(sidecar)) {
+                unlinkat(trash_fd, sidecar, 0);
+            }
+        }
+        rmtree_pace(start, *done, trash.rate, &trash.stop);
     }
+    closedir(dir);
 }
 
-// Function to create symbolic link
-void create_symbolic_link(UserContext *user_ctx) {
-    char target[256], link_name[256];
-    if (get_input("Enter target file for symbolic link: ", target, sizeof(target)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+static void *trash_purger_main(void *arg) {
+    (void)arg;
+    long interval = trash.retention < TRASH_SCAN_SECONDS ? trash.retention : TRASH_SCAN_SECONDS;
+    pthread_mutex_lock(&trash.lock);
+    while (atomic_load(&trash.stop) == 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval;
+        while (atomic_load(&trash.stop) == 0 &&
+               pthread_cond_timedwait(&trash.wake, &trash.lock, &deadline) != ETIMEDOUT) {
+        }
+        if (atomic_load(&trash.stop) != 0) break;
+        pthread_mutex_unlock(&trash.lock);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long done = 0;
+        const char *base;
+        for (int i = 0; (base = trash_bases(i)) != NULL; i++) {
+            char area[PATH_MAX];
+            if (snprintf(area, sizeof(area), "%s/%s", base, TRASH_NAME) < (int)sizeof(area)) {
+                trash_purge_area(area, &start, &done);
+            }
+        }
+        pthread_mutex_lock(&trash.lock);
     }
-    if (get_input("Enter symbolic link name: ", link_name, sizeof(link_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+    pthread_mutex_unlock(&trash.lock);
+    return NULL;
+}
+
+// Read the retention period and purge rate and start the purger
+void trash_init(const char *retention, const char *rate) {
+    if (retention != NULL && retention[0] != '\0') {
+        char *end;
+        long value = strtol(retention, &end, 10);
+        if (*end == '\0' && value >= 0) {
+            trash.retention = value;
+        } else {
+            fprintf(stderr, "Invalid LOGISTICS_TRASH_RETENTION value %s, keeping %ld seconds.\n", retention,
+                    trash.retention);
+        }
     }
-    char sanitized_target[256];
-    char sanitized_link_name[256];
-    if (!sanitize_filename(target, sanitized_target, sizeof(sanitized_target)) ||
-        !sanitize_filename(link_name, sanitized_link_name, sizeof(sanitized_link_name))) {
-        printf("Invalid file or link name.\n");
-        return;
+    if (rate != NULL && rate[0] != '\0') {
+        char *end;
+        long value = strtol(rate, &end, 10);
+        if (*end == '\0' && value >= 0) {
+            trash.rate = value;
+        } else {
+            fprintf(stderr, "Invalid LOGISTICS_PURGE_RATE value %s, keeping %ld per second.\n", rate, trash.rate);
+        }
     }
+    if (!trash_enabled()) return;
+    atomic_store(&trash.stop, 0);
+    trash.purger_running = start_service_thread(&trash.purger, trash_purger_main);
+}
 
-    // Base path selection for target
-    const char *target_base_path = select_base_path_with_other(user_ctx, "Select the directory where the target file is located:");
-    if (target_base_path == NULL) return;
-
-    // Base path selection for link
-    const char *link_base_path = select_base_path_with_other(user_ctx, "Select the directory where the symbolic link will be created:");
-    if (link_base_path == NULL) return;
+// Stop the purger; a purge cut short leaves the rest for next time
+void trash_shutdown(void) {
+    if (!trash.purger_running) return;
+    pthread_mutex_lock(&trash.lock);
+    atomic_store(&trash.stop, 1);
+    pthread_cond_signal(&trash.wake);
+    pthread_mutex_unlock(&trash.lock);
+    pthread_join(trash.purger, NULL);
+    trash.purger_running = 0;
+}
 
-    char full_target_path[PATH_MAX], full_link_path[PATH_MAX];
-    if (snprintf(full_target_path, sizeof(full_target_path), "%s/%s", target_base_path, sanitized_target) >= (int)sizeof(full_target_path) ||
-        snprintf(full_link_path, sizeof(full_link_path), "%s/%s", link_base_path, sanitized_link_name) >= (int)sizeof(full_link_path)) {
-        printf("Path is too long.\n");
-        return;
+// ---------------------------------------------------------------------------
+// Bulk file operations
+//
+// fsop_bulk_run carries out many independent stats, creates, deletes,
+// moves and copies in one call. On io_uring it queues them as statx,
+// openat, unlinkat, renameat, read, write and close requests. Up to
+// FSBULK_DEPTH requests are in flight per system call instead of one.
+// Items whose next step needs the previous result (open, then read, then
+// write, then close) advance as their completions are reaped. When
+// io_uring is missing, disabled, or lacks one of these operations, the
+// same items run one system call at a time. The automatic choice is
+// io_uring when the probe passes and more than one CPU is online;
+// LOGISTICS_IO=sync or LOGISTICS_IO=uring overrides it.
+//
+// Stats and mutating operations act on the leaf name relative to the
+// confined parent directory, as the single-file functions above do. Copy
+// sources are opened relative to their confinement root. Parent descriptors
+// are cached for the life of the context, so a directory of a thousand
+// files costs one open. Copies larger than FSBULK_COPY_INLINE go to a few
+// copier threads, where fsop_copy_data can reflink or copy in the kernel;
+// a read of the slot's eventfd completes in the ring when one is done, so
+// the reap loop never waits on a big file.
+// ---------------------------------------------------------------------------
+
+#define FSBULK_DEPTH 256                 // Items in flight per ring
+#define FSBULK_PARENTS 64                // Parent directories kept open
+#define FSBULK_COPY_INLINE (1 << 20)     // Larger copies use fsop_copy_data
+#define FSBULK_COPIERS 4                 // Threads that run the larger copies
+
+// Where an item is in its sequence of requests
+enum {
+    FSBULK_STAGE_STAT,
+    FSBULK_STAGE_CREATE_OPEN,
+    FSBULK_STAGE_CREATE_CLOSE,
+    FSBULK_STAGE_UNLINK,
+    FSBULK_STAGE_RENAME,
+    FSBULK_STAGE_COPY_OPEN_SRC,
+    FSBULK_STAGE_COPY_STAT,
+    FSBULK_STAGE_COPY_OPEN_DST,
+    FSBULK_STAGE_COPY_OFFLOAD,
+    FSBULK_STAGE_COPY_READ,
+    FSBULK_STAGE_COPY_WRITE,
+    FSBULK_STAGE_COPY_CLOSE_SRC,
+    FSBULK_STAGE_COPY_CLOSE_DST
+};
+
+typedef struct FsBulkParent {
+    char *path;
+    size_t len;
+    int fd;
+    int refs;                // Items in flight that use fd
+} FsBulkParent;
+
+typedef struct FsBulkSlot {
+    FsBulkItem *item;
+    int stage;
+    FsBulkParent *parent, *parent2;
+    const char *leaf, *leaf2;
+    int in_fd, out_fd;
+    int err;
+    off_t offset;            // Copy position
+    size_t pending;          // Bytes read into buffer
+    size_t written;          // ... and already written out
+    char *buffer;            // VIEW_BLOCK_SIZE bytes, allocated on first copy
+    struct statx stx;
+    struct open_how how;
+    int event_fd;            // Signalled by the copier; opened on first offload
+    uint64_t event_value;
+    int offloaded;           // A copier owns in_fd and out_fd (copy_lock)
+    struct FsBulkSlot *copy_next;
+} FsBulkSlot;
+
+struct FsBulk {
+    FsBulkBackend backend;
+    int ring_fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;
+    FsBulkSlot slots[FSBULK_DEPTH];
+    int free_slots[FSBULK_DEPTH];
+    int free_count;
+    FsBulkParent parents[FSBULK_PARENTS];
+    int parent_count;
+    int parent_last;         // Most recent hit, checked first
+    int parent_clock;        // Next eviction candidate
+    pthread_mutex_t copy_lock;
+    pthread_cond_t copy_work;    // A copy was queued, or the copiers must stop
+    pthread_cond_t copy_done;    // An offloaded copy finished
+    FsBulkSlot *copy_head, *copy_tail;
+    pthread_t copiers[FSBULK_COPIERS];
+    int copier_count;
+    int copiers_idle;
+    int copiers_stop;
+};
+
+static FsBulkBackend fsop_bulk_policy = FSBULK_AUTO;
+static pthread_once_t fsop_bulk_probe_once = PTHREAD_ONCE_INIT;
+static int fsop_bulk_uring_usable;
+
+// Pick the backend from LOGISTICS_IO: "sync", "uring", or unset for automatic
+void fsop_bulk_init(const char *policy) {
+    if (policy == NULL || policy[0] == '\0' || strcmp(policy, "auto") == 0) {
+        fsop_bulk_policy = FSBULK_AUTO;
+    } else if (strcmp(policy, "sync") == 0) {
+        fsop_bulk_policy = FSBULK_SYNC;
+    } else if (strcmp(policy, "uring") == 0) {
+        fsop_bulk_policy = FSBULK_URING;
+    } else {
+        fprintf(stderr, "Unknown LOGISTICS_IO value %s, choosing automatically.\n", policy);
+        fsop_bulk_policy = FSBULK_AUTO;
     }
+}
 
-    // Validate paths
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_target_path) ||
-        !is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_link_path)) {
-        printf("Invalid path. Operation not allowed.\n");
-        return;
+// Can this kernel set up a ring that supports every opcode used here?
+static void fsop_bulk_probe(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, 4, &params);
+    if (fd < 0) return;
+
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe != NULL && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        static const int needed[] = {
+            IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_OPENAT2, IORING_OP_CLOSE,
+            IORING_OP_READ, IORING_OP_WRITE, IORING_OP_UNLINKAT, IORING_OP_RENAMEAT,
+        };
+        fsop_bulk_uring_usable = 1;
+        for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                fsop_bulk_uring_usable = 0;
+            }
+        }
     }
+    free(probe);
+    close(fd);
+}
 
-    // Check if target file exists
-    struct stat sb;
-    if (stat(full_target_path, &sb) != 0) {
-        printf("Target file does not exist.\n");
-        return;
+static int fsop_bulk_ring_setup(FsBulk *bulk) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, FSBULK_DEPTH, &params);
+    if (fd < 0) return errno;
+
+    bulk->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    bulk->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && bulk->cq_ring_size > bulk->sq_ring_size) bulk->sq_ring_size = bulk->cq_ring_size;
+    bulk->sq_ring = mmap(NULL, bulk->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+    bulk->cq_ring = single ? bulk->sq_ring
+                           : mmap(NULL, bulk->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                  IORING_OFF_CQ_RING);
+    bulk->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    bulk->sqes = mmap(NULL, bulk->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (bulk->sq_ring == MAP_FAILED || bulk->cq_ring == MAP_FAILED || bulk->sqes == MAP_FAILED) {
+        int err = errno;
+        if (bulk->sqes != MAP_FAILED) munmap(bulk->sqes, bulk->sqes_size);
+        if (!single && bulk->cq_ring != MAP_FAILED) munmap(bulk->cq_ring, bulk->cq_ring_size);
+        if (bulk->sq_ring != MAP_FAILED) munmap(bulk->sq_ring, bulk->sq_ring_size);
+        close(fd);
+        return err;
     }
 
-    // Create symbolic link using ln -s command
-    char command[PATH_MAX * 2 + 20];
-    snprintf(command, sizeof(command), "ln -s \"%s\" \"%s\"", full_target_path, full_link_path);
-    int result = system(command);
-    if (result == 0) {
-        printf("Symbolic link created: %s\n", full_link_path);
-    } else {
-        printf("Error creating symbolic link\n");
-    }
+    char *sq = bulk->sq_ring, *cq = bulk->cq_ring;
+    bulk->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    bulk->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    bulk->sq_array = (unsigned *)(sq + params.sq_off.array);
+    bulk->cq_head = (unsigned *)(cq + params.cq_off.head);
+    bulk->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    bulk->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    bulk->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    bulk->ring_fd = fd;
+    return 0;
 }
 
-// Function to copy file
-void copy_file(UserContext *user_ctx) {
-    char source[256], destination[256];
-    if (get_input("Enter source file to copy: ", source, sizeof(source)) == NULL ||
-        get_input("Enter destination file name: ", destination, sizeof(destination)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Create a context for bulk runs. backend FSBULK_AUTO follows LOGISTICS_IO;
+// a ring that cannot be set up falls back to FSBULK_SYNC. Returns NULL when
+// out of memory.
+FsBulk *fsop_bulk_open(FsBulkBackend backend) {
+    FsBulk *bulk = calloc(1, sizeof(*bulk));
+    if (bulk == NULL) return NULL;
+    bulk->ring_fd = -1;
+    bulk->parent_last = -1;
+    for (int i = 0; i < FSBULK_DEPTH; i++) {
+        bulk->free_slots[i] = FSBULK_DEPTH - 1 - i;
+        bulk->slots[i].event_fd = -1;
     }
-    char sanitized_source[256];
-    char sanitized_destination[256];
-    if (!sanitize_filename(source, sanitized_source, sizeof(sanitized_source)) ||
-        !sanitize_filename(destination, sanitized_destination, sizeof(sanitized_destination))) {
-        printf("Invalid source or destination file name.\n");
-        return;
+    bulk->free_count = FSBULK_DEPTH;
+    pthread_mutex_init(&bulk->copy_lock, NULL);
+    pthread_cond_init(&bulk->copy_work, NULL);
+    pthread_cond_init(&bulk->copy_done, NULL);
+
+    // Requests that would block run on kernel worker threads. With a single
+    // CPU those only compete with the submitter, so automatic mode keeps to
+    // plain system calls there.
+    if (backend == FSBULK_AUTO) backend = fsop_bulk_policy;
+    if (backend == FSBULK_AUTO && sysconf(_SC_NPROCESSORS_ONLN) < 2) backend = FSBULK_SYNC;
+    if (backend != FSBULK_SYNC) {
+        pthread_once(&fsop_bulk_probe_once, fsop_bulk_probe);
+        backend = fsop_bulk_uring_usable && fsop_bulk_ring_setup(bulk) == 0 ? FSBULK_URING : FSBULK_SYNC;
     }
+    bulk->backend = backend;
+    return bulk;
+}
 
-    // Base path selection for source
-    const char *source_base_path = select_base_path_with_other(user_ctx, "Select the directory where the source file is located:");
-    if (source_base_path == NULL) return;
+// The backend runs on this context actually use
+FsBulkBackend fsop_bulk_backend(const FsBulk *bulk) {
+    return bulk->backend;
+}
 
-    // Base path selection for destination
-    const char *dest_base_path = select_base_path_with_other(user_ctx, "Select the directory where the destination file will be created:");
-    if (dest_base_path == NULL) return;
+void fsop_bulk_close(FsBulk *bulk) {
+    if (bulk == NULL) return;
+    pthread_mutex_lock(&bulk->copy_lock);
+    bulk->copiers_stop = 1;
+    pthread_cond_broadcast(&bulk->copy_work);
+    pthread_mutex_unlock(&bulk->copy_lock);
+    for (int i = 0; i < bulk->copier_count; i++) pthread_join(bulk->copiers[i], NULL);
+    pthread_cond_destroy(&bulk->copy_done);
+    pthread_cond_destroy(&bulk->copy_work);
+    pthread_mutex_destroy(&bulk->copy_lock);
+    for (int i = 0; i < bulk->parent_count; i++) {
+        close(bulk->parents[i].fd);
+        free(bulk->parents[i].path);
+    }
+    for (int i = 0; i < FSBULK_DEPTH; i++) {
+        free(bulk->slots[i].buffer);
+        if (bulk->slots[i].event_fd >= 0) close(bulk->slots[i].event_fd);
+    }
+    if (bulk->ring_fd >= 0) {
+        munmap(bulk->sqes, bulk->sqes_size);
+        if (bulk->cq_ring != bulk->sq_ring) munmap(bulk->cq_ring, bulk->cq_ring_size);
+        munmap(bulk->sq_ring, bulk->sq_ring_size);
+        close(bulk->ring_fd);
+    }
+    free(bulk);
+}
 
-    char full_source_path[PATH_MAX], full_destination_path[PATH_MAX];
-    if (snprintf(full_source_path, sizeof(full_source_path), "%s/%s", source_base_path, sanitized_source) >= (int)sizeof(full_source_path) ||
-        snprintf(full_destination_path, sizeof(full_destination_path), "%s/%s", dest_base_path, sanitized_destination) >= (int)sizeof(full_destination_path)) {
-        printf("Path is too long.\n");
-        return;
+// Take a reference on the open parent directory of path, setting *leaf.
+// Returns NULL with *err set; EAGAIN means every cached parent is in use
+// and completions must be reaped first.
+static FsBulkParent *fsop_bulk_parent(FsBulk *bulk, const char *path, const char **leaf, int *err) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash != NULL ? (size_t)(slash - path) : 0;
+    if (slash != NULL && slash[1] == '\0') {
+        *err = EINVAL;
+        return NULL;
     }
+    *leaf = slash != NULL ? slash + 1 : path;
 
-    // Validate paths
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_source_path) ||
+    int hit = -1;
+    if (bulk->parent_last >= 0) {
+        FsBulkParent *p = &bulk->parents[bulk->parent_last];
+        if (p->len == len && memcmp(p->path, path, len) == 0) hit = bulk->parent_last;
+    }
+    for (int i = 0; hit < 0 && i < bulk->parent_count; i++) {
+        if (bulk->parents[i].len == len && memcmp(bulk->parents[i].path, path, len) == 0) hit = i;
+    }
+    if (hit < 0) {
+        // Reuse a free entry, or evict one that nothing in flight refers to
+        if (bulk->parent_count < FSBULK_PARENTS) {
+            hit = bulk->parent_count;
+        } else {
+            for (int tries = 0; tries < FSBULK_PARENTS && hit < 0; tries++) {
+                int i = bulk->parent_clock;
+                bulk->parent_clock = (bulk->parent_clock + 1) % FSBULK_PARENTS;
+                if (bulk->parents[i].refs == 0) hit = i;
+            }
+            if (hit < 0) {
+                *err = EAGAIN;
+                return NULL;
+            }
+        }
+        char *copy = strndup(path, len);
+        const char *ignored;
+        int fd = copy == NULL ? -1 : fsop_open_parent(path, &ignored);
+        if (fd < 0) {
+            *err = copy == NULL ? ENOMEM : errno;
+            free(copy);
+            return NULL;
+        }
+        FsBulkParent *p = &bulk->parents[hit];
+        if (hit < bulk->parent_count) {
+            close(p->fd);
+            free(p->path);
+        } else {
+            bulk->parent_count++;
+        }
+        *p = (FsBulkParent){ .path = copy, .len = len, .fd = fd };
+    }
+    bulk->parent_last = hit;
+    bulk->parents[hit].refs++;
+    return &bulk->parents[hit];
+}
+
+static void fsop_bulk_release(FsBulkParent *parent) {
+    if (parent != NULL) parent->refs--;
+}
+
+// Run one item with plain system calls
+static void fsop_bulk_sync_one(FsBulk *bulk, FsBulkItem *item) {
+    FsBulkParent *parent = NULL, *parent2 = NULL;
+    const char *leaf = NULL, *leaf2 = NULL;
+    int err = 0;
+    switch (item->op) {
+        case FSBULK_STAT:
+            parent = fsop_bulk_parent(bulk, item->path, &leaf, &err);
+            if (parent == NULL) break;
+            err = statx(parent->fd, leaf, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &item->stx) == 0 ? 0 : errno;
+            break;
+        case FSBULK_CREATE: {
+            parent = fsop_bulk_parent(bulk, item->path, &leaf, &err);
+            if (parent == NULL) break;
+            int fd = fsop_open_leaf(parent->fd, leaf, item->path, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC, 0666);
+            err = fd >= 0 ? 0 : errno;
+            if (fd >= 0 && close(fd) != 0) err = errno;
+            break;
+        }
+        case FSBULK_UNLINK:
+        case FSBULK_RMDIR:
+            parent = fsop_bulk_parent(bulk, item->path, &leaf, &err);
+            if (parent == NULL) break;
+            err = unlinkat(parent->fd, leaf, item->op == FSBULK_RMDIR ? AT_REMOVEDIR : 0) == 0 ? 0 : errno;
+            break;
+        case FSBULK_RENAME:
+            parent = fsop_bulk_parent(bulk, item->path, &leaf, &err);
+            if (parent != NULL) parent2 = fsop_bulk_parent(bulk, item->path2, &leaf2, &err);
+            if (parent2 == NULL) break;
+            err = renameat2(parent->fd, leaf, parent2->fd, leaf2, RENAME_NOREPLACE) == 0 ? 0 : errno;
+            if (err == EINVAL || err == ENOSYS || err == EXDEV) err = fsop_rename(item->path, item->path2);
+            break;
+        case FSBULK_COPY:
+            err = fsop_copy_file(item->path, item->path2, NULL);
+            break;
+    }
+    fsop_bulk_release(parent);
+    fsop_bulk_release(parent2);
+    item->result = err;
+}
+
+// Queue a request for slot; it is submitted with the next io_uring_enter
+static struct io_uring_sqe *fsop_bulk_sqe(FsBulk *bulk, FsBulkSlot *slot, int opcode, int fd, const void *addr) {
+    unsigned tail = *bulk->sq_tail;
+    unsigned index = tail & *bulk->sq_mask;
+    struct io_uring_sqe *sqe = &bulk->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->user_data = (uint64_t)(slot - bulk->slots);
+    bulk->sq_array[index] = index;
+    __atomic_store_n(bulk->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    bulk->to_submit++;
+    return sqe;
+}
+
+static void fsop_bulk_queue_close(FsBulk *bulk, FsBulkSlot *slot, int stage, int fd) {
+    slot->stage = stage;
+    fsop_bulk_sqe(bulk, slot, IORING_OP_CLOSE, fd, NULL);
+}
+
+static void fsop_bulk_queue_read(FsBulk *bulk, FsBulkSlot *slot) {
+    slot->stage = FSBULK_STAGE_COPY_READ;
+    struct io_uring_sqe *sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_READ, slot->in_fd, slot->buffer);
+    sqe->len = VIEW_BLOCK_SIZE;
+    sqe->off = (uint64_t)slot->offset;
+}
+
+static void fsop_bulk_queue_write(FsBulk *bulk, FsBulkSlot *slot) {
+    slot->stage = FSBULK_STAGE_COPY_WRITE;
+    struct io_uring_sqe *sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_WRITE, slot->out_fd, slot->buffer + slot->written);
+    sqe->len = (uint32_t)(slot->pending - slot->written);
+    sqe->off = (uint64_t)(slot->offset + (off_t)slot->written);
+}
+
+// Close whichever end of a copy is still open. Returns 1 while a close is
+// in flight.
+static int fsop_bulk_copy_close(FsBulk *bulk, FsBulkSlot *slot) {
+    if (slot->in_fd >= 0) {
+        fsop_bulk_queue_close(bulk, slot, FSBULK_STAGE_COPY_CLOSE_SRC, slot->in_fd);
+        slot->in_fd = -1;
+        return 1;
+    }
+    if (slot->out_fd >= 0) {
+        fsop_bulk_queue_close(bulk, slot, FSBULK_STAGE_COPY_CLOSE_DST, slot->out_fd);
+        slot->out_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+// Run the large copies handed over by fsop_bulk_offload until the context
+// is closed
+static void *fsop_bulk_copier(void *arg) {
+    FsBulk *bulk = arg;
+    pthread_mutex_lock(&bulk->copy_lock);
+    while (1) {
+        while (bulk->copy_head == NULL && !bulk->copiers_stop) {
+            bulk->copiers_idle++;
+            pthread_cond_wait(&bulk->copy_work, &bulk->copy_lock);
+            bulk->copiers_idle--;
+        }
+        FsBulkSlot *slot = bulk->copy_head;
+        if (slot == NULL) break;
+        bulk->copy_head = slot->copy_next;
+        if (bulk->copy_head == NULL) bulk->copy_tail = NULL;
+        pthread_mutex_unlock(&bulk->copy_lock);
+
+        long long copied;
+        const char *method;
+        int err = fsop_copy_data(slot->in_fd, slot->out_fd, (off_t)slot->stx.stx_size, &copied, &method);
+
+        pthread_mutex_lock(&bulk->copy_lock);
+        slot->err = err;
+        slot->offloaded = 0;
+        // Completes the ring's read of the eventfd, which holds at most one
+        // count, so the write cannot overflow it
+        uint64_t one = 1;
+        int wake_err = fsop_write_all(slot->event_fd, (const char *)&one, sizeof(one));
+        if (wake_err != 0) fprintf(stderr, "Cannot signal a finished copy: %s\n", strerror(wake_err));
+        pthread_cond_broadcast(&bulk->copy_done);
+    }
+    pthread_mutex_unlock(&bulk->copy_lock);
+    return NULL;
+}
+
+// Hand the copy of slot, both ends open, to a copier thread and queue a
+// read of the slot's eventfd that completes when it is done. Returns 0, or
+// an errno value when the copy has to run here instead.
+static int fsop_bulk_offload(FsBulk *bulk, FsBulkSlot *slot) {
+    if (slot->event_fd < 0 && (slot->event_fd = eventfd(0, EFD_CLOEXEC)) < 0) return errno;
+    pthread_mutex_lock(&bulk->copy_lock);
+    if (bulk->copiers_idle == 0 && bulk->copier_count < FSBULK_COPIERS &&
+        pthread_create(&bulk->copiers[bulk->copier_count], NULL, fsop_bulk_copier, bulk) == 0) {
+        bulk->copier_count++;
+    }
+    if (bulk->copier_count == 0) {
+        pthread_mutex_unlock(&bulk->copy_lock);
+        return EAGAIN;
+    }
+    slot->offloaded = 1;
+    slot->copy_next = NULL;
+    if (bulk->copy_tail != NULL) bulk->copy_tail->copy_next = slot;
+    else bulk->copy_head = slot;
+    bulk->copy_tail = slot;
+    pthread_cond_signal(&bulk->copy_work);
+    pthread_mutex_unlock(&bulk->copy_lock);
+
+    slot->stage = FSBULK_STAGE_COPY_OFFLOAD;
+    struct io_uring_sqe *sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_READ, slot->event_fd, &slot->event_value);
+    sqe->len = sizeof(slot->event_value);
+    return 0;
+}
+
+// Wait until no copier owns the descriptors of slot
+static void fsop_bulk_offload_wait(FsBulk *bulk, FsBulkSlot *slot) {
+    pthread_mutex_lock(&bulk->copy_lock);
+    while (slot->offloaded) pthread_cond_wait(&bulk->copy_done, &bulk->copy_lock);
+    pthread_mutex_unlock(&bulk->copy_lock);
+}
+
+// The copied data is complete (or failed): fix the mode, then close both
+// ends. The creation mode is filtered by umask and ignored for files that
+// already existed, as in fsop_copy_file.
+static int fsop_bulk_copy_finish(FsBulk *bulk, FsBulkSlot *slot) {
+    if (slot->err == 0 && slot->out_fd >= 0 && fchmod(slot->out_fd, slot->stx.stx_mode & 07777) != 0) slot->err = errno;
+    return fsop_bulk_copy_close(bulk, slot);
+}
+
+// Queue the first request of item in a free slot. Returns 1 if it is in
+// flight, 0 if it already finished, and -1 if it must wait for a parent
+// directory entry to be released.
+static int fsop_bulk_start(FsBulk *bulk, FsBulkItem *item) {
+    FsBulkSlot *slot = &bulk->slots[bulk->free_slots[bulk->free_count - 1]];
+    slot->item = item;
+    slot->parent = slot->parent2 = NULL;
+    slot->in_fd = slot->out_fd = -1;
+    slot->err = 0;
+    int err = 0;
+    struct io_uring_sqe *sqe;
+
+    switch (item->op) {
+        case FSBULK_STAT:
+            slot->parent = fsop_bulk_parent(bulk, item->path, &slot->leaf, &err);
+            if (slot->parent == NULL) break;
+            slot->stage = FSBULK_STAGE_STAT;
+            sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_STATX, slot->parent->fd, slot->leaf);
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uint64_t)(uintptr_t)&item->stx;
+            break;
+        case FSBULK_CREATE:
+        case FSBULK_UNLINK:
+        case FSBULK_RMDIR:
+            slot->parent = fsop_bulk_parent(bulk, item->path, &slot->leaf, &err);
+            if (slot->parent == NULL) break;
+            if (item->op == FSBULK_CREATE) {
+                slot->stage = FSBULK_STAGE_CREATE_OPEN;
+                sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_OPENAT, slot->parent->fd, slot->leaf);
+                sqe->open_flags = O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC | O_NOFOLLOW;
+                sqe->len = 0666;
+            } else {
+                slot->stage = FSBULK_STAGE_UNLINK;
+                sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_UNLINKAT, slot->parent->fd, slot->leaf);
+                sqe->unlink_flags = item->op == FSBULK_RMDIR ? AT_REMOVEDIR : 0;
+            }
+            break;
+        case FSBULK_RENAME:
+            slot->parent = fsop_bulk_parent(bulk, item->path, &slot->leaf, &err);
+            if (slot->parent != NULL) slot->parent2 = fsop_bulk_parent(bulk, item->path2, &slot->leaf2, &err);
+            if (slot->parent2 == NULL) break;
+            slot->stage = FSBULK_STAGE_RENAME;
+            sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_RENAMEAT, slot->parent->fd, slot->leaf);
+            sqe->len = (uint32_t)slot->parent2->fd;
+            sqe->addr2 = (uint64_t)(uintptr_t)slot->leaf2;
+            sqe->rename_flags = RENAME_NOREPLACE;
+            break;
+        case FSBULK_COPY: {
+            slot->parent2 = fsop_bulk_parent(bulk, item->path2, &slot->leaf2, &err);
+            if (slot->parent2 == NULL) break;
+            if (slot->buffer == NULL && (slot->buffer = malloc(VIEW_BLOCK_SIZE)) == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            // Same lookup as confine_open: beneath the root, no magic links
+            slot->stage = FSBULK_STAGE_COPY_OPEN_SRC;
+            const char *rel;
+            const ConfineRoot *root = confine_has_openat2 ? confine_find_root(item->path, &rel) : NULL;
+            if (root != NULL) {
+                slot->how = (struct open_how){ .flags = O_RDONLY | O_CLOEXEC,
+                                               .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+                sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_OPENAT2, root->fd, rel);
+                sqe->len = sizeof(slot->how);
+                sqe->off = (uint64_t)(uintptr_t)&slot->how;
+            } else {
+                sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_OPENAT, AT_FDCWD, item->path);
+                sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            }
+            break;
+        }
+    }
+
+    if (err != 0) {
+        // On EAGAIN only the first of two parents can have been taken
+        fsop_bulk_release(slot->parent);
+        if (err != EAGAIN) fsop_bulk_release(slot->parent2);
+        slot->item = NULL;
+        if (err == EAGAIN) return -1;
+        item->result = err;
+        return 0;
+    }
+    bulk->free_count--;
+    return 1;
+}
+
+// Handle the completion of slot's current request. Returns 1 if the item
+// queued its next request and 0 once it is finished.
+static int fsop_bulk_advance(FsBulk *bulk, FsBulkSlot *slot, int res) {
+    FsBulkItem *item = slot->item;
+    struct io_uring_sqe *sqe;
+    switch (slot->stage) {
+        case FSBULK_STAGE_STAT:
+        case FSBULK_STAGE_UNLINK:
+            slot->err = res < 0 ? -res : 0;
+            break;
+        case FSBULK_STAGE_CREATE_OPEN:
+            if (res == -ELOOP) {
+                // A symbolic link: follow it only through a confined lookup
+                res = fsop_open_leaf(slot->parent->fd, slot->leaf, item->path, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC,
+                                     0666);
+                if (res < 0) res = -errno;
+            }
+            if (res < 0) {
+                slot->err = -res;
+                break;
+            }
+            fsop_bulk_queue_close(bulk, slot, FSBULK_STAGE_CREATE_CLOSE, res);
+            return 1;
+        case FSBULK_STAGE_CREATE_CLOSE:
+            slot->err = res < 0 ? -res : 0;
+            break;
+        case FSBULK_STAGE_RENAME:
+            slot->err = res < 0 ? -res : 0;
+            if (slot->err == EINVAL || slot->err == ENOSYS || slot->err == EXDEV) {
+                // No RENAME_NOREPLACE here, or another filesystem: take the careful path
+                slot->err = fsop_rename(item->path, item->path2);
+            }
+            break;
+        case FSBULK_STAGE_COPY_OPEN_SRC:
+            if (res == -EXDEV) {
+                // Through a symbolic link with an absolute target
+                res = confine_open_resolved(item->path, O_RDONLY | O_CLOEXEC, 0);
+                if (res < 0) res = -errno;
+            }
+            if (res < 0) {
+                slot->err = -res;
+                break;
+            }
+            slot->in_fd = res;
+            slot->stage = FSBULK_STAGE_COPY_STAT;
+            sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_STATX, slot->in_fd, "");
+            sqe->statx_flags = AT_EMPTY_PATH;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uint64_t)(uintptr_t)&slot->stx;
+            return 1;
+        case FSBULK_STAGE_COPY_STAT:
+            if (res < 0) slot->err = -res;
+            else if (!S_ISREG(slot->stx.stx_mode)) slot->err = S_ISDIR(slot->stx.stx_mode) ? EISDIR : EINVAL;
+            if (slot->err != 0) return fsop_bulk_copy_finish(bulk, slot);
+            slot->stage = FSBULK_STAGE_COPY_OPEN_DST;
+            sqe = fsop_bulk_sqe(bulk, slot, IORING_OP_OPENAT, slot->parent2->fd, slot->leaf2);
+            sqe->open_flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW;
+            sqe->len = slot->stx.stx_mode & 07777;
+            return 1;
+        case FSBULK_STAGE_COPY_OPEN_DST: {
+            if (res == -ELOOP) {
+                res = fsop_open_leaf(slot->parent2->fd, slot->leaf2, item->path2, O_WRONLY | O_CREAT | O_CLOEXEC,
+                                     slot->stx.stx_mode & 07777);
+                if (res < 0) res = -errno;
+            }
+            if (res < 0) {
+                slot->err = -res;
+                return fsop_bulk_copy_finish(bulk, slot);
+            }
+            slot->out_fd = res;
+            struct stat in_sb;
+            slot->err = fstat(slot->in_fd, &in_sb) == 0 ? fsop_copy_truncate(&in_sb, slot->out_fd) : errno;
+            if (slot->err != 0) return fsop_bulk_copy_finish(bulk, slot);
+            if (slot->stx.stx_size > FSBULK_COPY_INLINE) {
+                // Big enough for a reflink or an in-kernel copy to win. A
+                // copier thread runs it while the ring keeps the other
+                // items moving; without one it runs here.
+                if (fsop_bulk_offload(bulk, slot) == 0) return 1;
+                long long copied;
+                const char *method;
+                slot->err = fsop_copy_data(slot->in_fd, slot->out_fd, (off_t)slot->stx.stx_size, &copied, &method);
+                return fsop_bulk_copy_finish(bulk, slot);
+            }
+            if (slot->stx.stx_size == 0) return fsop_bulk_copy_finish(bulk, slot);
+            slot->offset = 0;
+            fsop_bulk_queue_read(bulk, slot);
+            return 1;
+        }
+        case FSBULK_STAGE_COPY_OFFLOAD:
+            // The copier has set slot->err. A failed read of the eventfd
+            // says nothing about the copy, so wait for it either way.
+            fsop_bulk_offload_wait(bulk, slot);
+            return fsop_bulk_copy_finish(bulk, slot);
+        case FSBULK_STAGE_COPY_READ:
+            if (res <= 0) {
+                slot->err = res < 0 ? -res : 0;
+                return fsop_bulk_copy_finish(bulk, slot);
+            }
+            slot->pending = (size_t)res;
+            slot->written = 0;
+            fsop_bulk_queue_write(bulk, slot);
+            return 1;
+        case FSBULK_STAGE_COPY_WRITE:
+            if (res <= 0) {
+                slot->err = res < 0 ? -res : EIO;
+                return fsop_bulk_copy_finish(bulk, slot);
+            }
+            slot->written += (size_t)res;
+            if (slot->written < slot->pending) {
+                fsop_bulk_queue_write(bulk, slot);
+            } else {
+                slot->offset += (off_t)slot->pending;
+                fsop_bulk_queue_read(bulk, slot);
+            }
+            return 1;
+        case FSBULK_STAGE_COPY_CLOSE_SRC:
+        case FSBULK_STAGE_COPY_CLOSE_DST:
+            if (res < 0 && slot->err == 0 && slot->stage == FSBULK_STAGE_COPY_CLOSE_DST) slot->err = -res;
+            return fsop_bulk_copy_close(bulk, slot);
+    }
+    return 0;
+}
+
+// The ring failed: fail the items in flight and switch the context to
+// plain system calls
+static void fsop_bulk_abandon(FsBulk *bulk, int err) {
+    bulk->free_count = 0;
+    for (int i = FSBULK_DEPTH - 1; i >= 0; i--) {
+        FsBulkSlot *slot = &bulk->slots[i];
+        if (slot->item != NULL) {
+            slot->item->result = err;
+            fsop_bulk_offload_wait(bulk, slot);
+            if (slot->in_fd >= 0) close(slot->in_fd);
+            if (slot->out_fd >= 0) close(slot->out_fd);
+            fsop_bulk_release(slot->parent);
+            fsop_bulk_release(slot->parent2);
+            slot->item = NULL;
+        }
+        bulk->free_slots[bulk->free_count++] = i;
+    }
+    bulk->to_submit = 0;
+    bulk->backend = FSBULK_SYNC;
+}
+
+// Drive items through the ring until every one has finished
+static void fsop_bulk_run_uring(FsBulk *bulk, FsBulkItem *items, size_t count) {
+    size_t next = 0, active = 0;
+    while (next < count || active > 0) {
+        while (next < count && bulk->free_count > 0) {
+            int started = fsop_bulk_start(bulk, &items[next]);
+            if (started < 0 && active == 0) {
+                // No completion will free a parent entry, so waiting would
+                // never end: run this one item directly
+                fsop_bulk_sync_one(bulk, &items[next++]);
+                continue;
+            }
+            if (started < 0) break;
+            active += (size_t)started;
+            next++;
+        }
+        if (active == 0) continue;
+
+        int submitted = (int)syscall(__NR_io_uring_enter, bulk->ring_fd, bulk->to_submit, 1, IORING_ENTER_GETEVENTS,
+                                     NULL, 0);
+        if (submitted < 0) {
+            // Transient: reap what has completed and try again
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                fsop_bulk_abandon(bulk, errno);
+                for (size_t i = next; i < count; i++) fsop_bulk_sync_one(bulk, &items[i]);
+                return;
+            }
+            submitted = 0;
+        }
+        bulk->to_submit -= (unsigned)submitted;
+
+        unsigned head = *bulk->cq_head;
+        unsigned tail = __atomic_load_n(bulk->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &bulk->cqes[head & *bulk->cq_mask];
+            FsBulkSlot *slot = &bulk->slots[cqe->user_data];
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(bulk->cq_head, head, __ATOMIC_RELEASE);
+            if (fsop_bulk_advance(bulk, slot, res)) continue;
+
+            slot->item->result = slot->err;
+            slot->item = NULL;
+            fsop_bulk_release(slot->parent);
+            fsop_bulk_release(slot->parent2);
+            bulk->free_slots[bulk->free_count++] = (int)(slot - bulk->slots);
+            active--;
+        }
+    }
+}
+
+// Run every item and set its result (0 or an errno value). Items are
+// independent and may complete in any order.
+void fsop_bulk_run(FsBulk *bulk, FsBulkItem *items, size_t count) {
+    if (bulk->backend == FSBULK_URING) {
+        fsop_bulk_run_uring(bulk, items, count);
+    } else {
+        for (size_t i = 0; i < count; i++) fsop_bulk_sync_one(bulk, &items[i]);
+    }
+}
+
+// One-shot form: open a context, run the items, close it. Returns the
+// backend that ran them, or -1 when no context could be allocated (every
+// item then carries ENOMEM).
+int fsop_bulk(FsBulkItem *items, size_t count, FsBulkBackend backend) {
+    FsBulk *bulk = fsop_bulk_open(backend);
+    if (bulk == NULL) {
+        for (size_t i = 0; i < count; i++) items[i].result = ENOMEM;
+        return -1;
+    }
+    fsop_bulk_run(bulk, items, count);
+    int used = (int)bulk->backend;
+    fsop_bulk_close(bulk);
+    return used;
+}
+
+// ---------------------------------------------------------------------------
+// Parallel directory walker
+//
+// Walks one or more trees with getdents64 on a pool of threads. Every worker
+// owns a deque of pending directories: it pushes and pops at the tail, and an
+// idle worker steals from the head of another worker's deque. A worker that
+// finds every deque empty sleeps on a condition variable until a directory
+// is queued or the walk is over. Symbolic links are reported but never
+// followed.
+// ---------------------------------------------------------------------------
+
+typedef struct WalkTask {
+    char *path;
+    int root;
+} WalkTask;
+
+typedef struct WalkDeque {
+    pthread_mutex_t lock;
+    WalkTask *items;
+    size_t head, tail, cap;
+} WalkDeque;
+
+typedef struct WalkPool {
+    WalkDeque *deques;
+    int workers;
+    atomic_long pending;  // Directories queued or being read
+    atomic_long queued;   // Directories queued only
+    atomic_int sleepers;  // Workers waiting on work
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work;  // A directory was queued, or pending reached 0
+    WalkVisitor visit;
+    void *arg;
+} WalkPool;
+
+typedef struct WalkWorker {
+    WalkPool *pool;
+    int id;
+} WalkWorker;
+
+// Number of walker threads to use on this machine
+int walk_default_workers(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > WALK_MAX_WORKERS) cpus = WALK_MAX_WORKERS;
+    return (int)cpus;
+}
+
+static int walk_push(WalkDeque *dq, char *path, int root) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head > 0 && dq->head == dq->tail) dq->head = dq->tail = 0;
+    if (dq->tail == dq->cap) {
+        // Compact before growing so stolen slots at the head are reused
+        if (dq->head > 0) {
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(WalkTask));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            size_t cap = dq->cap ? dq->cap * 2 : 64;
+            WalkTask *items = realloc(dq->items, cap * sizeof(WalkTask));
+            if (items == NULL) {
+                pthread_mutex_unlock(&dq->lock);
+                return ENOMEM;
+            }
+            dq->items = items;
+            dq->cap = cap;
+        }
+    }
+    dq->items[dq->tail].path = path;
+    dq->items[dq->tail].root = root;
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// Owner side: newest directory first, which keeps the working set small
+static int walk_pop(WalkDeque *dq, WalkTask *task) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        *task = dq->items[--dq->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Thief side: oldest directory first, which tends to be the largest subtree
+static int walk_steal(WalkDeque *dq, WalkTask *task) {
+    int found = 0;
+    if (pthread_mutex_trylock(&dq->lock) != 0) return 0;
+    if (dq->tail > dq->head) {
+        *task = dq->items[dq->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Read one directory and report its entries, queueing subdirectories
+static void walk_directory(WalkPool *pool, int worker, WalkTask *task) {
+    int fd = open(task->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open directory %s: %s\n", task->path, strerror(errno));
+        return;
+    }
+
+    size_t base_len = strlen(task->path);
+    char path[PATH_MAX];
+    memcpy(path, task->path, base_len);
+    path[base_len] = '/';
+
+    char buffer[WALK_DENTS_BUFFER] __attribute__((aligned(8)));
+    ssize_t n;
+    while ((n = getdents64(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64 *ent = (struct dirent64 *)(buffer + off);
+            off += ent->d_reclen;
+
+            const char *name = ent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            size_t name_len = strlen(name);
+            if (base_len + 1 + name_len >= sizeof(path)) {
+                fprintf(stderr, "Path too long under %s\n", task->path);
+                continue;
+            }
+            memcpy(path + base_len + 1, name, name_len + 1);
+
+            unsigned char type = ent->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat sb;
+                if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = IFTODT(sb.st_mode);
+            }
+            if (type == DT_DIR && trash_is_area(path, base_len + 1 + name_len)) continue;
+
+            WalkEntry entry = {
+                .root = task->root,
+                .dirfd = fd,
+                .name = name,
+                .path = path,
+                .path_len = base_len + 1 + name_len,
+                .type = type,
+                .ino = (ino_t)ent->d_ino,
+            };
+            if (pool->visit != NULL) pool->visit(worker, &entry, pool->arg);
+
+            if (type == DT_DIR) {
+                char *child = strdup(path);
+                if (child == NULL) continue;
+                atomic_fetch_add(&pool->pending, 1);
+                if (walk_push(&pool->deques[worker], child, task->root) != 0) {
+                    atomic_fetch_sub(&pool->pending, 1);
+                    free(child);
+                    continue;
+                }
+                // Pairs with the sleepers/queued check in walk_wait
+                atomic_fetch_add(&pool->queued, 1);
+                if (atomic_load(&pool->sleepers) > 0) {
+                    pthread_mutex_lock(&pool->idle_lock);
+                    pthread_cond_signal(&pool->work);
+                    pthread_mutex_unlock(&pool->idle_lock);
+                }
+            }
+        }
+    }
+    if (n < 0) fprintf(stderr, "Error reading directory %s: %s\n", task->path, strerror(errno));
+    close(fd);
+}
+
+// Sleep while nothing is queued but others are still reading directories
+// that may queue more
+static void walk_wait(WalkPool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->work, &pool->idle_lock);
+    }
+    atomic_fetch_sub(&pool->sleepers, 1);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void *walk_worker_main(void *arg) {
+    WalkWorker *self = arg;
+    WalkPool *pool = self->pool;
+
+    while (atomic_load(&pool->pending) > 0) {
+        WalkTask task;
+        int found = walk_pop(&pool->deques[self->id], &task);
+        for (int i = 1; !found && i < pool->workers; i++) {
+            found = walk_steal(&pool->deques[(self->id + i) % pool->workers], &task);
+        }
+        if (!found) {
+            walk_wait(pool);
+            continue;
+        }
+
+        atomic_fetch_sub(&pool->queued, 1);
+        walk_directory(pool, self->id, &task);
+        free(task.path);
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            // The walk is over: wake everyone to leave
+            pthread_mutex_lock(&pool->idle_lock);
+            pthread_cond_broadcast(&pool->work);
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+// Walk every root in parallel with up to `workers` threads, calling visit
+// for each entry below the roots. visit runs concurrently on different
+// workers and receives the worker index so it can keep per-thread state.
+// Returns 0 or an errno value.
+int walk_trees(const char **roots, int root_count, int workers, WalkVisitor visit, void *arg) {
+    if (workers < 1) workers = 1;
+    if (workers > WALK_MAX_WORKERS) workers = WALK_MAX_WORKERS;
+
+    WalkPool pool;
+    pool.workers = workers;
+    pool.visit = visit;
+    pool.arg = arg;
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.queued, 0);
+    atomic_init(&pool.sleepers, 0);
+    pool.deques = calloc((size_t)workers, sizeof(WalkDeque));
+    if (pool.deques == NULL) return ENOMEM;
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    for (int i = 0; i < workers; i++) pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+    // Spread the roots over the workers so they all start busy
+    int err = 0;
+    for (int i = 0; i < root_count && err == 0; i++) {
+        char *root = strdup(roots[i]);
+        if (root == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        atomic_fetch_add(&pool.pending, 1);
+        err = walk_push(&pool.deques[i % workers], root, i);
+        if (err != 0) {
+            atomic_fetch_sub(&pool.pending, 1);
+            free(root);
+        } else {
+            atomic_fetch_add(&pool.queued, 1);
+        }
+    }
+
+    pthread_t threads[WALK_MAX_WORKERS];
+    WalkWorker args[WALK_MAX_WORKERS];
+    int started = 0;
+    for (int i = 1; i < workers && err == 0; i++) {
+        args[i].pool = &pool;
+        args[i].id = i;
+        if (pthread_create(&threads[i], NULL, walk_worker_main, &args[i]) != 0) break;
+        started = i;
+    }
+    // The calling thread is worker 0; its loop drains whatever others fail to
+    args[0].pool = &pool;
+    args[0].id = 0;
+    if (err == 0) walk_worker_main(&args[0]);
+    for (int i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+
+    // Anything left over (only after an early error) is discarded
+    for (int i = 0; i < workers; i++) {
+        for (size_t j = pool.deques[i].head; j < pool.deques[i].tail; j++) free(pool.deques[i].items[j].path);
+        free(pool.deques[i].items);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.work);
+    return err;
+}
+
+// Append len bytes to the buffer, growing it geometrically
+int out_append(OutBuffer *buffer, const char *data, size_t len) {
+    if (buffer->len + len > buffer->cap) {
+        size_t cap = buffer->cap ? buffer->cap : 4096;
+        while (cap < buffer->len + len) cap *= 2;
+        char *grown = realloc(buffer->data, cap);
+        if (grown == NULL) return ENOMEM;
+        buffer->data = grown;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+void out_free(OutBuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->len = buffer->cap = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Parallel task runner
+//
+// Runs task(worker, index) for every index below count on a fixed set of
+// threads that claim indices from a shared counter. parallel_start returns
+// immediately so the caller can consume results while the workers run.
+// ---------------------------------------------------------------------------
+
+static void *parallel_worker_main(void *arg) {
+    ParallelWorker *self = arg;
+    ParallelJob *job = self->job;
+    size_t index;
+    while ((index = atomic_fetch_add(&job->next, 1)) < job->count) {
+        job->task(self->id, index, job->arg);
+    }
+    return NULL;
+}
+
+// Start up to `workers` threads on the job. If no thread can be created the
+// whole job runs on the calling thread before this returns.
+int parallel_start(ParallelJob *job, size_t count, int workers, ParallelTask task, void *arg) {
+    if (workers < 1) workers = 1;
+    if (workers > WALK_MAX_WORKERS) workers = WALK_MAX_WORKERS;
+    if ((size_t)workers > count) workers = count > 0 ? (int)count : 1;
+
+    job->count = count;
+    job->task = task;
+    job->arg = arg;
+    job->started = 0;
+    atomic_init(&job->next, 0);
+    for (int i = 0; i < workers; i++) {
+        job->workers[i].job = job;
+        job->workers[i].id = i;
+        if (pthread_create(&job->threads[i], NULL, parallel_worker_main, &job->workers[i]) != 0) break;
+        job->started++;
+    }
+    if (job->started == 0) {
+        job->workers[0].job = job;
+        job->workers[0].id = 0;
+        parallel_worker_main(&job->workers[0]);
+    }
+    return job->started;
+}
+
+// Wait for every task of the job to finish
+void parallel_wait(ParallelJob *job) {
+    for (int i = 0; i < job->started; i++) pthread_join(job->threads[i], NULL);
+    job->started = 0;
+}
+
+// Start a long-lived background thread with every signal blocked, so SIGINT
+// and SIGTERM always reach the main thread and its shutdown path. Returns 1
+// when the thread is running.
+int start_service_thread(pthread_t *thread, void *(*run)(void *)) {
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int started = pthread_create(thread, NULL, run, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return started;
+}
+
+// ---------------------------------------------------------------------------
+// Namespace index
+//
+// In-memory map from path to inode, size, mtime and type for everything under
+// the logistics tree. It is built once at startup (or loaded from a snapshot
+// file and revalidated), and kept current with inotify: pending events are
+// applied before every query, so the caller always sees its own changes.
+// All functions take name_index.lock and may be called from any thread.
+// ---------------------------------------------------------------------------
+
+typedef struct NameIndex {
+    pthread_mutex_t lock;
+    int live;                  // Built and being kept current
+    char root[PATH_MAX];
+    size_t root_len;
+    char snapshot_path[PATH_MAX];
+    NameIndexEntry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    int inotify_fd;
+    char **watch_paths;        // Directory path per inotify watch descriptor
+    int watch_cap;
+    pthread_t refresher;
+    int refresher_running;
+    atomic_int stop_refresher;
+} NameIndex;
+
+static NameIndex name_index = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1 };
+
+#define NSINDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | \
+                            IN_ATTRIB | IN_CLOSE_WRITE | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define NSINDEX_SNAPSHOT_MAGIC "LSIDX001"
+
+static uint64_t nsindex_hash(const char *path, size_t len) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static NameIndexEntry **nsindex_slot(const char *path, size_t len, uint64_t hash) {
+    NameIndexEntry **slot = &name_index.buckets[hash & (name_index.bucket_count - 1)];
+    while (*slot != NULL) {
+        if ((*slot)->hash == hash && (*slot)->path_len == len && memcmp((*slot)->path, path, len) == 0) break;
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static int nsindex_grow(void) {
+    size_t count = name_index.bucket_count ? name_index.bucket_count * 2 : 1024;
+    NameIndexEntry **buckets = calloc(count, sizeof(NameIndexEntry *));
+    if (buckets == NULL) return ENOMEM;
+    for (size_t i = 0; i < name_index.bucket_count; i++) {
+        NameIndexEntry *e = name_index.buckets[i];
+        while (e != NULL) {
+            NameIndexEntry *next = e->next;
+            e->next = buckets[e->hash & (count - 1)];
+            buckets[e->hash & (count - 1)] = e;
+            e = next;
+        }
+    }
+    free(name_index.buckets);
+    name_index.buckets = buckets;
+    name_index.bucket_count = count;
+    return 0;
+}
+
+// Insert or update the entry for path
+static int nsindex_put(const char *path, size_t len, ino_t ino, off_t size, long long mtime_ns, unsigned char type) {
+    if (name_index.entry_count >= name_index.bucket_count && nsindex_grow() != 0) return ENOMEM;
+
+    uint64_t hash = nsindex_hash(path, len);
+    NameIndexEntry **slot = nsindex_slot(path, len, hash);
+    NameIndexEntry *e = *slot;
+    if (e == NULL) {
+        e = malloc(sizeof(NameIndexEntry) + len + 1);
+        if (e == NULL) return ENOMEM;
+        e->next = NULL;
+        e->hash = hash;
+        e->path_len = len;
+        memcpy(e->path, path, len + 1);
+        *slot = e;
+        name_index.entry_count++;
+    }
+    e->info.ino = ino;
+    e->info.size = size;
+    e->info.mtime_ns = mtime_ns;
+    e->info.type = type;
+    e->unverified = 0;
+    return 0;
+}
+
+static void nsindex_put_stat(const char *path, size_t len, const struct stat *sb) {
+    nsindex_put(path, len, sb->st_ino, sb->st_size,
+                (long long)sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec, IFTODT(sb->st_mode));
+}
+
+static void nsindex_remove(const char *path, size_t len) {
+    NameIndexEntry **slot = nsindex_slot(path, len, nsindex_hash(path, len));
+    if (*slot != NULL) {
+        NameIndexEntry *e = *slot;
+        *slot = e->next;
+        free(e);
+        name_index.entry_count--;
+    }
+}
+
+// Remove every entry strictly below the directory prefix
+static void nsindex_remove_below(const char *prefix, size_t len) {
+    for (size_t i = 0; i < name_index.bucket_count; i++) {
+        NameIndexEntry **slot = &name_index.buckets[i];
+        while (*slot != NULL) {
+            NameIndexEntry *e = *slot;
+            if (e->path_len > len && e->path[len] == '/' && memcmp(e->path, prefix, len) == 0) {
+                *slot = e->next;
+                free(e);
+                name_index.entry_count--;
+            } else {
+                slot = &e->next;
+            }
+        }
+    }
+}
+
+static void nsindex_clear(void) {
+    for (size_t i = 0; i < name_index.bucket_count; i++) {
+        NameIndexEntry *e = name_index.buckets[i];
+        while (e != NULL) {
+            NameIndexEntry *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(name_index.buckets);
+    name_index.buckets = NULL;
+    name_index.bucket_count = name_index.entry_count = 0;
+}
+
+// Start watching a directory; returns 0 or an errno value
+static int nsindex_watch(const char *path) {
+    int wd = inotify_add_watch(name_index.inotify_fd, path, NSINDEX_WATCH_MASK);
+    if (wd < 0) return errno;
+    if (wd >= name_index.watch_cap) {
+        int cap = name_index.watch_cap ? name_index.watch_cap : 256;
+        while (cap <= wd) cap *= 2;
+        char **paths = realloc(name_index.watch_paths, (size_t)cap * sizeof(char *));
+        if (paths == NULL) return ENOMEM;
+        memset(paths + name_index.watch_cap, 0, (size_t)(cap - name_index.watch_cap) * sizeof(char *));
+        name_index.watch_paths = paths;
+        name_index.watch_cap = cap;
+    }
+    free(name_index.watch_paths[wd]);
+    name_index.watch_paths[wd] = strdup(path);
+    return name_index.watch_paths[wd] != NULL ? 0 : ENOMEM;
+}
+
+// Stop watching a directory and everything below it
+static void nsindex_unwatch_tree(const char *prefix, size_t len) {
+    for (int wd = 0; wd < name_index.watch_cap; wd++) {
+        char *p = name_index.watch_paths[wd];
+        if (p == NULL || strncmp(p, prefix, len) != 0 || (p[len] != '\0' && p[len] != '/')) continue;
+        inotify_rm_watch(name_index.inotify_fd, wd);
+        free(p);
+        name_index.watch_paths[wd] = NULL;
+    }
+}
+
+static void nsindex_drop_watches(void) {
+    for (int wd = 0; wd < name_index.watch_cap; wd++) free(name_index.watch_paths[wd]);
+    free(name_index.watch_paths);
+    name_index.watch_paths = NULL;
+    name_index.watch_cap = 0;
+    if (name_index.inotify_fd >= 0) close(name_index.inotify_fd);
+    name_index.inotify_fd = -1;
+}
+
+// Add a subtree that appeared after the initial build (single-threaded)
+static int nsindex_scan_tree(const char *path) {
+    int err = nsindex_watch(path);
+    if (err != 0) return err;
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) return errno == ENOENT ? 0 : errno;
+
+    struct dirent *ent;
+    char child[PATH_MAX];
+    while (err == 0 && (ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        int len = snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+        if (len >= (int)sizeof(child) || trash_is_area(child, (size_t)len)) continue;
+
+        struct stat sb;
+        if (fstatat(dirfd(dir), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        nsindex_put_stat(child, (size_t)len, &sb);
+        if (S_ISDIR(sb.st_mode)) err = nsindex_scan_tree(child);
+    }
+    closedir(dir);
+    return err;
+}
+
+// Entries gathered by one walker thread during a full build
+typedef struct NsIndexBuild {
+    NameIndexEntry **items;
+    size_t count, cap;
+} NsIndexBuild;
+
+static void nsindex_build_visit(int worker, const WalkEntry *entry, void *arg) {
+    NsIndexBuild *build = &((NsIndexBuild *)arg)[worker];
+    struct stat sb;
+    if (fstatat(entry->dirfd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) != 0) return;
+
+    if (build->count == build->cap) {
+        size_t cap = build->cap ? build->cap * 2 : 1024;
+        NameIndexEntry **items = realloc(build->items, cap * sizeof(NameIndexEntry *));
+        if (items == NULL) return;
+        build->items = items;
+        build->cap = cap;
+    }
+    NameIndexEntry *e = malloc(sizeof(NameIndexEntry) + entry->path_len + 1);
+    if (e == NULL) return;
+    e->path_len = entry->path_len;
+    memcpy(e->path, entry->path, entry->path_len + 1);
+    e->info.ino = sb.st_ino;
+    e->info.size = sb.st_size;
+    e->info.mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    e->info.type = IFTODT(sb.st_mode);
+    build->items[build->count++] = e;
+}
+
+// Full parallel scan of the root; caller holds the lock
+static int nsindex_rebuild(void) {
+    nsindex_clear();
+    nsindex_drop_watches();
+    name_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (name_index.inotify_fd < 0) return errno;
+
+    // Watch the root first so changes made during the scan are queued
+    int err = nsindex_watch(name_index.root);
+    if (err != 0) return err;
+
+    int workers = walk_default_workers();
+    NsIndexBuild *builds = calloc((size_t)workers, sizeof(NsIndexBuild));
+    if (builds == NULL) return ENOMEM;
+    const char *roots[1] = { name_index.root };
+    err = walk_trees(roots, 1, workers, nsindex_build_visit, builds);
+
+    for (int w = 0; w < workers; w++) {
+        for (size_t i = 0; i < builds[w].count; i++) {
+            NameIndexEntry *e = builds[w].items[i];
+            if (err == 0) {
+                err = nsindex_put(e->path, e->path_len, e->info.ino, e->info.size, e->info.mtime_ns, e->info.type);
+                if (err == 0 && e->info.type == DT_DIR) err = nsindex_watch(e->path);
+            }
+            free(e);
+        }
+        free(builds[w].items);
+    }
+    free(builds);
+    return err;
+}
+
+// Apply one inotify event; caller holds the lock
+static void nsindex_apply_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_IGNORED) {
+        if (ev->wd >= 0 && ev->wd < name_index.watch_cap) {
+            free(name_index.watch_paths[ev->wd]);
+            name_index.watch_paths[ev->wd] = NULL;
+        }
+        return;
+    }
+    if (ev->len == 0 || ev->wd < 0 || ev->wd >= name_index.watch_cap || name_index.watch_paths[ev->wd] == NULL) return;
+
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/%s", name_index.watch_paths[ev->wd], ev->name);
+    if (len >= (int)sizeof(path) || trash_contains(path)) return;
+
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        nsindex_remove(path, (size_t)len);
+        if (ev->mask & IN_ISDIR) {
+            nsindex_remove_below(path, (size_t)len);
+            nsindex_unwatch_tree(path, (size_t)len);
+        }
+        return;
+    }
+
+    // Created, moved in or modified: take the current state from the file system
+    struct stat sb;
+    if (lstat(path, &sb) != 0) {
+        nsindex_remove(path, (size_t)len);
+        return;
+    }
+    nsindex_put_stat(path, (size_t)len, &sb);
+    if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && S_ISDIR(sb.st_mode)) {
+        nsindex_scan_tree(path);
+    }
+}
+
+// Drain queued inotify events; caller holds the lock
+static void nsindex_sync_locked(void) {
+    if (!name_index.live) return;
+
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(name_index.inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)(buffer + off);
+            off += (ssize_t)sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost; only a rescan can tell what changed
+                name_index.live = nsindex_rebuild() == 0;
+                return;
+            }
+            nsindex_apply_event(ev);
+        }
+    }
+}
+
+// Write the index to the snapshot file (temporary file + rename); caller holds the lock
+static int nsindex_save_locked(void) {
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", name_index.snapshot_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) return errno;
+
+    uint32_t root_len = (uint32_t)name_index.root_len;
+    uint64_t count = name_index.entry_count;
+    fwrite(NSINDEX_SNAPSHOT_MAGIC, 1, 8, fp);
+    fwrite(&root_len, sizeof(root_len), 1, fp);
+    fwrite(name_index.root, 1, root_len, fp);
+    fwrite(&count, sizeof(count), 1, fp);
+    for (size_t i = 0; i < name_index.bucket_count; i++) {
+        for (NameIndexEntry *e = name_index.buckets[i]; e != NULL; e = e->next) {
+            uint64_t ino = e->info.ino;
+            int64_t size = e->info.size, mtime = e->info.mtime_ns;
+            uint16_t rel_len = (uint16_t)(e->path_len - name_index.root_len);
+            fwrite(&ino, sizeof(ino), 1, fp);
+            fwrite(&size, sizeof(size), 1, fp);
+            fwrite(&mtime, sizeof(mtime), 1, fp);
+            fwrite(&e->info.type, 1, 1, fp);
+            fwrite(&rel_len, sizeof(rel_len), 1, fp);
+            fwrite(e->path + name_index.root_len, 1, rel_len, fp);
+        }
+    }
+
+    int err = ferror(fp) ? EIO : 0;
+    if (fclose(fp) != 0 && err == 0) err = errno;
+    if (err == 0 && rename(tmp_path, name_index.snapshot_path) != 0) err = errno;
+    if (err != 0) unlink(tmp_path);
+    return err;
+}
+
+// Load a snapshot written by nsindex_save_locked; caller holds the lock
+static int nsindex_load_locked(void) {
+    FILE *fp = fopen(name_index.snapshot_path, "rb");
+    if (fp == NULL) return errno;
+
+    char magic[8];
+    uint32_t root_len;
+    char root[PATH_MAX];
+    uint64_t count;
+    int err = 0;
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, NSINDEX_SNAPSHOT_MAGIC, 8) != 0 ||
+        fread(&root_len, sizeof(root_len), 1, fp) != 1 || root_len != name_index.root_len ||
+        fread(root, 1, root_len, fp) != root_len || memcmp(root, name_index.root, root_len) != 0 ||
+        fread(&count, sizeof(count), 1, fp) != 1) {
+        err = EINVAL;  // Different tree or format
+    }
+
+    char path[PATH_MAX];
+    memcpy(path, name_index.root, name_index.root_len);
+    for (uint64_t i = 0; err == 0 && i < count; i++) {
+        uint64_t ino;
+        int64_t size, mtime;
+        unsigned char type;
+        uint16_t rel_len;
+        if (fread(&ino, sizeof(ino), 1, fp) != 1 || fread(&size, sizeof(size), 1, fp) != 1 ||
+            fread(&mtime, sizeof(mtime), 1, fp) != 1 || fread(&type, 1, 1, fp) != 1 ||
+            fread(&rel_len, sizeof(rel_len), 1, fp) != 1 || name_index.root_len + rel_len >= sizeof(path) ||
+            fread(path + name_index.root_len, 1, rel_len, fp) != rel_len) {
+            err = EINVAL;
+            break;
+        }
+        path[name_index.root_len + rel_len] = '\0';
+        size_t len = name_index.root_len + rel_len;
+        err = nsindex_put(path, len, (ino_t)ino, (off_t)size, mtime, type);
+        if (err == 0) (*nsindex_slot(path, len, nsindex_hash(path, len)))->unverified = 1;
+    }
+    fclose(fp);
+    if (err != 0) nsindex_clear();
+    return err;
+}
+
+// Bring a loaded snapshot up to date. Directories are cheap to stat, so all
+// of them are checked now: a changed mtime means entries were added or
+// removed, and that directory is re-read. Other entries stay unverified
+// until the background refresher gets to them; lookups stat the ones they
+// need before that.
+static int nsindex_revalidate_locked(void) {
+    name_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (name_index.inotify_fd < 0) return errno;
+    int err = nsindex_watch(name_index.root);
+    if (err != 0) return err;
+
+    // Collect directories first; the table changes while they are re-read
+    size_t dir_count = 0, dir_cap = 256;
+    char **dirs = malloc(dir_cap * sizeof(char *));
+    long long *mtimes = malloc(dir_cap * sizeof(long long));
+    if (dirs == NULL || mtimes == NULL) {
+        free(dirs);
+        free(mtimes);
+        return ENOMEM;
+    }
+    dirs[dir_count] = strdup(name_index.root);
+    mtimes[dir_count++] = -1;  // The root itself is not in the table: always re-read
+    for (size_t i = 0; i < name_index.bucket_count && err == 0; i++) {
+        for (NameIndexEntry *e = name_index.buckets[i]; e != NULL && err == 0; e = e->next) {
+            if (e->info.type != DT_DIR) continue;
+            if (dir_count == dir_cap) {
+                dir_cap *= 2;
+                char **d = realloc(dirs, dir_cap * sizeof(char *));
+                long long *m = realloc(mtimes, dir_cap * sizeof(long long));
+                if (d != NULL) dirs = d;
+                if (m != NULL) mtimes = m;
+                if (d == NULL || m == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+            }
+            mtimes[dir_count] = e->info.mtime_ns;
+            dirs[dir_count++] = strdup(e->path);
+        }
+    }
+
+    for (size_t i = 0; i < dir_count && err == 0; i++) {
+        if (dirs[i] == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        size_t len = strlen(dirs[i]);
+        struct stat sb;
+        if (lstat(dirs[i], &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+            // Gone while we were down
+            nsindex_remove(dirs[i], len);
+            nsindex_remove_below(dirs[i], len);
+            continue;
+        }
+        err = nsindex_watch(dirs[i]);
+        if (err != 0) break;
+        long long mtime = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+        if (i > 0) nsindex_put_stat(dirs[i], len, &sb);
+        if (mtime == mtimes[i]) continue;
+
+        // Drop children that no longer exist, then add the ones that are new.
+        // Subtrees of vanished directories are removed after the pass, since
+        // that may free entries the pass still points into.
+        OutBuffer gone_dirs = { 0 };
+        for (size_t b = 0; b < name_index.bucket_count; b++) {
+            NameIndexEntry **slot = &name_index.buckets[b];
+            while (*slot != NULL) {
+                NameIndexEntry *e = *slot;
+                const char *slash = strrchr(e->path, '/');
+                struct stat child;
+                if ((size_t)(slash - e->path) == len && memcmp(e->path, dirs[i], len) == 0 &&
+                    lstat(e->path, &child) != 0) {
+                    *slot = e->next;
+                    if (e->info.type == DT_DIR) out_append(&gone_dirs, e->path, e->path_len + 1);
+                    free(e);
+                    name_index.entry_count--;
+                } else {
+                    slot = &e->next;
+                }
+            }
+        }
+        for (size_t off = 0; off < gone_dirs.len; ) {
+            size_t gone_len = strlen(gone_dirs.data + off);
+            nsindex_remove_below(gone_dirs.data + off, gone_len);
+            off += gone_len + 1;
+        }
+        out_free(&gone_dirs);
+        DIR *dir = opendir(dirs[i]);
+        if (dir == NULL) continue;
+        struct dirent *ent;
+        char child[PATH_MAX];
+        while (err == 0 && (ent = readdir(dir)) != NULL) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+            int child_len = snprintf(child, sizeof(child), "%s/%s", dirs[i], ent->d_name);
+            if (child_len >= (int)sizeof(child) || trash_is_area(child, (size_t)child_len)) continue;
+            if (*nsindex_slot(child, (size_t)child_len, nsindex_hash(child, (size_t)child_len)) != NULL) continue;
+            struct stat csb;
+            if (fstatat(dirfd(dir), ent->d_name, &csb, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            nsindex_put_stat(child, (size_t)child_len, &csb);
+            if (S_ISDIR(csb.st_mode)) err = nsindex_scan_tree(child);
+        }
+        closedir(dir);
+    }
+
+    for (size_t i = 0; i < dir_count; i++) free(dirs[i]);
+    free(dirs);
+    free(mtimes);
+    return err;
+}
+
+// Background pass that re-stats entries loaded from a snapshot, a batch of
+// buckets at a time so queries are never blocked for long. Each batch is
+// stated in one bulk run; if that cannot be set up, one entry at a time.
+static void *nsindex_refresher_main(void *arg) {
+    (void)arg;
+    FsBulk *bulk = fsop_bulk_open(FSBULK_AUTO);
+    FsBulkItem *items = NULL;
+    size_t item_cap = 0;
+    for (size_t next = 0; !atomic_load(&name_index.stop_refresher); ) {
+        pthread_mutex_lock(&name_index.lock);
+        if (next >= name_index.bucket_count || !name_index.live) {
+            pthread_mutex_unlock(&name_index.lock);
+            break;
+        }
+        nsindex_sync_locked();
+        size_t end = next + 256 < name_index.bucket_count ? next + 256 : name_index.bucket_count;
+
+        size_t count = 0;
+        int batched = bulk != NULL;
+        for (size_t b = next; b < end && batched; b++) {
+            for (NameIndexEntry *e = name_index.buckets[b]; e != NULL; e = e->next) {
+                if (count == item_cap) {
+                    size_t cap = item_cap > 0 ? item_cap * 2 : 1024;
+                    FsBulkItem *grown = realloc(items, cap * sizeof(*items));
+                    if (grown == NULL) {
+                        batched = 0;
+                        break;
+                    }
+                    items = grown;
+                    item_cap = cap;
+                }
+                items[count++] = (FsBulkItem){ .op = FSBULK_STAT, .path = e->path };
+            }
+        }
+        if (batched) fsop_bulk_run(bulk, items, count);
+
+        // Apply the results in the same order the entries were queued
+        for (size_t k = 0; next < end; next++) {
+            NameIndexEntry **slot = &name_index.buckets[next];
+            while (*slot != NULL) {
+                NameIndexEntry *e = *slot;
+                struct statx one;
+                const struct statx *stx = batched ? &items[k].stx : &one;
+                int err = batched ? items[k].result
+                                  : (statx(AT_FDCWD, e->path, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &one) == 0 ? 0 : errno);
+                k++;
+                if (err != 0) {
+                    *slot = e->next;
+                    free(e);
+                    name_index.entry_count--;
+                    continue;
+                }
+                e->info.ino = (ino_t)stx->stx_ino;
+                e->info.size = (off_t)stx->stx_size;
+                e->info.mtime_ns = stx->stx_mtime.tv_sec * 1000000000LL + stx->stx_mtime.tv_nsec;
+                e->info.type = IFTODT(stx->stx_mode);
+                e->unverified = 0;
+                slot = &e->next;
+            }
+        }
+        pthread_mutex_unlock(&name_index.lock);
+        sched_yield();
+    }
+    free(items);
+    fsop_bulk_close(bulk);
+    return NULL;
+}
+
+// Build (or load and revalidate) the index for everything under root.
+// Returns 0 or an errno value; on failure callers fall back to walking.
+int nsindex_init(const char *root, const char *snapshot_path) {
+    pthread_mutex_lock(&name_index.lock);
+    snprintf(name_index.root, sizeof(name_index.root), "%s", root);
+    name_index.root_len = strlen(name_index.root);
+    snprintf(name_index.snapshot_path, sizeof(name_index.snapshot_path), "%s", snapshot_path);
+
+    int from_snapshot = nsindex_load_locked() == 0;
+    int err = from_snapshot ? nsindex_revalidate_locked() : nsindex_rebuild();
+    if (err != 0 && from_snapshot) {
+        from_snapshot = 0;
+        err = nsindex_rebuild();
+    }
+    name_index.live = err == 0;
+    if (err != 0) {
+        nsindex_clear();
+        nsindex_drop_watches();
+    } else {
+        nsindex_sync_locked();
+        nsindex_save_locked();
+    }
+    pthread_mutex_unlock(&name_index.lock);
+
+    if (err == 0 && from_snapshot) {
+        atomic_store(&name_index.stop_refresher, 0);
+        name_index.refresher_running = start_service_thread(&name_index.refresher, nsindex_refresher_main);
+    }
+    return err;
+}
+
+// Save the snapshot and release everything
+void nsindex_shutdown(void) {
+    if (name_index.refresher_running) {
+        atomic_store(&name_index.stop_refresher, 1);
+        pthread_join(name_index.refresher, NULL);
+        name_index.refresher_running = 0;
+    }
+    pthread_mutex_lock(&name_index.lock);
+    if (name_index.live) {
+        nsindex_sync_locked();
+        nsindex_save_locked();
+    }
+    name_index.live = 0;
+    nsindex_clear();
+    nsindex_drop_watches();
+    pthread_mutex_unlock(&name_index.lock);
+}
+
+// Stat an entry still unverified since the snapshot was loaded, so lookups
+// never answer with what the file looked like before a restart. Returns 0,
+// or ENOENT after dropping an entry whose file is gone; caller holds the
+// lock.
+static int nsindex_verify_locked(NameIndexEntry **slot) {
+    NameIndexEntry *e = *slot;
+    if (!e->unverified) return 0;
+    struct stat sb;
+    if (lstat(e->path, &sb) != 0) {
+        *slot = e->next;
+        free(e);
+        name_index.entry_count--;
+        return ENOENT;
+    }
+    e->info.ino = sb.st_ino;
+    e->info.size = sb.st_size;
+    e->info.mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    e->info.type = IFTODT(sb.st_mode);
+    e->unverified = 0;
+    return 0;
+}
+
+// Call visit for every indexed entry below prefix (any prefix when NULL).
+// The matching entries are copied under the lock and visited after it is
+// released, so visit may take its time and do I/O; copies of unverified
+// entries are stat'd then too. Returns 0, ENOENT when the index is not
+// live, or ENOMEM.
+int nsindex_for_each(const char *prefix, NameIndexVisitor visit, void *arg) {
+    static const char padding[_Alignof(NameIndexEntry)];
+    pthread_mutex_lock(&name_index.lock);
+    if (!name_index.live) {
+        pthread_mutex_unlock(&name_index.lock);
+        return ENOENT;
+    }
+    nsindex_sync_locked();
+    size_t len = prefix != NULL ? strlen(prefix) : 0;
+    OutBuffer snapshot = { 0 };
+    int err = 0;
+    for (size_t i = 0; i < name_index.bucket_count && err == 0; i++) {
+        for (NameIndexEntry *e = name_index.buckets[i]; e != NULL && err == 0; e = e->next) {
+            if (prefix != NULL && (e->path_len <= len || e->path[len] != '/' || memcmp(e->path, prefix, len) != 0)) continue;
+            // Copies stay aligned for the next one
+            size_t size = offsetof(NameIndexEntry, path) + e->path_len + 1;
+            size_t pad = (sizeof(padding) - size % sizeof(padding)) % sizeof(padding);
+            err = out_append(&snapshot, (const char *)e, size);
+            if (err == 0 && pad > 0) err = out_append(&snapshot, padding, pad);
+        }
+    }
+    pthread_mutex_unlock(&name_index.lock);
+
+    for (size_t off = 0; err == 0 && off < snapshot.len;) {
+        NameIndexEntry *e = (NameIndexEntry *)(snapshot.data + off);
+        struct stat sb;
+        if (!e->unverified) {
+            visit(e, arg);
+        } else if (lstat(e->path, &sb) == 0) {
+            e->info.ino = sb.st_ino;
+            e->info.size = sb.st_size;
+            e->info.mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+            e->info.type = IFTODT(sb.st_mode);
+            visit(e, arg);
+        }
+        size_t size = offsetof(NameIndexEntry, path) + e->path_len + 1;
+        off += size + (sizeof(padding) - size % sizeof(padding)) % sizeof(padding);
+    }
+    out_free(&snapshot);
+    return err;
+}
+
+// Copy the indexed metadata for path into *info. Returns 0, ENOENT when the
+// path is not indexed, or EAGAIN when the index is not live.
+int nsindex_lookup(const char *path, NameIndexInfo *info) {
+    pthread_mutex_lock(&name_index.lock);
+    int err = EAGAIN;
+    if (name_index.live) {
+        nsindex_sync_locked();
+        size_t len = strlen(path);
+        NameIndexEntry **slot = nsindex_slot(path, len, nsindex_hash(path, len));
+        err = *slot != NULL ? nsindex_verify_locked(slot) : ENOENT;
+        if (err == 0) *info = (*slot)->info;
+    }
+    pthread_mutex_unlock(&name_index.lock);
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// Look up many paths under one hold of the lock: known[i] is set, and
+// infos[i] filled in, for every indexed path. Returns 0, or EAGAIN when the
+// index is not live.
+int nsindex_lookup_each(char **paths, size_t count, NameIndexInfo *infos, char *known) {
+    pthread_mutex_lock(&name_index.lock);
+    if (!name_index.live) {
+        pthread_mutex_unlock(&name_index.lock);
+        return EAGAIN;
+    }
+    nsindex_sync_locked();
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(paths[i]);
+        NameIndexEntry **slot = nsindex_slot(paths[i], len, nsindex_hash(paths[i], len));
+        known[i] = *slot != NULL && nsindex_verify_locked(slot) == 0;
+        if (known[i]) infos[i] = (*slot)->info;
+    }
+    pthread_mutex_unlock(&name_index.lock);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Glob matcher
+//
+// A find -name pattern is compiled once into tokens (literal runs, '?',
+// '*' and [...] classes) and then matched against many names without
+// re-parsing. Every token but '*' has a fixed width, so matching needs only
+// a single backtrack point at the most recent star.
+// ---------------------------------------------------------------------------
+
+static void glob_set_bit(uint8_t *set, unsigned char c, int ignore_case) {
+    set[c >> 3] |= (uint8_t)(1u << (c & 7));
+    if (ignore_case) {
+        unsigned char lower = (unsigned char)tolower(c), upper = (unsigned char)toupper(c);
+        set[lower >> 3] |= (uint8_t)(1u << (lower & 7));
+        set[upper >> 3] |= (uint8_t)(1u << (upper & 7));
+    }
+}
+
+// Compile pattern into glob. Returns 0, or EINVAL for an unterminated
+// class or a pattern that is too long.
+int glob_compile(GlobPattern *glob, const char *pattern, int ignore_case) {
+    memset(glob, 0, sizeof(*glob));
+    glob->ignore_case = ignore_case;
+    size_t text_len = 0;
+
+    for (const char *p = pattern; *p != '\0'; ) {
+        if (glob->token_count == GLOB_MAX_TOKENS) return EINVAL;
+        GlobToken *tok = &glob->tokens[glob->token_count];
+
+        if (*p == '*') {
+            // Consecutive stars are the same as one
+            if (glob->token_count == 0 || glob->tokens[glob->token_count - 1].kind != GLOB_STAR) {
+                tok->kind = GLOB_STAR;
+                glob->token_count++;
+            }
+            p++;
+        } else if (*p == '?') {
+            tok->kind = GLOB_ANY;
+            glob->min_len++;
+            glob->token_count++;
+            p++;
+        } else if (*p == '[' && strchr(p + 1, ']') != NULL) {
+            const char *q = p + 1;
+            int negate = *q == '!' || *q == '^';
+            if (negate) q++;
+            uint8_t set[32] = { 0 };
+            // A ']' right after the opening bracket is a member, not the end
+            int first = 1;
+            while (*q != '\0' && (*q != ']' || first)) {
+                unsigned char lo = (unsigned char)*q;
+                if (q[1] == '-' && q[2] != ']' && q[2] != '\0') {
+                    unsigned char hi = (unsigned char)q[2];
+                    for (unsigned c = lo; c <= hi; c++) glob_set_bit(set, (unsigned char)c, ignore_case);
+                    q += 3;
+                } else {
+                    glob_set_bit(set, lo, ignore_case);
+                    q++;
+                }
+                first = 0;
+            }
+            if (*q != ']') return EINVAL;
+            if (negate) {
+                for (int i = 0; i < 32; i++) set[i] = (uint8_t)~set[i];
+            }
+            tok->kind = GLOB_CLASS;
+            memcpy(tok->set, set, sizeof(set));
+            glob->min_len++;
+            glob->token_count++;
+            p = q + 1;
+        } else {
+            // Literal run, with backslash escaping the next character
+            tok->kind = GLOB_LITERAL;
+            tok->offset = text_len;
+            while (*p != '\0' && *p != '*' && *p != '?' && !(*p == '[' && strchr(p + 1, ']') != NULL)) {
+                if (*p == '\\' && p[1] != '\0') p++;
+                if (text_len + 1 >= sizeof(glob->text)) return EINVAL;
+                glob->text[text_len++] = ignore_case ? (char)tolower((unsigned char)*p) : *p;
+                p++;
+            }
+            tok->len = text_len - tok->offset;
+            glob->min_len += tok->len;
+            glob->token_count++;
+        }
+    }
+
+    // The literal prefix lets most names be rejected after one compare
+    if (glob->token_count > 0 && glob->tokens[0].kind == GLOB_LITERAL) glob->prefix_len = glob->tokens[0].len;
+    return 0;
+}
+
+static int glob_token_match(const GlobPattern *glob, const GlobToken *tok, const char *name, size_t remaining) {
+    switch (tok->kind) {
+        case GLOB_ANY:
+            return remaining >= 1;
+        case GLOB_CLASS: {
+            unsigned char c = (unsigned char)name[0];
+            return remaining >= 1 && (tok->set[c >> 3] & (1u << (c & 7)));
+        }
+        case GLOB_LITERAL:
+            if (remaining < tok->len) return 0;
+            if (!glob->ignore_case) return memcmp(name, glob->text + tok->offset, tok->len) == 0;
+            for (size_t i = 0; i < tok->len; i++) {
+                if (tolower((unsigned char)name[i]) != glob->text[tok->offset + i]) return 0;
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static size_t glob_token_width(const GlobToken *tok) {
+    return tok->kind == GLOB_LITERAL ? tok->len : 1;
+}
+
+// Match a complete name against a compiled pattern
+int glob_match(const GlobPattern *glob, const char *name, size_t len) {
+    if (len < glob->min_len) return 0;
+    if (glob->prefix_len > 0 && !glob_token_match(glob, &glob->tokens[0], name, len)) return 0;
+
+    int t = 0, star_t = -1;
+    size_t i = 0, star_i = 0;
+    while (i < len) {
+        if (t < glob->token_count && glob->tokens[t].kind == GLOB_STAR) {
+            star_t = ++t;
+            star_i = i;
+        } else if (t < glob->token_count && glob_token_match(glob, &glob->tokens[t], name + i, len - i)) {
+            i += glob_token_width(&glob->tokens[t]);
+            t++;
+        } else if (star_t >= 0) {
+            // Let the last star absorb one more character and retry
+            t = star_t;
+            i = ++star_i;
+        } else {
+            return 0;
+        }
+    }
+    while (t < glob->token_count && glob->tokens[t].kind == GLOB_STAR) t++;
+    return t == glob->token_count;
+}
+
+// Parse a size predicate such as "+10k", "-2M" or "512"; returns 0 or EINVAL
+static int find_parse_size(const char *text, FindFilter *filter) {
+    char *end;
+    filter->size_op = (*text == '+' || *text == '-') ? *text++ : '=';
+    if (!isdigit((unsigned char)*text)) return EINVAL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno == ERANGE) return EINVAL;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        case 'c': case '\0': break;
+        default: return EINVAL;
+    }
+    if (*end == 'c') end++;
+    if (*end != '\0') return EINVAL;
+    // Sizes are compared as off_t, so the scaled value must stay below 2^63
+    if (value > ((uint64_t)INT64_MAX >> shift)) return EINVAL;
+    filter->size = (long long)(value << shift);
+    filter->has_size = 1;
+    return 0;
+}
+
+// Parse an age predicate in days: "-7" (changed in the last 7 days) or "+30"
+static int find_parse_age(const char *text, FindFilter *filter) {
+    char *end;
+    if (*text != '+' && *text != '-') return EINVAL;
+    filter->mtime_op = *text;
+    long days = strtol(text + 1, &end, 10);
+    if (end == text + 1 || *end != '\0' || days < 0) return EINVAL;
+    filter->mtime_cutoff_ns = ((long long)time(NULL) - (long long)days * 86400LL) * 1000000000LL;
+    filter->has_mtime = 1;
+    return 0;
+}
+
+// Check the size and age predicates of filter
+int find_filter_accepts(const FindFilter *filter, off_t size, long long mtime_ns) {
+    if (filter->has_size) {
+        if (filter->size_op == '+' && !(size > filter->size)) return 0;
+        if (filter->size_op == '-' && !(size < filter->size)) return 0;
+        if (filter->size_op == '=' && size != filter->size) return 0;
+    }
+    if (filter->has_mtime) {
+        if (filter->mtime_op == '-' && mtime_ns < filter->mtime_cutoff_ns) return 0;
+        if (filter->mtime_op == '+' && mtime_ns >= filter->mtime_cutoff_ns) return 0;
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Content search
+//
+// Literal substring search over memory-mapped files. Candidate positions are
+// found 16 or 32 bytes at a time by comparing the first and the last byte of
+// the keyword at once (SSE2, or AVX2 when the CPU has it); only positions
+// where both agree are verified with memcmp.
+// ---------------------------------------------------------------------------
+
+#if defined(__x86_64__)
+static const char *memsearch_sse2(const char *hay, size_t n, const char *needle, size_t k) {
+    if (k == 1) return memchr(hay, needle[0], n);
+    if (k == 0 || k > n) return k == 0 ? hay : NULL;
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+    size_t i = 0;
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + k - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                                  _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, k - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return memmem(hay + i, n - i, needle, k);
+}
+
+__attribute__((target("avx2")))
+static const char *memsearch_avx2(const char *hay, size_t n, const char *needle, size_t k) {
+    if (k == 1) return memchr(hay, needle[0], n);
+    if (k == 0 || k > n) return k == 0 ? hay : NULL;
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+    size_t i = 0;
+    for (; i + k - 1 + 32 <= n; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(hay + i + k - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                                        _mm256_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, k - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return memsearch_sse2(hay + i, n - i, needle, k);
+}
+#else
+static const char *memsearch_scalar(const char *hay, size_t n, const char *needle, size_t k) {
+    return memmem(hay, n, needle, k);
+}
+#endif
+
+// Pick the widest search routine this CPU supports
+static MemSearchFn memsearch_select(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return memsearch_avx2;
+    return memsearch_sse2;
+#else
+    return memsearch_scalar;
+#endif
+}
+
+// Append "path:line:text" to out for every line of data that contains the
+// needle; line_no is the number of the first line of data
+static void content_search_lines(const char *path, const char *data, size_t n, size_t line_no, const char *needle,
+                                 size_t k, MemSearchFn search, OutBuffer *out) {
+    size_t path_len = strlen(path);
+    const char *counted = data;  // Newlines before this point are in line_no
+    const char *end = data + n;
+
+    for (const char *pos = data; pos < end; ) {
+        const char *hit = k == 0 ? pos : search(pos, (size_t)(end - pos), needle, k);
+        if (hit == NULL) break;
+
+        const char *line_start = memrchr(pos, '\n', (size_t)(hit - pos));
+        line_start = line_start != NULL ? line_start + 1 : pos;
+        const char *line_end = memchr(hit, '\n', (size_t)(end - hit));
+        if (line_end == NULL) line_end = end;
+
+        for (const char *nl; (nl = memchr(counted, '\n', (size_t)(line_start - counted))) != NULL; counted = nl + 1) {
+            line_no++;
+        }
+        counted = line_start;
+
+        char number[32];
+        int number_len = snprintf(number, sizeof(number), ":%zu:", line_no);
+        out_append(out, path, path_len);
+        out_append(out, number, (size_t)number_len);
+        out_append(out, line_start, (size_t)(line_end - line_start));
+        out_append(out, "\n", 1);
+
+        // One report per line; continue on the next one
+        pos = line_end + 1;
+    }
+}
+
+// Search one file and append "path:line:text" for every matching line to
+// out (or a single "Binary file ... matches" line, as grep does)
+int content_search_file(const char *path, const char *needle, size_t k, MemSearchFn search, OutBuffer *out) {
+    int fd = confine_open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+    if (fd < 0 && errno == ENOENT) fd = pack_open_member(path, NULL);
+    if (fd < 0) return errno;
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t n = (size_t)sb.st_size;
+    int mapped = 1;
+    char *data = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        // Fall back to reading the file in large chunks
+        mapped = 0;
+        data = malloc(n);
+        size_t got = 0;
+        while (data != NULL && got < n) {
+            ssize_t r = read(fd, data + got, n - got < (1 << 20) ? n - got : (1 << 20));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got += (size_t)r;
+        }
+        if (data == NULL || got == 0) {
+            free(data);
+            close(fd);
+            return data == NULL ? ENOMEM : 0;
+        }
+        n = got;
+    } else {
+        madvise(data, n, MADV_SEQUENTIAL);
+    }
+    if (segment_detect(data, n)) {
+        // A sealed shipment log: only blocks that may hold the needle are read
+        if (mapped) munmap(data, n);
+        else free(data);
+        int err = segment_search(fd, path, needle, k, search, out);
+        close(fd);
+        return err;
+    }
+    close(fd);
+
+    // Like grep, a NUL byte near the start marks the file as binary
+    if (memchr(data, '\0', n < 32768 ? n : 32768) != NULL) {
+        if (k == 0 || search(data, n, needle, k) != NULL) {
+            char line[PATH_MAX + 32];
+            int len = snprintf(line, sizeof(line), "Binary file %s matches\n", path);
+            out_append(out, line, (size_t)len);
+        }
+    } else {
+        content_search_lines(path, data, n, 1, needle, k, search, out);
+    }
+
+    if (mapped) munmap(data, n);
+    else free(data);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Trigram index
+//
+// Optional inverted index from every 3-byte sequence to the files containing
+// it, kept in .logistics_trigrams next to the logistics tree. search_content
+// intersects the posting lists of the keyword's trigrams to find candidate
+// files. A file whose inode, size or mtime no longer match its record is
+// always scanned, and re-indexed in the same pass. Re-indexing gives the file
+// a new id and marks the old one dead. Files indexed by a search are appended
+// to .logistics_trigrams.log, which is replayed after the snapshot on load;
+// once the log outgrows TRIGRAM_LOG_SHARE of the snapshot, a checkpoint drops
+// vanished files and dead ids and writes a new snapshot. Set
+// LOGISTICS_NO_TRIGRAMS to disable the index.
+// ---------------------------------------------------------------------------
+
+typedef struct TrigramFile {
+    char *path;
+    ino_t ino;
+    off_t size;
+    long long mtime_ns;
+    int dead;
+} TrigramFile;
+
+typedef struct TrigramPosting {
+    uint32_t key;          // Three bytes; TRIGRAM_EMPTY_KEY marks a free slot
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *ids;         // Ascending file ids
+} TrigramPosting;
+
+typedef struct TrigramIndex {
+    pthread_mutex_t lock;
+    int enabled;
+    int loaded;
+    char path[PATH_MAX];
+    char log_path[PATH_MAX + 8];
+    long snapshot_size, log_size;
+    TrigramFile *files;
+    uint32_t file_count, file_cap, dead_count;
+    uint32_t *path_slots;  // Open addressing: file id + 1, or 0 when free
+    size_t path_slot_count;
+    TrigramPosting *postings;
+    size_t posting_slots, posting_count;
+} TrigramIndex;
+
+static TrigramIndex trigram_index = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define TRIGRAM_EMPTY_KEY 0xFFFFFFFFu
+#define TRIGRAM_SNAPSHOT_MAGIC "LSTRI001"
+#define TRIGRAM_LOG_SHARE 4            // Checkpoint once the log is a quarter of the snapshot
+#define TRIGRAM_LOG_MIN (1L << 20)     // ... and at least this large
+#define TRIGRAM_BITMAP_WORDS ((1u << 24) / 64)
+
+static uint32_t trigram_key(const unsigned char *p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static size_t trigram_slot_hash(uint32_t key) {
+    return (size_t)(key * 2654435761u);
+}
+
+static TrigramPosting *trigram_posting(uint32_t key, int create) {
+    TrigramIndex *ti = &trigram_index;
+    if (create && (ti->posting_count + 1) * 10 >= ti->posting_slots * 7) {
+        size_t slots = ti->posting_slots ? ti->posting_slots * 2 : 4096;
+        TrigramPosting *grown = malloc(slots * sizeof(TrigramPosting));
+        if (grown == NULL) return NULL;
+        for (size_t i = 0; i < slots; i++) grown[i].key = TRIGRAM_EMPTY_KEY;
+        for (size_t i = 0; i < ti->posting_slots; i++) {
+            if (ti->postings[i].key == TRIGRAM_EMPTY_KEY) continue;
+            size_t j = trigram_slot_hash(ti->postings[i].key) & (slots - 1);
+            while (grown[j].key != TRIGRAM_EMPTY_KEY) j = (j + 1) & (slots - 1);
+            grown[j] = ti->postings[i];
+        }
+        free(ti->postings);
+        ti->postings = grown;
+        ti->posting_slots = slots;
+    }
+    if (ti->posting_slots == 0) return NULL;
+
+    size_t j = trigram_slot_hash(key) & (ti->posting_slots - 1);
+    while (ti->postings[j].key != TRIGRAM_EMPTY_KEY) {
+        if (ti->postings[j].key == key) return &ti->postings[j];
+        j = (j + 1) & (ti->posting_slots - 1);
+    }
+    if (!create) return NULL;
+    ti->postings[j].key = key;
+    ti->postings[j].count = ti->postings[j].cap = 0;
+    ti->postings[j].ids = NULL;
+    ti->posting_count++;
+    return &ti->postings[j];
+}
+
+static int trigram_posting_add(uint32_t key, uint32_t id) {
+    TrigramPosting *p = trigram_posting(key, 1);
+    if (p == NULL) return ENOMEM;
+    if (p->count == p->cap) {
+        uint32_t cap = p->cap ? p->cap * 2 : 4;
+        uint32_t *ids = realloc(p->ids, cap * sizeof(uint32_t));
+        if (ids == NULL) return ENOMEM;
+        p->ids = ids;
+        p->cap = cap;
+    }
+    p->ids[p->count++] = id;
+    return 0;
+}
+
+// Find the slot holding path, or the free slot where it would go
+static uint32_t *trigram_path_slot(const char *path) {
+    TrigramIndex *ti = &trigram_index;
+    size_t j = (size_t)nsindex_hash(path, strlen(path)) & (ti->path_slot_count - 1);
+    while (ti->path_slots[j] != 0 && strcmp(ti->files[ti->path_slots[j] - 1].path, path) != 0) {
+        j = (j + 1) & (ti->path_slot_count - 1);
+    }
+    return &ti->path_slots[j];
+}
+
+static int trigram_rehash_paths(size_t slots) {
+    TrigramIndex *ti = &trigram_index;
+    uint32_t *table = calloc(slots, sizeof(uint32_t));
+    if (table == NULL) return ENOMEM;
+    free(ti->path_slots);
+    ti->path_slots = table;
+    ti->path_slot_count = slots;
+    for (uint32_t id = 0; id < ti->file_count; id++) {
+        if (!ti->files[id].dead) *trigram_path_slot(ti->files[id].path) = id + 1;
+    }
+    return 0;
+}
+
+// Register a new version of path and return its id through *id
+static int trigram_add_file(const char *path, const NameIndexInfo *info, uint32_t *id) {
+    TrigramIndex *ti = &trigram_index;
+    if (ti->file_count == ti->file_cap) {
+        uint32_t cap = ti->file_cap ? ti->file_cap * 2 : 1024;
+        TrigramFile *files = realloc(ti->files, cap * sizeof(TrigramFile));
+        if (files == NULL) return ENOMEM;
+        ti->files = files;
+        ti->file_cap = cap;
+    }
+    if ((size_t)(ti->file_count + 1) * 2 >= ti->path_slot_count &&
+        trigram_rehash_paths(ti->path_slot_count ? ti->path_slot_count * 2 : 2048) != 0) {
+        return ENOMEM;
+    }
+
+    uint32_t *slot = trigram_path_slot(path);
+    if (*slot != 0) {
+        ti->files[*slot - 1].dead = 1;
+        ti->dead_count++;
+    }
+    TrigramFile *f = &ti->files[ti->file_count];
+    f->path = strdup(path);
+    if (f->path == NULL) return ENOMEM;
+    f->ino = info->ino;
+    f->size = info->size;
+    f->mtime_ns = info->mtime_ns;
+    f->dead = 0;
+    *id = ti->file_count++;
+    *slot = *id + 1;
+    return 0;
+}
+
+static void trigram_clear(void) {
+    TrigramIndex *ti = &trigram_index;
+    for (uint32_t i = 0; i < ti->file_count; i++) free(ti->files[i].path);
+    for (size_t i = 0; i < ti->posting_slots; i++) {
+        if (ti->postings[i].key != TRIGRAM_EMPTY_KEY) free(ti->postings[i].ids);
+    }
+    free(ti->files);
+    free(ti->path_slots);
+    free(ti->postings);
+    ti->files = NULL;
+    ti->path_slots = NULL;
+    ti->postings = NULL;
+    ti->file_count = ti->file_cap = ti->dead_count = 0;
+    ti->path_slot_count = ti->posting_slots = ti->posting_count = 0;
+}
+
+static void trigram_put_varint(FILE *fp, uint32_t v) {
+    while (v >= 0x80) {
+        fputc((int)(v & 0x7F) | 0x80, fp);
+        v >>= 7;
+    }
+    fputc((int)v, fp);
+}
+
+static int trigram_get_varint(FILE *fp, uint32_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = fgetc(fp);
+        if (c == EOF) return EINVAL;
+        *v |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return EINVAL;
+}
+
+// Drop dead file versions, renumbering the live ones; caller holds the lock
+static int trigram_compact(void) {
+    TrigramIndex *ti = &trigram_index;
+    uint32_t *remap = malloc((ti->file_count + 1) * sizeof(uint32_t));
+    if (remap == NULL) return ENOMEM;
+    uint32_t live = 0;
+    for (uint32_t id = 0; id < ti->file_count; id++) {
+        if (ti->files[id].dead) {
+            free(ti->files[id].path);
+            remap[id] = UINT32_MAX;
+        } else {
+            ti->files[live] = ti->files[id];
+            remap[id] = live++;
+        }
+    }
+    ti->file_count = live;
+    ti->dead_count = 0;
+
+    for (size_t i = 0; i < ti->posting_slots; i++) {
+        TrigramPosting *p = &ti->postings[i];
+        if (p->key == TRIGRAM_EMPTY_KEY) continue;
+        uint32_t kept = 0;
+        for (uint32_t j = 0; j < p->count; j++) {
+            if (remap[p->ids[j]] != UINT32_MAX) p->ids[kept++] = remap[p->ids[j]];
+        }
+        p->count = kept;
+    }
+    free(remap);
+    return trigram_rehash_paths(ti->path_slot_count ? ti->path_slot_count : 2048);
+}
+
+// Write the index to disk (temporary file + rename); caller holds the lock
+static int trigram_save_locked(void) {
+    TrigramIndex *ti = &trigram_index;
+    if (ti->dead_count > 0) {
+        int err = trigram_compact();
+        if (err != 0) return err;
+    }
+
+    char tmp_path[PATH_MAX + 8];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%.*s.tmp", PATH_MAX - 1, ti->path) >= (int)sizeof(tmp_path)) return ENAMETOOLONG;
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) return errno;
+
+    fwrite(TRIGRAM_SNAPSHOT_MAGIC, 1, 8, fp);
+    fwrite(&ti->file_count, sizeof(uint32_t), 1, fp);
+    for (uint32_t id = 0; id < ti->file_count; id++) {
+        TrigramFile *f = &ti->files[id];
+        uint64_t ino = f->ino;
+        int64_t size = f->size, mtime = f->mtime_ns;
+        uint16_t len = (uint16_t)strlen(f->path);
+        fwrite(&ino, sizeof(ino), 1, fp);
+        fwrite(&size, sizeof(size), 1, fp);
+        fwrite(&mtime, sizeof(mtime), 1, fp);
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(f->path, 1, len, fp);
+    }
+    uint64_t postings = 0;
+    for (size_t i = 0; i < ti->posting_slots; i++) {
+        if (ti->postings[i].key != TRIGRAM_EMPTY_KEY && ti->postings[i].count > 0) postings++;
+    }
+    fwrite(&postings, sizeof(postings), 1, fp);
+    for (size_t i = 0; i < ti->posting_slots; i++) {
+        TrigramPosting *p = &ti->postings[i];
+        if (p->key == TRIGRAM_EMPTY_KEY || p->count == 0) continue;
+        // Ids are ascending, so gaps are small and encode in a byte or two
+        fwrite(&p->key, sizeof(p->key), 1, fp);
+        trigram_put_varint(fp, p->count);
+        for (uint32_t j = 0, prev = 0; j < p->count; prev = p->ids[j++]) trigram_put_varint(fp, p->ids[j] - prev);
+    }
+
+    int err = ferror(fp) ? EIO : 0;
+    long size = ftell(fp);
+    if (fclose(fp) != 0 && err == 0) err = errno;
+    if (err == 0 && rename(tmp_path, ti->path) != 0) err = errno;
+    if (err != 0) {
+        unlink(tmp_path);
+        return err;
+    }
+    // Replaying a log the snapshot already holds is harmless, so this order
+    // is safe
+    ti->snapshot_size = size;
+    if (truncate(ti->log_path, 0) != 0 && errno != ENOENT) return errno;
+    ti->log_size = 0;
+    return 0;
+}
+
+// One file and its trigrams, as written to the log: inode, size and mtime,
+// the path, the number of trigrams, then each trigram
+static void trigram_put_file(FILE *fp, const char *path, const TrigramSet *set) {
+    uint64_t ino = set->info.ino;
+    int64_t size = set->info.size, mtime = set->info.mtime_ns;
+    uint16_t len = (uint16_t)strlen(path);
+    fwrite(&ino, sizeof(ino), 1, fp);
+    fwrite(&size, sizeof(size), 1, fp);
+    fwrite(&mtime, sizeof(mtime), 1, fp);
+    fwrite(&len, sizeof(len), 1, fp);
+    fwrite(path, 1, len, fp);
+    trigram_put_varint(fp, (uint32_t)set->count);
+    for (size_t i = 0; i < set->count; i++) trigram_put_varint(fp, set->keys[i]);
+}
+
+// Apply the log after the snapshot. A record cut short by a crash ends the
+// replay, and the log is cut back to the last whole record.
+static int trigram_replay_locked(void) {
+    TrigramIndex *ti = &trigram_index;
+    FILE *fp = fopen(ti->log_path, "rb");
+    if (fp == NULL) return errno == ENOENT ? 0 : errno;
+    long good = 0;
+    int err = 0;
+    char path[PATH_MAX];
+    while (err == 0) {
+        uint64_t ino;
+        int64_t size, mtime;
+        uint16_t len;
+        uint32_t n, key, id;
+        if (fread(&ino, sizeof(ino), 1, fp) != 1) break;
+        if (fread(&size, sizeof(size), 1, fp) != 1 || fread(&mtime, sizeof(mtime), 1, fp) != 1 ||
+            fread(&len, sizeof(len), 1, fp) != 1 || len >= sizeof(path) || fread(path, 1, len, fp) != len ||
+            trigram_get_varint(fp, &n) != 0) {
+            break;
+        }
+        path[len] = '\0';
+        uint32_t *keys = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+        if (keys == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        uint32_t got = 0;
+        while (got < n && trigram_get_varint(fp, &key) == 0 && key < (1u << 24)) keys[got++] = key;
+        if (got == n) {
+            NameIndexInfo info = { .ino = (ino_t)ino, .size = (off_t)size, .mtime_ns = mtime };
+            err = trigram_add_file(path, &info, &id);
+            for (uint32_t j = 0; j < n && err == 0; j++) err = trigram_posting_add(keys[j], id);
+            good = ftell(fp);
+        }
+        free(keys);
+        if (got != n) break;
+    }
+    fclose(fp);
+    if (err == 0 && truncate(ti->log_path, good) != 0) err = errno;
+    ti->log_size = good;
+    return err;
+}
+
+// Load the index from disk, or start empty; caller holds the lock
+static void trigram_load_locked(void) {
+    TrigramIndex *ti = &trigram_index;
+    ti->loaded = 1;
+    FILE *fp = fopen(ti->path, "rb");
+    if (fp == NULL) {
+        // The log alone is worth keeping
+        if (trigram_replay_locked() != 0) trigram_clear();
+        return;
+    }
+
+    char magic[8];
+    uint32_t count;
+    int err = 0;
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, TRIGRAM_SNAPSHOT_MAGIC, 8) != 0 ||
+        fread(&count, sizeof(count), 1, fp) != 1) {
+        err = EINVAL;
+    }
+    char path[PATH_MAX];
+    for (uint32_t i = 0; err == 0 && i < count; i++) {
+        uint64_t ino;
+        int64_t size, mtime;
+        uint16_t len;
+        if (fread(&ino, sizeof(ino), 1, fp) != 1 || fread(&size, sizeof(size), 1, fp) != 1 ||
+            fread(&mtime, sizeof(mtime), 1, fp) != 1 || fread(&len, sizeof(len), 1, fp) != 1 ||
+            len >= sizeof(path) || fread(path, 1, len, fp) != len) {
+            err = EINVAL;
+            break;
+        }
+        path[len] = '\0';
+        NameIndexInfo info = { .ino = (ino_t)ino, .size = (off_t)size, .mtime_ns = mtime };
+        uint32_t id;
+        err = trigram_add_file(path, &info, &id);
+    }
+    uint64_t postings = 0;
+    if (err == 0 && fread(&postings, sizeof(postings), 1, fp) != 1) err = EINVAL;
+    for (uint64_t i = 0; err == 0 && i < postings; i++) {
+        uint32_t key, n, id = 0, delta;
+        if (fread(&key, sizeof(key), 1, fp) != 1 || trigram_get_varint(fp, &n) != 0) {
+            err = EINVAL;
+            break;
+        }
+        for (uint32_t j = 0; err == 0 && j < n; j++) {
+            err = trigram_get_varint(fp, &delta);
+            id += delta;
+            if (err == 0 && id >= ti->file_count) err = EINVAL;
+            if (err == 0) err = trigram_posting_add(key, id);
+        }
+    }
+    ti->snapshot_size = err == 0 ? ftell(fp) : 0;
+    fclose(fp);
+    if (err == 0) err = trigram_replay_locked();
+    if (err != 0) {
+        // A damaged index only costs a rebuild
+        fprintf(stderr, "Ignoring unreadable trigram index %s.\n", ti->path);
+        trigram_clear();
+        unlink(ti->log_path);
+        ti->log_size = 0;
+    }
+}
+
+// Enable the trigram index stored at path
+void trigram_index_open(const char *path) {
+    pthread_mutex_lock(&trigram_index.lock);
+    snprintf(trigram_index.path, sizeof(trigram_index.path), "%s", path);
+    snprintf(trigram_index.log_path, sizeof(trigram_index.log_path), "%s.log", path);
+    trigram_index.enabled = getenv("LOGISTICS_NO_TRIGRAMS") == NULL;
+    pthread_mutex_unlock(&trigram_index.lock);
+}
+
+// Current metadata for path, from the namespace index when possible
+static int trigram_current_info(const char *path, NameIndexInfo *info) {
+    if (nsindex_lookup(path, info) == 0) return 0;
+    struct stat sb;
+    int err = lstat(path, &sb) == 0 ? 0 : errno;
+    if (err == ENOENT) err = pack_stat(path, &sb);
+    if (err != 0) return err;
+    info->ino = sb.st_ino;
+    info->size = sb.st_size;
+    info->mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    info->type = IFTODT(sb.st_mode);
+    return 0;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Decide which files a search for needle must read. scan[i] is set for
+// candidates, and reindex[i] additionally for files whose record is missing
+// or stale. Returns 0 if the index was used, or ENOENT when it is disabled
+// or the keyword is shorter than a trigram (every file must be scanned).
+int trigram_index_select(char **files, size_t count, const char *needle, size_t k, char *scan, char *reindex) {
+    TrigramIndex *ti = &trigram_index;
+    pthread_mutex_lock(&ti->lock);
+    if (!ti->enabled || k < 3) {
+        pthread_mutex_unlock(&ti->lock);
+        return ENOENT;
+    }
+    if (!ti->loaded) trigram_load_locked();
+
+    // Distinct trigrams of the keyword, rarest posting list first
+    size_t gram_count = 0;
+    uint32_t *grams = malloc((k - 2) * sizeof(uint32_t));
+    TrigramPosting **lists = malloc((k - 2) * sizeof(TrigramPosting *));
+    if (grams == NULL || lists == NULL) {
+        free(grams);
+        free(lists);
+        pthread_mutex_unlock(&ti->lock);
+        return ENOMEM;
+    }
+    for (size_t i = 0; i + 2 < k; i++) grams[gram_count++] = trigram_key((const unsigned char *)needle + i);
+    qsort(grams, gram_count, sizeof(uint32_t), compare_u32);
+    size_t distinct = 0;
+    for (size_t i = 0; i < gram_count; i++) {
+        if (distinct == 0 || grams[distinct - 1] != grams[i]) grams[distinct++] = grams[i];
+    }
+
+    // Candidate ids: the intersection of all posting lists
+    char *hit = calloc(ti->file_count + 1, 1);
+    int missing = 0;
+    for (size_t i = 0; i < distinct; i++) {
+        lists[i] = trigram_posting(grams[i], 0);
+        if (lists[i] == NULL || lists[i]->count == 0) missing = 1;
+    }
+    if (hit != NULL && !missing && distinct > 0) {
+        size_t rarest = 0;
+        for (size_t i = 1; i < distinct; i++) {
+            if (lists[i]->count < lists[rarest]->count) rarest = i;
+        }
+        for (uint32_t j = 0; j < lists[rarest]->count; j++) hit[lists[rarest]->ids[j]] = 1;
+        for (size_t i = 0; i < distinct; i++) {
+            if (i == rarest) continue;
+            char *next = calloc(ti->file_count + 1, 1);
+            if (next == NULL) break;
+            for (uint32_t j = 0; j < lists[i]->count; j++) {
+                if (hit[lists[i]->ids[j]]) next[lists[i]->ids[j]] = 1;
+            }
+            free(hit);
+            hit = next;
+        }
+    }
+
+    // A file that is not a candidate may have gained the keyword since it
+    // was indexed, so every recorded file is checked; the namespace index
+    // answers for all of them in one pass, and only files it does not cover
+    // (every file while it is down) cost a stat
+    NameIndexInfo *infos = malloc((count > 0 ? count : 1) * sizeof(NameIndexInfo));
+    char *known = calloc(count > 0 ? count : 1, 1);
+    if (infos != NULL && known != NULL) nsindex_lookup_each(files, count, infos, known);
+    for (size_t i = 0; i < count; i++) {
+        NameIndexInfo info;
+        uint32_t slot = ti->path_slot_count ? *trigram_path_slot(files[i]) : 0;
+        TrigramFile *f = slot ? &ti->files[slot - 1] : NULL;
+        int current = ENOENT;
+        if (f != NULL && known != NULL && known[i]) {
+            info = infos[i];
+            current = 0;
+        } else if (f != NULL) {
+            current = trigram_current_info(files[i], &info);
+        }
+        if (current != 0 || f->ino != info.ino || f->size != info.size || f->mtime_ns != info.mtime_ns) {
+            scan[i] = reindex[i] = 1;  // Unknown or changed since it was indexed
+        } else {
+            scan[i] = hit != NULL ? hit[slot - 1] : 1;
+            reindex[i] = 0;
+        }
+    }
+
+    free(infos);
+    free(known);
+    free(hit);
+    free(grams);
+    free(lists);
+    pthread_mutex_unlock(&ti->lock);
+    return 0;
+}
+
+typedef struct TrigramScan {
+    uint64_t *bitmap;
+    TrigramSet *set;
+} TrigramScan;
+
+// Add the trigrams of data not yet in the scan's bitmap to its set
+static int trigram_scan_block(const char *data, size_t n, void *arg) {
+    TrigramScan *scan = arg;
+    TrigramSet *set = scan->set;
+    for (size_t i = 0; i + 2 < n; i++) {
+        uint32_t key = trigram_key((const unsigned char *)data + i);
+        uint64_t bit = 1ULL << (key & 63);
+        if (scan->bitmap[key >> 6] & bit) continue;
+        scan->bitmap[key >> 6] |= bit;
+        if (set->count == set->cap) {
+            size_t cap = set->cap ? set->cap * 2 : 1024;
+            uint32_t *keys = realloc(set->keys, cap * sizeof(uint32_t));
+            if (keys == NULL) return ENOMEM;
+            set->keys = keys;
+            set->cap = cap;
+        }
+        set->keys[set->count++] = key;
+    }
+    return 0;
+}
+
+// Compute the distinct trigrams of one file. bitmap is a per-thread scratch
+// area of TRIGRAM_BITMAP_WORDS words that is returned all zero.
+int trigram_scan_file(const char *path, uint64_t *bitmap, TrigramSet *set) {
+    memset(set, 0, sizeof(*set));
+    NameIndexInfo member = { 0 };
+    int fd = confine_open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+    if (fd < 0 && errno == ENOENT) fd = pack_open_member(path, &member);
+    if (fd < 0) return errno;
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    set->info.ino = sb.st_ino;
+    set->info.size = sb.st_size;
+    set->info.mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    set->info.type = IFTODT(sb.st_mode);
+    if (member.type == DT_REG) set->info = member;  // Recorded as pack_stat reports it
+    if (!S_ISREG(sb.st_mode) || sb.st_size < 3) {
+        // Nothing to index, but the file is known not to match
+        close(fd);
+        set->valid = 1;
+        return 0;
+    }
+
+    size_t n = (size_t)sb.st_size;
+    const unsigned char *data = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    int err;
+    TrigramScan scan = { bitmap, set };
+    if (segment_detect(data, n)) {
+        // Index what a sealed shipment log holds, not its compressed bytes
+        munmap((void *)data, n);
+        err = segment_scan(fd, trigram_scan_block, &scan);
+    } else {
+        err = trigram_scan_block((const char *)data, n, &scan);
+        munmap((void *)data, n);
+    }
+    close(fd);
+
+    for (size_t i = 0; i < set->count; i++) bitmap[set->keys[i] >> 6] = 0;
+    if (err != 0) {
+        free(set->keys);
+        memset(set, 0, sizeof(*set));
+    }
+    set->valid = err == 0;
+    return err;
+}
+
+// Forget files that no longer exist and write a new snapshot; caller holds
+// the lock
+static int trigram_checkpoint_locked(void) {
+    TrigramIndex *ti = &trigram_index;
+    for (uint32_t id = 0; id < ti->file_count; id++) {
+        NameIndexInfo info;
+        if (!ti->files[id].dead && trigram_current_info(ti->files[id].path, &info) == ENOENT) {
+            ti->files[id].dead = 1;
+            ti->dead_count++;
+        }
+    }
+    return trigram_save_locked();
+}
+
+// Record freshly scanned trigram sets, appending them to the log, and
+// checkpoint once the log has grown large
+void trigram_index_update(char **files, size_t count, TrigramSet *sets) {
+    TrigramIndex *ti = &trigram_index;
+    pthread_mutex_lock(&ti->lock);
+    FILE *log = NULL;
+    int err = 0;
+    for (size_t i = 0; i < count && err == 0; i++) {
+        if (!sets[i].valid) continue;
+        uint32_t id;
+        err = trigram_add_file(files[i], &sets[i].info, &id);
+        for (size_t j = 0; j < sets[i].count && err == 0; j++) err = trigram_posting_add(sets[i].keys[j], id);
+        if (err == 0 && log == NULL && (log = fopen(ti->log_path, "ab")) == NULL) err = errno;
+        if (err == 0) trigram_put_file(log, files[i], &sets[i]);
+    }
+    if (log != NULL) {
+        if (ferror(log) && err == 0) err = EIO;
+        ti->log_size = ftell(log);
+        if (fclose(log) != 0 && err == 0) err = errno;
+    }
+    if (err != 0) {
+        fprintf(stderr, "Trigram index update failed: %s\n", strerror(err));
+    } else if (ti->log_size > TRIGRAM_LOG_MIN && ti->log_size > ti->snapshot_size / TRIGRAM_LOG_SHARE) {
+        err = trigram_checkpoint_locked();
+        if (err != 0) fprintf(stderr, "Cannot save trigram index: %s\n", strerror(err));
+    }
+    pthread_mutex_unlock(&ti->lock);
+}
+
+// Shared state of one search_content run
+typedef struct SearchState {
+    char **files;
+    size_t file_count;
+    const char *needle;
+    size_t needle_len;
+    MemSearchFn search;
+    OutBuffer *results;    // One per file
+    char *scan;            // Candidate files (all of them without the trigram index)
+    char *reindex;         // Files whose trigrams must be recomputed
+    TrigramSet *trigrams;
+    uint64_t *bitmaps[WALK_MAX_WORKERS];  // Per-worker trigram scratch space
+    char *done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} SearchState;
+
+static void search_content_task(int worker, size_t index, void *arg) {
+    SearchState *state = arg;
+    if (state->scan[index]) {
+        int err = content_search_file(state->files[index], state->needle, state->needle_len, state->search, &state->results[index]);
+        if (err != 0) {
+            fprintf(stderr, "Cannot search %s: %s\n", state->files[index], strerror(err));
+        }
+    }
+    if (state->reindex[index]) {
+        // The file was just read, so this second pass comes from the page cache
+        if (state->bitmaps[worker] == NULL) state->bitmaps[worker] = calloc(TRIGRAM_BITMAP_WORDS, sizeof(uint64_t));
+        if (state->bitmaps[worker] != NULL) trigram_scan_file(state->files[index], state->bitmaps[worker], &state->trigrams[index]);
+    }
+    pthread_mutex_lock(&state->lock);
+    state->done[index] = 1;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+// ---------------------------------------------------------------------------
+// View engine
+//
+// Native cat/head/tail. Whole files and tails go to the output descriptor
+// with sendfile (or splice into a pipe), so the data never passes through
+// user space. head stops reading at the N-th newline, and tail finds its
+// starting point by scanning fixed-size blocks backwards from EOF, so its
+// cost depends on N, not on the size of the file.
+// ---------------------------------------------------------------------------
+
+// Send bytes [offset, end) of in_fd to out_fd
+static int view_send_range(int in_fd, int out_fd, off_t offset, off_t end) {
+    int use_sendfile = 1, use_splice = 1;
+    while (offset < end) {
+        size_t chunk = (size_t)(end - offset) < (1u << 30) ? (size_t)(end - offset) : (1u << 30);
+        ssize_t n = -1;
+        if (use_sendfile) {
+            n = sendfile(out_fd, in_fd, &offset, chunk);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) use_sendfile = 0;
+        }
+        if (!use_sendfile && use_splice) {
+            loff_t in_off = offset;
+            n = splice(in_fd, &in_off, out_fd, NULL, chunk, SPLICE_F_MORE);
+            if (n > 0) offset = in_off;
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) use_splice = 0;
+        }
+        if (!use_sendfile && !use_splice) {
+            // Terminals and other targets that accept neither
+            char buffer[65536];
+            n = pread(in_fd, buffer, chunk < sizeof(buffer) ? chunk : sizeof(buffer), offset);
+            if (n > 0) {
+                int err = fsop_write_all(out_fd, buffer, (size_t)n);
+                if (err != 0) return err;
+                offset += n;
+            }
+        }
+        if (n == 0) break;  // File shrank underneath us
+        if (n < 0 && errno != EINTR && errno != EINVAL && errno != ENOSYS) return errno;
+    }
+    return 0;
+}
+
+// Write bytes [start, end) of the file
+int view_range(int in_fd, int out_fd, off_t start, off_t end) {
+    return view_send_range(in_fd, out_fd, start, end);
+}
+
+// Write the whole file (cat)
+int view_whole(int in_fd, int out_fd) {
+    struct stat sb;
+    if (fstat(in_fd, &sb) != 0) return errno;
+    return view_send_range(in_fd, out_fd, 0, sb.st_size);
+}
+
+// Write the first `lines` lines (head -n)
+int view_head(int in_fd, int out_fd, long lines) {
+    char buffer[VIEW_BLOCK_SIZE];
+    ssize_t n;
+    while (lines > 0 && (n = read(in_fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        size_t len = (size_t)n;
+        for (const char *p = buffer; (p = memchr(p, '\n', (size_t)(buffer + n - p))) != NULL; p++) {
+            if (--lines == 0) {
+                len = (size_t)(p - buffer) + 1;
+                break;
+            }
+        }
+        int err = fsop_write_all(out_fd, buffer, len);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+// Write the last `lines` lines (tail -n)
+int view_tail(int in_fd, int out_fd, long lines) {
+    struct stat sb;
+    if (fstat(in_fd, &sb) != 0) return errno;
+    off_t size = sb.st_size;
+    if (size == 0) return 0;
+
+    // A newline at EOF ends the last line; it does not start a new one
+    char last;
+    ssize_t got;
+    do {
+        got = pread(in_fd, &last, 1, size - 1);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) return errno;
+    if (got == 0) return 0;  // Truncated since the fstat: nothing left to show
+    off_t scan_end = last == '\n' ? size - 1 : size;
+
+    off_t start = 0;
+    char buffer[VIEW_BLOCK_SIZE];
+    for (off_t block_end = scan_end; block_end > 0 && lines > 0; ) {
+        off_t block_start = block_end > (off_t)sizeof(buffer) ? block_end - (off_t)sizeof(buffer) : 0;
+        ssize_t n = pread(in_fd, buffer, (size_t)(block_end - block_start), block_start);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (n == 0) break;
+        for (const char *p = buffer + n; (p = memrchr(buffer, '\n', (size_t)(p - buffer))) != NULL; ) {
+            if (--lines == 0) {
+                start = block_start + (p - buffer) + 1;
+                break;
+            }
+        }
+        block_end = block_start;
+    }
+    return view_send_range(in_fd, out_fd, start, size);
+}
+
+// ---------------------------------------------------------------------------
+// Line offset index
+//
+// Sidecar files under .logistics_lines/ record the byte offset of every
+// LINE_INDEX_STRIDE-th line of a file, keyed by device and inode so renames
+// keep them. The sidecar is built on first use and extended from where it
+// stopped when the file has grown by appends. A fingerprint of the bytes just
+// before the indexed end detects files that were rewritten instead, which
+// are indexed again from scratch.
+// ---------------------------------------------------------------------------
+
+typedef struct LineIndexHeader {
+    char magic[8];
+    uint64_t dev, ino;
+    uint64_t stride;
+    uint64_t indexed_size;   // Bytes covered: always just after a newline
+    uint64_t line_count;     // Complete lines within indexed_size
+    uint64_t checkpoints;    // Entries in the offset table that follows
+    unsigned char fingerprint[LINE_INDEX_FINGERPRINT];
+} LineIndexHeader;
+
+#define LINE_INDEX_MAGIC "LSLIN001"
+
+static void line_index_fingerprint(int fd, uint64_t end, unsigned char *out) {
+    memset(out, 0, LINE_INDEX_FINGERPRINT);
+    uint64_t len = end < LINE_INDEX_FINGERPRINT ? end : LINE_INDEX_FINGERPRINT;
+    if (len > 0 && pread(fd, out, (size_t)len, (off_t)(end - len)) != (ssize_t)len) memset(out, 0, LINE_INDEX_FINGERPRINT);
+}
+
+// Load the sidecar for fd, bringing it up to date with the file's current
+// size. On success *offsets holds hdr->checkpoints entries (caller frees).
+static int line_index_load(int fd, const char *cache_dir, LineIndexHeader *hdr, uint64_t **offsets) {
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) return errno;
+
+    char sidecar[PATH_MAX];
+    if (snprintf(sidecar, sizeof(sidecar), "%s/%lx-%lx.lines", cache_dir,
+                 (unsigned long)sb.st_dev, (unsigned long)sb.st_ino) >= (int)sizeof(sidecar)) {
+        return ENAMETOOLONG;
+    }
+
+    // Start from the existing sidecar if it still describes this file. It
+    // stays locked while it is read and brought up to date, so sessions
+    // viewing the same file never see each other's half-written tables.
+    int side_fd = open(sidecar, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (side_fd < 0 && errno == ENOENT) {
+        mkdir(cache_dir, 0755);
+        side_fd = open(sidecar, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (side_fd >= 0 && flock(side_fd, LOCK_EX) != 0) {
+        close(side_fd);
+        side_fd = -1;
+    }
+    int fresh = 1;
+    *offsets = NULL;
+    memset(hdr, 0, sizeof(*hdr));
+    if (side_fd >= 0 && pread(side_fd, hdr, sizeof(*hdr), 0) == (ssize_t)sizeof(*hdr) &&
+        memcmp(hdr->magic, LINE_INDEX_MAGIC, 8) == 0 && hdr->dev == (uint64_t)sb.st_dev &&
+        hdr->ino == (uint64_t)sb.st_ino && hdr->stride == LINE_INDEX_STRIDE &&
+        hdr->indexed_size <= (uint64_t)sb.st_size && hdr->checkpoints > 0) {
+        unsigned char current[LINE_INDEX_FINGERPRINT];
+        line_index_fingerprint(fd, hdr->indexed_size, current);
+        *offsets = malloc(hdr->checkpoints * sizeof(uint64_t));
+        if (*offsets != NULL && memcmp(current, hdr->fingerprint, sizeof(current)) == 0 &&
+            pread(side_fd, *offsets, hdr->checkpoints * sizeof(uint64_t), sizeof(*hdr)) ==
+                (ssize_t)(hdr->checkpoints * sizeof(uint64_t))) {
+            fresh = 0;
+        }
+    }
+    if (fresh) {
+        free(*offsets);
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, LINE_INDEX_MAGIC, 8);
+        hdr->dev = (uint64_t)sb.st_dev;
+        hdr->ino = (uint64_t)sb.st_ino;
+        hdr->stride = LINE_INDEX_STRIDE;
+        hdr->checkpoints = 1;
+        *offsets = malloc(sizeof(uint64_t));
+        if (*offsets == NULL) {
+            if (side_fd >= 0) close(side_fd);
+            return ENOMEM;
+        }
+        (*offsets)[0] = 0;  // Line 1 starts at byte 0
+    }
+    if ((uint64_t)sb.st_size == hdr->indexed_size && !fresh) {
+        close(side_fd);
+        return 0;
+    }
+
+    // Scan only what was appended since the last pass
+    uint64_t old_checkpoints = fresh ? 0 : hdr->checkpoints;
+    size_t cap = hdr->checkpoints;
+    char buffer[VIEW_BLOCK_SIZE];
+    uint64_t pos = hdr->indexed_size;
+    while (pos < (uint64_t)sb.st_size) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), (off_t)pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (const char *p = buffer; (p = memchr(p, '\n', (size_t)(buffer + n - p))) != NULL; p++) {
+            uint64_t next_line = pos + (uint64_t)(p - buffer) + 1;
+            hdr->line_count++;
+            hdr->indexed_size = next_line;
+            if (hdr->line_count % LINE_INDEX_STRIDE == 0) {
+                if (hdr->checkpoints == cap) {
+                    cap *= 2;
+                    uint64_t *grown = realloc(*offsets, cap * sizeof(uint64_t));
+                    if (grown == NULL) {
+                        if (side_fd >= 0) close(side_fd);
+                        free(*offsets);
+                        *offsets = NULL;
+                        return ENOMEM;
+                    }
+                    *offsets = grown;
+                }
+                (*offsets)[hdr->checkpoints++] = next_line;
+            }
+        }
+        pos += (uint64_t)n;
+    }
+    line_index_fingerprint(fd, hdr->indexed_size, hdr->fingerprint);
+
+    // Persist: new checkpoints are appended, then the header is rewritten.
+    // Failing to save only means the next view scans again.
+    if (fresh && side_fd >= 0 && ftruncate(side_fd, 0) != 0) {
+        close(side_fd);
+        side_fd = -1;
+    }
+    if (side_fd >= 0) {
+        size_t added = (size_t)(hdr->checkpoints - old_checkpoints);
+        if (pwrite(side_fd, *offsets + old_checkpoints, added * sizeof(uint64_t),
+                   (off_t)(sizeof(*hdr) + old_checkpoints * sizeof(uint64_t))) == (ssize_t)(added * sizeof(uint64_t))) {
+            pwrite(side_fd, hdr, sizeof(*hdr), 0);
+        }
+        close(side_fd);
+    }
+    return 0;
+}
+
+// Find the byte range holding lines first..last (1-based, inclusive).
+// *start == *end when the file has fewer than `first` lines. With a NULL
+// cache_dir no sidecar is kept and the scan starts at the top, which suits
+// short-lived descriptors such as packed files.
+int line_index_range(int fd, const char *cache_dir, long first, long last, off_t *start, off_t *end) {
+    LineIndexHeader hdr = { .checkpoints = 1 };
+    uint64_t top = 0, *offsets = &top;
+    if (cache_dir != NULL) {
+        int err = line_index_load(fd, cache_dir, &hdr, &offsets);
+        if (err != 0) return err;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        if (offsets != &top) free(offsets);
+        return errno;
+    }
+
+    // Jump to the nearest checkpoint, then count the remaining newlines
+    uint64_t checkpoint = (uint64_t)(first - 1) / LINE_INDEX_STRIDE;
+    if (checkpoint >= hdr.checkpoints) checkpoint = hdr.checkpoints - 1;
+    uint64_t pos = offsets[checkpoint];
+    if (offsets != &top) free(offsets);
+    long line = (long)(checkpoint * LINE_INDEX_STRIDE) + 1;  // Line starting at pos
+
+    *start = *end = sb.st_size;
+    char buffer[VIEW_BLOCK_SIZE];
+    int found_start = first == line;
+    if (found_start) *start = (off_t)pos;
+    while (pos < (uint64_t)sb.st_size) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), (off_t)pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        if (n == 0) break;
+        for (const char *p = buffer; (p = memchr(p, '\n', (size_t)(buffer + n - p))) != NULL; p++) {
+            uint64_t next_line = pos + (uint64_t)(p - buffer) + 1;
+            if (line == last) {
+                *end = (off_t)next_line;
+                if (!found_start) *start = *end;
+                return 0;
+            }
+            line++;
+            if (line == first) {
+                *start = (off_t)next_line;
+                found_start = 1;
+            }
+        }
+        pos += (uint64_t)n;
+    }
+    return 0;  // Range runs past EOF: end at the end of the file
+}
+
+// ---------------------------------------------------------------------------
+// Append writer
+//
+// Native O_APPEND writer used instead of echo >> file. Concurrent appends to
+// the same file are grouped: the first caller becomes the leader and writes
+// everything queued behind it with writev, then wakes the others. The fsync
+// policy is none, per batch or per record (LOGISTICS_APPEND_SYNC), and every
+// caller gets a receipt saying where its record landed and whether it is
+// already on stable storage.
+// ---------------------------------------------------------------------------
+
+typedef struct AppendRequest {
+    struct AppendRequest *next;
+    const char *data;
+    size_t len;
+    AppendSync sync;
+    AppendReceipt receipt;
+    int err;
+    int done;
+} AppendRequest;
+
+// Pending records for one file; exists only while someone is appending
+typedef struct AppendQueue {
+    struct AppendQueue *next;
+    AppendRequest *head;
+    AppendRequest **tail;
+    char path[];
+} AppendQueue;
+
+typedef struct AppendWriter {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    AppendQueue *queues;
+    AppendSync policy;
+} AppendWriter;
+
+static AppendWriter append_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .policy = APPEND_SYNC_BATCH,
+};
+
+// Set the fsync policy from its name: "none", "batch" or "record"
+void append_writer_init(const char *policy) {
+    AppendSync sync = APPEND_SYNC_BATCH;
+    if (policy != NULL && strcmp(policy, "none") == 0) sync = APPEND_SYNC_NONE;
+    if (policy != NULL && strcmp(policy, "record") == 0) sync = APPEND_SYNC_RECORD;
+    pthread_mutex_lock(&append_writer.lock);
+    append_writer.policy = sync;
+    pthread_mutex_unlock(&append_writer.lock);
+}
+
+// Open path for appending. A newly created file also needs its directory
+// entry synced before any record in it can be called durable.
+static int append_open(const char *path, AppendSync policy, int *out_fd) {
+    const char *leaf;
+    int dirfd = fsop_open_parent(path, &leaf);
+    if (dirfd < 0) return errno;
+
+    int err = 0;
+    int fd = fsop_open_leaf(dirfd, leaf, path, O_WRONLY | O_APPEND | O_CLOEXEC, 0);
+    if (fd < 0 && errno == ENOENT) {
+        fd = openat(dirfd, leaf, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0 && policy != APPEND_SYNC_NONE) {
+            err = fsync(fd) == 0 ? fsop_fsync_dir(dirfd) : errno;
+        } else if (fd < 0 && errno == EEXIST) {
+            fd = fsop_open_leaf(dirfd, leaf, path, O_WRONLY | O_APPEND | O_CLOEXEC, 0);
+        }
+    }
+    if (fd < 0) err = errno;
+    close(dirfd);
+    if (err != 0 && fd >= 0) close(fd);
+    *out_fd = err == 0 ? fd : -1;
+    return err;
+}
+
+// Write count records with as few writev calls as IOV_MAX allows
+static int append_write_records(int fd, AppendRequest **records, size_t count) {
+    struct iovec iov[IOV_MAX];
+    size_t first = 0;
+    while (first < count) {
+        size_t n = count - first < IOV_MAX ? count - first : IOV_MAX;
+        size_t total = 0;
+        for (size_t i = 0; i < n; i++) {
+            iov[i].iov_base = (void *)records[first + i]->data;
+            iov[i].iov_len = records[first + i]->len;
+            total += records[first + i]->len;
+        }
+
+        // Short writes only happen when the disk fills up; finish the rest
+        struct iovec *pos = iov;
+        size_t left = n;
+        size_t remaining = total;
+        while (remaining > 0) {
+            ssize_t w = writev(fd, pos, (int)left);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            remaining -= (size_t)w;
+            while (left > 0 && (size_t)w >= pos->iov_len) {
+                w -= (ssize_t)pos->iov_len;
+                pos++;
+                left--;
+            }
+            if (left > 0) {
+                pos->iov_base = (char *)pos->iov_base + w;
+                pos->iov_len -= (size_t)w;
+            }
+        }
+
+        // With O_APPEND the file offset now sits just past this group
+        off_t offset = lseek(fd, 0, SEEK_CUR) - (off_t)total;
+        for (size_t i = 0; i < n; i++) {
+            records[first + i]->receipt.offset = offset;
+            offset += (off_t)records[first + i]->len;
+        }
+        first += n;
+    }
+    return 0;
+}
+
+// Write one batch taken off a queue and fill in every receipt. Records are
+// written together up to the next one that wants its own fdatasync; the
+// group is synced once if any record in it asked for durability.
+static void append_flush(const char *path, AppendRequest *batch) {
+    size_t count = 0;
+    AppendSync strongest = APPEND_SYNC_NONE;
+    for (AppendRequest *r = batch; r != NULL; r = r->next) {
+        count++;
+        if (r->sync > strongest) strongest = r->sync;
+    }
+
+    AppendRequest *stack_records[64];
+    AppendRequest **records = count <= 64 ? stack_records : malloc(count * sizeof(*records));
+    int fd = -1;
+    int err = records == NULL ? ENOMEM : append_open(path, strongest, &fd);
+    if (err == 0) {
+        size_t i = 0;
+        for (AppendRequest *r = batch; r != NULL; r = r->next) records[i++] = r;
+
+        size_t first = 0;
+        while (first < count) {
+            size_t end = first;
+            int wants_sync = 0;
+            while (end < count) {
+                wants_sync |= records[end]->sync != APPEND_SYNC_NONE;
+                if (records[end++]->sync == APPEND_SYNC_RECORD) break;
+            }
+            if (err == 0) err = append_write_records(fd, &records[first], end - first);
+            if (err == 0 && wants_sync && fdatasync(fd) != 0) err = errno;
+            for (i = first; i < end; i++) {
+                records[i]->err = err;
+                records[i]->receipt.synced = err == 0 && wants_sync;
+            }
+            first = end;
+        }
+        close(fd);
+    } else {
+        for (AppendRequest *r = batch; r != NULL; r = r->next) r->err = err;
+    }
+    for (AppendRequest *r = batch; r != NULL; r = r->next) r->receipt.batch_records = count;
+    if (records != stack_records) free(records);
+}
+
+// Append len bytes to path as one record under the configured fsync policy
+int append_record(const char *path, const char *data, size_t len, AppendReceipt *receipt) {
+    pthread_mutex_lock(&append_writer.lock);
+    AppendSync sync = append_writer.policy;
+    pthread_mutex_unlock(&append_writer.lock);
+    return append_record_sync(path, data, len, sync, receipt);
+}
+
+// Append len bytes to path as one record. Returns once the record has been
+// written (and synced, if sync asks for it), or an errno value.
+int append_record_sync(const char *path, const char *data, size_t len, AppendSync sync, AppendReceipt *receipt) {
+    AppendRequest request = { .data = data, .len = len, .sync = sync };
+
+    pthread_mutex_lock(&append_writer.lock);
+    AppendQueue *queue = append_writer.queues;
+    while (queue != NULL && strcmp(queue->path, path) != 0) queue = queue->next;
+
+    if (queue != NULL) {
+        // A leader is already writing this file; it will pick us up
+        *queue->tail = &request;
+        queue->tail = &request.next;
+        while (!request.done) pthread_cond_wait(&append_writer.done, &append_writer.lock);
+        pthread_mutex_unlock(&append_writer.lock);
+    } else {
+        size_t path_len = strlen(path);
+        queue = malloc(sizeof(*queue) + path_len + 1);
+        if (queue == NULL) {
+            pthread_mutex_unlock(&append_writer.lock);
+            return ENOMEM;
+        }
+        memcpy(queue->path, path, path_len + 1);
+        queue->head = &request;
+        queue->tail = &request.next;
+        queue->next = append_writer.queues;
+        append_writer.queues = queue;
+
+        // Lead: keep flushing until nobody has queued behind us
+        while (queue->head != NULL) {
+            AppendRequest *batch = queue->head;
+            queue->head = NULL;
+            queue->tail = &queue->head;
+            pthread_mutex_unlock(&append_writer.lock);
+
+            append_flush(queue->path, batch);
+
+            pthread_mutex_lock(&append_writer.lock);
+            for (AppendRequest *r = batch; r != NULL; r = r->next) r->done = 1;
+            pthread_cond_broadcast(&append_writer.done);
+        }
+
+        AppendQueue **link = &append_writer.queues;
+        while (*link != queue) link = &(*link)->next;
+        *link = queue->next;
+        pthread_mutex_unlock(&append_writer.lock);
+        free(queue);
+    }
+
+    if (receipt != NULL) *receipt = request.receipt;
+    return request.err;
+}
+
+// ---------------------------------------------------------------------------
+// Operation journal
+//
+// Every mutating command writes an intent record to .logistics_journal
+// before touching the tree and a completion record as soon as it is done.
+// Intents go through the append writer with a batch fsync, so concurrent
+// operations share one sequential write and one fdatasync. Completions are
+// not synced at all, because the next synced intent makes them durable
+// too. At startup any intent without a completion is finished or undone,
+// and the journal is truncated once everything it describes has reached
+// the disk.
+//
+// A lost completion means recovery sees an operation that did finish, and
+// the tree may have changed since: a moved file's name reused, a deleted
+// directory made again. So an intent records the device, inode, size and
+// mtime its paths had when it was written, and recovery only rolls an
+// operation forward on the very files it started on.
+//
+// The journal belongs to one process at a time, which holds an exclusive
+// flock on it from journal_open until exit. A second process started while
+// the owner runs (a batch run next to --serve, say) must not replay the
+// owner's intents or truncate its journal, so it skips recovery and runs
+// without journaling.
+// ---------------------------------------------------------------------------
+
+#define JOURNAL_MAGIC 0x324a534cu   // "LSJ2"
+#define JOURNAL_INTENT 1
+#define JOURNAL_DONE 2
+
+// On-disk record header, followed by path_len + path2_len bytes of paths
+typedef struct JournalHeader {
+    uint32_t magic;
+    uint32_t crc;        // Of everything after this field, paths included
+    uint64_t seq;
+    uint8_t kind;
+    uint8_t op;
+    uint16_t flags;
+    uint32_t arg;        // Mode for intents, errno result for completions
+    uint32_t pid;
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint64_t dev, ino;   // Intents: path when the intent was written, 0 if absent
+    uint64_t dev2, ino2; // ... and path2
+    int64_t size;        // ... and path's size and mtime
+    int64_t mtime_ns;
+} JournalHeader;
+
+typedef struct Journal {
+    pthread_mutex_t lock;
+    char path[PATH_MAX];
+    int enabled;
+    uint64_t next_seq;
+    uint64_t in_flight;
+    off_t size;
+    int owner_fd;        // Holds the flock while this process owns the journal
+} Journal;
+
+static Journal journal = { .lock = PTHREAD_MUTEX_INITIALIZER, .next_seq = 1, .owner_fd = -1 };
+
+static uint32_t journal_crc32(const unsigned char *data, size_t len) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// Serialise one record into buffer; returns its length. hdr carries the
+// fields particular to the record, the rest are filled in here.
+static size_t journal_encode(unsigned char *buffer, JournalHeader hdr, const char *path, const char *path2) {
+    hdr.magic = JOURNAL_MAGIC;
+    hdr.pid = (uint32_t)getpid();
+    hdr.path_len = (uint16_t)(path != NULL ? strlen(path) : 0);
+    hdr.path2_len = (uint16_t)(path2 != NULL ? strlen(path2) : 0);
+    size_t len = sizeof(hdr);
+    if (hdr.path_len > 0) memcpy(buffer + len, path, hdr.path_len);
+    len += hdr.path_len;
+    if (hdr.path2_len > 0) memcpy(buffer + len, path2, hdr.path2_len);
+    len += hdr.path2_len;
+    memcpy(buffer, &hdr, sizeof(hdr));
+    hdr.crc = journal_crc32(buffer + 8, len - 8);
+    memcpy(buffer, &hdr, sizeof(hdr));
+    return len;
+}
+
+// Is sb the file an intent recorded as dev and ino?
+static int journal_same_file(const struct stat *sb, uint64_t dev, uint64_t ino) {
+    return ino != 0 && (uint64_t)sb->st_dev == dev && (uint64_t)sb->st_ino == ino;
+}
+
+// Finish or undo one operation that was interrupted by a crash. Every
+// action is safe to repeat, since a completion record may simply have been
+// lost with the page cache, and is taken only on the files the operation
+// started on.
+static int journal_recover_one(const JournalHeader *hdr, const char *path, const char *path2) {
+    struct stat sb, sb2;
+    switch ((JournalOp)hdr->op) {
+        case JOURNAL_OP_DELETE_TREE:
+            // Roll forward: the user asked for the whole tree to go, but a
+            // directory made at the same path since is not that tree
+            if (lstat(path, &sb) != 0 || !journal_same_file(&sb, hdr->dev, hdr->ino)) return 0;
+            return fsop_delete_tree(path);
+
+        case JOURNAL_OP_COPY:
+            // Roll forward: the destination may be truncated mid-copy. Only
+            // while the source is unchanged, and the destination is the file
+            // the copy opened and shorter than the source, so a finished
+            // copy that was appended to later is left alone.
+            if (lstat(path, &sb) != 0 || !S_ISREG(sb.st_mode) || !journal_same_file(&sb, hdr->dev, hdr->ino) ||
+                sb.st_size != hdr->size ||
+                (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec != hdr->mtime_ns ||
+                lstat(path2, &sb2) != 0 || !S_ISREG(sb2.st_mode) || sb2.st_size >= sb.st_size ||
+                (hdr->ino2 != 0 && !journal_same_file(&sb2, hdr->dev2, hdr->ino2))) {
+                return 0;
+            }
+            return fsop_copy_file(path, path2, NULL);
+
+        case JOURNAL_OP_MOVE: {
+            // A cross-device move may leave its hidden temporary behind
+            const char *slash = strrchr(path2, '/');
+            if (slash != NULL) {
+                char tmp_path[PATH_MAX];
+                if (snprintf(tmp_path, sizeof(tmp_path), "%.*s/.%.200s.mv.%u", (int)(slash - path2), path2,
+                             slash + 1, (unsigned)hdr->pid) < (int)sizeof(tmp_path)) {
+                    unlink(tmp_path);
+                }
+            }
+            // Both names present means the new one was published but the
+            // old one not yet removed: finish the move. The old name must
+            // still be the file that was moved, the new one must not have
+            // existed before, and it must hold that file: the same inode
+            // after link and unlink, a copy of the same size across devices.
+            if (hdr->ino2 != 0 || lstat(path, &sb) != 0 || !journal_same_file(&sb, hdr->dev, hdr->ino) ||
+                lstat(path2, &sb2) != 0) {
+                return 0;
+            }
+            if (sb2.st_dev == sb.st_dev ? sb2.st_ino != sb.st_ino
+                                        : !S_ISREG(sb2.st_mode) || sb2.st_size != sb.st_size || sb.st_size != hdr->size) {
+                return 0;
+            }
+            return fsop_delete_file(path);
+        }
+
+        default:
+            // Single system calls: either they happened or they did not
+            return 0;
+    }
+}
+
+// An intent found during recovery and where its paths start
+typedef struct JournalIntent {
+    JournalHeader hdr;
+    size_t paths;
+} JournalIntent;
+
+static int journal_compare_seq(const void *a, const void *b) {
+    uint64_t x = ((const JournalIntent *)a)->hdr.seq;
+    uint64_t y = ((const JournalIntent *)b)->hdr.seq;
+    return x < y ? -1 : x > y;
+}
+
+// Read the journal, complete whatever it says was left half done, and
+// count them in *recovered
+static int journal_recover(const char *path, int *recovered) {
+    *recovered = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : errno;
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    if (sb.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    unsigned char *data = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return errno;
+
+    // Collect intents and completions; a torn or corrupt tail ends the scan.
+    // Records are packed, so headers are copied out rather than cast.
+    size_t cap = 64, count = 0, done_cap = 64, done_count = 0;
+    JournalIntent *intents = malloc(cap * sizeof(*intents));
+    uint64_t *done = malloc(done_cap * sizeof(*done));
+    int err = intents == NULL || done == NULL ? ENOMEM : 0;
+    size_t pos = 0;
+    while (err == 0 && pos + sizeof(JournalHeader) <= (size_t)sb.st_size) {
+        JournalHeader hdr;
+        memcpy(&hdr, data + pos, sizeof(hdr));
+        size_t len = sizeof(hdr) + hdr.path_len + hdr.path2_len;
+        if (hdr.magic != JOURNAL_MAGIC || pos + len > (size_t)sb.st_size ||
+            journal_crc32(data + pos + 8, len - 8) != hdr.crc) {
+            break;
+        }
+        if (hdr.seq >= journal.next_seq) journal.next_seq = hdr.seq + 1;
+        if (hdr.kind == JOURNAL_INTENT) {
+            if (count == cap) {
+                cap *= 2;
+                JournalIntent *grown = realloc(intents, cap * sizeof(*intents));
+                if (grown == NULL) err = ENOMEM;
+                else intents = grown;
+            }
+            if (err == 0) intents[count++] = (JournalIntent){ .hdr = hdr, .paths = pos + sizeof(hdr) };
+        } else if (hdr.kind == JOURNAL_DONE) {
+            if (done_count == done_cap) {
+                done_cap *= 2;
+                uint64_t *grown = realloc(done, done_cap * sizeof(*done));
+                if (grown == NULL) err = ENOMEM;
+                else done = grown;
+            }
+            if (err == 0) done[done_count++] = hdr.seq;
+        }
+        pos += len;
+    }
+
+    if (err == 0) {
+        // Drop finished intents, then redo the rest in their original order
+        qsort(intents, count, sizeof(*intents), journal_compare_seq);
+        for (size_t i = 0; i < done_count; i++) {
+            JournalIntent key = { .hdr.seq = done[i] };
+            JournalIntent *hit = bsearch(&key, intents, count, sizeof(*intents), journal_compare_seq);
+            if (hit != NULL) hit->hdr.kind = JOURNAL_DONE;
+        }
+        for (size_t i = 0; i < count; i++) {
+            const JournalHeader *hdr = &intents[i].hdr;
+            if (hdr->kind != JOURNAL_INTENT || hdr->path_len >= PATH_MAX || hdr->path2_len >= PATH_MAX) continue;
+            char first[PATH_MAX], second[PATH_MAX];
+            memcpy(first, data + intents[i].paths, hdr->path_len);
+            first[hdr->path_len] = '\0';
+            memcpy(second, data + intents[i].paths + hdr->path_len, hdr->path2_len);
+            second[hdr->path2_len] = '\0';
+
+            int op_err = journal_recover_one(hdr, first, second);
+            if (op_err != 0) {
+                fprintf(stderr, "Warning: could not recover interrupted operation on %s: %s\n", first, strerror(op_err));
+            }
+            (*recovered)++;
+        }
+    }
+
+    free(intents);
+    free(done);
+    munmap(data, (size_t)sb.st_size);
+    return err;
+}
+
+// Flush the file system holding the journal, then empty the journal: once
+// everything it describes is on disk there is nothing left to recover.
+// Only the owner does this.
+static int journal_checkpoint_locked(void) {
+    int fd = journal.owner_fd;
+    if (fd < 0) return EBADF;
+    int err = 0;
+    if (syncfs(fd) != 0 || ftruncate(fd, 0) != 0 || fsync(fd) != 0) err = errno;
+    if (err == 0) journal.size = 0;
+    return err;
+}
+
+// Take ownership of the journal at path, recover from it and start
+// journaling to it. EBUSY means another process owns it.
+int journal_open(const char *path) {
+    pthread_mutex_lock(&journal.lock);
+    snprintf(journal.path, sizeof(journal.path), "%s", path);
+    int recovered = 0;
+    int err = 0;
+    journal.owner_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journal.owner_fd < 0) {
+        err = errno;
+    } else if (flock(journal.owner_fd, LOCK_EX | LOCK_NB) != 0) {
+        err = errno == EWOULDBLOCK ? EBUSY : errno;
+        close(journal.owner_fd);
+        journal.owner_fd = -1;
+    }
+    if (err == 0) err = journal_recover(path, &recovered);
+    if (err == 0) err = journal_checkpoint_locked();
+    journal.enabled = err == 0;
+    pthread_mutex_unlock(&journal.lock);
+
+    if (recovered > 0) printf("Recovered %d interrupted operation(s) from the journal.\n", recovered);
+    return err;
+}
+
+// Checkpoint on a clean exit so the next start has nothing to replay
+void journal_close(void) {
+    pthread_mutex_lock(&journal.lock);
+    if (journal.enabled && journal.in_flight == 0 && journal.size > 0) journal_checkpoint_locked();
+    journal.enabled = 0;
+    if (journal.owner_fd >= 0) close(journal.owner_fd);
+    journal.owner_fd = -1;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Durably record that a group of operations is about to run: all intents go
+// out in one write and one fdatasync. txns[i] is later passed to journal_end.
+int journal_begin_many(const JournalIntentSpec *specs, size_t count, uint64_t *txns) {
+    memset(txns, 0, count * sizeof(*txns));
+    if (count == 0) return 0;
+    pthread_mutex_lock(&journal.lock);
+    if (!journal.enabled) {
+        pthread_mutex_unlock(&journal.lock);
+        return 0;
+    }
+    uint64_t first_seq = journal.next_seq;
+    journal.next_seq += count;
+    journal.in_flight += count;
+    pthread_mutex_unlock(&journal.lock);
+
+    unsigned char stack_records[sizeof(JournalHeader) + 2 * PATH_MAX];
+    unsigned char *records = stack_records;
+    if (count > 1) records = malloc(count * sizeof(stack_records));
+    int err = records == NULL ? ENOMEM : 0;
+    size_t len = 0;
+    for (size_t i = 0; i < count && err == 0; i++) {
+        JournalHeader hdr = { .seq = first_seq + i, .kind = JOURNAL_INTENT, .op = (uint8_t)specs[i].op,
+                              .arg = (uint32_t)specs[i].mode };
+        // The files that recovery may act on, as they are now
+        struct stat sb;
+        int recoverable = specs[i].op == JOURNAL_OP_DELETE_TREE || specs[i].op == JOURNAL_OP_COPY ||
+                          specs[i].op == JOURNAL_OP_MOVE;
+        if (recoverable && lstat(specs[i].path, &sb) == 0) {
+            hdr.dev = (uint64_t)sb.st_dev;
+            hdr.ino = (uint64_t)sb.st_ino;
+            hdr.size = (int64_t)sb.st_size;
+            hdr.mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+        }
+        if (recoverable && specs[i].path2 != NULL && lstat(specs[i].path2, &sb) == 0) {
+            hdr.dev2 = (uint64_t)sb.st_dev;
+            hdr.ino2 = (uint64_t)sb.st_ino;
+        }
+        len += journal_encode(records + len, hdr, specs[i].path, specs[i].path2);
+    }
+
+    AppendReceipt receipt;
+    if (err == 0) err = append_record_sync(journal.path, (const char *)records, len, APPEND_SYNC_BATCH, &receipt);
+    if (records != stack_records) free(records);
+
+    pthread_mutex_lock(&journal.lock);
+    if (err != 0) {
+        journal.in_flight -= count;
+    } else {
+        if (receipt.offset + (off_t)len > journal.size) journal.size = receipt.offset + (off_t)len;
+        for (size_t i = 0; i < count; i++) txns[i] = first_seq + i;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return err;
+}
+
+// Durably record that op is about to run. *txn is passed to journal_end.
+int journal_begin(JournalOp op, const char *path, const char *path2, mode_t mode, uint64_t *txn) {
+    JournalIntentSpec spec = { .op = op, .path = path, .path2 = path2, .mode = mode };
+    return journal_begin_many(&spec, 1, txn);
+}
+
+// Record the outcomes of a group of operations in one write. Not synced:
+// the next intent carries them to disk. Zero txns are skipped.
+void journal_end_many(const uint64_t *txns, const int *results, size_t count) {
+    unsigned char stack_records[sizeof(JournalHeader)];
+    unsigned char *records = count > 1 ? malloc(count * sizeof(JournalHeader)) : stack_records;
+    size_t len = 0, ended = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (txns[i] == 0) continue;
+        ended++;
+        if (records != NULL) {
+            JournalHeader hdr = { .seq = txns[i], .kind = JOURNAL_DONE, .arg = (uint32_t)results[i] };
+            len += journal_encode(records + len, hdr, NULL, NULL);
+        }
+    }
+    if (ended == 0) {
+        if (records != stack_records) free(records);
+        return;
+    }
+
+    // Without memory for the records the intents simply stay open, which
+    // only means recovery repeats work that already happened
+    AppendReceipt receipt;
+    int err = records == NULL ? ENOMEM : append_record_sync(journal.path, (const char *)records, len, APPEND_SYNC_NONE, &receipt);
+    if (records != stack_records) free(records);
+
+    pthread_mutex_lock(&journal.lock);
+    journal.in_flight -= ended;
+    if (err == 0 && receipt.offset + (off_t)len > journal.size) journal.size = receipt.offset + (off_t)len;
+    if (journal.enabled && journal.in_flight == 0 && journal.size > JOURNAL_CHECKPOINT_BYTES) {
+        journal_checkpoint_locked();
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Record the outcome of txn
+void journal_end(uint64_t txn, int result) {
+    journal_end_many(&txn, &result, 1);
+}
+
+// ---------------------------------------------------------------------------
+// Order store
+//
+// Orders are kept column by column in .logistics_orders, a file mapped into
+// memory. A header page is followed by fixed-width arrays of order ids,
+// statuses, warehouse ids, creation and update times and note locations,
+// each with room for the store's capacity; the file is rebuilt at twice the
+// capacity when it fills. A status query only touches the one-byte status
+// column, comparing 32 orders per AVX2 instruction (16 with SSE2), so it runs
+// at memory bandwidth instead of opening and parsing a file per order.
+// Free-text notes go to the heap file .logistics_orders.notes, which is only
+// ever appended to; an unchanged note keeps its place.
+//
+// order_store_import reads order_NNN.track files. "status: ",
+// "warehouse: " and "created: " lines set those fields, the last one
+// winning, so an appended "status: delivered" moves the order on; every
+// other line is a note. order_store_export writes the same format back.
+//
+// The id table lives in the memory of the process that mapped the store,
+// and growth renames a new file over the old one, so the store has a
+// single owner: the first process to use it holds an exclusive flock on
+// .logistics_orders until it exits. In any other process (a batch run next
+// to --serve, say) every order store call fails with EBUSY; such sessions
+// reach the owner's store through --connect instead.
+//
+// A put writes the note and the row but only moves the in-memory header
+// (live). order_store_sync, run at the end of every import and at exit,
+// syncs the notes, then the columns, and only then writes live into the
+// file's header and syncs that, so after a crash the header never counts
+// a row or a note byte that did not reach the disk. Puts since the last
+// sync are lost; a row replaced in place whose new note did not make it is
+// opened with no note.
+// ---------------------------------------------------------------------------
+
+#define ORDER_STORE_MAGIC "LSORD001"
+#define ORDER_HEADER_BYTES 4096
+#define ORDER_MIN_CAPACITY 4096
+#define ORDER_SCAN_ROWS 4096         // Rows per match bitmap
+#define ORDER_FILE_CHUNK 4096        // .track files parsed or written per parallel job
+
+enum { ORDER_COL_ID, ORDER_COL_STATUS, ORDER_COL_WAREHOUSE, ORDER_COL_CREATED, ORDER_COL_UPDATED,
+       ORDER_COL_NOTE_OFFSET, ORDER_COL_NOTE_LEN, ORDER_COLUMNS };
+
+static const size_t order_column_widths[ORDER_COLUMNS] = {
+    sizeof(uint64_t), sizeof(uint8_t), sizeof(uint32_t), sizeof(int64_t), sizeof(int64_t), sizeof(uint64_t),
+    sizeof(uint32_t),
+};
+
+static const char *order_status_names[ORDER_STATUS_COUNT] = {
+    "unknown", "pending", "packed", "shipped", "in_transit", "delivered", "returned", "cancelled",
+};
+
+typedef struct OrderStoreHeader {
+    char magic[8];
+    uint64_t capacity;       // Rows each column has room for
+    uint64_t count;          // Rows in use
+    uint64_t notes_size;     // Bytes of the notes heap in use
+} OrderStoreHeader;
+
+typedef struct OrderColumns {
+    uint64_t *id;
+    uint8_t *status;
+    uint32_t *warehouse;
+    int64_t *created;
+    int64_t *updated;
+    uint64_t *note_offset;
+    uint32_t *note_len;
+} OrderColumns;
+
+// Sets bit i of bits for every i < n with column[i] == status and returns
+// how many there were; n is at most ORDER_SCAN_ROWS. With bits NULL it
+// only counts.
+typedef size_t (*OrderMatchFn)(const uint8_t *column, size_t n, uint8_t status, uint64_t *bits);
+
+typedef struct OrderStore {
+    pthread_rwlock_t lock;   // Writers: puts and growth; readers: everything else
+    char path[PATH_MAX];
+    char notes_path[PATH_MAX + 8];
+    int fd, notes_fd;
+    OrderStoreHeader *header; // Start of the mapping; NULL until first use
+    OrderStoreHeader live;   // Header as of the last put; header gets it on sync
+    size_t map_size;
+    OrderColumns col;
+    uint32_t *slots;         // Open addressing over ids: row + 1, or 0 when free
+    size_t slot_count;
+    OrderMatchFn match;
+} OrderStore;
+
+static OrderStore order_store = { .lock = PTHREAD_RWLOCK_INITIALIZER, .fd = -1, .notes_fd = -1 };
+
+#if defined(__x86_64__)
+static size_t order_match_sse2(const uint8_t *column, size_t n, uint8_t status, uint64_t *bits) {
+    if (bits != NULL) memset(bits, 0, (n + 63) / 64 * sizeof(uint64_t));
+    const __m128i want = _mm_set1_epi8((char)status);
+    size_t i = 0, matched = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(want, _mm_loadu_si128((const __m128i *)(column + i))));
+        if (mask == 0) continue;
+        if (bits != NULL) bits[i / 64] |= (uint64_t)mask << (i % 64);
+        matched += (size_t)__builtin_popcount(mask);
+    }
+    for (; i < n; i++) {
+        if (column[i] != status) continue;
+        if (bits != NULL) bits[i / 64] |= 1ull << (i % 64);
+        matched++;
+    }
+    return matched;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t order_match_avx2(const uint8_t *column, size_t n, uint8_t status, uint64_t *bits) {
+    if (bits != NULL) memset(bits, 0, (n + 63) / 64 * sizeof(uint64_t));
+    const __m256i want = _mm256_set1_epi8((char)status);
+    size_t i = 0, matched = 0;
+    for (; i + 32 <= n; i += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(want, _mm256_loadu_si256((const __m256i *)(column + i))));
+        if (mask == 0) continue;
+        if (bits != NULL) bits[i / 64] |= (uint64_t)mask << (i % 64);
+        matched += (size_t)__builtin_popcount(mask);
+    }
+    for (; i < n; i++) {
+        if (column[i] != status) continue;
+        if (bits != NULL) bits[i / 64] |= 1ull << (i % 64);
+        matched++;
+    }
+    return matched;
+}
+#else
+static size_t order_match_scalar(const uint8_t *column, size_t n, uint8_t status, uint64_t *bits) {
+    if (bits != NULL) memset(bits, 0, (n + 63) / 64 * sizeof(uint64_t));
+    size_t matched = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (column[i] != status) continue;
+        if (bits != NULL) bits[i / 64] |= 1ull << (i % 64);
+        matched++;
+    }
+    return matched;
+}
+#endif
+
+// Pick the widest status scan this CPU supports
+static OrderMatchFn order_match_select(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return order_match_avx2;
+    return order_match_sse2;
+#else
+    return order_match_scalar;
+#endif
+}
+
+const char *order_status_name(int status) {
+    return status >= 0 && status < ORDER_STATUS_COUNT ? order_status_names[status] : "unknown";
+}
+
+// Status named by name ("in transit", "In-Transit" and "in_transit" alike),
+// or -1
+int order_status_parse(const char *name) {
+    for (int s = 0; s < ORDER_STATUS_COUNT; s++) {
+        const char *want = order_status_names[s];
+        size_t i = 0;
+        for (; name[i] != '\0' && want[i] != '\0'; i++) {
+            char c = (char)tolower((unsigned char)name[i]);
+            if (c == ' ' || c == '-') c = '_';
+            if (c != want[i]) break;
+        }
+        if (name[i] == '\0' && want[i] == '\0') return s;
+    }
+    return -1;
+}
+
+// Offset of every column for a store of the given capacity; returns the file size
+static size_t order_store_offsets(uint64_t capacity, size_t offsets[ORDER_COLUMNS]) {
+    size_t offset = ORDER_HEADER_BYTES;
+    for (int c = 0; c < ORDER_COLUMNS; c++) {
+        offsets[c] = offset;
+        offset = (offset + (size_t)capacity * order_column_widths[c] + 63) & ~(size_t)63;
+    }
+    return offset;
+}
+
+static void order_store_columns(char *base, uint64_t capacity, OrderColumns *col) {
+    size_t offsets[ORDER_COLUMNS];
+    order_store_offsets(capacity, offsets);
+    col->id = (uint64_t *)(base + offsets[ORDER_COL_ID]);
+    col->status = (uint8_t *)(base + offsets[ORDER_COL_STATUS]);
+    col->warehouse = (uint32_t *)(base + offsets[ORDER_COL_WAREHOUSE]);
+    col->created = (int64_t *)(base + offsets[ORDER_COL_CREATED]);
+    col->updated = (int64_t *)(base + offsets[ORDER_COL_UPDATED]);
+    col->note_offset = (uint64_t *)(base + offsets[ORDER_COL_NOTE_OFFSET]);
+    col->note_len = (uint32_t *)(base + offsets[ORDER_COL_NOTE_LEN]);
+}
+
+static size_t order_slot_hash(uint64_t id) {
+    return (size_t)((id * 0x9E3779B97F4A7C15ull) >> 24);
+}
+
+// The slot holding id, or the free slot where it belongs
+static uint32_t *order_slot(uint64_t id) {
+    OrderStore *os = &order_store;
+    size_t mask = os->slot_count - 1;
+    size_t j = order_slot_hash(id) & mask;
+    while (os->slots[j] != 0 && os->col.id[os->slots[j] - 1] != id) j = (j + 1) & mask;
+    return &os->slots[j];
+}
+
+// Rebuild the id table for the current capacity; caller holds the lock for writing
+static int order_store_index_locked(void) {
+    OrderStore *os = &order_store;
+    size_t slot_count = 1024;
+    while (slot_count < os->live.capacity * 2) slot_count *= 2;
+    uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+    if (slots == NULL) return ENOMEM;
+    free(os->slots);
+    os->slots = slots;
+    os->slot_count = slot_count;
+    for (uint64_t row = 0; row < os->live.count; row++) {
+        uint32_t *slot = order_slot(os->col.id[row]);
+        // A duplicate id can only come from a damaged file; the later row wins
+        *slot = (uint32_t)row + 1;
+    }
+    return 0;
+}
+
+static void order_store_unmap_locked(void) {
+    OrderStore *os = &order_store;
+    if (os->header != NULL) munmap(os->header, os->map_size);
+    if (os->fd >= 0) close(os->fd);
+    if (os->notes_fd >= 0) close(os->notes_fd);
+    free(os->slots);
+    os->header = NULL;
+    os->slots = NULL;
+    os->slot_count = 0;
+    os->fd = os->notes_fd = -1;
+}
+
+// Open a store file and take ownership of it (flags get O_CREAT). The flock
+// must be on the file the path names now: the owner may have renamed a new
+// one over the file we opened while we waited. Returns the fd, or -1 with
+// errno set (EBUSY: another process owns the file).
+static int open_owned(const char *path, int flags) {
+    while (1) {
+        int fd = open(path, flags | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        struct stat held, named;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            int err = errno == EWOULDBLOCK ? EBUSY : errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if (fstat(fd, &held) == 0 && stat(path, &named) == 0 && held.st_ino == named.st_ino &&
+            held.st_dev == named.st_dev) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+// Map the store, creating it when missing; caller holds the lock for writing
+static int order_store_map_locked(void) {
+    OrderStore *os = &order_store;
+    if (os->path[0] == '\0') return ENOENT;
+    os->fd = open_owned(os->path, O_RDWR);
+    os->notes_fd = os->fd < 0 ? -1 : open(os->notes_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (os->notes_fd < 0) {
+        int err = errno;
+        order_store_unmap_locked();
+        if (err == EBUSY) fprintf(stderr, "Order store %s is in use by another running instance.\n", os->path);
+        return err;
+    }
+
+    int err = 0;
+    struct stat sb, notes_sb;
+    OrderStoreHeader header = { .magic = ORDER_STORE_MAGIC, .capacity = ORDER_MIN_CAPACITY };
+    size_t offsets[ORDER_COLUMNS];
+    int created = 0;
+    if (fstat(os->fd, &sb) != 0 || fstat(os->notes_fd, &notes_sb) != 0) {
+        err = errno;
+    } else if (sb.st_size == 0) {
+        created = 1;
+        os->map_size = order_store_offsets(header.capacity, offsets);
+        if (ftruncate(os->fd, (off_t)os->map_size) != 0) err = errno;
+    } else if (pread(os->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+               memcmp(header.magic, ORDER_STORE_MAGIC, 8) != 0 || header.capacity == 0 ||
+               header.capacity >= UINT32_MAX || header.count > header.capacity ||
+               (uint64_t)sb.st_size < order_store_offsets(header.capacity, offsets) ||
+               (uint64_t)notes_sb.st_size < header.notes_size) {
+        err = EINVAL;
+    } else {
+        os->map_size = order_store_offsets(header.capacity, offsets);
+    }
+    // Notes past notes_size belong to a put that never completed
+    if (err == 0 && (uint64_t)notes_sb.st_size > header.notes_size &&
+        ftruncate(os->notes_fd, (off_t)header.notes_size) != 0) {
+        err = errno;
+    }
+    if (err == 0) {
+        void *map = mmap(NULL, os->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, os->fd, 0);
+        if (map == MAP_FAILED) {
+            err = errno;
+        } else {
+            os->header = map;
+            os->live = header;
+            if (created) *os->header = header;
+            order_store_columns(map, header.capacity, &os->col);
+            // A row replaced in place may have reached the disk ahead of its note
+            for (uint64_t row = 0; row < header.count; row++) {
+                if (os->col.note_offset[row] > header.notes_size ||
+                    os->col.note_len[row] > header.notes_size - os->col.note_offset[row]) {
+                    os->col.note_len[row] = 0;
+                }
+            }
+            err = order_store_index_locked();
+        }
+    }
+    if (err != 0) {
+        order_store_unmap_locked();
+        if (err == EINVAL) fprintf(stderr, "Order store %s is damaged; move it away to start a new one.\n", os->path);
+        return err;
+    }
+    os->match = order_match_select();
+    return 0;
+}
+
+// Rebuild the store at twice its capacity. The copy is written next to the
+// store and renamed over it, so a crash leaves one complete version.
+static int order_store_grow_locked(void) {
+    OrderStore *os = &order_store;
+    uint64_t capacity = os->live.capacity * 2;
+    if (capacity >= UINT32_MAX) return EFBIG;
+    size_t old_offsets[ORDER_COLUMNS], offsets[ORDER_COLUMNS];
+    order_store_offsets(os->live.capacity, old_offsets);
+    size_t size = order_store_offsets(capacity, offsets);
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", os->path) >= (int)sizeof(tmp_path)) return ENAMETOOLONG;
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return errno;
+    // Owned before it gets the store's name
+    int err = flock(fd, LOCK_EX | LOCK_NB) == 0 ? 0 : errno;
+    if (err == 0 && ftruncate(fd, (off_t)size) != 0) err = errno;
+    char *map = err == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (err == 0 && map == MAP_FAILED) err = errno;
+    if (err == 0) {
+        // The copy's header counts every row put so far, so their notes go first
+        const char *old = (const char *)os->header;
+        OrderStoreHeader header = os->live;
+        header.capacity = capacity;
+        memcpy(map, &header, sizeof(header));
+        for (int c = 0; c < ORDER_COLUMNS; c++) {
+            memcpy(map + offsets[c], old + old_offsets[c], (size_t)os->live.count * order_column_widths[c]);
+        }
+        if (fdatasync(os->notes_fd) != 0 || msync(map, size, MS_SYNC) != 0 || rename(tmp_path, os->path) != 0) {
+            err = errno;
+        }
+    }
+    if (err != 0) {
+        if (map != MAP_FAILED) munmap(map, size);
+        close(fd);
+        unlink(tmp_path);
+        return err;
+    }
+    munmap(os->header, os->map_size);
+    close(os->fd);
+    os->fd = fd;
+    os->header = (OrderStoreHeader *)map;
+    os->live.capacity = capacity;
+    os->map_size = size;
+    order_store_columns(map, capacity, &os->col);
+    return order_store_index_locked();
+}
+
+// Take the store's lock, mapping the store first if nobody has yet
+static int order_store_lock(int write) {
+    OrderStore *os = &order_store;
+    while (1) {
+        if (write) {
+            pthread_rwlock_wrlock(&os->lock);
+        } else {
+            pthread_rwlock_rdlock(&os->lock);
+        }
+        if (os->header != NULL) return 0;
+        pthread_rwlock_unlock(&os->lock);
+
+        pthread_rwlock_wrlock(&os->lock);
+        int err = os->header != NULL ? 0 : order_store_map_locked();
+        pthread_rwlock_unlock(&os->lock);
+        if (err != 0) return err;
+    }
+}
+
+static void order_store_row(uint64_t row, OrderRecord *record) {
+    const OrderColumns *col = &order_store.col;
+    record->id = col->id[row];
+    record->status = col->status[row];
+    record->warehouse = col->warehouse[row];
+    record->created = col->created[row];
+    record->updated = col->updated[row];
+}
+
+// Read the note of a row into a new buffer (caller frees)
+static int order_store_read_note(uint64_t row, char **notes, size_t *notes_len) {
+    const OrderColumns *col = &order_store.col;
+    size_t len = col->note_len[row];
+    char *buffer = malloc(len + 1);
+    if (buffer == NULL) return ENOMEM;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(order_store.notes_fd, buffer + done, len - done, (off_t)(col->note_offset[row] + done));
+        if (n <= 0) {
+            int err = n < 0 ? errno : EIO;
+            if (err == EINTR) continue;
+            free(buffer);
+            return err;
+        }
+        done += (size_t)n;
+    }
+    buffer[len] = '\0';
+    *notes = buffer;
+    *notes_len = len;
+    return 0;
+}
+
+// Insert or replace one order; caller holds the lock for writing
+static int order_store_put_locked(const OrderRecord *record, const char *notes, size_t notes_len) {
+    OrderStore *os = &order_store;
+    if (notes_len > UINT32_MAX) return EFBIG;
+    uint32_t *slot = order_slot(record->id);
+    if (*slot == 0 && os->live.count == os->live.capacity) {
+        int err = order_store_grow_locked();
+        if (err != 0) return err;
+        slot = order_slot(record->id);
+    }
+    uint64_t row = *slot != 0 ? *slot - 1 : os->live.count;
+
+    // The note goes to the heap before any row points at it
+    uint64_t note_offset = os->live.notes_size;
+    int same_note = 0;
+    if (*slot != 0 && os->col.note_len[row] == notes_len) {
+        char *old;
+        size_t old_len;
+        if (order_store_read_note(row, &old, &old_len) == 0) {
+            same_note = memcmp(old, notes, notes_len) == 0;
+            free(old);
+        }
+    }
+    if (same_note) {
+        note_offset = os->col.note_offset[row];
+    } else {
+        size_t done = 0;
+        while (done < notes_len) {
+            ssize_t n = pwrite(os->notes_fd, notes + done, notes_len - done, (off_t)(note_offset + done));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            done += (size_t)n;
+        }
+        os->live.notes_size += notes_len;
+    }
+
+    os->col.id[row] = record->id;
+    os->col.status[row] = record->status;
+    os->col.warehouse[row] = record->warehouse;
+    os->col.created[row] = record->created;
+    os->col.updated[row] = record->updated;
+    os->col.note_offset[row] = note_offset;
+    os->col.note_len[row] = (uint32_t)notes_len;
+    if (*slot == 0) {
+        *slot = (uint32_t)row + 1;
+        os->live.count++;
+    }
+    return 0;
+}
+
+// Use the store at path, mapping it on first use
+void order_store_open(const char *path) {
+    pthread_rwlock_wrlock(&order_store.lock);
+    snprintf(order_store.path, sizeof(order_store.path), "%s", path);
+    snprintf(order_store.notes_path, sizeof(order_store.notes_path), "%s.notes", path);
+    pthread_rwlock_unlock(&order_store.lock);
+}
+
+// Make the puts so far durable: the notes, then the columns (the mapped
+// header still holds the last synced counts), then the new header. Caller
+// holds the lock for writing.
+static int order_store_sync_locked(void) {
+    OrderStore *os = &order_store;
+    if (fdatasync(os->notes_fd) != 0 || msync(os->header, os->map_size, MS_SYNC) != 0) return errno;
+    if (memcmp(os->header, &os->live, sizeof(os->live)) == 0) return 0;
+    *os->header = os->live;
+    return msync(os->header, ORDER_HEADER_BYTES, MS_SYNC) == 0 ? 0 : errno;
+}
+
+// Flush the store and unmap it
+void order_store_close(void) {
+    pthread_rwlock_wrlock(&order_store.lock);
+    if (order_store.header != NULL) order_store_sync_locked();
+    order_store_unmap_locked();
+    pthread_rwlock_unlock(&order_store.lock);
+}
+
+// Make every put so far durable
+int order_store_sync(void) {
+    int err = order_store_lock(1);
+    if (err != 0) return err;
+    err = order_store_sync_locked();
+    pthread_rwlock_unlock(&order_store.lock);
+    return err;
+}
+
+// Insert an order, or replace the one with the same id. It survives a
+// crash once order_store_sync has run.
+int order_store_put(const OrderRecord *record, const char *notes, size_t notes_len) {
+    int err = order_store_lock(1);
+    if (err != 0) return err;
+    err = order_store_put_locked(record, notes, notes_len);
+    pthread_rwlock_unlock(&order_store.lock);
+    return err;
+}
+
+// Look up one order. With notes non-NULL its note is returned in a new
+// buffer (caller frees).
+int order_store_get(uint64_t id, OrderRecord *record, char **notes, size_t *notes_len) {
+    int err = order_store_lock(0);
+    if (err != 0) return err;
+    uint32_t slot = *order_slot(id);
+    if (slot == 0) {
+        err = ENOENT;
+    } else {
+        order_store_row(slot - 1, record);
+        if (notes != NULL) err = order_store_read_note(slot - 1, notes, notes_len);
+    }
+    pthread_rwlock_unlock(&order_store.lock);
+    return err;
+}
+
+// Call visit for every order with the given status, in store order, and
+// count them. visit may be NULL to only count; it runs under the store's
+// read lock and must not put.
+int order_store_scan(int status, OrderVisitor visit, void *arg, size_t *matched) {
+    *matched = 0;
+    if (status < 0 || status >= ORDER_STATUS_COUNT) return EINVAL;
+    int err = order_store_lock(0);
+    if (err != 0) return err;
+    OrderStore *os = &order_store;
+    uint64_t bits[ORDER_SCAN_ROWS / 64];
+    size_t count = (size_t)os->live.count;
+    for (size_t base = 0; base < count; base += ORDER_SCAN_ROWS) {
+        size_t rows = count - base < ORDER_SCAN_ROWS ? count - base : ORDER_SCAN_ROWS;
+        size_t found = os->match(os->col.status + base, rows, (uint8_t)status, visit != NULL ? bits : NULL);
+        *matched += found;
+        if (visit == NULL || found == 0) continue;
+        for (size_t w = 0; w < (rows + 63) / 64; w++) {
+            for (uint64_t mask = bits[w]; mask != 0; mask &= mask - 1) {
+                OrderRecord record;
+                order_store_row(base + w * 64 + (size_t)__builtin_ctzll(mask), &record);
+                visit(&record, arg);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&os->lock);
+    return 0;
+}
+
+// Number of orders in each status, and in total
+int order_store_counts(size_t counts[ORDER_STATUS_COUNT], size_t *total) {
+    *total = 0;
+    for (int s = 0; s < ORDER_STATUS_COUNT; s++) {
+        int err = order_store_scan(s, NULL, NULL, &counts[s]);
+        if (err != 0) return err;
+        *total += counts[s];
+    }
+    return 0;
+}
+
+// One .track file on its way into or out of the store
+typedef struct OrderFile {
+    char name[NAME_MAX + 1];
+    OrderRecord record;
+    char *notes;
+    size_t notes_len;
+    int err;
+} OrderFile;
+
+typedef struct OrderFileJob {
+    int dir_fd;
+    OrderFile *files;
+} OrderFileJob;
+
+// The order id in a file name of the form order_NNN.track
+static int order_track_id(const char *name, uint64_t *id) {
+    if (strncmp(name, "order_", 6) != 0 || !isdigit((unsigned char)name[6])) return 0;
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(name + 6, &end, 10);
+    if (errno != 0 || strcmp(end, ".track") != 0) return 0;
+    *id = value;
+    return 1;
+}
+
+// The value of a "key: value" line, or NULL when line is something else
+static const char *order_track_field(const char *line, const char *key) {
+    size_t len = strlen(key);
+    if (strncasecmp(line, key, len) != 0 || line[len] != ':') return NULL;
+    const char *value = line + len + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    return value;
+}
+
+// Parse "1792162765", "2026-10-16T14:59:25Z" or "2026-10-16 14:59:25" (UTC)
+static int order_parse_time(const char *text, int64_t *when) {
+    char *end;
+    long long seconds = strtoll(text, &end, 10);
+    if (end != text && *end == '\0') {
+        *when = seconds;
+        return 1;
+    }
+    struct tm tm = { 0 };
+    end = strptime(text, "%Y-%m-%dT%H:%M:%SZ", &tm);
+    if (end == NULL || *end != '\0') {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(text, "%Y-%m-%d %H:%M:%S", &tm);
+    }
+    if (end == NULL || *end != '\0') return 0;
+    *when = (int64_t)timegm(&tm);
+    return 1;
+}
+
+// Parse one line of a .track file into file; anything that is not a known
+// field with a valid value is kept as a note
+static void order_track_line(OrderFile *file, char *line, size_t len) {
+    // Trim the line end, including a CR from files edited elsewhere
+    while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+    char saved = line[len];
+    line[len] = '\0';
+    const char *value;
+    int status;
+    int64_t when;
+    char *end;
+    int used = 0;
+    if ((value = order_track_field(line, "status")) != NULL && (status = order_status_parse(value)) >= 0) {
+        file->record.status = (uint8_t)status;
+        used = 1;
+    } else if ((value = order_track_field(line, "warehouse")) != NULL && isdigit((unsigned char)*value)) {
+        unsigned long warehouse = strtoul(value, &end, 10);
+        if (*end == '\0' && warehouse <= UINT32_MAX) {
+            file->record.warehouse = (uint32_t)warehouse;
+            used = 1;
+        }
+    } else if ((value = order_track_field(line, "created")) != NULL && order_parse_time(value, &when)) {
+        file->record.created = when;
+        used = 1;
+    }
+    line[len] = saved;
+    if (used) return;
+    memcpy(file->notes + file->notes_len, line, len);
+    file->notes_len += len;
+    file->notes[file->notes_len++] = '\n';
+}
+
+// Read and parse one .track file (parallel task)
+static void order_import_task(int worker, size_t index, void *arg) {
+    (void)worker;
+    OrderFileJob *job = arg;
+    OrderFile *file = &job->files[index];
+    int fd = openat(job->dir_fd, file->name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) fd = pack_openat(job->dir_fd, file->name, NULL);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        file->err = errno;
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        close(fd);
+        file->err = EINVAL;
+        return;
+    }
+    size_t size = (size_t)sb.st_size;
+    char *text = malloc(size + 1);
+    // A note never outgrows the file, plus the newline a last line may lack
+    file->notes = malloc(size + 1);
+    if (text == NULL || file->notes == NULL) {
+        free(text);
+        close(fd);
+        file->err = ENOMEM;
+        return;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, text + done, size - done, (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+
+    file->record.updated = (int64_t)sb.st_mtim.tv_sec;
+    file->record.created = file->record.updated;
+    for (size_t start = 0; start < done;) {
+        char *newline = memchr(text + start, '\n', done - start);
+        size_t end = newline != NULL ? (size_t)(newline - text) : done;
+        order_track_line(file, text + start, end - start);
+        start = end + 1;
+    }
+    free(text);
+}
+
+// Packed .track files of a directory that no plain file shadows
+typedef struct OrderPacked {
+    int dir_fd;
+    OutBuffer names;     // NUL-terminated, back to back
+} OrderPacked;
+
+static void order_packed_visit(const char *name, size_t name_len, const NameIndexInfo *info, void *arg) {
+    (void)info;
+    OrderPacked *packed = arg;
+    uint64_t id;
+    struct stat sb;
+    if (!order_track_id(name, &id) || fstatat(packed->dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) return;
+    out_append(&packed->names, name, name_len + 1);
+}
+
+// Import every order_NNN.track file in dir, packed or not, replacing
+// orders already in the store. Files are parsed in parallel a chunk at a
+// time.
+int order_store_import(const char *dir, size_t *imported, size_t *failed) {
+    *imported = *failed = 0;
+    int dir_fd = confine_open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (dir_fd < 0) return errno;
+    int list_fd = dup(dir_fd);
+    DIR *listing = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+    if (listing == NULL) {
+        int err = errno;
+        if (list_fd >= 0) close(list_fd);
+        close(dir_fd);
+        return err;
+    }
+
+    // Packed files come after the directory's own
+    OrderPacked packed = { .dir_fd = dir_fd };
+    pack_for_each(dir_fd, order_packed_visit, &packed);
+    size_t packed_pos = 0;
+    int listed = 0;
+
+    OrderFile *files = malloc(ORDER_FILE_CHUNK * sizeof(OrderFile));
+    OrderFileJob job = { .dir_fd = dir_fd, .files = files };
+    int err = files == NULL ? ENOMEM : 0;
+    int workers = walk_default_workers();
+    int done = 0;
+    while (err == 0 && !done) {
+        size_t count = 0;
+        while (count < ORDER_FILE_CHUNK) {
+            const char *name = NULL;
+            if (!listed) {
+                struct dirent *de = readdir(listing);
+                if (de != NULL) name = de->d_name;
+                else listed = 1;
+            }
+            if (listed) {
+                if (packed_pos >= packed.names.len) break;
+                name = packed.names.data + packed_pos;
+                packed_pos += strlen(name) + 1;
+            }
+            uint64_t id;
+            if (!order_track_id(name, &id)) continue;
+            files[count] = (OrderFile){ .record = { .id = id } };
+            snprintf(files[count].name, sizeof(files[count].name), "%s", name);
+            count++;
+        }
+        done = count < ORDER_FILE_CHUNK;
+        if (count == 0) break;
+
+        ParallelJob parallel;
+        parallel_start(&parallel, count, workers, order_import_task, &job);
+        parallel_wait(&parallel);
+
+        err = order_store_lock(1);
+        for (size_t i = 0; i < count; i++) {
+            if (err == 0 && files[i].err == 0) files[i].err = order_store_put_locked(&files[i].record, files[i].notes,
+                                                                                      files[i].notes_len);
+            if (files[i].err == 0) {
+                (*imported)++;
+            } else {
+                (*failed)++;
+            }
+            free(files[i].notes);
+        }
+        if (err == 0) pthread_rwlock_unlock(&order_store.lock);
+    }
+    closedir(listing);
+    close(dir_fd);
+    free(files);
+    out_free(&packed.names);
+    if (*imported > 0) {
+        int sync_err = order_store_sync();
+        if (err == 0) err = sync_err;
+    }
+    return err;
+}
+
+// Write one order back as dir/order_NNN.track (parallel task). The file is
+// written under a temporary name and renamed into place.
+static void order_export_task(int worker, size_t index, void *arg) {
+    (void)worker;
+    OrderFileJob *job = arg;
+    OrderFile *file = &job->files[index];
+    if (file->err != 0) return;
+    const OrderRecord *record = &file->record;
+    char tmp_name[NAME_MAX + 8];
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.tmp", file->name);
+
+    char header[160], created[32];
+    struct tm tm;
+    time_t when = (time_t)record->created;
+    strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&when, &tm));
+    int len = 0;
+    if (record->status != ORDER_UNKNOWN) {
+        len += snprintf(header + len, sizeof(header) - (size_t)len, "status: %s\n", order_status_name(record->status));
+    }
+    if (record->warehouse != 0) {
+        len += snprintf(header + len, sizeof(header) - (size_t)len, "warehouse: %u\n", record->warehouse);
+    }
+    len += snprintf(header + len, sizeof(header) - (size_t)len, "created: %s\n", created);
+
+    int fd = openat(job->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        file->err = errno;
+        return;
+    }
+    int err = fsop_write_all(fd, header, (size_t)len);
+    if (err == 0) err = fsop_write_all(fd, file->notes, file->notes_len);
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = (time_t)record->updated } };
+    if (err == 0 && futimens(fd, times) != 0) err = errno;
+    if (close(fd) != 0 && err == 0) err = errno;
+    if (err == 0 && renameat(job->dir_fd, tmp_name, job->dir_fd, file->name) != 0) err = errno;
+    if (err != 0) unlinkat(job->dir_fd, tmp_name, 0);
+    file->err = err;
+}
+
+// Write every order in the store to dir as order_NNN.track files
+int order_store_export(const char *dir, size_t *exported, size_t *failed) {
+    *exported = *failed = 0;
+    int dir_fd = confine_open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (dir_fd < 0) return errno;
+    OrderFile *files = malloc(ORDER_FILE_CHUNK * sizeof(OrderFile));
+    int err = files == NULL ? ENOMEM : order_store_lock(0);
+    if (err != 0) {
+        free(files);
+        close(dir_fd);
+        return err;
+    }
+
+    OrderFileJob job = { .dir_fd = dir_fd, .files = files };
+    int workers = walk_default_workers();
+    uint64_t total = order_store.live.count;
+    for (uint64_t base = 0; base < total; base += ORDER_FILE_CHUNK) {
+        size_t count = total - base < ORDER_FILE_CHUNK ? (size_t)(total - base) : ORDER_FILE_CHUNK;
+        for (size_t i = 0; i < count; i++) {
+            OrderFile *file = &files[i];
+            *file = (OrderFile){ .err = 0 };
+            order_store_row(base + i, &file->record);
+            snprintf(file->name, sizeof(file->name), "order_%llu.track", (unsigned long long)file->record.id);
+            file->err = order_store_read_note(base + i, &file->notes, &file->notes_len);
+        }
+
+        ParallelJob parallel;
+        parallel_start(&parallel, count, workers, order_export_task, &job);
+        parallel_wait(&parallel);
+
+        for (size_t i = 0; i < count; i++) {
+            if (files[i].err == 0) {
+                (*exported)++;
+            } else {
+                (*failed)++;
+            }
+            free(files[i].notes);
+        }
+    }
+    pthread_rwlock_unlock(&order_store.lock);
+    free(files);
+    close(dir_fd);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Inventory engine
+//
+// admin/inventory.txt and warehouse/stock.dat hold one item per line:
+// SKU, quantity and an optional name, separated by blanks. Each file is
+// loaded on first use into an open-addressing hash table keyed by SKU, with
+// one 64-byte record per slot so a lookup touches a single cache line.
+// Quantities are changed with atomic adds under the table's read lock, so
+// stock checks and adjustments from many sessions run in parallel; only a
+// new SKU takes the write lock.
+//
+// Changes reach the file through snapshots: the records are copied under the
+// write lock, which only blocks adjustments for the length of a memory copy,
+// and the copy is written to a new file that is renamed over the old one, so
+// the file on disk is always a complete inventory. A background thread
+// saves changed inventories every LOGISTICS_INVENTORY_SNAPSHOT seconds
+// (default 30; 0 saves only at exit) and reloads a file edited by someone
+// else. If there are unsaved adjustments, the edited file is read again and
+// each item's change since the last save is applied to its quantity there,
+// so lines added or edited outside the program are kept. Comment and
+// unparseable lines are kept in place.
+// ---------------------------------------------------------------------------
+
+#define INVENTORY_FILES 2
+#define INVENTORY_MIN_SLOTS 1024
+#define INVENTORY_DEFAULT_INTERVAL 30
+
+// One slot of the table; an empty sku marks a free slot
+typedef struct __attribute__((aligned(64))) InventorySlot {
+    char sku[INVENTORY_SKU_MAX];
+    atomic_llong quantity;
+    char *name;              // NULL when the line had none
+    uint32_t order;          // Position in the file
+    uint32_t hash;
+} InventorySlot;
+
+// A line of the file that is not an item, kept to be written back in place
+typedef struct InventoryLine {
+    uint32_t order;
+    char *text;
+} InventoryLine;
+
+// The quantity of one item in a file being written
+typedef struct InventoryWritten {
+    char sku[INVENTORY_SKU_MAX];
+    uint32_t hash;
+    long long quantity;
+} InventoryWritten;
+
+typedef struct Inventory {
+    char path[PATH_MAX];
+    pthread_rwlock_t lock;       // Readers: lookups and adjustments; writer: new SKUs, growth, snapshots
+    pthread_mutex_t save_lock;   // Serializes loads and saves
+    int loaded;
+    InventorySlot *slots;
+    long long *saved;            // Per slot: the quantity as last read from or written to the file
+    size_t slot_count, item_count;
+    InventoryLine *lines;
+    size_t line_count;
+    uint32_t next_order;
+    atomic_long changes;         // Adjustments not yet saved
+    struct stat known;           // The file as last loaded or saved
+} Inventory;
+
+static Inventory inventories[INVENTORY_FILES] = {
+    { .lock = PTHREAD_RWLOCK_INITIALIZER, .save_lock = PTHREAD_MUTEX_INITIALIZER },
+    { .lock = PTHREAD_RWLOCK_INITIALIZER, .save_lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static struct {
+    long interval;
+    pthread_t thread;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+} inventory_saver = { .interval = INVENTORY_DEFAULT_INTERVAL, .lock = PTHREAD_MUTEX_INITIALIZER,
+                      .wake = PTHREAD_COND_INITIALIZER };
+
+static uint32_t inventory_hash(const char *sku) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)sku; *p != '\0'; p++) hash = (hash ^ *p) * 16777619u;
+    return hash;
+}
+
+// The slot holding sku, or the free slot where it belongs
+static InventorySlot *inventory_slot(Inventory *inv, const char *sku, uint32_t hash) {
+    size_t mask = inv->slot_count - 1;
+    size_t j = hash & mask;
+    while (inv->slots[j].sku[0] != '\0' && (inv->slots[j].hash != hash || strcmp(inv->slots[j].sku, sku) != 0)) {
+        j = (j + 1) & mask;
+    }
+    return &inv->slots[j];
+}
+
+static InventorySlot *inventory_alloc_slots(size_t count) {
+    InventorySlot *slots = aligned_alloc(64, count * sizeof(InventorySlot));
+    if (slots != NULL) memset(slots, 0, count * sizeof(InventorySlot));
+    return slots;
+}
+
+// Make room for one more item, keeping the table at most half full; caller
+// holds the write lock
+static int inventory_reserve(Inventory *inv) {
+    if (inv->slots != NULL && (inv->item_count + 1) * 2 <= inv->slot_count) return 0;
+    size_t slot_count = inv->slot_count ? inv->slot_count * 2 : INVENTORY_MIN_SLOTS;
+    InventorySlot *slots = inventory_alloc_slots(slot_count);
+    long long *saved = calloc(slot_count, sizeof(long long));
+    if (slots == NULL || saved == NULL) {
+        free(slots);
+        free(saved);
+        return ENOMEM;
+    }
+    InventorySlot *old = inv->slots;
+    long long *old_saved = inv->saved;
+    size_t old_count = inv->slot_count;
+    inv->slots = slots;
+    inv->saved = saved;
+    inv->slot_count = slot_count;
+    for (size_t i = 0; i < old_count; i++) {
+        if (old[i].sku[0] == '\0') continue;
+        InventorySlot *slot = inventory_slot(inv, old[i].sku, old[i].hash);
+        memcpy(slot->sku, old[i].sku, sizeof(slot->sku));
+        atomic_init(&slot->quantity, atomic_load(&old[i].quantity));
+        slot->name = old[i].name;
+        slot->order = old[i].order;
+        slot->hash = old[i].hash;
+        saved[slot - slots] = old_saved[i];
+    }
+    free(old);
+    free(old_saved);
+    return 0;
+}
+
+// Add a new item; caller holds the write lock and has checked sku is absent.
+// saved is its quantity in the file, 0 for an item the file does not have.
+static int inventory_insert(Inventory *inv, const char *sku, long long quantity, long long saved, const char *name) {
+    int err = inventory_reserve(inv);
+    if (err != 0) return err;
+    char *copy = NULL;
+    if (name != NULL && name[0] != '\0' && (copy = strdup(name)) == NULL) return ENOMEM;
+    uint32_t hash = inventory_hash(sku);
+    InventorySlot *slot = inventory_slot(inv, sku, hash);
+    snprintf(slot->sku, sizeof(slot->sku), "%s", sku);
+    atomic_init(&slot->quantity, quantity);
+    slot->name = copy;
+    slot->order = inv->next_order++;
+    slot->hash = hash;
+    inv->saved[slot - inv->slots] = saved;
+    inv->item_count++;
+    return 0;
+}
+
+static int inventory_keep_line(Inventory *inv, const char *text, size_t len) {
+    InventoryLine *lines = realloc(inv->lines, (inv->line_count + 1) * sizeof(InventoryLine));
+    if (lines == NULL) return ENOMEM;
+    inv->lines = lines;
+    char *copy = strndup(text, len);
+    if (copy == NULL) return ENOMEM;
+    lines[inv->line_count++] = (InventoryLine){ .order = inv->next_order++, .text = copy };
+    return 0;
+}
+
+// Free every item and kept line; caller holds the write lock
+static void inventory_clear(Inventory *inv) {
+    for (size_t i = 0; i < inv->slot_count; i++) free(inv->slots[i].name);
+    for (size_t i = 0; i < inv->line_count; i++) free(inv->lines[i].text);
+    free(inv->slots);
+    free(inv->saved);
+    free(inv->lines);
+    inv->slots = NULL;
+    inv->saved = NULL;
+    inv->lines = NULL;
+    inv->slot_count = inv->item_count = inv->line_count = 0;
+    inv->next_order = 0;
+}
+
+// Is sku usable as a key: printable, no blanks, short enough?
+static int inventory_valid_sku(const char *sku) {
+    size_t len = strlen(sku);
+    if (len == 0 || len >= INVENTORY_SKU_MAX || sku[0] == '#') return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isgraph((unsigned char)sku[i])) return 0;
+    }
+    return 1;
+}
+
+// Parse one line: an item, or something to keep as it is
+static int inventory_parse_line(Inventory *inv, char *line, size_t len) {
+    while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+    char saved = line[len];
+    line[len] = '\0';
+    char *p = line + strspn(line, " \t");
+    char *sku = p;
+    p += strcspn(p, " \t");
+    char *quantity_start = p + strspn(p, " \t");
+    char *end;
+    errno = 0;
+    long long quantity = strtoll(quantity_start, &end, 10);
+    int is_item = *p != '\0' && end != quantity_start && errno == 0 && quantity >= 0 &&
+                  (*end == '\0' || *end == ' ' || *end == '\t');
+    int err = 0;
+    if (is_item) {
+        char separator = *p;
+        *p = '\0';
+        const char *name = end + strspn(end, " \t");
+        uint32_t hash = inventory_hash(sku);
+        // A repeated SKU is kept as a plain line rather than merged
+        is_item = inventory_valid_sku(sku) && (inv->slots == NULL || inventory_slot(inv, sku, hash)->sku[0] == '\0');
+        if (is_item) err = inventory_insert(inv, sku, quantity, quantity, name);
+        *p = separator;
+    }
+    if (!is_item) err = inventory_keep_line(inv, line, len);
+    line[len] = saved;
+    return err;
+}
+
+// Read and parse path into fresh, an empty table
+static int inventory_read(const char *path, Inventory *fresh) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        // No file yet: an empty inventory
+        if (errno != ENOENT) return errno;
+        memset(&fresh->known, 0, sizeof(fresh->known));
+        return inventory_reserve(fresh);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        close(fd);
+        return S_ISDIR(sb.st_mode) ? EISDIR : EINVAL;
+    }
+    size_t size = (size_t)sb.st_size;
+    char *text = malloc(size + 1);
+    if (text == NULL) {
+        close(fd);
+        return ENOMEM;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, text + done, size - done, (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+
+    int err = 0;
+    for (size_t start = 0; start < done && err == 0;) {
+        char *newline = memchr(text + start, '\n', done - start);
+        size_t end = newline != NULL ? (size_t)(newline - text) : done;
+        err = inventory_parse_line(fresh, text + start, end - start);
+        start = end + 1;
+    }
+    free(text);
+    if (err == 0) err = inventory_reserve(fresh);
+    if (err != 0) {
+        inventory_clear(fresh);
+        return err;
+    }
+    fresh->known = sb;
+    return 0;
+}
+
+// Replace the contents of inv with those of fresh; caller holds the write lock
+static void inventory_adopt(Inventory *inv, Inventory *fresh) {
+    inventory_clear(inv);
+    inv->slots = fresh->slots;
+    inv->saved = fresh->saved;
+    inv->slot_count = fresh->slot_count;
+    inv->item_count = fresh->item_count;
+    inv->lines = fresh->lines;
+    inv->line_count = fresh->line_count;
+    inv->next_order = fresh->next_order;
+    inv->known = fresh->known;
+}
+
+// (Re)load the file; caller holds save_lock and the write lock. The file is
+// parsed into a new table that replaces the current one only on success, so
+// a failed first load leaves the inventory unloaded and a failed reload
+// leaves it as it was.
+static int inventory_load_locked(Inventory *inv) {
+    Inventory fresh = { .loaded = 0 };
+    int err = inventory_read(inv->path, &fresh);
+    if (err != 0) return err;
+    inventory_adopt(inv, &fresh);
+    atomic_store(&inv->changes, 0);
+    inv->loaded = 1;
+    return 0;
+}
+
+// Reload a file edited by someone else while inv has unsaved adjustments:
+// each item's change since the last save is applied to the quantity the
+// file now holds, and items the file no longer has keep what was added
+// here. Caller holds save_lock and the write lock; on failure inv is left
+// as it was.
+static int inventory_merge_locked(Inventory *inv) {
+    Inventory fresh = { .loaded = 0 };
+    int err = inventory_read(inv->path, &fresh);
+    if (err != 0) return err;
+    for (size_t i = 0; i < inv->slot_count && err == 0; i++) {
+        const InventorySlot *ours = &inv->slots[i];
+        if (ours->sku[0] == '\0') continue;
+        long long delta = atomic_load(&ours->quantity) - inv->saved[i];
+        if (delta == 0) continue;
+        InventorySlot *theirs = inventory_slot(&fresh, ours->sku, ours->hash);
+        if (theirs->sku[0] != '\0') {
+            long long next;
+            if (__builtin_add_overflow(atomic_load(&theirs->quantity), delta, &next)) next = LLONG_MAX;
+            if (next < 0) {
+                fprintf(stderr, "Warning: %s in %s would go below zero after merging; keeping 0.\n", ours->sku,
+                        inv->path);
+                next = 0;
+            }
+            atomic_store(&theirs->quantity, next);
+        } else if (delta > 0) {
+            err = inventory_insert(&fresh, ours->sku, delta, 0, ours->name);
+        }
+    }
+    if (err != 0) {
+        inventory_clear(&fresh);
+        return err;
+    }
+    inventory_adopt(inv, &fresh);
+    return 0;
+}
+
+// The registered inventory stored at path, loaded if it was not yet
+static Inventory *inventory_find(const char *path, int *err) {
+    for (int i = 0; i < INVENTORY_FILES; i++) {
+        Inventory *inv = &inventories[i];
+        if (inv->path[0] == '\0' || strcmp(inv->path, path) != 0) continue;
+        *err = 0;
+        pthread_rwlock_rdlock(&inv->lock);
+        int loaded = inv->loaded;
+        pthread_rwlock_unlock(&inv->lock);
+        if (!loaded) {
+            pthread_mutex_lock(&inv->save_lock);
+            pthread_rwlock_wrlock(&inv->lock);
+            if (!inv->loaded) *err = inventory_load_locked(inv);
+            pthread_rwlock_unlock(&inv->lock);
+            pthread_mutex_unlock(&inv->save_lock);
+        }
+        return *err == 0 ? inv : NULL;
+    }
+    *err = ENOENT;
+    return NULL;
+}
+
+// Quantity and name of one SKU. name (name_size bytes) may be NULL.
+int inventory_lookup(const char *path, const char *sku, long long *quantity, char *name, size_t name_size) {
+    int err;
+    Inventory *inv = inventory_find(path, &err);
+    if (inv == NULL) return err;
+    pthread_rwlock_rdlock(&inv->lock);
+    InventorySlot *slot = inventory_slot(inv, sku, inventory_hash(sku));
+    if (slot->sku[0] == '\0') {
+        err = ENOENT;
+    } else {
+        *quantity = atomic_load(&slot->quantity);
+        if (name != NULL) snprintf(name, name_size, "%s", slot->name != NULL ? slot->name : "");
+    }
+    pthread_rwlock_unlock(&inv->lock);
+    return err;
+}
+
+// Add delta (negative to take stock out) to the quantity of sku. Taking out
+// more than is in stock fails with ERANGE and changes nothing; adding to an
+// unknown SKU creates it.
+int inventory_adjust(const char *path, const char *sku, long long delta, long long *quantity) {
+    if (!inventory_valid_sku(sku)) return EINVAL;
+    int err;
+    Inventory *inv = inventory_find(path, &err);
+    if (inv == NULL) return err;
+    uint32_t hash = inventory_hash(sku);
+
+    pthread_rwlock_rdlock(&inv->lock);
+    InventorySlot *slot = inventory_slot(inv, sku, hash);
+    if (slot->sku[0] != '\0') {
+        long long current = atomic_load(&slot->quantity), next;
+        do {
+            if (__builtin_add_overflow(current, delta, &next) || next < 0) {
+                err = ERANGE;
+                break;
+            }
+        } while (!atomic_compare_exchange_weak(&slot->quantity, &current, next));
+        pthread_rwlock_unlock(&inv->lock);
+        if (err == 0) {
+            *quantity = next;
+            atomic_fetch_add(&inv->changes, 1);
+        }
+        return err;
+    }
+    pthread_rwlock_unlock(&inv->lock);
+    if (delta < 0) return ENOENT;
+
+    // A new SKU: look again under the write lock, as another session may
+    // have added it meanwhile
+    pthread_rwlock_wrlock(&inv->lock);
+    slot = inventory_slot(inv, sku, hash);
+    if (slot->sku[0] != '\0') {
+        *quantity = atomic_fetch_add(&slot->quantity, delta) + delta;
+    } else {
+        err = inventory_insert(inv, sku, delta, 0, NULL);
+        *quantity = delta;
+    }
+    pthread_rwlock_unlock(&inv->lock);
+    if (err == 0) atomic_fetch_add(&inv->changes, 1);
+    return err;
+}
+
+static int inventory_compare_order(const void *a, const void *b) {
+    const InventoryLine *x = a, *y = b;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Call visit for every item with at most max_quantity in stock, in file order
+int inventory_low(const char *path, long long max_quantity, InventoryVisitor visit, void *arg) {
+    int err;
+    Inventory *inv = inventory_find(path, &err);
+    if (inv == NULL) return err;
+    pthread_rwlock_rdlock(&inv->lock);
+    InventoryLine *matches = malloc((inv->item_count + 1) * sizeof(InventoryLine));
+    size_t count = 0;
+    for (size_t i = 0; matches != NULL && i < inv->slot_count; i++) {
+        if (inv->slots[i].sku[0] == '\0' || atomic_load(&inv->slots[i].quantity) > max_quantity) continue;
+        matches[count++] = (InventoryLine){ .order = inv->slots[i].order, .text = (char *)&inv->slots[i] };
+    }
+    if (matches != NULL) {
+        qsort(matches, count, sizeof(*matches), inventory_compare_order);
+        for (size_t i = 0; i < count; i++) {
+            const InventorySlot *slot = (const InventorySlot *)matches[i].text;
+            visit(slot->sku, atomic_load(&slot->quantity), slot->name, arg);
+        }
+    }
+    pthread_rwlock_unlock(&inv->lock);
+    free(matches);
+    return matches == NULL ? ENOMEM : 0;
+}
+
+// Write the inventory to disk if it changed; caller holds save_lock
+static int inventory_save_locked(Inventory *inv) {
+    struct stat sb;
+    int on_disk = lstat(inv->path, &sb) == 0;
+    int edited = on_disk ? sb.st_ino != inv->known.st_ino || sb.st_size != inv->known.st_size ||
+                               sb.st_mtim.tv_sec != inv->known.st_mtim.tv_sec ||
+                               sb.st_mtim.tv_nsec != inv->known.st_mtim.tv_nsec
+                         : inv->known.st_ino != 0;
+    long changes = atomic_load(&inv->changes);
+    if (changes == 0) {
+        if (!edited) return 0;
+        // Edited by someone else and nothing of ours to lose: take theirs
+        pthread_rwlock_wrlock(&inv->lock);
+        int err = inventory_load_locked(inv);
+        pthread_rwlock_unlock(&inv->lock);
+        return err;
+    }
+
+    // Copy everything under the write lock: a consistent point in time. An
+    // edit from outside is merged in first rather than written over.
+    pthread_rwlock_wrlock(&inv->lock);
+    if (edited) {
+        int err = inventory_merge_locked(inv);
+        if (err != 0) {
+            pthread_rwlock_unlock(&inv->lock);
+            return err;
+        }
+    }
+    changes = atomic_load(&inv->changes);
+    size_t count = inv->item_count + inv->line_count;
+    InventoryLine *rows = malloc((count + 1) * sizeof(InventoryLine));
+    InventoryWritten *written = malloc((inv->item_count + 1) * sizeof(InventoryWritten));
+    OutBuffer out = { 0 };
+    size_t n = 0, items = 0;
+    for (size_t i = 0; rows != NULL && written != NULL && i < inv->slot_count; i++) {
+        const InventorySlot *slot = &inv->slots[i];
+        if (slot->sku[0] == '\0') continue;
+        long long quantity = atomic_load(&slot->quantity);
+        char *text = NULL;
+        if (asprintf(&text, "%s\t%lld%s%s", slot->sku, quantity, slot->name != NULL ? "\t" : "",
+                     slot->name != NULL ? slot->name : "") < 0) {
+            text = NULL;
+        }
+        rows[n++] = (InventoryLine){ .order = slot->order, .text = text };
+        // What the file will hold, to become each slot's saved quantity
+        memcpy(written[items].sku, slot->sku, sizeof(slot->sku));
+        written[items].hash = slot->hash;
+        written[items].quantity = quantity;
+        items++;
+    }
+    for (size_t i = 0; rows != NULL && written != NULL && i < inv->line_count; i++) {
+        rows[n++] = (InventoryLine){ .order = inv->lines[i].order, .text = strdup(inv->lines[i].text) };
+    }
+    pthread_rwlock_unlock(&inv->lock);
+
+    int err = rows == NULL || written == NULL ? ENOMEM : 0;
+    if (err == 0) qsort(rows, n, sizeof(*rows), inventory_compare_order);
+    for (size_t i = 0; i < n; i++) {
+        if (rows[i].text == NULL && err == 0) err = ENOMEM;
+        if (err == 0) err = out_append(&out, rows[i].text, strlen(rows[i].text));
+        if (err == 0) err = out_append(&out, "\n", 1);
+        free(rows[i].text);
+    }
+    free(rows);
+
+    // The copy replaces the file in one rename
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", inv->path);
+    int fd = err == 0 ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644) : -1;
+    if (err == 0 && fd < 0) err = errno;
+    if (err == 0) err = fsop_write_all(fd, out.data != NULL ? out.data : "", out.len);
+    if (err == 0 && fdatasync(fd) != 0) err = errno;
+    if (fd >= 0 && close(fd) != 0 && err == 0) err = errno;
+    if (err == 0 && rename(tmp_path, inv->path) != 0) err = errno;
+    if (err != 0 && fd >= 0) unlink(tmp_path);
+    out_free(&out);
+    if (err == 0) {
+        pthread_rwlock_wrlock(&inv->lock);
+        for (size_t i = 0; i < items; i++) {
+            InventorySlot *slot = inventory_slot(inv, written[i].sku, written[i].hash);
+            if (slot->sku[0] != '\0') inv->saved[slot - inv->slots] = written[i].quantity;
+        }
+        pthread_rwlock_unlock(&inv->lock);
+        atomic_fetch_sub(&inv->changes, changes);
+        if (lstat(inv->path, &sb) == 0) inv->known = sb;
+    }
+    free(written);
+    return err;
+}
+
+// Save one inventory now
+int inventory_snapshot(const char *path) {
+    int err;
+    Inventory *inv = inventory_find(path, &err);
+    if (inv == NULL) return err;
+    pthread_mutex_lock(&inv->save_lock);
+    err = inventory_save_locked(inv);
+    pthread_mutex_unlock(&inv->save_lock);
+    return err;
+}
+
+static void inventory_save_all(void) {
+    for (int i = 0; i < INVENTORY_FILES; i++) {
+        Inventory *inv = &inventories[i];
+        pthread_mutex_lock(&inv->save_lock);
+        if (inv->loaded) {
+            int err = inventory_save_locked(inv);
+            if (err != 0) fprintf(stderr, "Error saving %s: %s\n", inv->path, strerror(err));
+        }
+        pthread_mutex_unlock(&inv->save_lock);
+    }
+}
+
+static void *inventory_saver_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&inventory_saver.lock);
+    while (!inventory_saver.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += inventory_saver.interval;
+        while (!inventory_saver.stop &&
+               pthread_cond_timedwait(&inventory_saver.wake, &inventory_saver.lock, &deadline) != ETIMEDOUT) {
+        }
+        if (inventory_saver.stop) break;
+        pthread_mutex_unlock(&inventory_saver.lock);
+        inventory_save_all();
+        pthread_mutex_lock(&inventory_saver.lock);
+    }
+    pthread_mutex_unlock(&inventory_saver.lock);
+    return NULL;
+}
+
+// Register the inventory files and start the periodic saver
+void inventory_init(const char *admin_path, const char *warehouse_path, const char *interval) {
+    snprintf(inventories[0].path, sizeof(inventories[0].path), "%s", admin_path);
+    snprintf(inventories[1].path, sizeof(inventories[1].path), "%s", warehouse_path);
+    if (interval != NULL && interval[0] != '\0') {
+        char *end;
+        long value = strtol(interval, &end, 10);
+        if (*end == '\0' && value >= 0) {
+            inventory_saver.interval = value;
+        } else {
+            fprintf(stderr, "Invalid LOGISTICS_INVENTORY_SNAPSHOT value %s, keeping %ld seconds.\n", interval,
+                    inventory_saver.interval);
+        }
+    }
+    if (inventory_saver.interval == 0) return;
+    inventory_saver.running = start_service_thread(&inventory_saver.thread, inventory_saver_main);
+}
+
+// Stop the saver and write out whatever changed since the last snapshot
+void inventory_shutdown(void) {
+    if (inventory_saver.running) {
+        pthread_mutex_lock(&inventory_saver.lock);
+        inventory_saver.stop = 1;
+        pthread_cond_signal(&inventory_saver.wake);
+        pthread_mutex_unlock(&inventory_saver.lock);
+        pthread_join(inventory_saver.thread, NULL);
+        inventory_saver.running = 0;
+    }
+    inventory_save_all();
+}
+
+// ---------------------------------------------------------------------------
+// Delivery schedule store
+//
+// admin/delivery_schedules.db holds the scheduled deliveries as one sorted
+// run: a 64-byte header, then fixed-size records ordered by delivery time
+// and route. The run is mapped read-only, so a time range is located by
+// binary search. New deliveries and cancellations go to an in-memory
+// skiplist (the memtable) and to .logistics_schedule_log, which is replayed
+// at startup. Once the memtable holds SCHEDULE_MEMTABLE_LIMIT entries, a
+// background thread freezes it and its log, starts new ones, and merges the
+// frozen memtable with the run into a new run renamed over the old one.
+// Queries merge the run and both memtables, newest first, so they never
+// wait for a merge to finish.
+//
+// The memtables live in the memory of one process, so the log has a single
+// owner, which holds an exclusive flock on it from the first use until it
+// exits; another process gets EBUSY from every schedule call. A merge
+// prepares the new log under SCHEDULE_NEXT_SUFFIX and locks it before it is
+// renamed over the old one, which was linked to the frozen name first, so
+// the log path always names a locked file.
+// ---------------------------------------------------------------------------
+
+#define SCHEDULE_MAGIC "LSCHED01"
+#define SCHEDULE_MEMTABLE_LIMIT 4096
+#define SCHEDULE_MAX_HEIGHT 16
+#define SCHEDULE_WRITE_RECORDS 1024
+#define SCHEDULE_NEXT_SUFFIX ".new"
+
+typedef struct ScheduleHeader {
+    char magic[8];
+    uint64_t count;
+    uint32_t record_size;
+    char reserved[44];       // Pads the header to one record
+} ScheduleHeader;
+
+typedef struct ScheduleNode {
+    ScheduleRecord record;
+    struct ScheduleNode *next[];   // One link per level of the node
+} ScheduleNode;
+
+typedef struct ScheduleMemtable {
+    ScheduleNode *head;      // Sentinel with SCHEDULE_MAX_HEIGHT levels
+    int height;
+    size_t count;
+} ScheduleMemtable;
+
+static struct {
+    pthread_rwlock_t lock;          // Readers: queries; writer: puts and swapping runs or memtables
+    pthread_mutex_t compact_lock;   // One merge at a time
+    char path[PATH_MAX];
+    char log_path[PATH_MAX];
+    char frozen_path[PATH_MAX + 8];
+    int loaded;
+    int log_fd;
+    void *map;
+    size_t map_size;
+    const ScheduleRecord *run;
+    size_t run_count;
+    ScheduleMemtable *active;       // Takes new puts
+    ScheduleMemtable *frozen;       // Being merged into the run, or NULL
+    uint32_t random;
+    pthread_t compactor;
+    int compactor_running;
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    int wanted, stop;
+} schedule = { .lock = PTHREAD_RWLOCK_INITIALIZER, .compact_lock = PTHREAD_MUTEX_INITIALIZER, .log_fd = -1,
+               .random = 2463534242u, .wake_lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// Order of the key (time, route) relative to record
+static int schedule_compare(int64_t time, uint32_t route, const ScheduleRecord *record) {
+    if (time != record->time) return time < record->time ? -1 : 1;
+    return route < record->route ? -1 : route > record->route;
+}
+
+static ScheduleMemtable *schedule_memtable_new(void) {
+    ScheduleMemtable *mt = calloc(1, sizeof(*mt));
+    if (mt == NULL) return NULL;
+    mt->head = calloc(1, sizeof(ScheduleNode) + SCHEDULE_MAX_HEIGHT * sizeof(ScheduleNode *));
+    if (mt->head == NULL) {
+        free(mt);
+        return NULL;
+    }
+    mt->height = 1;
+    return mt;
+}
+
+static void schedule_memtable_free(ScheduleMemtable *mt) {
+    if (mt == NULL) return;
+    for (ScheduleNode *node = mt->head; node != NULL;) {
+        ScheduleNode *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    free(mt);
+}
+
+// First entry at or after (time, route)
+static const ScheduleNode *schedule_memtable_seek(const ScheduleMemtable *mt, int64_t time, uint32_t route) {
+    if (mt == NULL) return NULL;
+    const ScheduleNode *node = mt->head;
+    for (int level = mt->height - 1; level >= 0; level--) {
+        while (node->next[level] != NULL && schedule_compare(time, route, &node->next[level]->record) > 0) {
+            node = node->next[level];
+        }
+    }
+    return node->next[0];
+}
+
+// Insert record, replacing the entry with the same key; caller holds the
+// write lock
+static int schedule_memtable_put(ScheduleMemtable *mt, const ScheduleRecord *record) {
+    ScheduleNode *update[SCHEDULE_MAX_HEIGHT];
+    ScheduleNode *node = mt->head;
+    for (int level = mt->height - 1; level >= 0; level--) {
+        while (node->next[level] != NULL && schedule_compare(record->time, record->route, &node->next[level]->record) > 0) {
+            node = node->next[level];
+        }
+        update[level] = node;
+    }
+    if (node->next[0] != NULL && schedule_compare(record->time, record->route, &node->next[0]->record) == 0) {
+        node->next[0]->record = *record;
+        return 0;
+    }
+
+    // Each level links about a quarter of the nodes of the one below
+    int height = 1;
+    while (height < SCHEDULE_MAX_HEIGHT) {
+        schedule.random ^= schedule.random << 13;
+        schedule.random ^= schedule.random >> 17;
+        schedule.random ^= schedule.random << 5;
+        if ((schedule.random & 3) != 0) break;
+        height++;
+    }
+    ScheduleNode *fresh = malloc(sizeof(ScheduleNode) + (size_t)height * sizeof(ScheduleNode *));
+    if (fresh == NULL) return ENOMEM;
+    fresh->record = *record;
+    for (int level = mt->height; level < height; level++) update[level] = mt->head;
+    if (height > mt->height) mt->height = height;
+    for (int level = 0; level < height; level++) {
+        fresh->next[level] = update[level]->next[level];
+        update[level]->next[level] = fresh;
+    }
+    mt->count++;
+    return 0;
+}
+
+// Index of the first run record at or after (time, route)
+static size_t schedule_run_seek(int64_t time, uint32_t route) {
+    size_t lo = 0, hi = schedule.run_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (schedule_compare(time, route, &schedule.run[mid]) > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Map the run at schedule.path in place of the current one; a missing or
+// empty file is an empty run. Caller holds the write lock.
+static int schedule_map_run_locked(void) {
+    int fd = open(schedule.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno != ENOENT) return errno;
+    struct stat sb;
+    void *map = NULL;
+    size_t map_size = 0, count = 0;
+    int err = 0;
+    if (fd >= 0 && fstat(fd, &sb) != 0) {
+        err = errno;
+    } else if (fd >= 0 && sb.st_size > 0) {
+        map_size = (size_t)sb.st_size;
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            err = errno;
+            map = NULL;
+        } else {
+            const ScheduleHeader *header = map;
+            count = map_size >= sizeof(*header) ? (size_t)header->count : 0;
+            if (map_size < sizeof(*header) || memcmp(header->magic, SCHEDULE_MAGIC, 8) != 0 ||
+                header->record_size != sizeof(ScheduleRecord) ||
+                count > (map_size - sizeof(*header)) / sizeof(ScheduleRecord)) {
+                err = EINVAL;
+                munmap(map, map_size);
+                map = NULL;
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (err != 0) {
+        if (err == EINVAL) fprintf(stderr, "%s is not a delivery schedule; move it away to start a new one.\n", schedule.path);
+        return err;
+    }
+    if (schedule.map != NULL) munmap(schedule.map, schedule.map_size);
+    schedule.map = map;
+    schedule.map_size = map_size;
+    schedule.run = map != NULL ? (const ScheduleRecord *)((const char *)map + sizeof(ScheduleHeader)) : NULL;
+    schedule.run_count = count;
+    return 0;
+}
+
+// Apply the records of a log to mt. A record cut short by a crash is
+// dropped, and with truncate the file is cut back to whole records so new
+// ones line up.
+static int schedule_replay(ScheduleMemtable *mt, const char *path, int truncate) {
+    int fd = open(path, (truncate ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) return errno;
+    ScheduleRecord records[SCHEDULE_WRITE_RECORDS];
+    off_t offset = 0;
+    int err = 0;
+    while (err == 0) {
+        ssize_t n = pread(fd, records, sizeof(records), offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) err = errno;
+        if (n <= 0) break;
+        size_t whole = (size_t)n / sizeof(ScheduleRecord);
+        for (size_t i = 0; i < whole && err == 0; i++) err = schedule_memtable_put(mt, &records[i]);
+        offset += (off_t)(whole * sizeof(ScheduleRecord));
+        if (whole * sizeof(ScheduleRecord) != (size_t)n) break;
+    }
+    if (err == 0 && truncate && ftruncate(fd, offset) != 0) err = errno;
+    close(fd);
+    return err;
+}
+
+static void schedule_request_compaction(void) {
+    pthread_mutex_lock(&schedule.wake_lock);
+    schedule.wanted = 1;
+    pthread_cond_signal(&schedule.wake);
+    pthread_mutex_unlock(&schedule.wake_lock);
+}
+
+// Map the run and replay the logs; caller holds the write lock
+static int schedule_load_locked(void) {
+    if (schedule.path[0] == '\0') return ENOENT;
+    int err = schedule_map_run_locked();
+    if (err != 0) return err;
+    schedule.active = schedule_memtable_new();
+    if (schedule.active == NULL) return ENOMEM;
+
+    // Replaying and truncating the log is the owner's business
+    schedule.log_fd = open_owned(schedule.log_path, O_WRONLY | O_APPEND);
+    if (schedule.log_fd < 0) {
+        err = errno;
+        if (err == EBUSY) {
+            fprintf(stderr, "Delivery schedule log %s is in use by another running instance.\n", schedule.log_path);
+        }
+    }
+
+    // A frozen log means the last merge did not finish: it is merged again
+    if (err == 0 && access(schedule.frozen_path, F_OK) == 0) {
+        schedule.frozen = schedule_memtable_new();
+        err = schedule.frozen == NULL ? ENOMEM : schedule_replay(schedule.frozen, schedule.frozen_path, 0);
+    }
+    if (err == 0) err = schedule_replay(schedule.active, schedule.log_path, 1);
+    if (err != 0) {
+        if (schedule.log_fd >= 0) close(schedule.log_fd);
+        schedule.log_fd = -1;
+        schedule_memtable_free(schedule.active);
+        schedule_memtable_free(schedule.frozen);
+        schedule.active = schedule.frozen = NULL;
+        return err;
+    }
+    schedule.loaded = 1;
+    if (schedule.frozen != NULL || schedule.active->count >= SCHEDULE_MEMTABLE_LIMIT) schedule_request_compaction();
+    return 0;
+}
+
+// Take the store's lock, loading the store first if nobody has yet
+static int schedule_lock(int write) {
+    while (1) {
+        if (write) {
+            pthread_rwlock_wrlock(&schedule.lock);
+        } else {
+            pthread_rwlock_rdlock(&schedule.lock);
+        }
+        if (schedule.loaded) return 0;
+        pthread_rwlock_unlock(&schedule.lock);
+
+        pthread_rwlock_wrlock(&schedule.lock);
+        int err = schedule.loaded ? 0 : schedule_load_locked();
+        pthread_rwlock_unlock(&schedule.lock);
+        if (err != 0) return err;
+    }
+}
+
+// Merge run and frozen into a new run at schedule.path, dropping
+// cancellations. Neither input changes while this runs.
+static int schedule_write_run(const ScheduleRecord *run, size_t run_count, const ScheduleMemtable *frozen) {
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", schedule.path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return errno;
+
+    ScheduleHeader header = { .magic = SCHEDULE_MAGIC, .record_size = sizeof(ScheduleRecord) };
+    ScheduleRecord *buffer = malloc(SCHEDULE_WRITE_RECORDS * sizeof(ScheduleRecord));
+    int err = buffer == NULL ? ENOMEM : fsop_write_all(fd, (const char *)&header, sizeof(header));
+    size_t buffered = 0, i = 0;
+    const ScheduleNode *node = frozen->head->next[0];
+    while (err == 0 && (i < run_count || node != NULL)) {
+        int cmp = i == run_count ? 1 : node == NULL ? -1 : schedule_compare(run[i].time, run[i].route, &node->record);
+        const ScheduleRecord *next;
+        if (cmp < 0) {
+            next = &run[i++];
+        } else {
+            // The memtable entry is newer than a run record with its key
+            next = &node->record;
+            node = node->next[0];
+            if (cmp == 0) i++;
+        }
+        if (next->cancelled) continue;
+        buffer[buffered++] = *next;
+        header.count++;
+        if (buffered == SCHEDULE_WRITE_RECORDS) {
+            err = fsop_write_all(fd, (const char *)buffer, buffered * sizeof(ScheduleRecord));
+            buffered = 0;
+        }
+    }
+    if (err == 0 && buffered > 0) err = fsop_write_all(fd, (const char *)buffer, buffered * sizeof(ScheduleRecord));
+    if (err == 0 && pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) err = errno ? errno : EIO;
+    if (err == 0 && fdatasync(fd) != 0) err = errno;
+    if (close(fd) != 0 && err == 0) err = errno;
+    if (err == 0 && rename(tmp_path, schedule.path) != 0) err = errno;
+    if (err != 0) unlink(tmp_path);
+    free(buffer);
+    return err;
+}
+
+// Freeze the memtable if there is nothing frozen yet, and merge the frozen
+// one into the run
+static int schedule_compact(void) {
+    pthread_mutex_lock(&schedule.compact_lock);
+    pthread_rwlock_wrlock(&schedule.lock);
+    int err = 0;
+    if (!schedule.loaded || (schedule.frozen == NULL && schedule.active->count == 0)) {
+        pthread_rwlock_unlock(&schedule.lock);
+        pthread_mutex_unlock(&schedule.compact_lock);
+        return 0;
+    }
+    if (schedule.frozen == NULL) {
+        // The log moves aside with the memtable it describes; its successor
+        // is locked before it takes the log's name
+        char next_path[PATH_MAX + 8];
+        snprintf(next_path, sizeof(next_path), "%s" SCHEDULE_NEXT_SUFFIX, schedule.log_path);
+        ScheduleMemtable *fresh = schedule_memtable_new();
+        int fd = -1;
+        if (fresh == NULL) {
+            err = ENOMEM;
+        } else if ((fd = open(next_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0 ||
+                   flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            err = errno;
+        } else if (link(schedule.log_path, schedule.frozen_path) != 0) {
+            err = errno;
+        } else if (rename(next_path, schedule.log_path) != 0) {
+            err = errno;
+            unlink(schedule.frozen_path);
+        }
+        if (err != 0) {
+            if (fd >= 0) close(fd);
+            unlink(next_path);
+            schedule_memtable_free(fresh);
+            pthread_rwlock_unlock(&schedule.lock);
+            pthread_mutex_unlock(&schedule.compact_lock);
+            return err;
+        }
+        close(schedule.log_fd);
+        schedule.log_fd = fd;
+        schedule.frozen = schedule.active;
+        schedule.active = fresh;
+    }
+    const ScheduleRecord *run = schedule.run;
+    size_t run_count = schedule.run_count;
+    ScheduleMemtable *frozen = schedule.frozen;
+    pthread_rwlock_unlock(&schedule.lock);
+
+    // Puts and queries carry on against the new memtable meanwhile
+    err = schedule_write_run(run, run_count, frozen);
+
+    if (err == 0) {
+        pthread_rwlock_wrlock(&schedule.lock);
+        err = schedule_map_run_locked();
+        if (err == 0) {
+            schedule.frozen = NULL;
+            schedule_memtable_free(frozen);
+        }
+        pthread_rwlock_unlock(&schedule.lock);
+        if (err == 0) unlink(schedule.frozen_path);
+    }
+    pthread_mutex_unlock(&schedule.compact_lock);
+    return err;
+}
+
+static void *schedule_compactor_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&schedule.wake_lock);
+    while (!schedule.stop) {
+        if (!schedule.wanted) {
+            pthread_cond_wait(&schedule.wake, &schedule.wake_lock);
+            continue;
+        }
+        schedule.wanted = 0;
+        pthread_mutex_unlock(&schedule.wake_lock);
+        int err = schedule_compact();
+        if (err != 0) fprintf(stderr, "Error merging the delivery schedule: %s\n", strerror(err));
+        pthread_mutex_lock(&schedule.wake_lock);
+    }
+    pthread_mutex_unlock(&schedule.wake_lock);
+    return NULL;
+}
+
+// Record where the store and its log live; they are opened on first use
+void schedule_open(const char *path, const char *log_path) {
+    pthread_rwlock_wrlock(&schedule.lock);
+    snprintf(schedule.path, sizeof(schedule.path), "%s", path);
+    snprintf(schedule.log_path, sizeof(schedule.log_path), "%s", log_path);
+    snprintf(schedule.frozen_path, sizeof(schedule.frozen_path), "%s.frozen", log_path);
+    pthread_rwlock_unlock(&schedule.lock);
+    schedule.compactor_running = start_service_thread(&schedule.compactor, schedule_compactor_main);
+}
+
+// Stop the compactor and merge what is left, so the next start has no log
+// to replay
+void schedule_close(void) {
+    if (schedule.compactor_running) {
+        pthread_mutex_lock(&schedule.wake_lock);
+        schedule.stop = 1;
+        pthread_cond_signal(&schedule.wake);
+        pthread_mutex_unlock(&schedule.wake_lock);
+        pthread_join(schedule.compactor, NULL);
+        schedule.compactor_running = 0;
+    }
+    if (schedule.loaded) {
+        // A frozen memtable the compactor did not get to is merged first,
+        // then the active one
+        int err = schedule_compact();
+        if (err == 0) err = schedule_compact();
+        if (err != 0) fprintf(stderr, "Error merging the delivery schedule: %s\n", strerror(err));
+    }
+    pthread_rwlock_wrlock(&schedule.lock);
+    if (schedule.log_fd >= 0) close(schedule.log_fd);
+    if (schedule.map != NULL) munmap(schedule.map, schedule.map_size);
+    schedule_memtable_free(schedule.active);
+    schedule_memtable_free(schedule.frozen);
+    schedule.log_fd = -1;
+    schedule.map = NULL;
+    schedule.run = NULL;
+    schedule.run_count = 0;
+    schedule.active = schedule.frozen = NULL;
+    schedule.loaded = 0;
+    pthread_rwlock_unlock(&schedule.lock);
+}
+
+// Cursor over the run and both memtables that yields each key once, in key
+// order, from the newest source that has it
+typedef struct ScheduleCursor {
+    size_t run_index;
+    const ScheduleNode *frozen;
+    const ScheduleNode *active;
+} ScheduleCursor;
+
+static void schedule_cursor_seek(ScheduleCursor *cursor, int64_t time, uint32_t route) {
+    cursor->run_index = schedule_run_seek(time, route);
+    cursor->frozen = schedule_memtable_seek(schedule.frozen, time, route);
+    cursor->active = schedule_memtable_seek(schedule.active, time, route);
+}
+
+// The next entry, cancellations included, or NULL at the end
+static const ScheduleRecord *schedule_cursor_next(ScheduleCursor *cursor) {
+    const ScheduleRecord *best = cursor->active != NULL ? &cursor->active->record : NULL;
+    const ScheduleRecord *sources[2] = {
+        cursor->frozen != NULL ? &cursor->frozen->record : NULL,
+        cursor->run_index < schedule.run_count ? &schedule.run[cursor->run_index] : NULL,
+    };
+    for (int s = 0; s < 2; s++) {
+        if (sources[s] != NULL && (best == NULL || schedule_compare(sources[s]->time, sources[s]->route, best) < 0)) {
+            best = sources[s];
+        }
+    }
+    if (best == NULL) return NULL;
+    int64_t time = best->time;
+    uint32_t route = best->route;
+    if (cursor->active != NULL && schedule_compare(time, route, &cursor->active->record) == 0) {
+        cursor->active = cursor->active->next[0];
+    }
+    if (cursor->frozen != NULL && schedule_compare(time, route, &cursor->frozen->record) == 0) {
+        cursor->frozen = cursor->frozen->next[0];
+    }
+    if (sources[1] != NULL && schedule_compare(time, route, sources[1]) == 0) cursor->run_index++;
+    return best;
+}
+
+// Write record to the log and the memtable; caller holds the write lock
+static int schedule_put_locked(const ScheduleRecord *record) {
+    int err = fsop_write_all(schedule.log_fd, (const char *)record, sizeof(*record));
+    if (err == 0 && fdatasync(schedule.log_fd) != 0) err = errno;
+    if (err == 0) err = schedule_memtable_put(schedule.active, record);
+    if (err == 0 && schedule.active->count >= SCHEDULE_MEMTABLE_LIMIT && schedule.frozen == NULL) {
+        schedule_request_compaction();
+    }
+    return err;
+}
+
+// Schedule a delivery, or replace the one at the same time on the same route
+int schedule_put(const ScheduleRecord *record) {
+    if (record->cancelled) return EINVAL;
+    int err = schedule_lock(1);
+    if (err != 0) return err;
+    err = schedule_put_locked(record);
+    pthread_rwlock_unlock(&schedule.lock);
+    return err;
+}
+
+// Cancel the delivery at time on route
+int schedule_cancel(int64_t time, uint32_t route) {
+    int err = schedule_lock(1);
+    if (err != 0) return err;
+    ScheduleCursor cursor;
+    schedule_cursor_seek(&cursor, time, route);
+    const ScheduleRecord *found = schedule_cursor_next(&cursor);
+    if (found == NULL || found->cancelled || schedule_compare(time, route, found) != 0) {
+        err = ENOENT;
+    } else {
+        ScheduleRecord tombstone = { .time = time, .route = route, .cancelled = 1 };
+        err = schedule_put_locked(&tombstone);
+    }
+    pthread_rwlock_unlock(&schedule.lock);
+    return err;
+}
+
+// Call visit for every delivery from `from` to `to` inclusive, in time and
+// route order, at depot only unless depot is 0, and count them. visit runs
+// under the store's read lock and must not put.
+int schedule_range(int64_t from, int64_t to, uint32_t depot, ScheduleVisitor visit, void *arg, size_t *matched) {
+    *matched = 0;
+    int err = schedule_lock(0);
+    if (err != 0) return err;
+    ScheduleCursor cursor;
+    schedule_cursor_seek(&cursor, from, 0);
+    const ScheduleRecord *record;
+    while ((record = schedule_cursor_next(&cursor)) != NULL && record->time <= to) {
+        if (record->cancelled || (depot != 0 && record->depot != depot)) continue;
+        (*matched)++;
+        if (visit != NULL) visit(record, arg);
+    }
+    pthread_rwlock_unlock(&schedule.lock);
+    return 0;
+}
+
+// Parse a delivery time: Unix seconds, "YYYY-MM-DD HH:MM" (or with a T),
+// "YYYY-MM-DD" for midnight, or "HH:MM" for today, all in local time
+int schedule_parse_time(const char *text, int64_t *time_out) {
+    char *end;
+    errno = 0;
+    long long seconds = strtoll(text, &end, 10);
+    if (end != text && *end == '\0' && errno == 0) {
+        *time_out = seconds;
+        return 0;
+    }
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int year, month, day, hour = 0, minute = 0, used = -1;
+    if (sscanf(text, "%d:%d%n", &hour, &minute, &used) != 2 || text[used] != '\0') {
+        used = -1;
+        sscanf(text, "%d-%d-%d%n", &year, &month, &day, &used);
+        if (used < 0) return EINVAL;
+        const char *rest = text + used;
+        hour = minute = 0;
+        if (*rest == ' ' || *rest == 'T') {
+            used = -1;
+            sscanf(rest + 1, "%d:%d%n", &hour, &minute, &used);
+            if (used < 0) return EINVAL;
+            rest += 1 + used;
+        }
+        if (*rest != '\0' || month < 1 || month > 12 || day < 1 || day > 31) return EINVAL;
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+    }
+    if (hour < 0 || hour > 23 || minute < 0 || minute > 59) return EINVAL;
+    tm.tm_hour = hour;
+    tm.tm_min = minute;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    time_t when = mktime(&tm);
+    if (when == (time_t)-1) return EINVAL;
+    *time_out = (int64_t)when;
+    return 0;
+}
+
+// Parse a route or depot number
+int schedule_parse_number(const char *text, uint32_t *number) {
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || text[0] == '-' || value > UINT32_MAX) return EINVAL;
+    *number = (uint32_t)value;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Shipment log segments
+//
+// warehouse/shipment_logs takes timestamped entries in one active segment,
+// current.log. Once it reaches LOGISTICS_SEGMENT_BYTES, or its first entry
+// is LOGISTICS_SEGMENT_SECONDS old, a background thread seals it: the file
+// is renamed to sealing-NNNNNN.log and compressed into shipments-NNNNNN.lseg.
+// A sealed segment is a 64-byte header holding the time range of its
+// entries, the blocks (about SEGMENT_BLOCK_SIZE bytes of whole lines each,
+// compressed with a small LZ77 coder), then the block index: each block's
+// place, first line and time range, followed by a trigram Bloom filter per
+// block. Views read only the blocks holding the lines they show, searches
+// skip blocks whose filter rules the keyword out, and time queries skip
+// segments and blocks outside the range. Plain files left in the directory
+// can be compressed in place the same way.
+//
+// Several processes may share the directory. Appenders hold a shared flock
+// on current.log while they write and reopen it when the path names another
+// file; a seal takes it exclusively, links it to the first free sealing
+// number and unlinks it. Whoever compresses sealing-NNNNNN.log holds an
+// exclusive flock on it, and anyone who cannot get that lock, or finds the
+// file gone, leaves it to the holder.
+// ---------------------------------------------------------------------------
+
+#define SEGMENT_MAGIC "LSEG0001"
+#define SEGMENT_BLOCK_SIZE 65536
+#define SEGMENT_BLOOM_BYTES 2048
+#define SEGMENT_HASH_BITS 14
+#define SEGMENT_MIN_MATCH 4
+#define SHIPLOG_ACTIVE_NAME "current.log"
+#define SHIPLOG_TIME_LEN 19          // "YYYY-MM-DD HH:MM:SS"
+#define SHIPLOG_RETRY_SECONDS 60
+
+typedef struct SegmentHeader {
+    char magic[8];
+    uint32_t block_count;
+    uint32_t block_size;
+    uint64_t line_count;
+    uint64_t raw_size;
+    int64_t first_time;      // Oldest and newest timestamped entry, 0 when there is none
+    int64_t last_time;
+    uint64_t index_offset;   // The block index, then one Bloom filter per block
+    uint64_t reserved;
+} SegmentHeader;
+
+typedef struct SegmentBlock {
+    uint64_t offset;
+    uint32_t stored_size;
+    uint32_t raw_size;
+    uint64_t first_line;     // Lines in the blocks before this one
+    uint32_t line_count;
+    uint32_t compressed;     // 0 when the block did not shrink and is stored as is
+    int64_t first_time;
+    int64_t last_time;
+} SegmentBlock;
+
+typedef struct SegmentReader {
+    int fd;
+    SegmentHeader header;
+    SegmentBlock *blocks;
+    uint8_t *blooms;         // Only loaded for searches
+    char *raw;               // The block last read, decompressed
+    uint8_t *stored;
+    size_t raw_cap, stored_cap;
+} SegmentReader;
+
+// Caches the Unix time of the hour the previous line was stamped in, so a
+// block of entries costs one mktime per hour rather than one per line
+typedef struct ShiplogClock {
+    char hour[14];           // "YYYY-MM-DD HH"
+    int64_t base;
+} ShiplogClock;
+
+// One file of the shipment log directory, in the order queries read them
+typedef struct ShiplogFile {
+    char name[256];
+    int rank;                // 0 sealed or plain, 1 being sealed, 2 active
+    int64_t key;             // First entry of a segment, or the file's mtime
+    off_t size;
+    int sealed;
+    SegmentHeader header;
+} ShiplogFile;
+
+static struct {
+    pthread_mutex_t lock;           // The active segment; also guards the sealer's wake-up state
+    pthread_rwlock_t files_lock;    // Readers: queries; writer: renames that move entries between files
+    pthread_mutex_t seal_lock;      // One seal or compression at a time
+    char dir[PATH_MAX];
+    char active_path[PATH_MAX + 16];
+    int loaded;
+    int fd;
+    off_t size;
+    int64_t first_time;             // Of the active segment's first entry, 0 when it is empty
+    unsigned next_seq;
+    long long max_bytes;            // 0: no size limit
+    long long max_seconds;          // 0: no age limit
+    pthread_t sealer;
+    int sealer_running;
+    pthread_cond_t wake;
+    int wanted, stop;
+} shiplog = { .lock = PTHREAD_MUTEX_INITIALIZER, .files_lock = PTHREAD_RWLOCK_INITIALIZER,
+              .seal_lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .wake = PTHREAD_COND_INITIALIZER };
+
+// Unix time of a line starting "YYYY-MM-DD HH:MM:SS" (or with a T), or 0
+static int64_t shiplog_line_time(ShiplogClock *clock, const char *line, size_t len) {
+    if (len < SHIPLOG_TIME_LEN || line[4] != '-' || line[7] != '-' || (line[10] != ' ' && line[10] != 'T') ||
+        line[13] != ':' || line[16] != ':') {
+        return 0;
+    }
+    static const int digits[] = { 0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, 17, 18 };
+    for (size_t i = 0; i < sizeof(digits) / sizeof(digits[0]); i++) {
+        if (!isdigit((unsigned char)line[digits[i]])) return 0;
+    }
+    int minute = (line[14] - '0') * 10 + (line[15] - '0');
+    int second = (line[17] - '0') * 10 + (line[18] - '0');
+    if (minute > 59 || second > 60) return 0;
+    if (memcmp(clock->hour, line, 10) != 0 || memcmp(clock->hour + 11, line + 11, 2) != 0) {
+        struct tm tm = { 0 };
+        tm.tm_year = atoi(line) - 1900;
+        tm.tm_mon = (line[5] - '0') * 10 + (line[6] - '0') - 1;
+        tm.tm_mday = (line[8] - '0') * 10 + (line[9] - '0');
+        tm.tm_hour = (line[11] - '0') * 10 + (line[12] - '0');
+        tm.tm_isdst = -1;
+        if (tm.tm_mon < 0 || tm.tm_mon > 11 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23) return 0;
+        time_t base = mktime(&tm);
+        if (base == (time_t)-1) return 0;
+        memcpy(clock->hour, line, 13);
+        clock->hour[10] = ' ';
+        clock->base = (int64_t)base;
+    }
+    return clock->base + minute * 60 + second;
+}
+
+// Append one sequence to dst: a token holding the literal and match lengths,
+// any length bytes past 15, the literals, then the match offset. A match
+// length of 0 ends the block with literals only. Returns the new length of
+// dst, or 0 when it would not fit in cap.
+static size_t segment_emit(uint8_t *dst, size_t pos, size_t cap, const uint8_t *literals, size_t literal_len,
+                           size_t offset, size_t match_len) {
+    size_t need = 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+    if (pos + need > cap) return 0;
+    size_t extra = match_len != 0 ? match_len - SEGMENT_MIN_MATCH : 0;
+    dst[pos++] = (uint8_t)((literal_len < 15 ? literal_len : 15) << 4 | (extra < 15 ? extra : 15));
+    if (literal_len >= 15) {
+        size_t rest = literal_len - 15;
+        for (; rest >= 255; rest -= 255) dst[pos++] = 255;
+        dst[pos++] = (uint8_t)rest;
+    }
+    memcpy(dst + pos, literals, literal_len);
+    pos += literal_len;
+    if (match_len == 0) return pos;
+    dst[pos++] = (uint8_t)(offset & 0xFF);
+    dst[pos++] = (uint8_t)(offset >> 8);
+    if (extra >= 15) {
+        size_t rest = extra - 15;
+        for (; rest >= 255; rest -= 255) dst[pos++] = 255;
+        dst[pos++] = (uint8_t)rest;
+    }
+    return pos;
+}
+
+// Greedy LZ77 over a 64 KiB window, finding matches through a hash of the
+// next four bytes. table holds 1 << SEGMENT_HASH_BITS positions. Returns
+// the compressed size, or 0 when it would not fit in cap.
+static size_t segment_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap, uint32_t *table) {
+    memset(table, 0, sizeof(uint32_t) << SEGMENT_HASH_BITS);
+    size_t anchor = 0, i = 0, pos = 0;
+    while (i + SEGMENT_MIN_MATCH <= n) {
+        uint32_t word, prior;
+        memcpy(&word, src + i, sizeof(word));
+        uint32_t hash = (word * 2654435761u) >> (32 - SEGMENT_HASH_BITS);
+        size_t candidate = table[hash];   // Position + 1, or 0
+        table[hash] = (uint32_t)(i + 1);
+        if (candidate != 0 && i + 1 - candidate <= 0xFFFF &&
+            (memcpy(&prior, src + candidate - 1, sizeof(prior)), prior == word)) {
+            size_t match = candidate - 1, len = SEGMENT_MIN_MATCH;
+            while (i + len < n && src[match + len] == src[i + len]) len++;
+            pos = segment_emit(dst, pos, cap, src + anchor, i - anchor, i - match, len);
+            if (pos == 0) return 0;
+            i += len;
+            anchor = i;
+        } else {
+            // Step faster through data that does not compress
+            i += 1 + ((i - anchor) >> 6);
+        }
+    }
+    return segment_emit(dst, pos, cap, src + anchor, n - anchor, 0, 0);
+}
+
+// Decode a block compressed by segment_compress into exactly raw_size bytes
+static int segment_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_size) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        uint8_t token = src[ip++];
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= n) return EBADMSG;
+                byte = src[ip++];
+                literal_len += byte;
+            } while (byte == 255);
+        }
+        if (literal_len > n - ip || literal_len > raw_size - op) return EBADMSG;
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == n) break;
+
+        if (n - ip < 2) return EBADMSG;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= n) return EBADMSG;
+                byte = src[ip++];
+                len += byte;
+            } while (byte == 255);
+        }
+        len += SEGMENT_MIN_MATCH;
+        if (offset == 0 || offset > op || len > raw_size - op) return EBADMSG;
+        if (offset >= len) {
+            memcpy(dst + op, dst + op - offset, len);
+        } else {
+            // The match overlaps what it produces: a run
+            for (size_t j = 0; j < len; j++) dst[op + j] = dst[op + j - offset];
+        }
+        op += len;
+    }
+    return op == raw_size ? 0 : EBADMSG;
+}
+
+// The two bits a trigram sets in a block's Bloom filter
+static void segment_bloom_bits(uint32_t key, uint32_t bits[2]) {
+    bits[0] = (key * 2654435761u) % (SEGMENT_BLOOM_BYTES * 8);
+    bits[1] = ((key ^ 0x5bd1e995u) * 0x85ebca6bu >> 7) % (SEGMENT_BLOOM_BYTES * 8);
+}
+
+static void segment_bloom_fill(uint8_t *bloom, const char *data, size_t n) {
+    for (size_t i = 0; i + 2 < n; i++) {
+        uint32_t bits[2];
+        segment_bloom_bits(trigram_key((const unsigned char *)data + i), bits);
+        bloom[bits[0] >> 3] |= (uint8_t)(1u << (bits[0] & 7));
+        bloom[bits[1] >> 3] |= (uint8_t)(1u << (bits[1] & 7));
+    }
+}
+
+// Whether every trigram of the needle may occur in the block
+static int segment_bloom_may_contain(const uint8_t *bloom, const char *needle, size_t k) {
+    for (size_t i = 0; i + 2 < k; i++) {
+        uint32_t bits[2];
+        segment_bloom_bits(trigram_key((const unsigned char *)needle + i), bits);
+        if (!(bloom[bits[0] >> 3] & (1u << (bits[0] & 7))) || !(bloom[bits[1] >> 3] & (1u << (bits[1] & 7)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Whether the first bytes of a file are those of a sealed segment
+int segment_detect(const void *head, size_t n) {
+    return n >= sizeof(SegmentHeader) && memcmp(head, SEGMENT_MAGIC, 8) == 0;
+}
+
+int segment_probe(int fd) {
+    char magic[sizeof(SegmentHeader)];
+    return pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && segment_detect(magic, sizeof(magic));
+}
+
+int segment_sealed(const char *path) {
+    int fd = confine_open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC | O_NONBLOCK, 0);
+    if (fd < 0) return 0;
+    int sealed = segment_probe(fd);
+    close(fd);
+    return sealed;
+}
+
+// Compress the plain file source into a segment written at destination. The
+// caller renames it into place. ENODATA: source is empty.
+static int segment_write(const char *source, const char *destination) {
+    int in = open(source, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    if (in < 0) return errno;
+    struct stat sb;
+    if (fstat(in, &sb) != 0) {
+        int err = errno;
+        close(in);
+        return err;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        close(in);
+        return EINVAL;
+    }
+    size_t n = (size_t)sb.st_size;
+    if (n == 0) {
+        close(in);
+        return ENODATA;
+    }
+    const char *data = mmap(NULL, n, PROT_READ, MAP_PRIVATE, in, 0);
+    close(in);
+    if (data == MAP_FAILED) return errno;
+    madvise((void *)data, n, MADV_SEQUENTIAL);
+
+    int out = open(destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        int err = errno;
+        munmap((void *)data, n);
+        return err;
+    }
+
+    SegmentHeader header = { .block_size = SEGMENT_BLOCK_SIZE };
+    memcpy(header.magic, SEGMENT_MAGIC, 8);
+    SegmentBlock *blocks = NULL;
+    uint8_t *blooms = NULL, *packed = NULL;
+    size_t block_cap = 0, packed_cap = 0;
+    uint32_t *table = malloc(sizeof(uint32_t) << SEGMENT_HASH_BITS);
+    ShiplogClock clock = { .hour = "" };
+    uint64_t offset = sizeof(SegmentHeader);
+    int err = table == NULL ? ENOMEM : 0;
+    if (err == 0 && lseek(out, (off_t)offset, SEEK_SET) < 0) err = errno;
+
+    for (size_t start = 0; err == 0 && start < n;) {
+        // End the block after the last whole line that fits, or after the
+        // first line when that one alone is longer than a block
+        size_t end = n;
+        if (n - start > SEGMENT_BLOCK_SIZE) {
+            const char *nl = memrchr(data + start, '\n', SEGMENT_BLOCK_SIZE);
+            if (nl == NULL) nl = memchr(data + start + SEGMENT_BLOCK_SIZE, '\n', n - start - SEGMENT_BLOCK_SIZE);
+            if (nl != NULL) end = (size_t)(nl - data) + 1;
+        }
+        if (end - start > UINT32_MAX) {
+            err = EFBIG;
+            break;
+        }
+        if (header.block_count == block_cap) {
+            size_t cap = block_cap ? block_cap * 2 : 64;
+            SegmentBlock *grown = realloc(blocks, cap * sizeof(SegmentBlock));
+            uint8_t *grown_blooms = grown != NULL ? realloc(blooms, cap * SEGMENT_BLOOM_BYTES) : NULL;
+            if (grown != NULL) blocks = grown;
+            if (grown_blooms != NULL) blooms = grown_blooms;
+            if (grown == NULL || grown_blooms == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            block_cap = cap;
+        }
+        SegmentBlock *block = &blocks[header.block_count];
+        uint8_t *bloom = blooms + (size_t)header.block_count * SEGMENT_BLOOM_BYTES;
+        memset(block, 0, sizeof(*block));
+        memset(bloom, 0, SEGMENT_BLOOM_BYTES);
+        block->offset = offset;
+        block->raw_size = (uint32_t)(end - start);
+        block->first_line = header.line_count;
+        for (size_t pos = start; pos < end;) {
+            const char *nl = memchr(data + pos, '\n', end - pos);
+            size_t line_end = nl != NULL ? (size_t)(nl - data) : end;
+            int64_t when = shiplog_line_time(&clock, data + pos, line_end - pos);
+            if (when != 0 && (block->first_time == 0 || when < block->first_time)) block->first_time = when;
+            if (when > block->last_time) block->last_time = when;
+            block->line_count++;
+            pos = line_end + 1;
+        }
+        segment_bloom_fill(bloom, data + start, end - start);
+
+        // A block that would not shrink is stored as it is
+        if (end - start > packed_cap) {
+            uint8_t *grown = realloc(packed, end - start);
+            if (grown == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            packed = grown;
+            packed_cap = end - start;
+        }
+        size_t size = segment_compress((const uint8_t *)data + start, end - start, packed, end - start, table);
+        block->compressed = size != 0;
+        block->stored_size = size != 0 ? (uint32_t)size : block->raw_size;
+        err = fsop_write_all(out, size != 0 ? (const char *)packed : data + start, block->stored_size);
+
+        if (block->first_time != 0 && (header.first_time == 0 || block->first_time < header.first_time)) {
+            header.first_time = block->first_time;
+        }
+        if (block->last_time > header.last_time) header.last_time = block->last_time;
+        header.line_count += block->line_count;
+        header.raw_size += block->raw_size;
+        header.block_count++;
+        offset += block->stored_size;
+        start = end;
+    }
+
+    header.index_offset = offset;
+    if (err == 0) err = fsop_write_all(out, (const char *)blocks, header.block_count * sizeof(SegmentBlock));
+    if (err == 0) err = fsop_write_all(out, (const char *)blooms, (size_t)header.block_count * SEGMENT_BLOOM_BYTES);
+    // The header goes last, so a segment cut short never looks complete
+    if (err == 0 && pwrite(out, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) err = errno ? errno : EIO;
+    if (err == 0 && fdatasync(out) != 0) err = errno;
+    if (close(out) != 0 && err == 0) err = errno;
+    if (err != 0) unlink(destination);
+    free(table);
+    free(blocks);
+    free(blooms);
+    free(packed);
+    munmap((void *)data, n);
+    return err;
+}
+
+static void segment_reader_free(SegmentReader *r) {
+    free(r->blocks);
+    free(r->blooms);
+    free(r->raw);
+    free(r->stored);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+// Read the header and block index of the segment open on fd, and the Bloom
+// filters too when with_blooms is set
+static int segment_load(int fd, SegmentReader *r, int with_blooms) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) return errno;
+    if (pread(fd, &r->header, sizeof(r->header), 0) != (ssize_t)sizeof(r->header) ||
+        !segment_detect(&r->header, sizeof(r->header))) {
+        return EBADMSG;
+    }
+    const SegmentHeader *h = &r->header;
+    uint64_t index_size = (uint64_t)h->block_count * sizeof(SegmentBlock);
+    uint64_t bloom_size = (uint64_t)h->block_count * SEGMENT_BLOOM_BYTES;
+    if (h->index_offset < sizeof(SegmentHeader) || h->index_offset > (uint64_t)sb.st_size ||
+        index_size + bloom_size > (uint64_t)sb.st_size - h->index_offset) {
+        return EBADMSG;
+    }
+    r->blocks = malloc(index_size ? index_size : 1);
+    if (r->blocks == NULL) return ENOMEM;
+    if (pread(fd, r->blocks, index_size, (off_t)h->index_offset) != (ssize_t)index_size) {
+        segment_reader_free(r);
+        return EBADMSG;
+    }
+    uint64_t line = 0;
+    for (uint32_t i = 0; i < h->block_count; i++) {
+        const SegmentBlock *b = &r->blocks[i];
+        if (b->offset < sizeof(SegmentHeader) || b->offset + b->stored_size > h->index_offset ||
+            b->first_line != line || (!b->compressed && b->stored_size != b->raw_size)) {
+            segment_reader_free(r);
+            return EBADMSG;
+        }
+        line += b->line_count;
+    }
+    if (line != h->line_count) {
+        segment_reader_free(r);
+        return EBADMSG;
+    }
+    if (with_blooms) {
+        r->blooms = malloc(bloom_size ? bloom_size : 1);
+        if (r->blooms == NULL ||
+            pread(fd, r->blooms, bloom_size, (off_t)(h->index_offset + index_size)) != (ssize_t)bloom_size) {
+            int err = r->blooms == NULL ? ENOMEM : EBADMSG;
+            segment_reader_free(r);
+            return err;
+        }
+    }
+    return 0;
+}
+
+// Read block i into r->raw, decompressing it if need be
+static int segment_read_block(SegmentReader *r, uint32_t i) {
+    const SegmentBlock *b = &r->blocks[i];
+    if (b->raw_size > r->raw_cap) {
+        char *grown = realloc(r->raw, b->raw_size);
+        if (grown == NULL) return ENOMEM;
+        r->raw = grown;
+        r->raw_cap = b->raw_size;
+    }
+    uint8_t *target = (uint8_t *)r->raw;
+    if (b->compressed) {
+        if (b->stored_size > r->stored_cap) {
+            uint8_t *grown = realloc(r->stored, b->stored_size);
+            if (grown == NULL) return ENOMEM;
+            r->stored = grown;
+            r->stored_cap = b->stored_size;
+        }
+        target = r->stored;
+    }
+    size_t got = 0;
+    while (got < b->stored_size) {
+        ssize_t n = pread(r->fd, target + got, b->stored_size - got, (off_t)(b->offset + got));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n < 0 ? errno : EBADMSG;
+        got += (size_t)n;
+    }
+    return b->compressed ? segment_decompress(r->stored, b->stored_size, (uint8_t *)r->raw, b->raw_size) : 0;
+}
+
+// The block holding line (counted from 0)
+static uint32_t segment_block_for_line(const SegmentReader *r, uint64_t line) {
+    uint32_t low = 0, high = r->header.block_count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (r->blocks[mid].first_line <= line) low = mid;
+        else high = mid;
+    }
+    return low;
+}
+
+// View the segment open on fd the way view_file_content would view a plain
+// file: mode 'h' or 't' shows the first or last `first` lines, 'r' lines
+// first to last, anything else the whole file. ERANGE: a range past the end.
+int segment_view(int fd, int out_fd, int mode, long first, long last) {
+    SegmentReader r;
+    int err = segment_load(fd, &r, 0);
+    if (err != 0) return err;
+    uint64_t total = r.header.line_count, from = 1, to = total;
+    if (mode == 'h') {
+        to = (uint64_t)first < total ? (uint64_t)first : total;
+    } else if (mode == 't') {
+        from = total > (uint64_t)first ? total - (uint64_t)first + 1 : 1;
+    } else if (mode == 'r') {
+        from = (uint64_t)first;
+        to = (uint64_t)last < total ? (uint64_t)last : total;
+        if (from > total) err = ERANGE;
+    }
+
+    for (uint32_t i = total > 0 ? segment_block_for_line(&r, from - 1) : r.header.block_count;
+         err == 0 && i < r.header.block_count && r.blocks[i].first_line < to; i++) {
+        const SegmentBlock *b = &r.blocks[i];
+        err = segment_read_block(&r, i);
+        if (err != 0) break;
+        size_t begin = 0, stop = b->raw_size;
+        if (from > b->first_line + 1 || to < b->first_line + b->line_count) {
+            // Trim the lines of the block outside the range
+            uint64_t line = b->first_line + 1;
+            for (; line < from && begin < stop; line++) {
+                const char *nl = memchr(r.raw + begin, '\n', stop - begin);
+                begin = nl != NULL ? (size_t)(nl - r.raw) + 1 : stop;
+            }
+            size_t pos = begin;
+            for (; line <= to && pos < stop; line++) {
+                const char *nl = memchr(r.raw + pos, '\n', stop - pos);
+                pos = nl != NULL ? (size_t)(nl - r.raw) + 1 : stop;
+            }
+            stop = pos;
+        }
+        err = fsop_write_all(out_fd, r.raw + begin, stop - begin);
+    }
+    segment_reader_free(&r);
+    return err;
+}
+
+// Search the segment open on fd as content_search_file searches a plain
+// file, reading only the blocks whose Bloom filter admits the keyword
+int segment_search(int fd, const char *path, const char *needle, size_t k, MemSearchFn search, OutBuffer *out) {
+    SegmentReader r;
+    int err = segment_load(fd, &r, k >= 3);
+    if (err != 0) return err;
+    for (uint32_t i = 0; err == 0 && i < r.header.block_count; i++) {
+        if (k >= 3 && !segment_bloom_may_contain(r.blooms + (size_t)i * SEGMENT_BLOOM_BYTES, needle, k)) continue;
+        err = segment_read_block(&r, i);
+        if (err == 0) {
+            content_search_lines(path, r.raw, r.blocks[i].raw_size, r.blocks[i].first_line + 1, needle, k, search, out);
+        }
+    }
+    segment_reader_free(&r);
+    return err;
+}
+
+// Call visit with the decompressed contents of every block in turn, until
+// it returns non-zero
+int segment_scan(int fd, SegmentBlockFn visit, void *arg) {
+    SegmentReader r;
+    int err = segment_load(fd, &r, 0);
+    for (uint32_t i = 0; err == 0 && i < r.header.block_count; i++) {
+        err = segment_read_block(&r, i);
+        if (err == 0) err = visit(r.raw, r.blocks[i].raw_size, arg);
+    }
+    segment_reader_free(&r);
+    return err;
+}
+
+// Number NNN of a file named PREFIXNNNSUFFIX
+static int shiplog_name_seq(const char *name, const char *prefix, const char *suffix, unsigned *seq) {
+    size_t prefix_len = strlen(prefix), suffix_len = strlen(suffix), len = strlen(name);
+    if (len <= prefix_len + suffix_len || strncmp(name, prefix, prefix_len) != 0 ||
+        strcmp(name + len - suffix_len, suffix) != 0) {
+        return 0;
+    }
+    unsigned value = 0;
+    for (const char *p = name + prefix_len; p < name + len - suffix_len; p++) {
+        if (!isdigit((unsigned char)*p) || value > UINT_MAX / 10 - 1) return 0;
+        value = value * 10 + (unsigned)(*p - '0');
+    }
+    *seq = value;
+    return 1;
+}
+
+// Find the active segment's size and age and the next segment number;
+// caller holds shiplog.lock
+static void shiplog_load_locked(void) {
+    if (shiplog.loaded) return;
+    shiplog.loaded = 1;
+    shiplog.next_seq = 1;
+    int fd = open(shiplog.active_path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    struct stat sb;
+    if (fd >= 0 && fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        char first[SHIPLOG_TIME_LEN];
+        ShiplogClock clock = { .hour = "" };
+        ssize_t n = pread(fd, first, sizeof(first), 0);
+        shiplog.size = sb.st_size;
+        shiplog.first_time = n > 0 ? shiplog_line_time(&clock, first, (size_t)n) : 0;
+        if (shiplog.first_time == 0) shiplog.first_time = (int64_t)sb.st_mtime;
+    }
+    if (fd >= 0) close(fd);
+
+    DIR *dir = opendir(shiplog.dir);
+    if (dir == NULL) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned seq;
+        if ((shiplog_name_seq(entry->d_name, "shipments-", ".lseg", &seq) ||
+             shiplog_name_seq(entry->d_name, "sealing-", ".log", &seq)) && seq >= shiplog.next_seq) {
+            shiplog.next_seq = seq + 1;
+        }
+    }
+    closedir(dir);
+}
+
+// Compress sealing-SEQ.log into shipments-SEQ.lseg and drop it. Running it
+// again after a crash redoes the same work, so recovery is just a retry.
+static int shiplog_seal_file(unsigned seq) {
+    char sealing[PATH_MAX], segment[PATH_MAX], temp[PATH_MAX];
+    if (snprintf(sealing, sizeof(sealing), "%s/sealing-%06u.log", shiplog.dir, seq) >= (int)sizeof(sealing) ||
+        snprintf(segment, sizeof(segment), "%s/shipments-%06u.lseg", shiplog.dir, seq) >= (int)sizeof(segment) ||
+        snprintf(temp, sizeof(temp), "%s/shipments-%06u.lseg.tmp", shiplog.dir, seq) >= (int)sizeof(temp)) {
+        return ENAMETOOLONG;
+    }
+    // Another process sealing it, or done with it, has it covered
+    int lock_fd = open(sealing, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    if (lock_fd < 0) return errno == ENOENT ? 0 : errno;
+    struct stat held;
+    int err = 0;
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0 || fstat(lock_fd, &held) != 0) {
+        err = errno == EWOULDBLOCK ? EALREADY : errno;
+    } else if (held.st_nlink == 0) {
+        err = EALREADY;
+    }
+    if (err != 0) {
+        close(lock_fd);
+        return err == EALREADY ? 0 : err;
+    }
+    err = segment_write(sealing, temp);
+    if (err == 0 || err == ENODATA) {
+        // Queries see the entries either in the plain file or in the segment
+        pthread_rwlock_wrlock(&shiplog.files_lock);
+        if (err == 0 && rename(temp, segment) != 0) err = errno;
+        if (err == 0 || err == ENODATA) err = unlink(sealing) == 0 ? 0 : errno;
+        pthread_rwlock_unlock(&shiplog.files_lock);
+    }
+    close(lock_fd);
+    return err;
+}
+
+// Finish seals a crash interrupted; caller holds shiplog.seal_lock
+static int shiplog_recover(void) {
+    DIR *dir = opendir(shiplog.dir);
+    if (dir == NULL) return errno == ENOENT ? 0 : errno;
+    unsigned *pending = NULL;
+    size_t count = 0, cap = 0;
+    int first_error = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned seq;
+        if (!shiplog_name_seq(entry->d_name, "sealing-", ".log", &seq)) continue;
+        if (count == cap) {
+            size_t new_cap = cap == 0 ? 64 : cap * 2;
+            unsigned *grown = realloc(pending, new_cap * sizeof(*pending));
+            if (grown == NULL) {
+                first_error = ENOMEM;
+                break;
+            }
+            pending = grown;
+            cap = new_cap;
+        }
+        pending[count++] = seq;
+    }
+    closedir(dir);
+    // Seal what was found even when the list is incomplete
+    for (size_t i = 0; i < count; i++) {
+        int err = shiplog_seal_file(pending[i]);
+        if (err != 0 && first_error == 0) first_error = err;
+    }
+    free(pending);
+    return first_error;
+}
+
+// Move the active segment aside and compress it; caller holds
+// shiplog.seal_lock
+static int shiplog_seal_active(void) {
+    char sealing[PATH_MAX], segment[PATH_MAX];
+    pthread_rwlock_wrlock(&shiplog.files_lock);
+    pthread_mutex_lock(&shiplog.lock);
+    shiplog_load_locked();
+    struct stat sb, named;
+    int err = 0;
+    unsigned seq = shiplog.next_seq;
+    // Appenders in every process write under a shared lock on current.log
+    int fd = open(shiplog.active_path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        err = errno == ENOENT ? ENODATA : errno;
+    } else if (flock(fd, LOCK_EX) != 0 || fstat(fd, &sb) != 0) {
+        err = errno;
+    } else if (sb.st_size == 0 || stat(shiplog.active_path, &named) != 0 || named.st_ino != sb.st_ino) {
+        err = ENODATA;  // Nothing to seal, or another process just sealed it
+    }
+    // Another process may have taken numbers since we counted
+    while (err == 0) {
+        if (snprintf(sealing, sizeof(sealing), "%s/sealing-%06u.log", shiplog.dir, seq) >= (int)sizeof(sealing) ||
+            snprintf(segment, sizeof(segment), "%s/shipments-%06u.lseg", shiplog.dir, seq) >= (int)sizeof(segment)) {
+            err = ENAMETOOLONG;
+        } else if (access(segment, F_OK) == 0) {
+            seq++;
+        } else if (link(shiplog.active_path, sealing) == 0) {
+            break;
+        } else if (errno == EEXIST) {
+            seq++;
+        } else {
+            err = errno;
+        }
+    }
+    if (err == 0 && (fdatasync(fd) != 0 || unlink(shiplog.active_path) != 0)) {
+        err = errno;
+        unlink(sealing);
+    }
+    if (err == 0) {
+        // The next append starts a new active segment
+        if (shiplog.fd >= 0) close(shiplog.fd);
+        shiplog.fd = -1;
+        shiplog.size = 0;
+        shiplog.first_time = 0;
+        shiplog.next_seq = seq + 1;
+    }
+    if (fd >= 0) close(fd);
+    pthread_mutex_unlock(&shiplog.lock);
+    pthread_rwlock_unlock(&shiplog.files_lock);
+    if (err != 0) return err == ENODATA ? 0 : err;
+    return shiplog_seal_file(seq);
+}
+
+static void *shiplog_sealer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&shiplog.seal_lock);
+    int err = shiplog_recover();
+    pthread_mutex_unlock(&shiplog.seal_lock);
+    if (err != 0) fprintf(stderr, "Error sealing the shipment log: %s\n", strerror(err));
+
+    time_t retry_at = 0;
+    pthread_mutex_lock(&shiplog.lock);
+    shiplog_load_locked();
+    while (!shiplog.stop) {
+        time_t now = time(NULL);
+        int aged = shiplog.max_seconds > 0 && shiplog.first_time != 0 && now >= shiplog.first_time + shiplog.max_seconds;
+        int full = shiplog.max_bytes > 0 && shiplog.size >= shiplog.max_bytes;
+        if (!(shiplog.wanted || aged || full) || now < retry_at) {
+            // Sleep until the active segment comes of age, or an append wakes us
+            time_t deadline = retry_at > now ? retry_at : 0;
+            if (shiplog.max_seconds > 0 && shiplog.first_time != 0 && (deadline == 0 || shiplog.first_time + shiplog.max_seconds < deadline)) {
+                deadline = (time_t)(shiplog.first_time + shiplog.max_seconds);
+            }
+            if (deadline != 0) {
+                struct timespec until = { .tv_sec = deadline > now ? deadline : now + 1 };
+                pthread_cond_timedwait(&shiplog.wake, &shiplog.lock, &until);
+            } else {
+                pthread_cond_wait(&shiplog.wake, &shiplog.lock);
+            }
+            continue;
+        }
+        shiplog.wanted = 0;
+        pthread_mutex_unlock(&shiplog.lock);
+        pthread_mutex_lock(&shiplog.seal_lock);
+        err = shiplog_seal_active();
+        pthread_mutex_unlock(&shiplog.seal_lock);
+        if (err != 0) fprintf(stderr, "Error sealing the shipment log: %s\n", strerror(err));
+        retry_at = err != 0 ? time(NULL) + SHIPLOG_RETRY_SECONDS : 0;
+        pthread_mutex_lock(&shiplog.lock);
+    }
+    pthread_mutex_unlock(&shiplog.lock);
+    return NULL;
+}
+
+// Record where the shipment log lives and its sealing thresholds; the
+// sealer finishes any interrupted seal, then waits for one to come due
+void shiplog_open(const char *dir, const char *max_bytes, const char *max_seconds) {
+    pthread_mutex_lock(&shiplog.lock);
+    snprintf(shiplog.dir, sizeof(shiplog.dir), "%s", dir);
+    snprintf(shiplog.active_path, sizeof(shiplog.active_path), "%s/%s", dir, SHIPLOG_ACTIVE_NAME);
+    char *end;
+    long long value = max_bytes != NULL ? strtoll(max_bytes, &end, 10) : -1;
+    shiplog.max_bytes = max_bytes != NULL && end != max_bytes && value >= 0 ? value : 4LL << 20;
+    value = max_seconds != NULL ? strtoll(max_seconds, &end, 10) : -1;
+    shiplog.max_seconds = max_seconds != NULL && end != max_seconds && value >= 0 ? value : 86400;
+    pthread_mutex_unlock(&shiplog.lock);
+    shiplog.sealer_running = start_service_thread(&shiplog.sealer, shiplog_sealer_main);
+}
+
+// Stop the sealer; the active segment stays as it is for the next run
+void shiplog_close(void) {
+    if (shiplog.sealer_running) {
+        pthread_mutex_lock(&shiplog.lock);
+        shiplog.stop = 1;
+        pthread_cond_signal(&shiplog.wake);
+        pthread_mutex_unlock(&shiplog.lock);
+        pthread_join(shiplog.sealer, NULL);
+        shiplog.sealer_running = 0;
+    }
+    pthread_mutex_lock(&shiplog.lock);
+    if (shiplog.fd >= 0) close(shiplog.fd);
+    shiplog.fd = -1;
+    shiplog.loaded = 0;
+    pthread_mutex_unlock(&shiplog.lock);
+}
+
+// Open current.log if need be and hold it shared for an append. A seal in
+// another process may have moved it since we opened it, in which case the
+// path names a new segment. Caller holds shiplog.lock.
+static int shiplog_lock_active_locked(void) {
+    while (1) {
+        int fresh = shiplog.fd < 0;
+        if (fresh) {
+            int err = fsop_mkdir_p(shiplog.dir, 0777);
+            if (err != 0) return err;
+            shiplog.fd = open(shiplog.active_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (shiplog.fd < 0) return errno;
+        }
+        struct stat held, named;
+        if (flock(shiplog.fd, LOCK_SH) != 0 || fstat(shiplog.fd, &held) != 0) return errno;
+        if (stat(shiplog.active_path, &named) == 0 && named.st_ino == held.st_ino && named.st_dev == held.st_dev) {
+            if (fresh) shiplog.size = held.st_size;
+            return 0;
+        }
+        close(shiplog.fd);
+        shiplog.fd = -1;
+        shiplog.size = 0;
+        shiplog.first_time = 0;
+    }
+}
+
+// Append one entry, stamped with the current time, to the active segment
+int shiplog_append(const char *text) {
+    size_t len = strlen(text);
+    if (len == 0 || memchr(text, '\n', len) != NULL) return EINVAL;
+    char *line = malloc(SHIPLOG_TIME_LEN + len + 2);
+    if (line == NULL) return ENOMEM;
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(line, SHIPLOG_TIME_LEN + 1, "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+    line[SHIPLOG_TIME_LEN] = ' ';
+    memcpy(line + SHIPLOG_TIME_LEN + 1, text, len);
+    line[SHIPLOG_TIME_LEN + 1 + len] = '\n';
+
+    pthread_mutex_lock(&shiplog.lock);
+    shiplog_load_locked();
+    int err = shiplog_lock_active_locked();
+    if (err == 0) {
+        err = fsop_write_all(shiplog.fd, line, SHIPLOG_TIME_LEN + len + 2);
+        flock(shiplog.fd, LOCK_UN);
+    }
+    int seal_now = 0;
+    if (err == 0) {
+        if (shiplog.size == 0 || shiplog.first_time == 0) {
+            // A new segment: the sealer learns when it comes of age
+            shiplog.first_time = (int64_t)now;
+            pthread_cond_signal(&shiplog.wake);
+        }
+        shiplog.size += (off_t)(SHIPLOG_TIME_LEN + len + 2);
+        if (shiplog.max_bytes > 0 && shiplog.size >= shiplog.max_bytes) {
+            shiplog.wanted = 1;
+            pthread_cond_signal(&shiplog.wake);
+            seal_now = !shiplog.sealer_running;
+        }
+    }
+    pthread_mutex_unlock(&shiplog.lock);
+    free(line);
+    if (seal_now) shiplog_seal();
+    return err;
+}
+
+// Seal the active segment now, after finishing any interrupted seal
+int shiplog_seal(void) {
+    pthread_mutex_lock(&shiplog.seal_lock);
+    int err = shiplog_recover();
+    int active_err = shiplog_seal_active();
+    pthread_mutex_unlock(&shiplog.seal_lock);
+    return err != 0 ? err : active_err;
+}
+
+static int shiplog_file_compare(const void *a, const void *b) {
+    const ShiplogFile *x = a, *y = b;
+    if (x->rank != y->rank) return x->rank - y->rank;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// The regular files of the shipment log directory, oldest entries first:
+// sealed segments and plain files by their first entry or mtime, then the
+// segments being sealed, then the active one
+static int shiplog_collect(ShiplogFile **files_out, size_t *count_out) {
+    *files_out = NULL;
+    *count_out = 0;
+    int dir_fd = open(shiplog.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return errno == ENOENT ? 0 : errno;
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        int err = errno;
+        close(dir_fd);
+        return err;
+    }
+    ShiplogFile *files = NULL;
+    size_t count = 0, cap = 0;
+    int err = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' || len >= sizeof(files[0].name) ||
+            (len > 4 && strcmp(entry->d_name + len - 4, ".tmp") == 0)) {
+            continue;
+        }
+        int fd = openat(dir_fd, entry->d_name, O_RDONLY | O_NOCTTY | O_CLOEXEC | O_NOFOLLOW);
+        struct stat sb;
+        if (fd < 0) continue;
+        if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+            close(fd);
+            continue;
+        }
+        if (count == cap) {
+            size_t grown_cap = cap ? cap * 2 : 64;
+            ShiplogFile *grown = realloc(files, grown_cap * sizeof(ShiplogFile));
+            if (grown == NULL) {
+                close(fd);
+                err = ENOMEM;
+                break;
+            }
+            files = grown;
+            cap = grown_cap;
+        }
+        ShiplogFile *file = &files[count++];
+        memset(file, 0, sizeof(*file));
+        memcpy(file->name, entry->d_name, len + 1);
+        file->size = sb.st_size;
+        file->key = (int64_t)sb.st_mtime;
+        unsigned seq;
+        file->rank = strcmp(file->name, SHIPLOG_ACTIVE_NAME) == 0 ? 2
+                   : shiplog_name_seq(file->name, "sealing-", ".log", &seq) ? 1 : 0;
+        if (pread(fd, &file->header, sizeof(file->header), 0) == (ssize_t)sizeof(file->header) &&
+            segment_detect(&file->header, sizeof(file->header))) {
+            file->sealed = 1;
+            if (file->header.first_time != 0) file->key = file->header.first_time;
+        }
+        close(fd);
+    }
+    closedir(dir);
+    if (err != 0) {
+        free(files);
+        return err;
+    }
+    qsort(files, count, sizeof(ShiplogFile), shiplog_file_compare);
+    *files_out = files;
+    *count_out = count;
+    return 0;
+}
+
+// Report the lines of data stamped from `from` to `to` that contain the
+// needle (any line when k is 0); line_no is the number of the first line
+static void shiplog_query_lines(const char *name, const char *data, size_t n, uint64_t line_no, int64_t from,
+                                int64_t to, const char *needle, size_t k, ShiplogClock *clock,
+                                ShiplogVisitor visit, void *arg, size_t *matched) {
+    for (size_t pos = 0; pos < n; line_no++) {
+        const char *nl = memchr(data + pos, '\n', n - pos);
+        size_t end = nl != NULL ? (size_t)(nl - data) : n;
+        int64_t when = shiplog_line_time(clock, data + pos, end - pos);
+        if (when != 0 && when >= from && when <= to && (k == 0 || memmem(data + pos, end - pos, needle, k) != NULL)) {
+            (*matched)++;
+            if (visit != NULL) visit(name, line_no, data + pos, end - pos, arg);
+        }
+        pos = end + 1;
+    }
+}
+
+// Call visit for every entry stamped from `from` to `to` inclusive that
+// contains needle (every entry when it is empty), oldest segment first, and
+// count them. Sealed segments and blocks outside the range, or whose Bloom
+// filter rules the needle out, are never read.
+int shiplog_query(int64_t from, int64_t to, const char *needle, ShiplogVisitor visit, void *arg, size_t *matched) {
+    *matched = 0;
+    size_t k = strlen(needle);
+    pthread_rwlock_rdlock(&shiplog.files_lock);
+    ShiplogFile *files;
+    size_t count;
+    int err = shiplog_collect(&files, &count);
+    ShiplogClock clock = { .hour = "" };
+    for (size_t i = 0; err == 0 && i < count; i++) {
+        const ShiplogFile *file = &files[i];
+        if (file->sealed && (file->header.last_time == 0 || file->header.last_time < from || file->header.first_time > to)) {
+            continue;
+        }
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", shiplog.dir, file->name) >= (int)sizeof(path)) continue;
+        int fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            err = errno == ENOENT ? 0 : errno;
+            continue;
+        }
+        if (file->sealed) {
+            SegmentReader r;
+            int load_err = segment_load(fd, &r, k >= 3);
+            err = load_err;
+            for (uint32_t b = 0; err == 0 && b < r.header.block_count; b++) {
+                const SegmentBlock *block = &r.blocks[b];
+                if (block->last_time == 0 || block->last_time < from || block->first_time > to) continue;
+                if (k >= 3 && !segment_bloom_may_contain(r.blooms + (size_t)b * SEGMENT_BLOOM_BYTES, needle, k)) continue;
+                err = segment_read_block(&r, b);
+                if (err == 0) {
+                    shiplog_query_lines(file->name, r.raw, block->raw_size, block->first_line + 1, from, to, needle, k,
+                                        &clock, visit, arg, matched);
+                }
+            }
+            if (load_err == 0) segment_reader_free(&r);
+        } else {
+            struct stat sb;
+            if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+                size_t n = (size_t)sb.st_size;
+                const char *data = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    err = errno;
+                } else {
+                    shiplog_query_lines(file->name, data, n, 1, from, to, needle, k, &clock, visit, arg, matched);
+                    munmap((void *)data, n);
+                }
+            }
+        }
+        close(fd);
+    }
+    pthread_rwlock_unlock(&shiplog.files_lock);
+    free(files);
+    return err;
+}
+
+// Compress every plain file of the shipment log directory other than the
+// active segment into NAME.lseg beside it
+int shiplog_compress(size_t *compressed, size_t *failed) {
+    *compressed = *failed = 0;
+    pthread_mutex_lock(&shiplog.seal_lock);
+    ShiplogFile *files;
+    size_t count;
+    pthread_rwlock_rdlock(&shiplog.files_lock);
+    int err = shiplog_collect(&files, &count);
+    pthread_rwlock_unlock(&shiplog.files_lock);
+    for (size_t i = 0; err == 0 && i < count; i++) {
+        if (files[i].sealed || files[i].rank != 0 || files[i].size == 0) continue;
+        char path[PATH_MAX], segment[PATH_MAX], temp[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", shiplog.dir, files[i].name) >= (int)sizeof(path) ||
+            snprintf(segment, sizeof(segment), "%s.lseg", path) >= (int)sizeof(segment) ||
+            snprintf(temp, sizeof(temp), "%s.lseg.tmp", path) >= (int)sizeof(temp)) {
+            (*failed)++;
+            continue;
+        }
+        int file_err = segment_write(path, temp);
+        if (file_err == 0) {
+            pthread_rwlock_wrlock(&shiplog.files_lock);
+            if (rename(temp, segment) != 0 || unlink(path) != 0) file_err = errno;
+            pthread_rwlock_unlock(&shiplog.files_lock);
+        }
+        if (file_err == 0) {
+            (*compressed)++;
+        } else {
+            fprintf(stderr, "Cannot compress %s: %s\n", path, strerror(file_err));
+            (*failed)++;
+        }
+    }
+    pthread_mutex_unlock(&shiplog.seal_lock);
+    free(files);
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// Small-file packs
+//
+// pack_tree moves the cold small files of every directory under a root into
+// one packfile per directory, PACK_FILE_NAME, and unlinks them, so listings
+// and backups read one file where there were thousands. A packfile is a
+// 64-byte header, the contents of its files back to back, then an index of
+// entries sorted by name (place, size, mode, mtime and CRC of each file)
+// and the names themselves. Readers map it and binary-search the index;
+// pack_open_member hands out a memfd holding a member's bytes, mode and
+// mtime, so view, copy and search read it through the same code as a plain
+// file. Anything that changes a file calls pack_unpack first, which
+// restores the member as a plain file and only then marks it dead in the
+// index. A plain file always shadows a member of the same name, so a crash
+// in between loses nothing, and the next pack run drops dead and shadowed
+// members. Changes to the packfile of a directory hold flock on the
+// directory.
+//
+// A plain file is read through the descriptor it was checked on, which
+// stays open until the file is unlinked. Where the filesystem grants one,
+// that descriptor holds a read lease: it cannot be taken while anyone has
+// the file open for writing, and any later open for writing waits for the
+// lease, so nothing can append between the last check and the unlink.
+// Without a lease, the file is checked again with fstat just before the
+// unlink.
+// ---------------------------------------------------------------------------
+
+#define PACK_MAGIC "LPAK0001"
+#define PACK_TMP_NAME ".logistics_pack.tmp"
+#define PACK_ENTRY_DEAD 0x1
+#define PACK_WRITE_BUFFER (1 << 20)
+#define PACK_OPEN_MAX 512        // Plain files held open per directory and run
+
+typedef struct PackHeader {
+    char magic[8];
+    uint64_t count;          // Entries in the index
+    uint64_t index_offset;   // Entry table; the contents sit between the header and it
+    uint64_t names_offset;   // Entry names, back to back
+    uint64_t names_size;
+    uint64_t data_size;
+    uint64_t reserved[2];
+} PackHeader;
+
+typedef struct PackEntry {
+    uint64_t offset;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t name_offset;
+    uint32_t name_len;
+    uint32_t mode;           // Permission bits
+    uint32_t crc;            // CRC-32 of the contents
+    uint32_t flags;          // PACK_ENTRY_DEAD once the file was unpacked
+    uint32_t reserved;
+} PackEntry;
+
+typedef struct PackMap {
+    int fd;
+    const char *base;
+    size_t size;
+    const PackHeader *header;
+    const PackEntry *entries;
+    const char *names;
+    ino_t ino;
+    dev_t dev;
+} PackMap;
+
+// A file going into a new packfile: a plain file or a member of the old one
+typedef struct PackItem {
+    const char *name;
+    size_t name_len;
+    const PackEntry *old;    // NULL for a plain file
+    struct stat sb;          // Plain files: as seen when chosen
+    int fd;                  // Plain files: open from the read until the unlink, or -1
+    int leased;              // fd holds a read lease
+    int packed;
+} PackItem;
+
+// Directories of one pack_tree run and their combined outcome
+typedef struct PackRun {
+    char **dirs;
+    size_t count;
+    time_t cutoff;
+    atomic_size_t files, packs, failed;
+    atomic_llong bytes;
+} PackRun;
+
+static struct {
+    long long max_bytes;     // Largest file that is packed
+    long long min_age;       // Seconds a file must have been left unchanged
+} pack = { .max_bytes = 16384, .min_age = 7 * 86400 };
+
+void pack_init(const char *max_bytes, const char *min_age) {
+    // A lease break is announced with SIGIO. The packer only gives its
+    // leases up once it is done with the files, so it needs no notice.
+    signal(SIGIO, SIG_IGN);
+    if (max_bytes != NULL && max_bytes[0] != '\0') {
+        char *end;
+        long long value = strtoll(max_bytes, &end, 10);
+        if (*end == '\0' && value >= 0) {
+            pack.max_bytes = value;
+        } else {
+            fprintf(stderr, "Invalid LOGISTICS_PACK_MAX_BYTES value %s, keeping %lld bytes.\n", max_bytes,
+                    pack.max_bytes);
+        }
+    }
+    if (min_age != NULL && min_age[0] != '\0') {
+        char *end;
+        long long value = strtoll(min_age, &end, 10);
+        if (*end == '\0' && value >= 0) {
+            pack.min_age = value;
+        } else {
+            fprintf(stderr, "Invalid LOGISTICS_PACK_AGE value %s, keeping %lld seconds.\n", min_age, pack.min_age);
+        }
+    }
+}
+
+void pack_limits(long long *max_bytes, long long *min_age) {
+    *max_bytes = pack.max_bytes;
+    *min_age = pack.min_age;
+}
+
+// Is name the packfile (1), or its temporary file while it is rewritten (2)?
+int pack_reserved_name(const char *name) {
+    size_t len = sizeof(PACK_FILE_NAME) - 1;
+    if (strncmp(name, PACK_FILE_NAME, len) != 0) return 0;
+    return name[len] == '\0' ? 1 : 2;
+}
+
+static int pack_compare_names(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp != 0) return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int pack_compare_items(const void *a, const void *b) {
+    const PackItem *x = a, *y = b;
+    return pack_compare_names(x->name, x->name_len, y->name, y->name_len);
+}
+
+static void pack_unmap(PackMap *map) {
+    if (map->base != NULL) munmap((void *)map->base, map->size);
+    if (map->fd >= 0) close(map->fd);
+    map->base = NULL;
+    map->fd = -1;
+}
+
+// Map the packfile of a directory. Returns 0, ENOENT when there is none,
+// EBADMSG when it is damaged, or another errno value.
+static int pack_map(int dir_fd, int flags, PackMap *map) {
+    memset(map, 0, sizeof(*map));
+    map->fd = openat(dir_fd, PACK_FILE_NAME, flags | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    if (map->fd < 0) return errno;
+    struct stat sb;
+    if (fstat(map->fd, &sb) != 0) {
+        int err = errno;
+        pack_unmap(map);
+        return err;
+    }
+    if (!S_ISREG(sb.st_mode) || (size_t)sb.st_size < sizeof(PackHeader)) {
+        pack_unmap(map);
+        return EBADMSG;
+    }
+    map->size = (size_t)sb.st_size;
+    map->ino = sb.st_ino;
+    map->dev = sb.st_dev;
+    void *base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, map->fd, 0);
+    if (base == MAP_FAILED) {
+        int err = errno;
+        pack_unmap(map);
+        return err;
+    }
+    map->base = base;
+
+    const PackHeader *h = base;
+    if (memcmp(h->magic, PACK_MAGIC, 8) != 0 || h->index_offset < sizeof(PackHeader) ||
+        h->names_offset < h->index_offset || h->names_offset > map->size ||
+        h->names_size > map->size - h->names_offset ||
+        h->count > (h->names_offset - h->index_offset) / sizeof(PackEntry) || h->index_offset % 8 != 0) {
+        pack_unmap(map);
+        return EBADMSG;
+    }
+    map->header = h;
+    map->entries = (const PackEntry *)(map->base + h->index_offset);
+    map->names = map->base + h->names_offset;
+    return 0;
+}
+
+// Does the entry lie within the file?
+static int pack_entry_valid(const PackMap *map, const PackEntry *e) {
+    const PackHeader *h = map->header;
+    return e->offset >= sizeof(PackHeader) && e->offset <= h->index_offset && e->size <= h->index_offset - e->offset &&
+           e->name_len > 0 && e->name_offset <= h->names_size && e->name_len <= h->names_size - e->name_offset;
+}
+
+// Index of the entry named name, dead or alive, or -1
+static long pack_find(const PackMap *map, const char *name, size_t len) {
+    size_t lo = 0, hi = map->header->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const PackEntry *e = &map->entries[mid];
+        if (!pack_entry_valid(map, e)) return -1;
+        int cmp = pack_compare_names(map->names + e->name_offset, e->name_len, name, len);
+        if (cmp == 0) return (long)mid;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+// The live member named name, or NULL
+static const PackEntry *pack_member(const PackMap *map, const char *name) {
+    long i = pack_find(map, name, strlen(name));
+    if (i < 0 || (map->entries[i].flags & PACK_ENTRY_DEAD)) return NULL;
+    return &map->entries[i];
+}
+
+static int pack_member_intact(const PackMap *map, const PackEntry *e) {
+    return journal_crc32((const unsigned char *)map->base + e->offset, (size_t)e->size) == e->crc;
+}
+
+static void pack_member_stat(const PackMap *map, const PackEntry *e, struct stat *sb) {
+    memset(sb, 0, sizeof(*sb));
+    sb->st_dev = map->dev;
+    sb->st_ino = map->ino;
+    sb->st_mode = S_IFREG | (e->mode & 07777);
+    sb->st_nlink = 1;
+    sb->st_uid = getuid();
+    sb->st_gid = getgid();
+    sb->st_size = (off_t)e->size;
+    sb->st_blksize = 4096;
+    sb->st_mtim.tv_sec = (time_t)(e->mtime_ns / 1000000000LL);
+    sb->st_mtim.tv_nsec = (long)(e->mtime_ns % 1000000000LL);
+    sb->st_atim = sb->st_ctim = sb->st_mtim;
+}
+
+// Serialize changes to the packfile of dir_fd (an O_PATH descriptor is
+// fine). Returns the lock descriptor to close, or -1 with errno set.
+static int pack_lock(int dir_fd) {
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno == EINTR) continue;
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Mark entry i dead; the caller syncs the packfile
+static int pack_kill(const PackMap *map, size_t i) {
+    uint32_t flags = map->entries[i].flags | PACK_ENTRY_DEAD;
+    off_t at = (off_t)(map->header->index_offset + i * sizeof(PackEntry) + offsetof(PackEntry, flags));
+    return pwrite(map->fd, &flags, sizeof(flags), at) == (ssize_t)sizeof(flags) ? 0 : errno;
+}
+
+// Write a member back as the plain file name in dir_fd, durably, without
+// replacing anything that appeared there meanwhile
+static int pack_restore(const PackMap *map, const PackEntry *e, int dir_fd, const char *name) {
+    if (!pack_member_intact(map, e)) return EBADMSG;
+    mode_t mode = e->mode & 07777;
+    char tmp_leaf[NAME_MAX + 1];
+    const char *tmp_name = NULL;
+    int fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+    if (fd < 0) {
+        if (snprintf(tmp_leaf, sizeof(tmp_leaf), ".%.200s.unpack.%ld", name, (long)getpid()) >= (int)sizeof(tmp_leaf)) {
+            return ENAMETOOLONG;
+        }
+        tmp_name = tmp_leaf;
+        fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+        if (fd < 0) return errno;
+    }
+    int err = fsop_write_all(fd, map->base + e->offset, (size_t)e->size);
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT },
+                                 { .tv_sec = (time_t)(e->mtime_ns / 1000000000LL), .tv_nsec = (long)(e->mtime_ns % 1000000000LL) } };
+    if (err == 0 && fchmod(fd, mode) != 0) err = errno;
+    if (err == 0 && futimens(fd, times) != 0) err = errno;
+    if (err == 0 && fsync(fd) != 0) err = errno;
+    if (err == 0) err = fsop_publish_no_replace(fd, dir_fd, name, tmp_name);
+    if (tmp_name != NULL) unlinkat(dir_fd, tmp_name, 0);
+    close(fd);
+    if (err == EEXIST) err = 0;  // A plain file got there first and shadows the member
+    return err == 0 ? fsop_fsync_dir(dir_fd) : err;
+}
+
+// Call visit for every live member of the packfile in dir_fd, in name
+// order. Returns 0, ENOENT when there is no packfile, or EBADMSG.
+int pack_for_each(int dir_fd, PackVisitor visit, void *arg) {
+    PackMap map;
+    int err = pack_map(dir_fd, O_RDONLY, &map);
+    if (err != 0) return err;
+    char name[NAME_MAX + 1];
+    for (uint64_t i = 0; i < map.header->count; i++) {
+        const PackEntry *e = &map.entries[i];
+        if (!pack_entry_valid(&map, e)) {
+            err = EBADMSG;
+            break;
+        }
+        if ((e->flags & PACK_ENTRY_DEAD) || e->name_len > NAME_MAX) continue;
+        memcpy(name, map.names + e->name_offset, e->name_len);
+        name[e->name_len] = '\0';
+        NameIndexInfo info = {
+            .ino = map.ino,
+            .size = (off_t)e->size,
+            .mtime_ns = e->mtime_ns,
+            .type = DT_REG,
+        };
+        visit(name, e->name_len, &info, arg);
+    }
+    pack_unmap(&map);
+    return err;
+}
+
+// Open the member name of the packfile in dir_fd for reading, as a memfd
+// with its contents, mode and mtime. info may be NULL. Returns the fd, or
+// -1 with errno set (ENOENT when no live member has that name).
+int pack_openat(int dir_fd, const char *name, NameIndexInfo *info) {
+    PackMap map;
+    int err = pack_map(dir_fd, O_RDONLY, &map);
+    if (err != 0) {
+        errno = err == EBADMSG ? EBADMSG : ENOENT;
+        return -1;
+    }
+    const PackEntry *e = pack_member(&map, name);
+    if (e == NULL || !pack_member_intact(&map, e)) {
+        err = e == NULL ? ENOENT : EBADMSG;
+        pack_unmap(&map);
+        errno = err;
+        return -1;
+    }
+
+    int fd = memfd_create("logistics-pack", MFD_CLOEXEC);
+    err = fd >= 0 ? fsop_write_all(fd, map.base + e->offset, (size_t)e->size) : errno;
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT },
+                                 { .tv_sec = (time_t)(e->mtime_ns / 1000000000LL), .tv_nsec = (long)(e->mtime_ns % 1000000000LL) } };
+    if (err == 0 && fchmod(fd, e->mode & 07777) != 0) err = errno;
+    if (err == 0 && futimens(fd, times) != 0) err = errno;
+    if (err == 0 && lseek(fd, 0, SEEK_SET) != 0) err = errno;
+    if (err == 0 && info != NULL) {
+        info->ino = map.ino;
+        info->size = (off_t)e->size;
+        info->mtime_ns = e->mtime_ns;
+        info->type = DT_REG;
+    }
+    pack_unmap(&map);
+    if (err != 0) {
+        if (fd >= 0) close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Open the packed file at path for reading; see pack_openat
+int pack_open_member(const char *path, NameIndexInfo *info) {
+    const char *leaf;
+    int dir_fd = fsop_open_parent(path, &leaf);
+    if (dir_fd < 0) return -1;
+    int fd = pack_openat(dir_fd, leaf, info);
+    int err = errno;
+    close(dir_fd);
+    errno = err;
+    return fd;
+}
+
+// stat() that also finds packed files. A member reports the device and
+// inode of its packfile. Returns 0 or an errno value.
+int pack_stat(const char *path, struct stat *sb) {
+    if (stat(path, sb) == 0) return 0;
+    if (errno != ENOENT) return errno;
+    const char *leaf;
+    int dir_fd = fsop_open_parent(path, &leaf);
+    if (dir_fd < 0) return ENOENT;
+    PackMap map;
+    int err = pack_map(dir_fd, O_RDONLY, &map);
+    close(dir_fd);
+    if (err != 0) return ENOENT;
+    const PackEntry *e = pack_member(&map, leaf);
+    if (e != NULL) pack_member_stat(&map, e, sb);
+    pack_unmap(&map);
+    return e != NULL ? 0 : ENOENT;
+}
+
+// Lock and map the packfile of dir_fd for unpacking. Returns the lock
+// descriptor, or -1 with errno set (ENOENT when there is no packfile).
+static int pack_unpack_begin(int dir_fd, PackMap *map) {
+    struct stat sb;
+    map->base = NULL;
+    map->fd = -1;
+    if (fstatat(dir_fd, PACK_FILE_NAME, &sb, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+    int lock_fd = pack_lock(dir_fd);
+    if (lock_fd < 0) return -1;
+    int err = pack_map(dir_fd, O_RDWR, map);
+    if (err != 0) {
+        close(lock_fd);
+        errno = err;
+        return -1;
+    }
+    return lock_fd;
+}
+
+// Make live entry i, called name, a plain file again: restore it, or just
+// drop it when a plain file already shadows it. The caller holds the lock
+// and syncs the packfile afterwards.
+static int pack_unpack_entry(const PackMap *map, size_t i, int dir_fd, const char *name, size_t *unpacked) {
+    struct stat sb;
+    if (fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno != ENOENT) return errno;
+        int err = pack_restore(map, &map->entries[i], dir_fd, name);
+        if (err != 0) return err;
+        (*unpacked)++;
+    }
+    return pack_kill(map, i);
+}
+
+static int pack_unpack_end(PackMap *map, int lock_fd, int changed, int err) {
+    if (changed && fdatasync(map->fd) != 0 && err == 0) err = errno;
+    pack_unmap(map);
+    close(lock_fd);
+    return err;
+}
+
+// Make path a plain file before it is changed: restore it if it is packed,
+// or forget a member that a plain file of the same name shadows. Returns 0
+// (also when nothing is packed under that name) or an errno value.
+int pack_unpack(const char *path) {
+    const char *leaf;
+    int dir_fd = fsop_open_parent(path, &leaf);
+    if (dir_fd < 0) return errno == ENOENT ? 0 : errno;
+    PackMap map;
+    int lock_fd = pack_unpack_begin(dir_fd, &map);
+    int err = lock_fd >= 0 || errno == ENOENT ? 0 : errno;
+    if (lock_fd >= 0) {
+        long i = pack_find(&map, leaf, strlen(leaf));
+        int live = i >= 0 && !(map.entries[i].flags & PACK_ENTRY_DEAD);
+        size_t unpacked = 0;
+        if (live) err = pack_unpack_entry(&map, (size_t)i, dir_fd, leaf, &unpacked);
+        err = pack_unpack_end(&map, lock_fd, live, err);
+    }
+    close(dir_fd);
+    return err;
+}
+
+// pack_unpack for every packed file of dir_fd whose name matches glob
+int pack_unpack_matching(int dir_fd, const GlobPattern *glob, size_t *unpacked) {
+    *unpacked = 0;
+    PackMap map;
+    int lock_fd = pack_unpack_begin(dir_fd, &map);
+    if (lock_fd < 0) return errno == ENOENT ? 0 : errno;
+    int err = 0, changed = 0;
+    char name[NAME_MAX + 1];
+    for (uint64_t i = 0; err == 0 && i < map.header->count; i++) {
+        const PackEntry *e = &map.entries[i];
+        if (!pack_entry_valid(&map, e)) {
+            err = EBADMSG;
+            break;
+        }
+        if ((e->flags & PACK_ENTRY_DEAD) || e->name_len > NAME_MAX) continue;
+        memcpy(name, map.names + e->name_offset, e->name_len);
+        name[e->name_len] = '\0';
+        if (!glob_match(glob, name, e->name_len)) continue;
+        err = pack_unpack_entry(&map, (size_t)i, dir_fd, name, unpacked);
+        changed = 1;
+    }
+    return pack_unpack_end(&map, lock_fd, changed, err);
+}
+
+// Is the file open on fd still the one item was chosen as?
+static int pack_item_unchanged(int fd, const PackItem *item) {
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) return 0;
+    return sb.st_ino == item->sb.st_ino && sb.st_nlink == 1 && sb.st_size == item->sb.st_size &&
+           sb.st_mtim.tv_sec == item->sb.st_mtim.tv_sec && sb.st_mtim.tv_nsec == item->sb.st_mtim.tv_nsec;
+}
+
+// Let go of the descriptor of a plain file, and of its lease
+static void pack_release_file(PackItem *item) {
+    if (item->fd < 0) return;
+    if (item->leased) fcntl(item->fd, F_SETLEASE, F_UNLCK);
+    close(item->fd);
+    item->fd = -1;
+    item->leased = 0;
+}
+
+// Read a plain file chosen for packing into buffer, checking that it is
+// still the file that was chosen. On success item->fd stays open, leased
+// if the filesystem allows, for pack_directory to check and unlink.
+static int pack_read_file(int dir_fd, PackItem *item, char *buffer) {
+    item->fd = openat(dir_fd, item->name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    if (item->fd < 0) return errno;
+    int err = 0;
+    if (fcntl(item->fd, F_SETLEASE, F_RDLCK) == 0) {
+        item->leased = 1;
+    } else if (errno == EAGAIN || errno == EBUSY) {
+        // Open for writing somewhere: it is not cold after all
+        err = EAGAIN;
+    }
+    if (err == 0 && !pack_item_unchanged(item->fd, item)) err = EAGAIN;
+    size_t done = 0;
+    while (err == 0 && done < (size_t)item->sb.st_size) {
+        ssize_t n = pread(item->fd, buffer + done, (size_t)item->sb.st_size - done, (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) err = errno;
+        else if (n == 0) err = EAGAIN;
+        else done += (size_t)n;
+    }
+    if (err != 0) pack_release_file(item);
+    return err;
+}
+
+// Write the packfile of items (sorted by name) to PACK_TMP_NAME in dir_fd
+// and rename it into place. Items whose file changed meanwhile are left out.
+static int pack_write(int dir_fd, const PackMap *old, PackItem *items, size_t count, long long *bytes) {
+    int fd = openat(dir_fd, PACK_TMP_NAME, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) return errno;
+
+    PackEntry *entries = malloc((count > 0 ? count : 1) * sizeof(PackEntry));
+    char *file_buffer = malloc(pack.max_bytes > 0 ? (size_t)pack.max_bytes : 1);
+    OutBuffer data = { 0 }, names = { 0 };
+    int err = entries == NULL || file_buffer == NULL ? ENOMEM : 0;
+    // The header goes in last, once the file is complete
+    if (err == 0 && lseek(fd, (off_t)sizeof(PackHeader), SEEK_SET) < 0) err = errno;
+    uint64_t offset = sizeof(PackHeader);
+    size_t n = 0, held = 0;
+    for (size_t i = 0; err == 0 && i < count; i++) {
+        PackItem *item = &items[i];
+        const char *contents;
+        PackEntry *e = &entries[n];
+        if (item->old != NULL) {
+            contents = old->base + item->old->offset;
+            *e = *item->old;
+        } else {
+            // Files past the limit of open descriptors wait for the next run
+            if (held == PACK_OPEN_MAX || pack_read_file(dir_fd, item, file_buffer) != 0) continue;
+            held++;
+            contents = file_buffer;
+            memset(e, 0, sizeof(*e));
+            e->size = (uint64_t)item->sb.st_size;
+            e->mtime_ns = (long long)item->sb.st_mtim.tv_sec * 1000000000LL + item->sb.st_mtim.tv_nsec;
+            e->mode = item->sb.st_mode & 07777;
+            e->crc = journal_crc32((const unsigned char *)contents, (size_t)e->size);
+            *bytes += (long long)e->size;
+        }
+        if (names.len + item->name_len > UINT32_MAX) {
+            err = EFBIG;
+            break;
+        }
+        e->offset = offset;
+        e->name_offset = (uint32_t)names.len;
+        e->name_len = (uint32_t)item->name_len;
+        e->flags = 0;
+        offset += e->size;
+        err = out_append(&data, contents, (size_t)e->size);
+        if (err == 0) err = out_append(&names, item->name, item->name_len);
+        if (err == 0 && data.len >= PACK_WRITE_BUFFER) {
+            err = fsop_write_all(fd, data.data, data.len);
+            data.len = 0;
+        }
+        item->packed = err == 0;
+        n++;
+    }
+    if (err == 0 && data.len > 0) err = fsop_write_all(fd, data.data, data.len);
+
+    // Entries start 8-byte aligned so readers can use the mapping directly
+    PackHeader header = { .count = n, .data_size = offset - sizeof(PackHeader) };
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.index_offset = (offset + 7) & ~(uint64_t)7;
+    header.names_offset = header.index_offset + n * sizeof(PackEntry);
+    header.names_size = names.len;
+    static const char padding[8];
+    if (err == 0) err = fsop_write_all(fd, padding, (size_t)(header.index_offset - offset));
+    if (err == 0) err = fsop_write_all(fd, (const char *)entries, n * sizeof(PackEntry));
+    if (err == 0) err = fsop_write_all(fd, names.data, names.len);
+    if (err == 0 && pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) err = errno;
+    if (err == 0 && fdatasync(fd) != 0) err = errno;
+    if (close(fd) != 0 && err == 0) err = errno;
+    if (err == 0 && renameat(dir_fd, PACK_TMP_NAME, dir_fd, PACK_FILE_NAME) != 0) err = errno;
+    if (err != 0) unlinkat(dir_fd, PACK_TMP_NAME, 0);
+    if (err == 0) err = fsop_fsync_dir(dir_fd);
+    free(entries);
+    free(file_buffer);
+    out_free(&data);
+    out_free(&names);
+    return err;
+}
+
+// Pack the cold small files of one directory together with the members its
+// packfile already holds. *files counts the files moved into the packfile.
+static int pack_directory(const char *dir, time_t cutoff, size_t *files, long long *bytes) {
+    *files = 0;
+    *bytes = 0;
+    int dir_fd = confine_open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (dir_fd < 0) return errno;
+    int lock_fd = pack_lock(dir_fd);
+    if (lock_fd < 0) {
+        int err = errno;
+        close(dir_fd);
+        return err;
+    }
+    PackMap old;
+    int err = pack_map(dir_fd, O_RDONLY, &old);
+    if (err == ENOENT) err = 0;
+
+    // Plain files that qualify
+    PackItem *items = NULL;
+    size_t count = 0, cap = 0, dead = 0;
+    int list_fd = err == 0 ? dup(dir_fd) : -1;
+    DIR *listing = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+    if (err == 0 && listing == NULL) {
+        err = errno;
+        if (list_fd >= 0) close(list_fd);
+    }
+    struct dirent *de;
+    while (err == 0 && (de = readdir(listing)) != NULL) {
+        // Hidden names are ours or other programs' temporary files
+        if (de->d_name[0] == '.' || (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)) continue;
+        struct stat sb;
+        if (fstatat(dir_fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(sb.st_mode) ||
+            sb.st_nlink != 1 || sb.st_size > pack.max_bytes || sb.st_mtim.tv_sec > cutoff) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            PackItem *grown = realloc(items, cap * sizeof(PackItem));
+            if (grown == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            items = grown;
+        }
+        size_t len = strlen(de->d_name);
+        char *name = malloc(len + 1);
+        if (name == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        memcpy(name, de->d_name, len + 1);
+        items[count++] = (PackItem){ .name = name, .name_len = len, .sb = sb, .fd = -1 };
+    }
+    size_t plain = count;
+    if (listing != NULL) closedir(listing);
+
+    // Members of the old packfile stay unless they are dead or shadowed
+    for (uint64_t i = 0; err == 0 && old.base != NULL && i < old.header->count; i++) {
+        const PackEntry *e = &old.entries[i];
+        if (!pack_entry_valid(&old, e)) {
+            err = EBADMSG;
+            break;
+        }
+        char name[NAME_MAX + 1];
+        struct stat sb;
+        if ((e->flags & PACK_ENTRY_DEAD) || e->name_len > NAME_MAX) {
+            dead++;
+            continue;
+        }
+        memcpy(name, old.names + e->name_offset, e->name_len);
+        name[e->name_len] = '\0';
+        if (fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+            dead++;
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            PackItem *grown = realloc(items, cap * sizeof(PackItem));
+            if (grown == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            items = grown;
+        }
+        items[count++] = (PackItem){ .name = old.names + e->name_offset, .name_len = e->name_len, .old = e, .fd = -1 };
+    }
+
+    if (err == 0 && count == 0 && dead > 0) {
+        // Everything it held was unpacked
+        err = unlinkat(dir_fd, PACK_FILE_NAME, 0) == 0 ? 0 : errno;
+    } else if (err == 0 && (plain > 0 || dead > 0)) {
+        qsort(items, count, sizeof(PackItem), pack_compare_items);
+        err = pack_write(dir_fd, &old, items, count, bytes);
+    }
+
+    // The packfile is durable: the originals can go, unless they changed.
+    // Each is checked on the descriptor it was packed from, and its name
+    // must still lead to that file. A lease that is being broken means a
+    // writer is waiting to open it, so it stays.
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].old != NULL) continue;
+        struct stat sb;
+        if (err == 0 && items[i].packed && items[i].fd >= 0 &&
+            (!items[i].leased || fcntl(items[i].fd, F_GETLEASE) == F_RDLCK) &&
+            pack_item_unchanged(items[i].fd, &items[i]) &&
+            fstatat(dir_fd, items[i].name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && sb.st_ino == items[i].sb.st_ino &&
+            unlinkat(dir_fd, items[i].name, 0) == 0) {
+            (*files)++;
+        }
+        pack_release_file(&items[i]);
+        free((char *)items[i].name);
+    }
+    free(items);
+    pack_unmap(&old);
+    close(lock_fd);
+    close(dir_fd);
+    return err;
+}
+
+// Walker callback: remember every directory of the tree
+static void pack_collect_visit(int worker, const WalkEntry *entry, void *arg) {
+    if (entry->type != DT_DIR) return;
+    OutBuffer *dirs = &((OutBuffer *)arg)[worker];
+    if (out_append(dirs, entry->path, entry->path_len) == 0) out_append(dirs, "", 1);
+}
+
+static void pack_directory_task(int worker, size_t index, void *arg) {
+    (void)worker;
+    PackRun *run = arg;
+    size_t files;
+    long long bytes;
+    int err = pack_directory(run->dirs[index], run->cutoff, &files, &bytes);
+    if (err != 0) {
+        fprintf(stderr, "Cannot pack %s: %s\n", run->dirs[index], strerror(err));
+        atomic_fetch_add(&run->failed, 1);
+        return;
+    }
+    if (files > 0) atomic_fetch_add(&run->packs, 1);
+    atomic_fetch_add(&run->files, files);
+    atomic_fetch_add(&run->bytes, bytes);
+}
+
+// Pack the cold small files of every directory under root, directories in
+// parallel. Returns 0 or an errno value; directories that fail are counted.
+int pack_tree(const char *root, PackStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int workers = walk_default_workers();
+    OutBuffer *found = calloc((size_t)workers, sizeof(OutBuffer));
+    if (found == NULL) return ENOMEM;
+    const char *roots[1] = { root };
+    int err = walk_trees(roots, 1, workers, pack_collect_visit, found);
+
+    PackRun run = { .cutoff = time(NULL) - (time_t)pack.min_age };
+    size_t cap = 1;
+    for (int w = 0; w < workers; w++) {
+        for (size_t off = 0; off < found[w].len; off += strlen(found[w].data + off) + 1) cap++;
+    }
+    run.dirs = err == 0 ? malloc(cap * sizeof(char *)) : NULL;
+    if (err == 0 && run.dirs == NULL) err = ENOMEM;
+    if (err == 0) {
+        run.dirs[run.count++] = (char *)root;
+        for (int w = 0; w < workers; w++) {
+            for (size_t off = 0; off < found[w].len; off += strlen(found[w].data + off) + 1) {
+                run.dirs[run.count++] = found[w].data + off;
+            }
+        }
+        ParallelJob job;
+        parallel_start(&job, run.count, workers, pack_directory_task, &run);
+        parallel_wait(&job);
+        stats->files = atomic_load(&run.files);
+        stats->packs = atomic_load(&run.packs);
+        stats->failed = atomic_load(&run.failed);
+        stats->bytes = atomic_load(&run.bytes);
+    }
+    free(run.dirs);
+    for (int w = 0; w < workers; w++) out_free(&found[w]);
+    free(found);
+    return err;
+}
+
+// Get input from user
+char *get_input(const char *prompt, char *buffer, size_t size) {
+    printf("%s", prompt);
+    fflush(stdout);
+    if (fgets(buffer, (int)size, stdin) != NULL) {
+        buffer[strcspn(buffer, "\n")] = '\0';  // Remove newline
+        return buffer;
+    }
+    return NULL;
+}
+
+// Function to select base path with 'Other' option. A subdirectory chosen
+// through 'Other' is built in path_buffer (PATH_MAX bytes), so the result
+// stays valid for as long as the caller's buffer does.
+const char* select_base_path_with_other(UserContext *user_ctx, const char *prompt, char *path_buffer) {
+    printf("%s\n", prompt);
+    for (int i = 0; i < user_ctx->base_paths_count; i++) {
+        printf("%d. %s\n", i + 1, user_ctx->base_paths[i]);
+    }
+    printf("%d. Other (specify subdirectory under allowed directories)\n", user_ctx->base_paths_count + 1);
+
+    char dir_choice_str[10];
+    if (get_input("Enter your choice: ", dir_choice_str, sizeof(dir_choice_str)) == NULL) {
+        printf("Error reading input.\n");
+        return NULL;
+    }
+    int dir_choice = atoi(dir_choice_str) - 1;
+    if (dir_choice < 0 || dir_choice > user_ctx->base_paths_count) {
+        printf("Invalid choice.\n");
+        return NULL;
+    }
+    if (dir_choice == user_ctx->base_paths_count) {
+        // 'Other' option selected
+        printf("Select the base directory under which the subdirectory is located:\n");
+        for (int i = 0; i < user_ctx->base_paths_count; i++) {
+            printf("%d. %s\n", i + 1, user_ctx->base_paths[i]);
+        }
+        if (get_input("Enter your choice: ", dir_choice_str, sizeof(dir_choice_str)) == NULL) {
+            printf("Error reading input.\n");
+            return NULL;
+        }
+        int base_dir_choice = atoi(dir_choice_str) - 1;
+        if (base_dir_choice < 0 || base_dir_choice >= user_ctx->base_paths_count) {
+            printf("Invalid choice.\n");
+            return NULL;
+        }
+        const char *selected_base_path = user_ctx->base_paths[base_dir_choice];
+        char subdir_name[256];
+        if (get_input("Enter the subdirectory path under selected base directory: ", subdir_name, sizeof(subdir_name)) == NULL) {
+            printf("Error reading input.\n");
+            return NULL;
+        }
+        // Sanitize subdirectory name
+        char sanitized_subdir[256];
+        if (!sanitize_filename(subdir_name, sanitized_subdir, sizeof(sanitized_subdir))) {
+            printf("Invalid subdirectory name.\n");
+            return NULL;
+        }
+        // Now construct the base path
+        char *temp_path = path_buffer;
+        if (snprintf(temp_path, PATH_MAX, "%s/%s", selected_base_path, sanitized_subdir) >= PATH_MAX) {
+            printf("Path is too long.\n");
+            return NULL;
+        }
+        // Check that it is a valid path under allowed paths
+        if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, temp_path)) {
+            printf("Invalid or forbidden path.\n");
+            return NULL;
+        }
+        // Check if the directory exists
+        struct stat sb;
+        if (stat(temp_path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            return temp_path;
+        } else {
+            printf("Directory does not exist.\n");
+            return NULL;
+        }
+    } else {
+        return user_ctx->base_paths[dir_choice];
+    }
+}
+
+// Per-worker, per-root output shared by list_files and find_file. With a
+// filter, entries of any type that pass it are collected; without one,
+// regular files are.
+typedef struct ListState {
+    const FindFilter *filter;
+    const char **roots;
+    int root_count;
+    OutBuffer *buffers;  // [worker * root_count + root]
+    int *counts;
+} ListState;
+
+static void list_state_add(ListState *state, int slot, const char *path, size_t path_len) {
+    OutBuffer *out = &state->buffers[slot];
+    if (out_append(out, path, path_len) == 0 && out_append(out, "\n", 1) == 0) {
+        state->counts[slot]++;
+    }
+}
+
+// Where the members of one packfile are listed
+typedef struct ListPack {
+    ListState *state;
+    int slot;
+    const char *dir;
+    size_t dir_len;
+} ListPack;
+
+// Members of a packfile are listed as the files they stand for
+static void list_pack_visit(const char *name, size_t name_len, const NameIndexInfo *info, void *arg) {
+    ListPack *pack = arg;
+    const FindFilter *filter = pack->state->filter;
+    if (filter != NULL && (!glob_match(&filter->glob, name, name_len) ||
+                           !find_filter_accepts(filter, info->size, info->mtime_ns))) {
+        return;
+    }
+    char path[PATH_MAX];
+    if (pack->dir_len + 1 + name_len >= sizeof(path)) return;
+    memcpy(path, pack->dir, pack->dir_len);
+    path[pack->dir_len] = '/';
+    memcpy(path + pack->dir_len + 1, name, name_len + 1);
+    list_state_add(pack->state, pack->slot, path, pack->dir_len + 1 + name_len);
+}
+
+// List the members of the packfile at path (in dir_fd) instead of the
+// packfile itself. Returns 0 when the entry is taken care of.
+static int list_state_add_pack(ListState *state, int slot, int dir_fd, const char *path) {
+    const char *name = strrchr(path, '/') + 1;
+    int kind = pack_reserved_name(name);
+    if (kind == 0) return ENOENT;
+    if (kind == 2) return 0;  // A packfile being written
+    ListPack pack = { state, slot, path, (size_t)(name - path) - 1 };
+    int err = pack_for_each(dir_fd, list_pack_visit, &pack);
+    if (err != 0) fprintf(stderr, "Cannot read %s: %s\n", path, strerror(err));
+    return 0;
+}
+
+static void list_files_visit(int worker, const WalkEntry *entry, void *arg) {
+    ListState *state = arg;
+    const FindFilter *filter = state->filter;
+    int slot = worker * state->root_count + entry->root;
+    if (entry->type == DT_REG && list_state_add_pack(state, slot, entry->dirfd, entry->path) == 0) {
+        return;
+    }
+    if (filter == NULL) {
+        if (entry->type != DT_REG) return;
+    } else {
+        if (!glob_match(&filter->glob, entry->name, entry->path_len - (size_t)(entry->name - entry->path))) return;
+        if (filter->has_size || filter->has_mtime) {
+            // Stat only names that already matched
+            struct stat sb;
+            if (fstatat(entry->dirfd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) != 0) return;
+            long long mtime_ns = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+            if (!find_filter_accepts(filter, sb.st_size, mtime_ns)) return;
+        }
+    }
+    list_state_add(state, slot, entry->path, entry->path_len);
+}
+
+// Same as list_files_visit, for entries served by the namespace index
+static void list_files_index_visit(const NameIndexEntry *entry, void *arg) {
+    ListState *state = arg;
+    const FindFilter *filter = state->filter;
+    int slot = -1;
+    for (int i = 0; i < state->root_count && slot < 0; i++) {
+        size_t len = strlen(state->roots[i]);
+        if (entry->path_len > len && entry->path[len] == '/' && memcmp(entry->path, state->roots[i], len) == 0) slot = i;
+    }
+    if (slot < 0) return;
+
+    const char *name = strrchr(entry->path, '/') + 1;
+    if (entry->info.type == DT_REG && pack_reserved_name(name)) {
+        const char *leaf;
+        int dir_fd = fsop_open_parent(entry->path, &leaf);
+        if (dir_fd >= 0) {
+            list_state_add_pack(state, slot, dir_fd, entry->path);
+            close(dir_fd);
+        }
+        return;
+    }
+    if (filter == NULL) {
+        if (entry->info.type != DT_REG) return;
+    } else {
+        if (!glob_match(&filter->glob, name, entry->path_len - (size_t)(name - entry->path))) return;
+        if (!find_filter_accepts(filter, entry->info.size, entry->info.mtime_ns)) return;
+    }
+    list_state_add(state, slot, entry->path, entry->path_len);
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Gather everything collected for one root into a sorted array of strings
+// pointing into the state's buffers. Returns NULL on allocation failure.
+static char **list_state_sorted(ListState *state, int root, int workers, size_t *count) {
+    size_t total = 0;
+    for (int w = 0; w < workers; w++) total += (size_t)state->counts[w * state->root_count + root];
+    char **lines = malloc((total > 0 ? total : 1) * sizeof(char *));
+    if (lines == NULL) return NULL;
+
+    size_t n = 0;
+    for (int w = 0; w < workers; w++) {
+        OutBuffer *out = &state->buffers[w * state->root_count + root];
+        for (size_t off = 0; off < out->len && n < total; ) {
+            char *line = out->data + off;
+            char *newline = memchr(line, '\n', out->len - off);
+            *newline = '\0';
+            lines[n++] = line;
+            off = (size_t)(newline - out->data) + 1;
+        }
+    }
+    qsort(lines, n, sizeof(char *), compare_strings);
+    *count = n;
+    return lines;
+}
+
+// Print everything collected for one root in sorted order
+static void list_state_print_sorted(ListState *state, int root, int workers) {
+    size_t count;
+    char **lines = list_state_sorted(state, root, workers, &count);
+    if (lines == NULL) return;
+    for (size_t i = 0; i < count; i++) {
+        fputs(lines[i], stdout);
+        fputc('\n', stdout);
+    }
+    free(lines);
+}
+
+// Write everything collected for one root to fd in sorted order, in one go
+static int list_state_write_sorted(ListState *state, int root, int workers, int fd) {
+    size_t count;
+    char **lines = list_state_sorted(state, root, workers, &count);
+    if (lines == NULL) return ENOMEM;
+    OutBuffer sorted = { 0 };
+    int err = 0;
+    for (size_t i = 0; err == 0 && i < count; i++) {
+        err = out_append(&sorted, lines[i], strlen(lines[i]));
+        if (err == 0) err = out_append(&sorted, "\n", 1);
+    }
+    if (err == 0 && sorted.len > 0) err = fsop_write_all(fd, sorted.data, sorted.len);
+    out_free(&sorted);
+    free(lines);
+    return err;
+}
+
+// Fill state from the index, or by walking the disk if the index is down
+static int list_state_collect(ListState *state, const char **roots, int root_count, int workers) {
+    state->roots = roots;
+    state->root_count = root_count;
+    state->buffers = calloc((size_t)(workers * root_count), sizeof(OutBuffer));
+    state->counts = calloc((size_t)(workers * root_count), sizeof(int));
+    if (state->buffers == NULL || state->counts == NULL) return ENOMEM;
+
+    int err = nsindex_for_each(NULL, list_files_index_visit, state);
+    if (err == ENOENT) err = walk_trees(roots, root_count, workers, list_files_visit, state);
+    return err;
+}
+
+static void list_state_free(ListState *state, int workers) {
+    if (state->buffers != NULL) {
+        for (int i = 0; i < workers * state->root_count; i++) out_free(&state->buffers[i]);
+    }
+    free(state->buffers);
+    free(state->counts);
+}
+
+// Function to list files in allowed directories
+void list_files(UserContext *user_ctx) {
+    printf("Listing files in allowed directories:\n");
+
+    // Collect all base paths at once, then print each one's files together
+    int workers = walk_default_workers();
+    ListState state = { .filter = NULL };
+    int err = list_state_collect(&state, user_ctx->base_paths, user_ctx->base_paths_count, workers);
+    if (err == ENOMEM && (state.buffers == NULL || state.counts == NULL)) {
+        printf("Memory allocation failed.\n");
+        list_state_free(&state, workers);
+        return;
+    }
+    if (err != 0) {
+        printf("Error listing files: %s\n", strerror(err));
+    }
+
+    int total_files = 0;
+    for (int i = 0; i < user_ctx->base_paths_count; i++) {
+        const char *base_path = user_ctx->base_paths[i];
+        printf("\nDirectory: %s\n", base_path);
+
+        int dir_file_count = 0;
+        for (int w = 0; w < workers; w++) dir_file_count += state.counts[w * state.root_count + i];
+        list_state_print_sorted(&state, i, workers);
+
+        printf("Number of files in %s: %d\n", base_path, dir_file_count);
+        total_files += dir_file_count;
+    }
+    printf("\nTotal number of files: %d\n", total_files);
+
+    list_state_free(&state, workers);
+}
+
+// Function to change file permissions
+void change_permissions(UserContext *user_ctx) {
+    char file_name[256];
+    if (get_input("Enter file name to change permissions: ", file_name, sizeof(file_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_name[256];
+    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
+        printf("Invalid file name.\n");
+        return;
+    }
+
+    char base_path_buffer[PATH_MAX];
+    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory of the file:", base_path_buffer);
+    if (base_path == NULL) return;
+
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // A packed file is unpacked first, so the new mode has a file to go on
+    int err = pack_unpack(full_path);
+    if (err != 0) {
+        printf("Error unpacking file: %s\n", strerror(err));
+        return;
+    }
+
+    // Check if file exists
+    struct stat sb;
+    if (stat(full_path, &sb) != 0) {
+        printf("File does not exist.\n");
+        return;
+    }
+
+    char perm_str[10];
+    if (get_input("Enter new permissions (e.g., 755): ", perm_str, sizeof(perm_str)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    // Use chmod function
+    mode_t mode = strtol(perm_str, NULL, 8);
+    uint64_t txn;
+    err = journal_begin(JOURNAL_OP_CHMOD, full_path, NULL, mode, &txn);
+    if (err == 0) {
+        err = fsop_chmod(full_path, mode);
+        journal_end(txn, err);
+    }
+    if (err == 0) {
+        printf("Permissions changed for %s\n", full_path);
+    } else {
+        printf("Error changing permissions: %s\n", strerror(err));
+    }
+}
+
+// Function to create directory
+void create_directory(UserContext *user_ctx) {
+    char dir_name[256];
+    if (get_input("Enter directory name to create: ", dir_name, sizeof(dir_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_name[256];
+    if (!sanitize_filename(dir_name, sanitized_name, sizeof(sanitized_name))) {
+        printf("Invalid directory name.\n");
+        return;
+    }
+
+    char base_path_buffer[PATH_MAX];
+    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory to create the new directory in:", base_path_buffer);
+    if (base_path == NULL) return;
+
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // Check if directory exists
+    struct stat sb;
+    if (stat(full_path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        printf("Directory already exists.\n");
+        return;
+    }
+
+    // Create directory
+    uint64_t txn;
+    int err = journal_begin(JOURNAL_OP_MKDIR, full_path, NULL, 0777, &txn);
+    if (err == 0) {
+        err = fsop_mkdir(full_path, 0777);
+        journal_end(txn, err);
+    }
+    if (err == 0) {
+        printf("Directory created: %s\n", full_path);
+    } else {
+        printf("Error creating directory: %s\n", strerror(err));
+    }
+}
+
+// Set by Ctrl-C while delete_directory is removing a tree
+static atomic_int delete_directory_cancel;
+
+static void delete_directory_interrupt(int sig) {
+    (void)sig;
+    atomic_store(&delete_directory_cancel, 1);
+}
+
+static void delete_directory_progress(const RmTreeProgress *progress, void *arg) {
+    *(int *)arg = 1;
+    printf("\rDeleting: %ld files, %ld directories (%.1f s). Press Ctrl-C to cancel.", progress->files,
+           progress->dirs, progress->seconds);
+    fflush(stdout);
+}
+
+// Function to delete directory
+void delete_directory(UserContext *user_ctx) {
+    char dir_name[256];
+    if (get_input("Enter directory name to delete: ", dir_name, sizeof(dir_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_name[256];
+    if (!sanitize_filename(dir_name, sanitized_name, sizeof(sanitized_name))) {
+        printf("Invalid directory name.\n");
+        return;
+    }
+
+    char base_path_buffer[PATH_MAX];
+    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the directory to delete is located:", base_path_buffer);
+    if (base_path == NULL) return;
+
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // Check if the directory exists
+    struct stat sb;
+    if (stat(full_path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+        printf("Directory does not exist.\n");
+        return;
+    }
+
+    // Move it to the trash: a single rename, so nothing to journal
+    int err = trash_move(full_path);
+    if (err == 0) {
+        printf("Directory moved to the trash: %s (restore it from the menu)\n", full_path);
+        return;
+    }
+    if (err != EXDEV) {
+        printf("Error deleting directory: %s\n", strerror(err));
+        return;
+    }
+
+    // Delete directory tree. Ctrl-C stops it; a cancelled deletion is
+    // journaled as finished, so recovery does not carry it on.
+    int shown = 0;
+    RmTreeProgress progress = { 0 };
+    RmTreeOptions options = { .cancel = &delete_directory_cancel, .progress = delete_directory_progress,
+                              .progress_arg = &shown };
+    struct sigaction interrupt = { .sa_handler = delete_directory_interrupt }, previous;
+    sigemptyset(&interrupt.sa_mask);
+    atomic_store(&delete_directory_cancel, 0);
+    sigaction(SIGINT, &interrupt, &previous);
+    uint64_t txn;
+    err = journal_begin(JOURNAL_OP_DELETE_TREE, full_path, NULL, 0, &txn);
+    if (err == 0) {
+        err = rmtree_run(full_path, &options, &progress);
+        journal_end(txn, err);
+    }
+    sigaction(SIGINT, &previous, NULL);
+    if (shown) printf("\n");
+
+    if (err == 0) {
+        printf("Directory deleted: %s (%ld files, %ld directories in %.2f s)\n", full_path, progress.files,
+               progress.dirs, progress.seconds);
+    } else if (err == ECANCELED) {
+        printf("Deletion cancelled after removing %ld files and %ld directories. The rest of %s is unchanged.\n",
+               progress.files, progress.dirs, full_path);
+    } else {
+        printf("Error deleting directory: %s (%ld files, %ld directories removed)\n", strerror(err), progress.files,
+               progress.dirs);
+    }
+}
+
+// Function to create file
+void create_file(UserContext *user_ctx) {
+    char file_name[256];
+    if (get_input("Enter file name to create: ", file_name, sizeof(file_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_name[256];
+    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
+        printf("Invalid file name.\n");
+        return;
+    }
+
+    char base_path_buffer[PATH_MAX];
+    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory to create the new file in:", base_path_buffer);
+    if (base_path == NULL) return;
+
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // Check if file exists, packed or not
+    struct stat sb;
+    if (pack_stat(full_path, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        printf("File already exists.\n");
+        return;
+    }
+
+    // Create file
+    uint64_t txn;
+    int err = journal_begin(JOURNAL_OP_CREATE, full_path, NULL, 0666, &txn);
+    if (err == 0) {
+        err = fsop_create_file(full_path, 0666);
+        journal_end(txn, err);
+    }
+    if (err == 0) {
+        printf("File created: %s\n", full_path);
+    } else {
+        printf("Error creating file: %s\n", strerror(err));
+    }
+}
+
+// Function to delete file
+void delete_file(UserContext *user_ctx) {
+    char file_name[256];
+    if (get_input("Enter file name to delete: ", file_name, sizeof(file_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_name[256];
+    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
+        printf("Invalid file name.\n");
+        return;
+    }
+
+    char base_path_buffer[PATH_MAX];
+    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the file is located:", base_path_buffer);
+    if (base_path == NULL) return;
+
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // A packed file goes to the trash like any other, as a plain file
+    int err = pack_unpack(full_path);
+    if (err != 0) {
+        printf("Error unpacking file: %s\n", strerror(err));
+        return;
+    }
+
+    // Check if file exists
+    struct stat sb;
+    if (stat(full_path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        printf("File does not exist.\n");
+        return;
+    }
+
+    // Move it to the trash, or delete it when there is none
+    err = trash_move(full_path);
+    if (err == 0) {
+        printf("File moved to the trash: %s (restore it from the menu)\n", full_path);
+        return;
+    }
+    if (err == EXDEV) {
+        uint64_t txn;
+        err = journal_begin(JOURNAL_OP_DELETE, full_path, NULL, 0, &txn);
+        if (err == 0) {
+            err = fsop_delete_file(full_path);
+            journal_end(txn, err);
+        }
+    }
+    if (err == 0) {
+        printf("File deleted: %s\n", full_path);
+    } else {
+        printf("Error deleting file: %s\n", strerror(err));
+    }
+}
+
+// Function to restore something deleted into the trash
+void restore_from_trash(UserContext *user_ctx) {
+    TrashEntry *entries;
+    size_t count;
+    int err = trash_list(user_ctx, &entries, &count);
+    if (err != 0) {
+        printf("Error reading the trash: %s\n", strerror(err));
+        return;
+    }
+    if (count == 0) {
+        printf(trash_enabled() ? "The trash is empty.\n" : "The trash is turned off; deletions are permanent.\n");
+        free(entries);
+        return;
+    }
+
+    printf("Deleted items, newest first:\n");
+    for (size_t i = 0; i < count; i++) {
+        char when[32];
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&entries[i].deleted, &tm));
+        printf("%zu. %s%s (deleted %s)\n", i + 1, entries[i].origin, entries[i].is_dir ? "/" : "", when);
+    }
+
+    char choice_str[32];
+    if (get_input("Choose an item to restore: ", choice_str, sizeof(choice_str)) == NULL) {
+        printf("Error reading input.\n");
+        free(entries);
+        return;
+    }
+    long choice = atol(choice_str);
+    if (choice < 1 || (size_t)choice > count) {
+        printf("Invalid choice.\n");
+        free(entries);
+        return;
+    }
+
+    const TrashEntry *entry = &entries[choice - 1];
+    err = trash_restore(entry);
+    if (err == 0) {
+        printf("Restored: %s\n", entry->origin);
+    } else if (err == EEXIST) {
+        printf("Cannot restore: %s exists again. Move it away first.\n", entry->origin);
+    } else if (err == ENOENT) {
+        printf("Cannot restore: the directory that held %s no longer exists.\n", entry->origin);
+    } else {
+        printf("Error restoring %s: %s\n", entry->origin, strerror(err));
+    }
+    free(entries);
+}
+
+// Function to create symbolic link
+void create_symbolic_link(UserContext *user_ctx) {
+    char target[256], link_name[256];
+    if (get_input("Enter target file for symbolic link: ", target, sizeof(target)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    if (get_input("Enter symbolic link name: ", link_name, sizeof(link_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_target[256];
+    char sanitized_link_name[256];
+    if (!sanitize_filename(target, sanitized_target, sizeof(sanitized_target)) ||
+        !sanitize_filename(link_name, sanitized_link_name, sizeof(sanitized_link_name))) {
+        printf("Invalid file or link name.\n");
+        return;
+    }
+
+    // Base path selection for target
+    char target_base_path_buffer[PATH_MAX];
+    const char *target_base_path = select_base_path_with_other(user_ctx, "Select the directory where the target file is located:", target_base_path_buffer);
+    if (target_base_path == NULL) return;
+
+    // Base path selection for link
+    char link_base_path_buffer[PATH_MAX];
+    const char *link_base_path = select_base_path_with_other(user_ctx, "Select the directory where the symbolic link will be created:", link_base_path_buffer);
+    if (link_base_path == NULL) return;
+
+    char full_target_path[PATH_MAX], full_link_path[PATH_MAX];
+    if (snprintf(full_target_path, sizeof(full_target_path), "%s/%s", target_base_path, sanitized_target) >= (int)sizeof(full_target_path) ||
+        snprintf(full_link_path, sizeof(full_link_path), "%s/%s", link_base_path, sanitized_link_name) >= (int)sizeof(full_link_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    // Validate paths
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_target_path) ||
+        !is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_link_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // A link needs a plain file to point at, and must not hide a packed one
+    int err = pack_unpack(full_target_path);
+    if (err == 0) err = pack_unpack(full_link_path);
+    if (err != 0) {
+        printf("Error unpacking file: %s\n", strerror(err));
+        return;
+    }
+
+    // Check if target file exists
+    struct stat sb;
+    if (stat(full_target_path, &sb) != 0) {
+        printf("Target file does not exist.\n");
+        return;
+    }
+
+    // Create symbolic link
+    uint64_t txn;
+    err = journal_begin(JOURNAL_OP_SYMLINK, full_link_path, full_target_path, 0, &txn);
+    if (err == 0) {
+        err = fsop_symlink(full_target_path, full_link_path);
+        journal_end(txn, err);
+    }
+    if (err == 0) {
+        printf("Symbolic link created: %s\n", full_link_path);
+    } else {
+        printf("Error creating symbolic link: %s\n", strerror(err));
+    }
+}
+
+// Function to copy file
+void copy_file(UserContext *user_ctx) {
+    char source[256], destination[256];
+    if (get_input("Enter source file to copy: ", source, sizeof(source)) == NULL ||
+        get_input("Enter destination file name: ", destination, sizeof(destination)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_source[256];
+    char sanitized_destination[256];
+    if (!sanitize_filename(source, sanitized_source, sizeof(sanitized_source)) ||
+        !sanitize_filename(destination, sanitized_destination, sizeof(sanitized_destination))) {
+        printf("Invalid source or destination file name.\n");
+        return;
+    }
+
+    // Base path selection for source
+    char source_base_path_buffer[PATH_MAX];
+    const char *source_base_path = select_base_path_with_other(user_ctx, "Select the directory where the source file is located:", source_base_path_buffer);
+    if (source_base_path == NULL) return;
+
+    // Base path selection for destination
+    char dest_base_path_buffer[PATH_MAX];
+    const char *dest_base_path = select_base_path_with_other(user_ctx, "Select the directory where the destination file will be created:", dest_base_path_buffer);
+    if (dest_base_path == NULL) return;
+
+    char full_source_path[PATH_MAX], full_destination_path[PATH_MAX];
+    if (snprintf(full_source_path, sizeof(full_source_path), "%s/%s", source_base_path, sanitized_source) >= (int)sizeof(full_source_path) ||
+        snprintf(full_destination_path, sizeof(full_destination_path), "%s/%s", dest_base_path, sanitized_destination) >= (int)sizeof(full_destination_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    // Validate paths
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_source_path) ||
+        !is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_destination_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // Check if source file exists; a packed one is read from its packfile
+    struct stat sb;
+    if (pack_stat(full_source_path, &sb) != 0) {
+        printf("Source file does not exist.\n");
+        return;
+    }
+    int err = pack_unpack(full_destination_path);
+    if (err != 0) {
+        printf("Error unpacking file: %s\n", strerror(err));
+        return;
+    }
+
+    // Copy file
+    CopyStats stats;
+    uint64_t txn;
+    err = journal_begin(JOURNAL_OP_COPY, full_source_path, full_destination_path, 0, &txn);
+    if (err == 0) {
+        err = fsop_copy_file(full_source_path, full_destination_path, &stats);
+        journal_end(txn, err);
+    }
+    if (err == 0) {
+        printf("File copied from %s to %s\n", full_source_path, full_destination_path);
+        double mb = (double)stats.bytes / (1024.0 * 1024.0);
+        if (stats.seconds > 0) {
+            printf("%lld bytes copied via %s in %.3f s (%.1f MB/s)\n", stats.bytes, stats.method, stats.seconds, mb / stats.seconds);
+        } else {
+            printf("%lld bytes copied via %s\n", stats.bytes, stats.method);
+        }
+    } else {
+        printf("Error copying file: %s\n", strerror(err));
+    }
+}
+
+// Function to move file
+void move_file(UserContext *user_ctx) {
+    char source_file_name[256];
+    if (get_input("Enter source file to move: ", source_file_name, sizeof(source_file_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_source[256];
+    if (!sanitize_filename(source_file_name, sanitized_source, sizeof(sanitized_source))) {
+        printf("Invalid source file name.\n");
+        return;
+    }
+
+    // Base path selection for source
+    char source_base_path_buffer[PATH_MAX];
+    const char *source_base_path = select_base_path_with_other(user_ctx, "Select the directory where the source file is located:", source_base_path_buffer);
+    if (source_base_path == NULL) return;
+
+    // Base path selection for destination
+    char dest_base_path_buffer[PATH_MAX];
+    const char *dest_base_path = select_base_path_with_other(user_ctx, "Select the directory where the file will be moved to:", dest_base_path_buffer);
+    if (dest_base_path == NULL) return;
+
+    char full_source_path[PATH_MAX], full_destination_path[PATH_MAX];
+    if (snprintf(full_source_path, sizeof(full_source_path), "%s/%s", source_base_path, sanitized_source) >= (int)sizeof(full_source_path) ||
+        snprintf(full_destination_path, sizeof(full_destination_path), "%s/%s", dest_base_path, sanitized_source) >= (int)sizeof(full_destination_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+
+    // Validate paths
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_source_path) ||
         !is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_destination_path)) {
         printf("Invalid path. Operation not allowed.\n");
         return;
     }
 
-    // Check if source file exists
-    struct stat sb;
-    if (stat(full_source_path, &sb) != 0) {
-        printf("Source file does not exist.\n");
-        return;
+    // Packed files move as plain ones, and a packed destination still counts
+    int err = pack_unpack(full_source_path);
+    if (err == 0) err = pack_unpack(full_destination_path);
+    if (err != 0) {
+        printf("Error unpacking file: %s\n", strerror(err));
+        return;
+    }
+
+    // Check if source file exists
+    struct stat sb;
+    if (stat(full_source_path, &sb) != 0) {
+        printf("Source file does not exist.\n");
+        return;
+    }
+
+    // Move file
+    uint64_t txn;
+    err = journal_begin(JOURNAL_OP_MOVE, full_source_path, full_destination_path, 0, &txn);
+    if (err == 0) {
+        err = fsop_rename(full_source_path, full_destination_path);
+        journal_end(txn, err);
+    }
+    if (err == 0) {
+        printf("File moved from %s to %s\n", full_source_path, full_destination_path);
+    } else if (err == EEXIST) {
+        printf("Destination file already exists. Nothing was moved.\n");
+    } else {
+        printf("Error moving file: %s\n", strerror(err));
+    }
+}
+
+// Function to append to file
+void append_to_file(UserContext *user_ctx) {
+    char file_name[256];
+    if (get_input("Enter file name to append text: ", file_name, sizeof(file_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_name[256];
+    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
+        printf("Invalid file name.\n");
+        return;
+    }
+
+    char base_path_buffer[PATH_MAX];
+    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the file is located or will be created:", base_path_buffer);
+    if (base_path == NULL) return;
+
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    if (segment_sealed(full_path)) {
+        printf("Sealed shipment log segments are read-only.\n");
+        return;
+    }
+    int err = pack_unpack(full_path);
+    if (err != 0) {
+        printf("Error unpacking file: %s\n", strerror(err));
+        return;
+    }
+
+    char text[1024];
+    if (get_input("Enter text to append: ", text, sizeof(text)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    // One record per note, newline-terminated like echo
+    size_t text_len = strlen(text);
+    text[text_len++] = '\n';
+
+    AppendReceipt receipt;
+    err = append_record(full_path, text, text_len, &receipt);
+    if (err != 0) {
+        printf("Error appending to file: %s\n", strerror(err));
+        return;
+    }
+    printf("Text appended to %s%s\n", full_path, receipt.synced ? " (synced to disk)" : "");
+}
+
+// Function to view file content
+void view_file_content(UserContext *user_ctx) {
+    char file_name[256];
+    if (get_input("Enter file name to view content: ", file_name, sizeof(file_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    char sanitized_name[256];
+    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
+        printf("Invalid file name.\n");
+        return;
+    }
+
+    char base_path_buffer[PATH_MAX];
+    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the file is located:", base_path_buffer);
+    if (base_path == NULL) return;
+
+    char full_path[PATH_MAX];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
+        printf("Path is too long.\n");
+        return;
+    }
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+
+    // Check if file exists, packed or not
+    struct stat sb;
+    if (pack_stat(full_path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        printf("File does not exist.\n");
+        return;
+    }
+
+    char option[10];
+    if (get_input("View whole file, (h)ead/(t)ail or line (r)ange? (w/h/t/r): ", option, sizeof(option)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    int num_lines = 0;
+    char num_str[10];
+    if (option[0] == 'h' || option[0] == 'H' || option[0] == 't' || option[0] == 'T') {
+        if (get_input("Enter number of lines to display: ", num_str, sizeof(num_str)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        num_lines = atoi(num_str);
+        if (num_lines <= 0) {
+            printf("Invalid number of lines.\n");
+            return;
+        }
+    }
+
+    long first_line = 0, last_line = 0;
+    if (option[0] == 'r' || option[0] == 'R') {
+        char range_str[20];
+        if (get_input("Enter first line: ", num_str, sizeof(num_str)) == NULL ||
+            get_input("Enter last line: ", range_str, sizeof(range_str)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        first_line = atol(num_str);
+        last_line = atol(range_str);
+        if (first_line <= 0 || last_line < first_line) {
+            printf("Invalid line range.\n");
+            return;
+        }
+    }
+
+    if (option[0] != 'w' && option[0] != 'W' && option[0] != 'h' && option[0] != 'H' &&
+        option[0] != 't' && option[0] != 'T' && option[0] != 'r' && option[0] != 'R') {
+        printf("Invalid option.\n");
+        return;
+    }
+
+    int packed = 0;
+    int fd = confine_open(full_path, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+    if (fd < 0 && errno == ENOENT) {
+        fd = pack_open_member(full_path, NULL);
+        packed = fd >= 0;
+    }
+    if (fd < 0) {
+        printf("Error opening file: %s\n", strerror(errno));
+        return;
+    }
+
+    // The engine writes straight to the descriptor, behind stdio's back
+    fflush(stdout);
+    int err;
+    if (segment_probe(fd)) {
+        // A sealed shipment log: only the blocks holding the lines are read
+        int mode = tolower((unsigned char)option[0]);
+        err = segment_view(fd, STDOUT_FILENO, mode, mode == 'r' ? first_line : num_lines, last_line);
+        if (err == ERANGE) {
+            printf("The file has fewer than %ld lines.\n", first_line);
+            err = 0;
+        }
+    } else if (option[0] == 'w' || option[0] == 'W') {
+        err = view_whole(fd, STDOUT_FILENO);
+    } else if (option[0] == 'h' || option[0] == 'H') {
+        err = view_head(fd, STDOUT_FILENO, num_lines);
+    } else if (option[0] == 't' || option[0] == 'T') {
+        err = view_tail(fd, STDOUT_FILENO, num_lines);
+    } else {
+        // One seek to the nearest checkpoint and a short scan
+        off_t start, end;
+        err = line_index_range(fd, packed ? NULL : LINE_INDEX_DIR, first_line, last_line, &start, &end);
+        if (err == 0 && start == end) {
+            printf("The file has fewer than %ld lines.\n", first_line);
+        } else if (err == 0) {
+            err = view_range(fd, STDOUT_FILENO, start, end);
+        }
+    }
+    close(fd);
+    if (err != 0) {
+        printf("Error viewing file: %s\n", strerror(err));
+    }
+}
+
+// Write the paths under roots that pass filter to fd, sorted per root;
+// returns 0 or an errno value. What was found is written even when part of
+// the walk failed.
+static int find_run(const char **roots, int root_count, const FindFilter *filter, int fd) {
+    int workers = walk_default_workers();
+    ListState state = { .filter = filter };
+    int err = list_state_collect(&state, roots, root_count, workers);
+    if (err == ENOMEM && (state.buffers == NULL || state.counts == NULL)) {
+        list_state_free(&state, workers);
+        return err;
+    }
+
+    for (int i = 0; i < root_count; i++) {
+        // Like find -name, the starting directory itself can match
+        const char *base_path = roots[i];
+        const char *base_name = strrchr(base_path, '/');
+        base_name = base_name != NULL ? base_name + 1 : base_path;
+        struct stat sb;
+        int write_err = 0;
+        if (glob_match(&filter->glob, base_name, strlen(base_name)) && stat(base_path, &sb) == 0 &&
+            find_filter_accepts(filter, sb.st_size, (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec)) {
+            write_err = fsop_write_all(fd, base_path, strlen(base_path));
+            if (write_err == 0) write_err = fsop_write_all(fd, "\n", 1);
+        }
+        if (write_err == 0) write_err = list_state_write_sorted(&state, i, workers, fd);
+        if (write_err != 0) {
+            err = write_err;
+            break;
+        }
+    }
+
+    list_state_free(&state, workers);
+    return err;
+}
+
+// Function to find files with pattern
+void find_file(UserContext *user_ctx) {
+    char pattern[256];
+    if (get_input("Enter file name pattern to search (use '*' for wildcards): ", pattern, sizeof(pattern)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    char option[10], size_str[32], age_str[32];
+    if (get_input("Ignore case? (y/n): ", option, sizeof(option)) == NULL ||
+        get_input("Size filter (e.g. +10k, -2M, 512; empty for any): ", size_str, sizeof(size_str)) == NULL ||
+        get_input("Modified within N days (-N) or over N days ago (+N); empty for any: ", age_str, sizeof(age_str)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    FindFilter filter;
+    memset(&filter, 0, sizeof(filter));
+    if (glob_compile(&filter.glob, pattern, option[0] == 'y' || option[0] == 'Y') != 0) {
+        printf("Invalid pattern.\n");
+        return;
+    }
+    if ((size_str[0] != '\0' && find_parse_size(size_str, &filter) != 0) ||
+        (age_str[0] != '\0' && find_parse_age(age_str, &filter) != 0)) {
+        printf("Invalid filter.\n");
+        return;
+    }
+
+    printf("Searching for files matching %s in allowed directories.\n", pattern);
+    fflush(stdout);
+
+    int err = find_run(user_ctx->base_paths, user_ctx->base_paths_count, &filter, STDOUT_FILENO);
+    if (err != 0) {
+        printf("Error searching files: %s\n", strerror(err));
+    }
+}
+
+// Search the files under roots for keyword and write each matching line to
+// fd as path:line:text, in sorted file order; returns 0 or an errno value
+static int search_run(const char **roots, int root_count, const char *keyword, int fd) {
+    // Collect the files of every root, sorted, in root order
+    int workers = walk_default_workers();
+    ListState list = { .filter = NULL };
+    int err = list_state_collect(&list, roots, root_count, workers);
+    if (err != 0) {
+        list_state_free(&list, workers);
+        return err;
+    }
+
+    SearchState state;
+    memset(&state, 0, sizeof(state));
+    for (int i = 0; i < root_count; i++) {
+        size_t count;
+        char **files = list_state_sorted(&list, i, workers, &count);
+        char **grown = files != NULL ? realloc(state.files, (state.file_count + count + 1) * sizeof(char *)) : NULL;
+        if (grown == NULL) {
+            free(files);
+            free(state.files);
+            list_state_free(&list, workers);
+            return ENOMEM;
+        }
+        state.files = grown;
+        memcpy(state.files + state.file_count, files, count * sizeof(char *));
+        state.file_count += count;
+        free(files);
+    }
+
+    state.needle = keyword;
+    state.needle_len = strlen(keyword);
+    state.search = memsearch_select();
+    state.results = calloc(state.file_count + 1, sizeof(OutBuffer));
+    state.done = calloc(state.file_count + 1, 1);
+    state.scan = calloc(state.file_count + 1, 1);
+    state.reindex = calloc(state.file_count + 1, 1);
+    state.trigrams = calloc(state.file_count + 1, sizeof(TrigramSet));
+    if (state.results == NULL || state.done == NULL || state.scan == NULL || state.reindex == NULL || state.trigrams == NULL) {
+        free(state.results);
+        free(state.done);
+        free(state.scan);
+        free(state.reindex);
+        free(state.trigrams);
+        free(state.files);
+        list_state_free(&list, workers);
+        return ENOMEM;
+    }
+
+    // Narrow the files down with the trigram index when it is enabled
+    int use_index = trigram_index_select(state.files, state.file_count, state.needle, state.needle_len,
+                                         state.scan, state.reindex) == 0;
+    if (!use_index) memset(state.scan, 1, state.file_count);
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    // Files are searched in parallel; results are written in file order as
+    // soon as each file and all files before it are done. A failed write
+    // stops the output, but the workers still run to the end.
+    ParallelJob job;
+    parallel_start(&job, state.file_count, workers, search_content_task, &state);
+    for (size_t i = 0; i < state.file_count; i++) {
+        pthread_mutex_lock(&state.lock);
+        while (!state.done[i]) pthread_cond_wait(&state.cond, &state.lock);
+        pthread_mutex_unlock(&state.lock);
+        if (err == 0 && state.results[i].len > 0) err = fsop_write_all(fd, state.results[i].data, state.results[i].len);
+        out_free(&state.results[i]);
+    }
+    parallel_wait(&job);
+
+    if (use_index) trigram_index_update(state.files, state.file_count, state.trigrams);
+    for (size_t i = 0; i < state.file_count; i++) free(state.trigrams[i].keys);
+    for (int w = 0; w < WALK_MAX_WORKERS; w++) free(state.bitmaps[w]);
+
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+    free(state.results);
+    free(state.done);
+    free(state.scan);
+    free(state.reindex);
+    free(state.trigrams);
+    free(state.files);
+    list_state_free(&list, workers);
+    return err;
+}
+
+// Function to search content in files
+void search_content(UserContext *user_ctx) {
+    char keyword[256];
+    if (get_input("Enter keyword to search in files: ", keyword, sizeof(keyword)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    printf("Searching for keyword '%s' in files under allowed directories.\n", keyword);
+    fflush(stdout);
+
+    int err = search_run(user_ctx->base_paths, user_ctx->base_paths_count, keyword, STDOUT_FILENO);
+    if (err != 0) {
+        printf("Error searching files: %s\n", strerror(err));
+    }
+}
+
+// Function to set alias
+void set_alias(UserContext *user_ctx) {
+    if (user_ctx->aliases == NULL || user_ctx->alias_count == NULL) {
+        printf("Aliases not available for this user.\n");
+        return;
+    }
+
+    char alias_name[256];
+    char command[256];
+    if (get_input("Enter alias name: ", alias_name, sizeof(alias_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    if (get_input("Enter command to associate with the alias: ", command, sizeof(command)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    if (*(user_ctx->alias_count) < ALIAS_MAX) {
+        strcpy(user_ctx->aliases[*(user_ctx->alias_count)].name, alias_name);
+        strcpy(user_ctx->aliases[*(user_ctx->alias_count)].command, command);
+        (*(user_ctx->alias_count))++;
+        printf("Alias '%s' set for command '%s'.\n", alias_name, command);
+    } else {
+        printf("Alias limit reached.\n");
+    }
+}
+
+// Function to use alias
+void use_alias(UserContext *user_ctx) {
+    if (user_ctx->aliases == NULL || user_ctx->alias_count == NULL) {
+        printf("Aliases not available for this user.\n");
+        return;
+    }
+
+    char alias_name[256];
+    if (get_input("Enter alias to use: ", alias_name, sizeof(alias_name)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    char command[256] = {0};
+    int found = 0;
+    for (int i = 0; i < *(user_ctx->alias_count); i++) {
+        if (strcmp(user_ctx->aliases[i].name, alias_name) == 0) {
+            strcpy(command, user_ctx->aliases[i].command);
+            found = 1;
+            break;
+        }
+    }
+    if (!found) {
+        printf("Alias not found.\n");
+        return;
+    }
+
+    // Map command to function
+    if (strcmp(command, "list") == 0) {
+        list_files(user_ctx);
+    } else if (strcmp(command, "move") == 0) {
+        move_file(user_ctx);
+    } else if (strcmp(command, "append") == 0) {
+        append_to_file(user_ctx);
+    } else if (strcmp(command, "view") == 0) {
+        view_file_content(user_ctx);
+    } else if (strcmp(command, "create_dir") == 0) {
+        create_directory(user_ctx);
+    } else if (strcmp(command, "delete_dir") == 0) {
+        delete_directory(user_ctx);
+    } else if (strcmp(command, "create_file") == 0) {
+        create_file(user_ctx);
+    } else if (strcmp(command, "delete_file") == 0) {
+        delete_file(user_ctx);
+    } else if (strcmp(command, "copy") == 0) {
+        copy_file(user_ctx);
+    } else if (strcmp(command, "find") == 0) {
+        find_file(user_ctx);
+    } else if (strcmp(command, "search") == 0) {
+        search_content(user_ctx);
+    } else if (strcmp(command, "change_perms") == 0) {
+        change_permissions(user_ctx);
+    } else if (strcmp(command, "bulk_copy") == 0) {
+        bulk_copy_files(user_ctx);
+    } else if (strcmp(command, "bulk_move") == 0) {
+        bulk_move_files(user_ctx);
+    } else if (strcmp(command, "bulk_delete") == 0) {
+        bulk_delete_files(user_ctx);
+    } else if (strcmp(command, "restore") == 0) {
+        restore_from_trash(user_ctx);
+    } else if (strcmp(command, "orders") == 0) {
+        order_store_menu(user_ctx);
+    } else if (strcmp(command, "stock") == 0) {
+        stock_menu(user_ctx);
+    } else if (strcmp(command, "schedule") == 0) {
+        delivery_schedule_menu(user_ctx);
+    } else if (strcmp(command, "shiplog") == 0) {
+        shipment_log_menu(user_ctx);
+    } else if (strcmp(command, "pack") == 0) {
+        pack_small_files(user_ctx);
+    } else {
+        printf("Command associated with alias '%s' is not recognized.\n", command);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Bulk glob operations
+//
+// bulk_plan matches a glob against the regular files of one directory and
+// builds the source and destination path of every match. The two
+// directories are checked once, up front; after that every path is a name
+// read from the directory joined to one of them, so no per-file check is
+// needed. bulk_run splits the plan into chunks of BULK_CHUNK files that a
+// bounded pool of threads claims one at a time. Each thread drives its
+// chunks through its own fsop_bulk context, so the operations in flight
+// grow with the number of cores and with the queue depth of each ring.
+// The intents of a chunk go to the journal in one write.
+// ---------------------------------------------------------------------------
+
+#define BULK_CHUNK 256
+#define BULK_MIN_WORKERS 4
+
+typedef struct BulkRun {
+    BulkPlan *plan;
+    int dry_run;
+    FsBulk *contexts[WALK_MAX_WORKERS];
+} BulkRun;
+
+static int bulk_compare_files(const void *a, const void *b) {
+    return strcmp(((const BulkFile *)a)->source, ((const BulkFile *)b)->source);
+}
+
+// Open a directory the user may work in; returns the fd or -1 with errno set
+static int bulk_open_dir(const UserContext *user_ctx, const char *path) {
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, path)) {
+        errno = EACCES;
+        return -1;
+    }
+    return confine_open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+}
+
+// Add name to the plan; paths that do not fit are kept, failed with ENAMETOOLONG
+static int bulk_plan_add(BulkPlan *plan, size_t *cap, const char *source_dir, const char *dest_dir, const char *name) {
+    if (plan->count == *cap) {
+        size_t new_cap = *cap > 0 ? *cap * 2 : 64;
+        BulkFile *files = realloc(plan->files, new_cap * sizeof(*files));
+        if (files == NULL) return ENOMEM;
+        plan->files = files;
+        *cap = new_cap;
+    }
+    BulkFile *file = &plan->files[plan->count];
+    memset(file, 0, sizeof(*file));
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", source_dir, name) >= (int)sizeof(path)) file->result = ENAMETOOLONG;
+    file->source = strdup(path);
+    if (file->source == NULL) return ENOMEM;
+    if (dest_dir != NULL) {
+        if (snprintf(path, sizeof(path), "%s/%s", dest_dir, name) >= (int)sizeof(path)) file->result = ENAMETOOLONG;
+        file->destination = strdup(path);
+        if (file->destination == NULL) {
+            free(file->source);
+            return ENOMEM;
+        }
+    }
+    plan->count++;
+    return 0;
+}
+
+// Packed members a dry run plans from the pack index
+typedef struct BulkPacked {
+    BulkPlan *plan;
+    size_t *cap;
+    const char *source_dir, *dest_dir, *pattern;
+    const GlobPattern *glob;
+    int dir_fd;
+    int err;
+} BulkPacked;
+
+static void bulk_plan_packed_visit(const char *name, size_t name_len, const NameIndexInfo *info, void *arg) {
+    (void)info;
+    BulkPacked *packed = arg;
+    struct stat sb;
+    if (packed->err != 0 || (name[0] == '.' && packed->pattern[0] != '.') || !glob_match(packed->glob, name, name_len) ||
+        fstatat(packed->dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        return;  // Unmatched, or shadowed by a plain file already planned
+    }
+    packed->err = bulk_plan_add(packed->plan, packed->cap, packed->source_dir, packed->dest_dir, name);
+    if (packed->err == 0) packed->plan->files[packed->plan->count - 1].packed = 1;
+}
+
+// Plan op (FSBULK_COPY, FSBULK_RENAME or FSBULK_UNLINK) for every regular
+// file directly inside source_dir whose name matches pattern. Like a shell
+// glob, names starting with a dot only match a pattern that starts with
+// one. Copies and moves go to dest_dir under the same name. Returns 0 or
+// an errno value: EINVAL for a bad pattern or when both directories are the
+// same, EACCES when the user may not work in one of them.
+int bulk_plan(const UserContext *user_ctx, FsBulkOp op, const char *source_dir, const char *pattern,
+              const char *dest_dir, int dry_run, BulkPlan *plan) {
+    memset(plan, 0, sizeof(*plan));
+    plan->op = op;
+    GlobPattern glob;
+    if (strchr(pattern, '/') != NULL || glob_compile(&glob, pattern, 0) != 0) return EINVAL;
+
+    int fd = bulk_open_dir(user_ctx, source_dir);
+    if (fd < 0) return errno;
+    if (op != FSBULK_UNLINK) {
+        int dest_fd = bulk_open_dir(user_ctx, dest_dir);
+        int err = dest_fd < 0 ? errno : 0;
+        struct stat source_sb, dest_sb;
+        if (err == 0 && fstat(fd, &source_sb) == 0 && fstat(dest_fd, &dest_sb) == 0 &&
+            source_sb.st_dev == dest_sb.st_dev && source_sb.st_ino == dest_sb.st_ino) {
+            err = EINVAL;
+        }
+        if (dest_fd >= 0) close(dest_fd);
+        if (err != 0) {
+            close(fd);
+            return err;
+        }
+    } else {
+        dest_dir = NULL;
+    }
+
+    // The bulk engine works on plain files, so a real run unpacks matching
+    // packed files first; a dry run changes nothing and reads them from the
+    // pack index instead
+    size_t unpacked;
+    int err = dry_run ? 0 : pack_unpack_matching(fd, &glob, &unpacked);
+    DIR *dir = err == 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (err == 0) err = errno;
+        close(fd);
+        return err;
+    }
+
+    size_t cap = 0;
+    while (err == 0) {
+        errno = 0;
+        struct dirent *de = readdir(dir);
+        if (de == NULL) {
+            err = errno;
+            break;
+        }
+        if (de->d_name[0] == '.' && pattern[0] != '.') continue;
+        if (!glob_match(&glob, de->d_name, strlen(de->d_name))) continue;
+        struct stat sb;
+        if (de->d_type != DT_REG &&
+            (de->d_type != DT_UNKNOWN || fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(sb.st_mode))) {
+            continue;
+        }
+        err = bulk_plan_add(plan, &cap, source_dir, dest_dir, de->d_name);
+    }
+    if (err == 0 && dry_run) {
+        BulkPacked packed = { .plan = plan, .cap = &cap, .source_dir = source_dir, .dest_dir = dest_dir,
+                              .pattern = pattern, .glob = &glob, .dir_fd = dirfd(dir) };
+        err = pack_for_each(packed.dir_fd, bulk_plan_packed_visit, &packed);
+        if (err == ENOENT) err = 0;
+        if (err == 0) err = packed.err;
+    }
+    closedir(dir);
+    if (err != 0) {
+        bulk_plan_free(plan);
+        return err;
+    }
+    if (plan->count > 1) qsort(plan->files, plan->count, sizeof(BulkFile), bulk_compare_files);
+    return 0;
+}
+
+// Run, or for a dry run check, one chunk of the plan
+static void bulk_run_chunk(int worker, size_t index, void *arg) {
+    BulkRun *run = arg;
+    BulkPlan *plan = run->plan;
+    BulkFile *files = plan->files + index * BULK_CHUNK;
+    size_t count = plan->count - index * BULK_CHUNK;
+    if (count > BULK_CHUNK) count = BULK_CHUNK;
+
+    FsBulkItem items[BULK_CHUNK];
+    JournalIntentSpec specs[BULK_CHUNK];
+    uint64_t txns[BULK_CHUNK];
+    int results[BULK_CHUNK];
+    size_t which[BULK_CHUNK];
+    JournalOp journal_op = plan->op == FSBULK_COPY ? JOURNAL_OP_COPY
+                         : plan->op == FSBULK_RENAME ? JOURNAL_OP_MOVE : JOURNAL_OP_DELETE;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].result != 0) continue;
+        // A packed file that would be deleted is there; nothing to look at
+        if (run->dry_run && files[i].packed && plan->op == FSBULK_UNLINK) continue;
+        which[n] = i;
+        if (run->dry_run) {
+            // A dry run only looks at where each file would go
+            const char *path = files[i].destination != NULL ? files[i].destination : files[i].source;
+            items[n] = (FsBulkItem){ .op = FSBULK_STAT, .path = path };
+        } else {
+            items[n] = (FsBulkItem){ .op = plan->op, .path = files[i].source, .path2 = files[i].destination };
+            specs[n] = (JournalIntentSpec){ .op = journal_op, .path = files[i].source, .path2 = files[i].destination };
+        }
+        n++;
+    }
+    if (n == 0) return;
+
+    if (run->contexts[worker] == NULL) run->contexts[worker] = fsop_bulk_open(FSBULK_AUTO);
+    int err = run->contexts[worker] == NULL ? ENOMEM : 0;
+    if (err == 0 && !run->dry_run) err = journal_begin_many(specs, n, txns);
+    if (err != 0) {
+        for (size_t j = 0; j < n; j++) files[which[j]].result = err;
+        return;
+    }
+    fsop_bulk_run(run->contexts[worker], items, n);
+
+    for (size_t j = 0; j < n; j++) {
+        BulkFile *file = &files[which[j]];
+        int res = items[j].result;
+        if (!run->dry_run) {
+            file->result = results[j] = res;
+        } else if (plan->op == FSBULK_UNLINK) {
+            file->result = res;
+        } else if (res == 0) {
+            // Copies replace an existing file; moves never do
+            file->dest_exists = 1;
+            file->result = plan->op == FSBULK_RENAME ? EEXIST : 0;
+        } else {
+            file->result = res == ENOENT ? 0 : res;
+        }
+    }
+    if (!run->dry_run) journal_end_many(txns, results, n);
+}
+
+// Carry out the plan, setting every file's result. A dry run changes
+// nothing; it sets the results the real run would be expected to give.
+void bulk_run(BulkPlan *plan, int dry_run) {
+    BulkRun run = { .plan = plan, .dry_run = dry_run };
+    size_t chunks = (plan->count + BULK_CHUNK - 1) / BULK_CHUNK;
+    if (chunks > 0) {
+        // Blocking calls leave a core idle while the disk works, so even
+        // small machines get a few workers
+        int workers = walk_default_workers();
+        if (workers < BULK_MIN_WORKERS) workers = BULK_MIN_WORKERS;
+        ParallelJob job;
+        parallel_start(&job, chunks, workers, bulk_run_chunk, &run);
+        parallel_wait(&job);
+    }
+    for (int i = 0; i < WALK_MAX_WORKERS; i++) {
+        if (run.contexts[i] != NULL) fsop_bulk_close(run.contexts[i]);
+    }
+    plan->failed = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        if (plan->files[i].result != 0) plan->failed++;
+    }
+}
+
+void bulk_plan_free(BulkPlan *plan) {
+    for (size_t i = 0; i < plan->count; i++) {
+        free(plan->files[i].source);
+        free(plan->files[i].destination);
+    }
+    free(plan->files);
+    plan->files = NULL;
+    plan->count = 0;
+}
+
+// Shared by the bulk copy, move and delete menu entries
+static void bulk_files(UserContext *user_ctx, FsBulkOp op) {
+    const char *verb = op == FSBULK_COPY ? "copy" : op == FSBULK_RENAME ? "move" : "delete";
+    const char *done = op == FSBULK_COPY ? "copied" : op == FSBULK_RENAME ? "moved" : "deleted";
+    char pattern[256];
+    if (get_input("Enter file name pattern (e.g. *.ship): ", pattern, sizeof(pattern)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+
+    char source_buffer[PATH_MAX], dest_buffer[PATH_MAX];
+    const char *source_dir = select_base_path_with_other(user_ctx, "Select the directory holding the files:", source_buffer);
+    if (source_dir == NULL) return;
+    const char *dest_dir = NULL;
+    if (op != FSBULK_UNLINK) {
+        dest_dir = select_base_path_with_other(user_ctx, op == FSBULK_COPY ? "Select the directory to copy the files to:"
+                                                                           : "Select the directory to move the files to:",
+                                               dest_buffer);
+        if (dest_dir == NULL) return;
+    }
+
+    char option[10];
+    if (get_input("Dry run? (y/n): ", option, sizeof(option)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    int dry_run = option[0] == 'y' || option[0] == 'Y';
+
+    BulkPlan plan;
+    int err = bulk_plan(user_ctx, op, source_dir, pattern, dest_dir, dry_run, &plan);
+    if (err == EINVAL) {
+        printf("Invalid pattern, or source and destination are the same directory.\n");
+        return;
+    }
+    if (err != 0) {
+        printf("Error reading the directories: %s\n", strerror(err));
+        return;
+    }
+    if (plan.count == 0) {
+        printf("No files match %s.\n", pattern);
+        bulk_plan_free(&plan);
+        return;
+    }
+
+    bulk_run(&plan, dry_run);
+    for (size_t i = 0; i < plan.count; i++) {
+        const BulkFile *file = &plan.files[i];
+        if (file->result != 0) {
+            printf("%s %s: %s\n", dry_run ? "Would fail" : "Failed", file->source,
+                   file->result == EEXIST ? "destination file already exists" : strerror(file->result));
+        } else if (!dry_run) {
+            printf("%s %s\n", op == FSBULK_COPY ? "Copied" : op == FSBULK_RENAME ? "Moved" : "Deleted", file->source);
+        } else if (file->destination != NULL) {
+            printf("Would %s %s to %s%s\n", verb, file->source, file->destination,
+                   file->dest_exists ? " (replacing it)" : "");
+        } else {
+            printf("Would %s %s\n", verb, file->source);
+        }
+    }
+    if (dry_run) {
+        printf("Dry run: %zu of %zu files would be %s, %zu would fail.\n", plan.count - plan.failed, plan.count, done,
+               plan.failed);
+    } else {
+        printf("%zu of %zu files %s, %zu failed.\n", plan.count - plan.failed, plan.count, done, plan.failed);
+    }
+    bulk_plan_free(&plan);
+}
+
+// Function to copy every file matching a pattern
+void bulk_copy_files(UserContext *user_ctx) {
+    bulk_files(user_ctx, FSBULK_COPY);
+}
+
+// Function to move every file matching a pattern
+void bulk_move_files(UserContext *user_ctx) {
+    bulk_files(user_ctx, FSBULK_RENAME);
+}
+
+// Function to delete every file matching a pattern
+void bulk_delete_files(UserContext *user_ctx) {
+    bulk_files(user_ctx, FSBULK_UNLINK);
+}
+
+#define ORDER_LIST_LIMIT 1000
+
+static void order_format_time(int64_t seconds, char *buffer, size_t size) {
+    time_t when = (time_t)seconds;
+    struct tm tm;
+    strftime(buffer, size, "%Y-%m-%d %H:%M", localtime_r(&when, &tm));
+}
+
+// Print one order of a listing, up to ORDER_LIST_LIMIT of them
+static void order_print_row(const OrderRecord *record, void *arg) {
+    size_t *shown = arg;
+    if ((*shown)++ >= ORDER_LIST_LIMIT) return;
+    char created[32], updated[32];
+    order_format_time(record->created, created, sizeof(created));
+    order_format_time(record->updated, updated, sizeof(updated));
+    printf("%-12llu %-11s %9u  %s  %s\n", (unsigned long long)record->id, order_status_name(record->status),
+           record->warehouse, created, updated);
+}
+
+// Function to work with the order store
+void order_store_menu(UserContext *user_ctx) {
+    printf("\nOrder store:\n");
+    printf("1. Import .track files\n");
+    printf("2. Export .track files\n");
+    printf("3. Status summary\n");
+    printf("4. List orders with a status\n");
+    printf("5. Show an order\n");
+    char choice_str[10];
+    if (get_input("Choose an option: ", choice_str, sizeof(choice_str)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    int choice = atoi(choice_str);
+
+    if (choice == 1 || choice == 2) {
+        char base_path_buffer[PATH_MAX];
+        const char *dir = select_base_path_with_other(user_ctx, "Select the directory with the .track files:",
+                                                      base_path_buffer);
+        if (dir == NULL) return;
+        if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, dir)) {
+            printf("Invalid path. Operation not allowed.\n");
+            return;
+        }
+        size_t done, failed;
+        int err = choice == 1 ? order_store_import(dir, &done, &failed) : order_store_export(dir, &done, &failed);
+        if (err != 0) {
+            printf("Error %s orders: %s\n", choice == 1 ? "importing" : "exporting", strerror(err));
+            return;
+        }
+        printf("%s %zu orders %s %s.\n", choice == 1 ? "Imported" : "Exported", done, choice == 1 ? "from" : "to",
+               dir);
+        if (failed > 0) printf("%zu files could not be %s.\n", failed, choice == 1 ? "read" : "written");
+    } else if (choice == 3) {
+        size_t counts[ORDER_STATUS_COUNT], total;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int err = order_store_counts(counts, &total);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (err != 0) {
+            printf("Error reading the order store: %s\n", strerror(err));
+            return;
+        }
+        for (int s = 0; s < ORDER_STATUS_COUNT; s++) {
+            if (counts[s] > 0) printf("%-11s %zu\n", order_status_name(s), counts[s]);
+        }
+        printf("%zu orders in total (counted in %.2f ms).\n", total,
+               (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+    } else if (choice == 4) {
+        char status_name[64];
+        if (get_input("Enter a status (pending, packed, shipped, in_transit, delivered, returned, cancelled): ",
+                      status_name, sizeof(status_name)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        int status = order_status_parse(status_name);
+        if (status < 0) {
+            printf("Unknown status.\n");
+            return;
+        }
+        printf("%-12s %-11s %9s  %-16s  %-16s\n", "order", "status", "warehouse", "created", "updated");
+        size_t shown = 0, matched;
+        int err = order_store_scan(status, order_print_row, &shown, &matched);
+        if (err != 0) {
+            printf("Error reading the order store: %s\n", strerror(err));
+        } else if (matched > ORDER_LIST_LIMIT) {
+            printf("%zu orders; the first %d are shown.\n", matched, ORDER_LIST_LIMIT);
+        } else {
+            printf("%zu orders.\n", matched);
+        }
+    } else if (choice == 5) {
+        char id_str[32];
+        if (get_input("Enter the order number: ", id_str, sizeof(id_str)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        char *end;
+        unsigned long long id = strtoull(id_str, &end, 10);
+        if (end == id_str || *end != '\0') {
+            printf("Invalid order number.\n");
+            return;
+        }
+        OrderRecord record;
+        char *notes;
+        size_t notes_len;
+        int err = order_store_get(id, &record, &notes, &notes_len);
+        if (err == ENOENT) {
+            printf("No such order.\n");
+            return;
+        }
+        if (err != 0) {
+            printf("Error reading the order store: %s\n", strerror(err));
+            return;
+        }
+        char created[32], updated[32];
+        order_format_time(record.created, created, sizeof(created));
+        order_format_time(record.updated, updated, sizeof(updated));
+        printf("Order %llu: %s, warehouse %u, created %s, updated %s\n", id, order_status_name(record.status),
+               record.warehouse, created, updated);
+        fwrite(notes, 1, notes_len, stdout);
+        free(notes);
+    } else {
+        printf("Invalid choice.\n");
+    }
+}
+
+#define INVENTORY_LIST_LIMIT 1000
+
+// Print one item of a low-stock listing, up to INVENTORY_LIST_LIMIT of them
+static void inventory_print_row(const char *sku, long long quantity, const char *name, void *arg) {
+    size_t *shown = arg;
+    if ((*shown)++ >= INVENTORY_LIST_LIMIT) return;
+    printf("%-24s %10lld  %s\n", sku, quantity, name != NULL ? name : "");
+}
+
+// Function to check and adjust stock
+void stock_menu(UserContext *user_ctx) {
+    // Offer the inventory files the user may reach
+    const char *files[] = { INVENTORY_PATH, STOCK_PATH };
+    const char *allowed[2];
+    int allowed_count = 0;
+    for (int i = 0; i < 2; i++) {
+        if (is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, files[i])) allowed[allowed_count++] = files[i];
+    }
+    if (allowed_count == 0) {
+        printf("No inventory is available to this user.\n");
+        return;
+    }
+    const char *path = allowed[0];
+    char choice_str[10];
+    if (allowed_count > 1) {
+        printf("\nSelect the inventory:\n");
+        for (int i = 0; i < allowed_count; i++) printf("%d. %s\n", i + 1, allowed[i]);
+        if (get_input("Choose an option: ", choice_str, sizeof(choice_str)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        int index = atoi(choice_str);
+        if (index < 1 || index > allowed_count) {
+            printf("Invalid choice.\n");
+            return;
+        }
+        path = allowed[index - 1];
+    }
+
+    printf("\nStock:\n");
+    printf("1. Check a SKU\n");
+    printf("2. Receive stock\n");
+    printf("3. Ship stock\n");
+    printf("4. List low stock\n");
+    printf("5. Save now\n");
+    if (get_input("Choose an option: ", choice_str, sizeof(choice_str)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    int choice = atoi(choice_str);
+
+    if (choice >= 1 && choice <= 3) {
+        char sku[INVENTORY_SKU_MAX + 2];
+        if (get_input("Enter the SKU: ", sku, sizeof(sku)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        long long quantity;
+        int err;
+        if (choice == 1) {
+            char name[256];
+            err = inventory_lookup(path, sku, &quantity, name, sizeof(name));
+            if (err == 0) printf("%s: %lld in stock%s%s\n", sku, quantity, name[0] != '\0' ? ", " : "", name);
+        } else {
+            char amount_str[32];
+            if (get_input("Enter the quantity: ", amount_str, sizeof(amount_str)) == NULL) {
+                printf("Error reading input.\n");
+                return;
+            }
+            char *end;
+            long long amount = strtoll(amount_str, &end, 10);
+            if (end == amount_str || *end != '\0' || amount <= 0) {
+                printf("Invalid quantity.\n");
+                return;
+            }
+            err = inventory_adjust(path, sku, choice == 2 ? amount : -amount, &quantity);
+            if (err == 0) printf("%s: %lld in stock.\n", sku, quantity);
+        }
+        if (err == ENOENT) {
+            printf("No such SKU.\n");
+        } else if (err == ERANGE) {
+            printf("Not enough stock.\n");
+        } else if (err == EINVAL) {
+            printf("Invalid SKU.\n");
+        } else if (err != 0) {
+            printf("Error reading the inventory: %s\n", strerror(err));
+        }
+    } else if (choice == 4) {
+        char limit_str[32];
+        if (get_input("Show items with at most this many in stock: ", limit_str, sizeof(limit_str)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        char *end;
+        long long limit = strtoll(limit_str, &end, 10);
+        if (end == limit_str || *end != '\0') {
+            printf("Invalid quantity.\n");
+            return;
+        }
+        size_t shown = 0;
+        int err = inventory_low(path, limit, inventory_print_row, &shown);
+        if (err != 0) {
+            printf("Error reading the inventory: %s\n", strerror(err));
+        } else if (shown > INVENTORY_LIST_LIMIT) {
+            printf("%zu items; the first %d are shown.\n", shown, INVENTORY_LIST_LIMIT);
+        } else {
+            printf("%zu items.\n", shown);
+        }
+    } else if (choice == 5) {
+        int err = inventory_snapshot(path);
+        if (err != 0) {
+            printf("Error saving %s: %s\n", path, strerror(err));
+        } else {
+            printf("Saved %s.\n", path);
+        }
+    } else {
+        printf("Invalid choice.\n");
+    }
+}
+
+#define SCHEDULE_LIST_LIMIT 1000
+
+// Print one delivery of a listing, up to SCHEDULE_LIST_LIMIT of them
+static void schedule_print_row(const ScheduleRecord *record, void *arg) {
+    size_t *shown = arg;
+    if ((*shown)++ >= SCHEDULE_LIST_LIMIT) return;
+    char when[32];
+    order_format_time(record->time, when, sizeof(when));
+    printf("%s  %10u %8u  %s\n", when, record->route, record->depot, record->note);
+}
+
+// Read a delivery time, route or depot; prints why on failure
+static int schedule_read_time(const char *prompt, int64_t *time_out) {
+    char text[64];
+    if (get_input(prompt, text, sizeof(text)) == NULL) {
+        printf("Error reading input.\n");
+        return 0;
+    }
+    if (schedule_parse_time(text, time_out) != 0) {
+        printf("Invalid time. Use YYYY-MM-DD HH:MM, or HH:MM for today.\n");
+        return 0;
+    }
+    return 1;
+}
+
+static int schedule_read_number(const char *prompt, uint32_t *number) {
+    char text[32];
+    if (get_input(prompt, text, sizeof(text)) == NULL) {
+        printf("Error reading input.\n");
+        return 0;
+    }
+    if (schedule_parse_number(text, number) != 0) {
+        printf("Invalid number.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Function to work with the delivery schedule
+void delivery_schedule_menu(UserContext *user_ctx) {
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, SCHEDULE_PATH)) {
+        printf("The delivery schedule is not available to this user.\n");
+        return;
+    }
+    printf("\nDelivery schedule:\n");
+    printf("1. Schedule a delivery\n");
+    printf("2. Cancel a delivery\n");
+    printf("3. List deliveries in a time range\n");
+    char choice_str[10];
+    if (get_input("Choose an option: ", choice_str, sizeof(choice_str)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    int choice = atoi(choice_str);
+
+    if (choice == 1) {
+        ScheduleRecord record = { 0 };
+        char note[256];
+        if (!schedule_read_time("Enter the delivery time (YYYY-MM-DD HH:MM): ", &record.time) ||
+            !schedule_read_number("Enter the route: ", &record.route) ||
+            !schedule_read_number("Enter the depot: ", &record.depot)) {
+            return;
+        }
+        if (get_input("Enter a note (optional): ", note, sizeof(note)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        if (strlen(note) >= sizeof(record.note)) {
+            printf("The note was shortened to %zu characters.\n", sizeof(record.note) - 1);
+        }
+        snprintf(record.note, sizeof(record.note), "%s", note);
+        int err = schedule_put(&record);
+        if (err != 0) {
+            printf("Error scheduling the delivery: %s\n", strerror(err));
+            return;
+        }
+        printf("Delivery scheduled.\n");
+    } else if (choice == 2) {
+        int64_t when;
+        uint32_t route;
+        if (!schedule_read_time("Enter the delivery time (YYYY-MM-DD HH:MM): ", &when) ||
+            !schedule_read_number("Enter the route: ", &route)) {
+            return;
+        }
+        int err = schedule_cancel(when, route);
+        if (err == ENOENT) {
+            printf("No delivery on that route at that time.\n");
+        } else if (err != 0) {
+            printf("Error cancelling the delivery: %s\n", strerror(err));
+        } else {
+            printf("Delivery cancelled.\n");
+        }
+    } else if (choice == 3) {
+        int64_t from, to;
+        uint32_t depot;
+        if (!schedule_read_time("From (YYYY-MM-DD HH:MM, or HH:MM today): ", &from) ||
+            !schedule_read_time("To: ", &to) || !schedule_read_number("Depot (0 for all): ", &depot)) {
+            return;
+        }
+        printf("%-16s  %10s %8s  %s\n", "time", "route", "depot", "note");
+        size_t shown = 0, matched;
+        int err = schedule_range(from, to, depot, schedule_print_row, &shown, &matched);
+        if (err != 0) {
+            printf("Error reading the delivery schedule: %s\n", strerror(err));
+        } else if (matched > SCHEDULE_LIST_LIMIT) {
+            printf("%zu deliveries; the first %d are shown.\n", matched, SCHEDULE_LIST_LIMIT);
+        } else {
+            printf("%zu deliveries.\n", matched);
+        }
+    } else {
+        printf("Invalid choice.\n");
+    }
+}
+
+#define SHIPLOG_LIST_LIMIT 1000
+
+// Print one entry of a query, up to SHIPLOG_LIST_LIMIT of them
+static void shiplog_print_row(const char *file, uint64_t line, const char *text, size_t len, void *arg) {
+    size_t *shown = arg;
+    if ((*shown)++ >= SHIPLOG_LIST_LIMIT) return;
+    printf("%s:%llu: %.*s\n", file, (unsigned long long)line, (int)len, text);
+}
+
+// Function to work with the shipment log
+void shipment_log_menu(UserContext *user_ctx) {
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, SHIPLOG_DIR)) {
+        printf("The shipment log is not available to this user.\n");
+        return;
+    }
+    printf("\nShipment log:\n");
+    printf("1. Add an entry\n");
+    printf("2. List entries in a time range\n");
+    printf("3. List segments\n");
+    printf("4. Seal the active segment now\n");
+    printf("5. Compress plain log files\n");
+    char choice_str[10];
+    if (get_input("Choose an option: ", choice_str, sizeof(choice_str)) == NULL) {
+        printf("Error reading input.\n");
+        return;
+    }
+    int choice = atoi(choice_str);
+
+    if (choice == 1) {
+        char text[1024];
+        if (get_input("Enter the entry: ", text, sizeof(text)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        int err = shiplog_append(text);
+        if (err == EINVAL) {
+            printf("The entry is empty.\n");
+        } else if (err != 0) {
+            printf("Error writing the shipment log: %s\n", strerror(err));
+        } else {
+            printf("Entry added.\n");
+        }
+    } else if (choice == 2) {
+        int64_t from, to;
+        char needle[256];
+        if (!schedule_read_time("From (YYYY-MM-DD HH:MM, or HH:MM today): ", &from) ||
+            !schedule_read_time("To: ", &to)) {
+            return;
+        }
+        if (get_input("Containing (empty for every entry): ", needle, sizeof(needle)) == NULL) {
+            printf("Error reading input.\n");
+            return;
+        }
+        size_t shown = 0, matched;
+        int err = shiplog_query(from, to, needle, shiplog_print_row, &shown, &matched);
+        if (err != 0) {
+            printf("Error reading the shipment log: %s\n", strerror(err));
+        } else if (matched > SHIPLOG_LIST_LIMIT) {
+            printf("%zu entries; the first %d are shown.\n", matched, SHIPLOG_LIST_LIMIT);
+        } else {
+            printf("%zu entries.\n", matched);
+        }
+    } else if (choice == 3) {
+        ShiplogFile *files;
+        size_t count;
+        int err = shiplog_collect(&files, &count);
+        if (err != 0) {
+            printf("Error reading %s: %s\n", SHIPLOG_DIR, strerror(err));
+            return;
+        }
+        printf("%-28s %-16s  %-16s %10s %12s %12s\n", "segment", "first entry", "last entry", "lines", "size", "on disk");
+        for (size_t i = 0; i < count; i++) {
+            const ShiplogFile *file = &files[i];
+            if (!file->sealed) {
+                printf("%-28s %-16s  %-16s %10s %12s %12lld\n", file->name,
+                       file->rank == 2 ? "(active)" : file->rank == 1 ? "(sealing)" : "(plain)", "", "", "",
+                       (long long)file->size);
+                continue;
+            }
+            char first[32] = "-", last[32] = "-";
+            if (file->header.first_time != 0) {
+                order_format_time(file->header.first_time, first, sizeof(first));
+                order_format_time(file->header.last_time, last, sizeof(last));
+            }
+            printf("%-28s %-16s  %-16s %10llu %12llu %12lld\n", file->name, first, last,
+                   (unsigned long long)file->header.line_count, (unsigned long long)file->header.raw_size,
+                   (long long)file->size);
+        }
+        printf("%zu files.\n", count);
+        free(files);
+    } else if (choice == 4) {
+        int err = shiplog_seal();
+        if (err != 0) {
+            printf("Error sealing the shipment log: %s\n", strerror(err));
+        } else {
+            printf("The active segment is sealed.\n");
+        }
+    } else if (choice == 5) {
+        size_t compressed, failed;
+        int err = shiplog_compress(&compressed, &failed);
+        if (err != 0) {
+            printf("Error reading %s: %s\n", SHIPLOG_DIR, strerror(err));
+        } else {
+            printf("%zu files compressed, %zu failed.\n", compressed, failed);
+        }
+    } else {
+        printf("Invalid choice.\n");
+    }
+}
+
+// Pack the cold small files of a base directory, or of any directory
+// below one
+void pack_small_files(UserContext *user_ctx) {
+    char base_path_buffer[PATH_MAX];
+    const char *dir = select_base_path_with_other(user_ctx, "Select the directory to pack:", base_path_buffer);
+    if (dir == NULL) return;
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, dir)) {
+        printf("Invalid path. Operation not allowed.\n");
+        return;
+    }
+    long long max_bytes, min_age;
+    pack_limits(&max_bytes, &min_age);
+    printf("Packing files of at most %lld bytes left unchanged for %lld seconds...\n", max_bytes, min_age);
+    PackStats stats;
+    int err = pack_tree(dir, &stats);
+    if (err != 0) {
+        printf("Error packing %s: %s\n", dir, strerror(err));
+        return;
+    }
+    printf("Packed %zu files (%lld bytes) into %zu directories.\n", stats.files, stats.bytes, stats.packs);
+    if (stats.failed > 0) printf("%zu directories could not be packed.\n", stats.failed);
+}
+
+// ---------------------------------------------------------------------------
+// Batch mode
+//
+// logistics_system --batch [FILE] --role ROLE --user NAME logs in once (the
+// password comes from LOGISTICS_PASSWORD) and runs one typed command per
+// line of FILE, or of stdin when FILE is "-" or missing:
+//
+//     copy order_1.track archive/order_1.track --from customers --to warehouse
+//     append order_1.track "left the depot" --in customers
+//
+// Each command is checked against the operations the role's menu offers
+// and answered with one tab-separated status line:
+//
+//     STATUS <line> <command> ok
+//     STATUS <line> <command> error <errno> <message>
+//
+// bulk-copy, bulk-move and bulk-delete take DIR/PATTERN, a glob over the
+// files of one directory, and copy or move take a destination directory.
+// Each matched file is reported on a FILE line before the STATUS line.
+// --dry-run reports what would happen without changing anything.
+//
+// orders-import and orders-export move orders between the order store and
+// the .track files of a base directory, customers unless --in says
+// otherwise. orders STATUS prints an ORDER line for every order in that
+// status, and orders-count a COUNT line per status.
+//
+// find PATTERN and search KEYWORD work like the menus' "Find file" and
+// "Search file content": find prints the matching paths, narrowed with
+// --size, --age and --ignore-case, and search prints each line containing
+// KEYWORD as path:line:text. Both cover every base, or the one --in names.
+//
+// stock SKU prints a STOCK line with the quantity and name of one item of
+// admin/inventory.txt or warehouse/stock.dat, whichever base --in names
+// (the role's first base by default); stock-adjust SKU DELTA adds DELTA,
+// which may be negative, and prints the new STOCK line.
+//
+// schedule-add WHEN ROUTE DEPOT NOTE and schedule-cancel WHEN ROUTE change
+// the delivery schedule; schedule FROM TO DEPOT prints a DELIVERY line for
+// every delivery in that time range, at any depot when DEPOT is 0.
+//
+// shiplog-append TEXT adds a timestamped entry to the shipment log, and
+// shiplog FROM TO TEXT prints a SHIPMENT line for every entry in that time
+// range containing TEXT (every entry when TEXT is ""). shiplog-seal seals
+// the active segment, and shiplog-compress turns the plain files of
+// warehouse/shipment_logs into segments and prints a SEGMENTS line.
+//
+// pack moves the cold small files of a base directory, customers unless
+// --in says otherwise, into per-directory packfiles and prints a PACKED
+// line with the files packed, the directories that gained a packfile and
+// the directories that failed.
+//
+// Admin and warehouse sessions can define aliases. After
+// alias note "append notes.txt", the line note "loaded" --in warehouse runs
+// as append notes.txt "loaded" --in warehouse. Aliases belong to the
+// session, like everything else a command may change, so sessions never
+// share mutable state and can run on any thread.
+//
+// Lines are taken in windows of BATCH_WINDOW commands, and the intents of
+// a window's mutating commands share one journal write and one fdatasync.
+// After a crash, recovery may therefore also finish commands of the last
+// window that had not started yet. Each completion is written as soon as
+// its command returns, so commands that did finish are left alone.
+// ---------------------------------------------------------------------------
+
+#define BATCH_ROLE_ADMIN 0x1
+#define BATCH_ROLE_WAREHOUSE 0x2
+#define BATCH_ROLE_CUSTOMER 0x4
+#define BATCH_MAX_ARGS 16
+
+typedef enum BatchKind {
+    BATCH_LIST,
+    BATCH_FIND,
+    BATCH_SEARCH,
+    BATCH_CHMOD,
+    BATCH_MKDIR,
+    BATCH_RMDIR,
+    BATCH_CREATE,
+    BATCH_DELETE,
+    BATCH_SYMLINK,
+    BATCH_COPY,
+    BATCH_MOVE,
+    BATCH_APPEND,
+    BATCH_VIEW,
+    BATCH_ALIAS,
+    BATCH_BULK_COPY,
+    BATCH_BULK_MOVE,
+    BATCH_BULK_DELETE,
+    BATCH_RESTORE,
+    BATCH_ORDERS_IMPORT,
+    BATCH_ORDERS_EXPORT,
+    BATCH_ORDERS,
+    BATCH_ORDERS_COUNT,
+    BATCH_STOCK,
+    BATCH_STOCK_ADJUST,
+    BATCH_SCHEDULE_ADD,
+    BATCH_SCHEDULE_CANCEL,
+    BATCH_SCHEDULE,
+    BATCH_SHIPLOG_APPEND,
+    BATCH_SHIPLOG,
+    BATCH_SHIPLOG_SEAL,
+    BATCH_SHIPLOG_COMPRESS,
+    BATCH_PACK
+} BatchKind;
+
+typedef struct BatchCommandInfo {
+    const char *name;
+    BatchKind kind;
+    int paths;          // Positional path arguments
+    int extra;          // Trailing positional arguments (mode, text, or alias name and command)
+    JournalOp op;
+    int roles;          // Roles whose menu offers the operation
+} BatchCommandInfo;
+
+static const BatchCommandInfo batch_commands[] = {
+    { "list", BATCH_LIST, 0, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE | BATCH_ROLE_CUSTOMER },
+    { "find", BATCH_FIND, 0, 1, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE | BATCH_ROLE_CUSTOMER },
+    { "search", BATCH_SEARCH, 0, 1, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE | BATCH_ROLE_CUSTOMER },
+    { "chmod", BATCH_CHMOD, 1, 1, JOURNAL_OP_CHMOD, BATCH_ROLE_ADMIN },
+    { "mkdir", BATCH_MKDIR, 1, 0, JOURNAL_OP_MKDIR, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    // rmdir journals only a tree it really removes, not the move to the trash
+    { "rmdir", BATCH_RMDIR, 1, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "create", BATCH_CREATE, 1, 0, JOURNAL_OP_CREATE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "delete", BATCH_DELETE, 1, 0, JOURNAL_OP_DELETE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "symlink", BATCH_SYMLINK, 2, 0, JOURNAL_OP_SYMLINK, BATCH_ROLE_ADMIN },
+    { "copy", BATCH_COPY, 2, 0, JOURNAL_OP_COPY, BATCH_ROLE_ADMIN | BATCH_ROLE_CUSTOMER },
+    { "move", BATCH_MOVE, 2, 0, JOURNAL_OP_MOVE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "append", BATCH_APPEND, 1, 1, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE | BATCH_ROLE_CUSTOMER },
+    { "view", BATCH_VIEW, 1, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE | BATCH_ROLE_CUSTOMER },
+    { "alias", BATCH_ALIAS, 0, 2, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    // Bulk commands journal each chunk of files themselves
+    { "bulk-copy", BATCH_BULK_COPY, 2, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_CUSTOMER },
+    { "bulk-move", BATCH_BULK_MOVE, 2, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "bulk-delete", BATCH_BULK_DELETE, 1, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    // A restore is a single rename out of the trash
+    { "restore", BATCH_RESTORE, 1, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    // Order store commands work on the .track files of one base directory
+    { "orders-import", BATCH_ORDERS_IMPORT, 0, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "orders-export", BATCH_ORDERS_EXPORT, 0, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "orders", BATCH_ORDERS, 0, 1, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "orders-count", BATCH_ORDERS_COUNT, 0, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    // Stock changes reach the inventory file with its next snapshot
+    { "stock", BATCH_STOCK, 0, 1, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "stock-adjust", BATCH_STOCK_ADJUST, 0, 2, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    // The schedule logs its own changes
+    { "schedule-add", BATCH_SCHEDULE_ADD, 0, 4, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN },
+    { "schedule-cancel", BATCH_SCHEDULE_CANCEL, 0, 2, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN },
+    { "schedule", BATCH_SCHEDULE, 0, 3, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN },
+    // Shipment log segments are written whole and renamed into place
+    { "shiplog-append", BATCH_SHIPLOG_APPEND, 0, 1, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "shiplog", BATCH_SHIPLOG, 0, 3, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "shiplog-seal", BATCH_SHIPLOG_SEAL, 0, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    { "shiplog-compress", BATCH_SHIPLOG_COMPRESS, 0, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+    // Packfiles are written whole and renamed into place
+    { "pack", BATCH_PACK, 0, 0, JOURNAL_OP_NONE, BATCH_ROLE_ADMIN | BATCH_ROLE_WAREHOUSE },
+};
+
+// One parsed line of the script
+typedef struct BatchCommand {
+    long line;
+    const BatchCommandInfo *info;
+    char *text;                 // The line; argv points into it
+    char *argv[BATCH_MAX_ARGS];
+    int argc;
+    const char *list_base;      // list, find and search --in BASE, or NULL for every base
+    char path[PATH_MAX];
+    char path2[PATH_MAX];
+    const char *extra;
+    char view_mode;             // 'w', 'h', 't' or 'r'
+    long view_first, view_last;
+    int dry_run;                // Bulk commands: --dry-run
+    int ignore_case;            // find: --ignore-case
+    const char *find_size;      // find: --size, or NULL
+    const char *find_age;       // find: --age, or NULL
+    long long delta;            // stock-adjust: the change in quantity
+    ScheduleRecord delivery;    // Schedule commands: the delivery, or the start of the range and the depot
+    int64_t until;              // schedule and shiplog: the end of the range
+    int err;
+    const char *message;        // Overrides strerror(err) when set
+    char message_text[64];      // Storage for a formatted message
+} BatchCommand;
+
+// Where a session's output goes. Status lines collect in pending and are
+// written out in one go; file contents bypass it, straight to the fd.
+typedef struct BatchOutput {
+    int fd;
+    OutBuffer pending;
+} BatchOutput;
+
+// One logged-in script or connection. Everything a command may change on
+// behalf of its user lives here, so sessions can run on any thread.
+typedef struct BatchSession {
+    UserContext user_ctx;
+    int role;
+    Alias aliases[ALIAS_MAX];   // Referenced by user_ctx; the session must not move
+    int alias_count;
+    long line_no;
+    long total;
+    long failed;
+    BatchOutput out;
+} BatchSession;
+
+static int batch_flush(BatchOutput *out) {
+    int err = out->pending.len > 0 ? fsop_write_all(out->fd, out->pending.data, out->pending.len) : 0;
+    out->pending.len = 0;
+    return err;
+}
+
+static void batch_printf(BatchOutput *out, const char *format, ...) {
+    char line[PATH_MAX + 256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = (int)sizeof(line) - 1;
+    out_append(&out->pending, line, (size_t)len);
+    if (out->pending.len >= VIEW_BLOCK_SIZE) batch_flush(out);
+}
+
+// Split line into words in place. Single and double quotes group words;
+// backslash escapes the next character outside single quotes.
+static int batch_tokenize(char *line, char **argv, int max_args) {
+    int argc = 0;
+    char *src = line, *dst = line;
+    while (1) {
+        while (*src == ' ' || *src == '\t') src++;
+        if (*src == '\0' || *src == '#') break;
+        if (argc == max_args) return -1;
+        argv[argc++] = dst;
+        char quote = 0;
+        while (*src != '\0' && (quote != 0 || (*src != ' ' && *src != '\t'))) {
+            if (quote == 0 && (*src == '"' || *src == '\'')) {
+                quote = *src++;
+            } else if (quote != 0 && *src == quote) {
+                quote = 0;
+                src++;
+            } else if (*src == '\\' && quote != '\'' && src[1] != '\0') {
+                *dst++ = src[1];
+                src += 2;
+            } else {
+                *dst++ = *src++;
+            }
+        }
+        if (quote != 0) return -1;
+        if (*src != '\0') src++;
+        *dst++ = '\0';
+    }
+    return argc;
+}
+
+// Map a base directory name to the user's base path, or NULL if the role
+// has no access to it
+static const char *batch_base(const UserContext *user_ctx, const char *name) {
+    const char *path = NULL;
+    if (strcmp(name, "admin") == 0) path = ADMIN_BASE_PATH;
+    else if (strcmp(name, "warehouse") == 0) path = WAREHOUSE_BASE_PATH;
+    else if (strcmp(name, "customers") == 0 || strcmp(name, "customer") == 0) path = CUSTOMER_BASE_PATH;
+    for (int i = 0; path != NULL && i < user_ctx->base_paths_count; i++) {
+        if (user_ctx->base_paths[i] == path) return path;
+    }
+    return NULL;
+}
+
+// Join base and a relative path given in a script. Subdirectories are
+// allowed; absolute paths and ".." components are not.
+static int batch_join(const char *base, const char *rel, char *out) {
+    if (rel[0] == '\0' || rel[0] == '/') return EINVAL;
+    for (const char *p = rel; *p != '\0';) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') return EINVAL;
+        p += len;
+        while (*p == '/') p++;
+    }
+    return snprintf(out, PATH_MAX, "%s/%s", base, rel) >= PATH_MAX ? ENAMETOOLONG : 0;
+}
+
+// Split a bulk command's DIR/PATTERN argument: the directory, joined to
+// base, goes to out and *pattern points at the glob. Without a slash the
+// files are matched in base itself.
+static int batch_split_pattern(const char *base, const char *arg, char *out, const char **pattern) {
+    const char *slash = strrchr(arg, '/');
+    *pattern = slash != NULL ? slash + 1 : arg;
+    if (**pattern == '\0') return EINVAL;
+    if (slash == NULL) return snprintf(out, PATH_MAX, "%s", base) >= PATH_MAX ? ENAMETOOLONG : 0;
+    char dir[PATH_MAX];
+    size_t len = (size_t)(slash - arg);
+    if (len >= sizeof(dir)) return ENAMETOOLONG;
+    memcpy(dir, arg, len);
+    dir[len] = '\0';
+    return batch_join(base, dir, out);
+}
+
+static int batch_is_bulk(BatchKind kind) {
+    return kind == BATCH_BULK_COPY || kind == BATCH_BULK_MOVE || kind == BATCH_BULK_DELETE;
+}
+
+static int batch_is_orders(BatchKind kind) {
+    return kind == BATCH_ORDERS_IMPORT || kind == BATCH_ORDERS_EXPORT || kind == BATCH_ORDERS ||
+           kind == BATCH_ORDERS_COUNT;
+}
+
+static int batch_is_shiplog(BatchKind kind) {
+    return kind == BATCH_SHIPLOG_APPEND || kind == BATCH_SHIPLOG || kind == BATCH_SHIPLOG_SEAL ||
+           kind == BATCH_SHIPLOG_COMPRESS;
+}
+
+static const BatchCommandInfo *batch_command_info(const char *name) {
+    for (size_t i = 0; i < sizeof(batch_commands) / sizeof(batch_commands[0]); i++) {
+        if (strcmp(name, batch_commands[i].name) == 0) return &batch_commands[i];
+    }
+    return NULL;
+}
+
+// alias NAME "COMMAND LINE" defines or replaces one of the session's aliases
+static int batch_define_alias(const UserContext *user_ctx, const char *name, const char *command, const char **message) {
+    if (name[0] == '\0' || strpbrk(name, " \t\"'\\#") != NULL || batch_command_info(name) != NULL) {
+        *message = "invalid alias name";
+        return EINVAL;
+    }
+    if (strlen(name) >= sizeof(user_ctx->aliases[0].name) || strlen(command) >= sizeof(user_ctx->aliases[0].command)) {
+        *message = "alias too long";
+        return ENAMETOOLONG;
+    }
+    int slot = 0;
+    while (slot < *user_ctx->alias_count && strcmp(user_ctx->aliases[slot].name, name) != 0) slot++;
+    if (slot == ALIAS_MAX) {
+        *message = "alias limit reached";
+        return ENOSPC;
     }
+    strcpy(user_ctx->aliases[slot].name, name);
+    strcpy(user_ctx->aliases[slot].command, command);
+    if (slot == *user_ctx->alias_count) (*user_ctx->alias_count)++;
+    return 0;
+}
 
-    // Copy file using cp command
-    char command[PATH_MAX * 2 + 20];
-    snprintf(command, sizeof(command), "cp \"%s\" \"%s\"", full_source_path, full_destination_path);
-    int result = system(command);
-    if (result == 0) {
-        printf("File copied from %s to %s\n", full_source_path, full_destination_path);
-    } else {
-        printf("Error copying file\n");
+// The alias named by the first word of line, if any; *rest is set to what
+// follows that word
+static const Alias *batch_find_alias(const UserContext *user_ctx, const char *line, const char **rest) {
+    if (user_ctx->aliases == NULL) return NULL;
+    line += strspn(line, " \t");
+    size_t len = strcspn(line, " \t");
+    for (int i = 0; i < *user_ctx->alias_count; i++) {
+        if (strlen(user_ctx->aliases[i].name) == len && memcmp(user_ctx->aliases[i].name, line, len) == 0) {
+            *rest = line + len;
+            return &user_ctx->aliases[i];
+        }
     }
+    return NULL;
 }
 
-// Function to move file
-void move_file(UserContext *user_ctx) {
-    char source_file_name[256];
-    if (get_input("Enter source file to move: ", source_file_name, sizeof(source_file_name)) == NULL) {
-        printf("Error reading input.\n");
+// Parse one non-empty script line into cmd, recording any rejection in it
+static void batch_parse(const UserContext *user_ctx, int role, BatchCommand *cmd) {
+    const char *positional[BATCH_MAX_ARGS];
+    int count = 0;
+    const char *from = NULL, *to = NULL;
+
+    cmd->view_mode = 'w';
+    cmd->info = batch_command_info(cmd->argv[0]);
+    if (cmd->info == NULL) {
+        cmd->err = EINVAL;
+        cmd->message = "unknown command";
         return;
     }
-    char sanitized_source[256];
-    if (!sanitize_filename(source_file_name, sanitized_source, sizeof(sanitized_source))) {
-        printf("Invalid source file name.\n");
+    if (!(cmd->info->roles & role)) {
+        cmd->err = EPERM;
+        cmd->message = "operation not permitted for this role";
         return;
     }
 
-    // Base path selection for source
-    const char *source_base_path = select_base_path_with_other(user_ctx, "Select the directory where the source file is located:");
-    if (source_base_path == NULL) return;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char *arg = cmd->argv[i];
+        const char *value = i + 1 < cmd->argc ? cmd->argv[i + 1] : NULL;
+        if (strcmp(arg, "--dry-run") == 0) {
+            if (!batch_is_bulk(cmd->info->kind)) {
+                cmd->err = EINVAL;
+                cmd->message = "option only applies to bulk commands";
+                return;
+            }
+            cmd->dry_run = 1;
+            continue;
+        }
+        if (strcmp(arg, "--ignore-case") == 0) {
+            if (cmd->info->kind != BATCH_FIND) {
+                cmd->err = EINVAL;
+                cmd->message = "option only applies to find";
+                return;
+            }
+            cmd->ignore_case = 1;
+            continue;
+        }
+        int takes_value = strcmp(arg, "--in") == 0 || strcmp(arg, "--from") == 0 || strcmp(arg, "--to") == 0 ||
+                          strcmp(arg, "--head") == 0 || strcmp(arg, "--tail") == 0 || strcmp(arg, "--lines") == 0 ||
+                          strcmp(arg, "--size") == 0 || strcmp(arg, "--age") == 0;
+        if (!takes_value) {
+            positional[count++] = arg;
+            continue;
+        }
+        if (value == NULL) {
+            cmd->err = EINVAL;
+            cmd->message = "option needs a value";
+            return;
+        }
+        i++;
+        if (strcmp(arg, "--in") == 0) {
+            from = to = value;
+        } else if (strcmp(arg, "--from") == 0) {
+            from = value;
+        } else if (strcmp(arg, "--to") == 0) {
+            to = value;
+        } else if (strcmp(arg, "--size") == 0 || strcmp(arg, "--age") == 0) {
+            if (cmd->info->kind != BATCH_FIND) {
+                cmd->err = EINVAL;
+                cmd->message = "option only applies to find";
+                return;
+            }
+            if (arg[2] == 's') cmd->find_size = value;
+            else cmd->find_age = value;
+        } else if (cmd->info->kind != BATCH_VIEW) {
+            cmd->err = EINVAL;
+            cmd->message = "option only applies to view";
+            return;
+        } else if (strcmp(arg, "--lines") == 0) {
+            cmd->view_mode = 'r';
+            if (sscanf(value, "%ld-%ld", &cmd->view_first, &cmd->view_last) != 2 ||
+                cmd->view_first <= 0 || cmd->view_last < cmd->view_first) {
+                cmd->err = EINVAL;
+                cmd->message = "invalid line range";
+                return;
+            }
+        } else {
+            cmd->view_mode = arg[2];  // 'h' or 't'
+            cmd->view_last = atol(value);
+            if (cmd->view_last <= 0) {
+                cmd->err = EINVAL;
+                cmd->message = "invalid number of lines";
+                return;
+            }
+        }
+    }
+    if (count != cmd->info->paths + cmd->info->extra) {
+        cmd->err = EINVAL;
+        cmd->message = "wrong number of arguments";
+        return;
+    }
+    if (cmd->info->kind == BATCH_ALIAS) {
+        // Defined while parsing, so later lines of the same window see it
+        cmd->err = batch_define_alias(user_ctx, positional[0], positional[1], &cmd->message);
+        return;
+    }
 
-    // Base path selection for destination
-    const char *dest_base_path = select_base_path_with_other(user_ctx, "Select the directory where the file will be moved to:");
-    if (dest_base_path == NULL) return;
+    // Unqualified paths live in the role's first base directory
+    const char *from_base = from != NULL ? batch_base(user_ctx, from) : user_ctx->base_paths[0];
+    const char *to_base = to != NULL ? batch_base(user_ctx, to) : user_ctx->base_paths[0];
+    if (from_base == NULL || to_base == NULL) {
+        cmd->err = EACCES;
+        cmd->message = "unknown or forbidden base directory";
+        return;
+    }
+    if (cmd->info->kind == BATCH_LIST || cmd->info->kind == BATCH_FIND || cmd->info->kind == BATCH_SEARCH) {
+        cmd->list_base = from != NULL ? from_base : NULL;
+        if (cmd->info->extra) cmd->extra = positional[0];
+        return;
+    }
+    if (batch_is_orders(cmd->info->kind) || cmd->info->kind == BATCH_PACK) {
+        // The .track files and the packed files live in customers unless
+        // --in names another base
+        if (from == NULL && batch_base(user_ctx, "customers") == NULL) {
+            cmd->err = EACCES;
+            cmd->message = "unknown or forbidden base directory";
+            return;
+        }
+        snprintf(cmd->path, PATH_MAX, "%s", from != NULL ? from_base : CUSTOMER_BASE_PATH);
+        if (cmd->info->extra) cmd->extra = positional[0];
+        return;
+    }
 
-    char full_source_path[PATH_MAX], full_destination_path[PATH_MAX];
-    if (snprintf(full_source_path, sizeof(full_source_path), "%s/%s", source_base_path, sanitized_source) >= (int)sizeof(full_source_path) ||
-        snprintf(full_destination_path, sizeof(full_destination_path), "%s/%s", dest_base_path, sanitized_source) >= (int)sizeof(full_destination_path)) {
-        printf("Path is too long.\n");
+    if (cmd->info->kind == BATCH_STOCK || cmd->info->kind == BATCH_STOCK_ADJUST) {
+        // Each of admin and warehouse keeps one inventory file
+        const char *file = from_base == ADMIN_BASE_PATH ? INVENTORY_PATH
+                         : from_base == WAREHOUSE_BASE_PATH ? STOCK_PATH : NULL;
+        if (file == NULL) {
+            cmd->err = ENOENT;
+            cmd->message = "no inventory in this base directory";
+            return;
+        }
+        snprintf(cmd->path, PATH_MAX, "%s", file);
+        cmd->extra = positional[0];
+        if (cmd->info->kind == BATCH_STOCK_ADJUST) {
+            char *end;
+            errno = 0;
+            cmd->delta = strtoll(positional[1], &end, 10);
+            if (end == positional[1] || *end != '\0' || errno != 0) {
+                cmd->err = EINVAL;
+                cmd->message = "invalid quantity";
+            }
+        }
         return;
     }
 
-    // Validate paths
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_source_path) ||
-        !is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_destination_path)) {
-        printf("Invalid path. Operation not allowed.\n");
+    if (cmd->info->kind == BATCH_SCHEDULE_ADD || cmd->info->kind == BATCH_SCHEDULE_CANCEL ||
+        cmd->info->kind == BATCH_SCHEDULE) {
+        snprintf(cmd->path, PATH_MAX, "%s", SCHEDULE_PATH);
+        ScheduleRecord *delivery = &cmd->delivery;
+        const char *message = "invalid time";
+        int err = schedule_parse_time(positional[0], &delivery->time);
+        if (err == 0 && cmd->info->kind == BATCH_SCHEDULE) {
+            err = schedule_parse_time(positional[1], &cmd->until);
+            if (err == 0) {
+                message = "invalid depot";
+                err = schedule_parse_number(positional[2], &delivery->depot);
+            }
+        } else if (err == 0) {
+            message = "invalid route or depot";
+            err = schedule_parse_number(positional[1], &delivery->route);
+            if (err == 0 && cmd->info->kind == BATCH_SCHEDULE_ADD) err = schedule_parse_number(positional[2], &delivery->depot);
+            if (err == 0 && cmd->info->kind == BATCH_SCHEDULE_ADD) {
+                message = "note too long or not on one line";
+                if (strlen(positional[3]) >= sizeof(delivery->note) || strpbrk(positional[3], "\t\n") != NULL) {
+                    err = EINVAL;
+                } else {
+                    snprintf(delivery->note, sizeof(delivery->note), "%s", positional[3]);
+                }
+            }
+        }
+        if (err != 0) {
+            cmd->err = err;
+            cmd->message = message;
+        }
         return;
     }
 
-    // Check if source file exists
-    struct stat sb;
-    if (stat(full_source_path, &sb) != 0) {
-        printf("Source file does not exist.\n");
+    if (batch_is_shiplog(cmd->info->kind)) {
+        snprintf(cmd->path, PATH_MAX, "%s", SHIPLOG_DIR);
+        if (cmd->info->kind == BATCH_SHIPLOG_APPEND) {
+            cmd->extra = positional[0];
+        } else if (cmd->info->kind == BATCH_SHIPLOG) {
+            // The range is kept where the schedule keeps its own
+            cmd->extra = positional[2];
+            if (schedule_parse_time(positional[0], &cmd->delivery.time) != 0 ||
+                schedule_parse_time(positional[1], &cmd->until) != 0) {
+                cmd->err = EINVAL;
+                cmd->message = "invalid time";
+            }
+        }
         return;
     }
 
-    // Move file using mv command
-    char command[PATH_MAX * 2 + 20];
-    snprintf(command, sizeof(command), "mv \"%s\" \"%s\"", full_source_path, full_destination_path);
-    int result = system(command);
-    if (result == 0) {
-        printf("File moved from %s to %s\n", full_source_path, full_destination_path);
+    if (batch_is_bulk(cmd->info->kind)) {
+        cmd->err = batch_split_pattern(from_base, positional[0], cmd->path, &cmd->extra);
+        if (cmd->err == 0 && cmd->info->paths == 2) {
+            // "." names the destination base directory itself
+            cmd->err = strcmp(positional[1], ".") == 0 ? (snprintf(cmd->path2, PATH_MAX, "%s", to_base), 0)
+                                                       : batch_join(to_base, positional[1], cmd->path2);
+        }
+        if (cmd->err == EINVAL) cmd->message = "invalid path or pattern";
+        return;
+    }
+    cmd->err = batch_join(from_base, positional[0], cmd->path);
+    if (cmd->err == 0 && cmd->info->paths == 2) cmd->err = batch_join(to_base, positional[1], cmd->path2);
+    if (cmd->err == EINVAL) cmd->message = "invalid path";
+    if (cmd->info->extra) cmd->extra = positional[count - 1];
+}
+
+// Print every file under the user's base directories, or just one of them
+static int batch_list(const UserContext *user_ctx, const char *only_base, BatchOutput *output) {
+    const char **roots = only_base != NULL ? &only_base : user_ctx->base_paths;
+    int root_count = only_base != NULL ? 1 : user_ctx->base_paths_count;
+    int workers = walk_default_workers();
+    ListState state = { .filter = NULL };
+    int err = list_state_collect(&state, roots, root_count, workers);
+    // Sorted like the menu's listing
+    for (int i = 0; err == 0 && i < root_count; i++) err = list_state_write_sorted(&state, i, workers, output->fd);
+    list_state_free(&state, workers);
+    return err;
+}
+
+// find PATTERN: print every path under the user's base directories, or
+// just one of them, whose name matches PATTERN and that passes --size and
+// --age, the predicates of the menu's "Find file"
+static int batch_find(const UserContext *user_ctx, BatchCommand *cmd, BatchOutput *output) {
+    FindFilter filter;
+    memset(&filter, 0, sizeof(filter));
+    if (glob_compile(&filter.glob, cmd->extra, cmd->ignore_case) != 0) {
+        cmd->message = "invalid pattern";
+        return EINVAL;
+    }
+    if ((cmd->find_size != NULL && find_parse_size(cmd->find_size, &filter) != 0) ||
+        (cmd->find_age != NULL && find_parse_age(cmd->find_age, &filter) != 0)) {
+        cmd->message = "invalid filter";
+        return EINVAL;
+    }
+    const char **roots = cmd->list_base != NULL ? &cmd->list_base : user_ctx->base_paths;
+    int root_count = cmd->list_base != NULL ? 1 : user_ctx->base_paths_count;
+    return find_run(roots, root_count, &filter, output->fd);
+}
+
+// search KEYWORD: print every line containing KEYWORD as path:line:text,
+// like the menu's "Search file content"
+static int batch_search(const UserContext *user_ctx, BatchCommand *cmd, BatchOutput *output) {
+    if (cmd->extra[0] == '\0') {
+        cmd->message = "empty keyword";
+        return EINVAL;
+    }
+    const char **roots = cmd->list_base != NULL ? &cmd->list_base : user_ctx->base_paths;
+    int root_count = cmd->list_base != NULL ? 1 : user_ctx->base_paths_count;
+    return search_run(roots, root_count, cmd->extra, output->fd);
+}
+
+// Run a bulk command. Every matched file gets a FILE line ahead of the
+// command's STATUS line; the command fails with the first file's error.
+static int batch_bulk(const UserContext *user_ctx, BatchCommand *cmd, BatchOutput *out) {
+    FsBulkOp op = cmd->info->kind == BATCH_BULK_COPY ? FSBULK_COPY
+                : cmd->info->kind == BATCH_BULK_MOVE ? FSBULK_RENAME : FSBULK_UNLINK;
+    BulkPlan plan;
+    int err = bulk_plan(user_ctx, op, cmd->path, cmd->extra, cmd->path2, cmd->dry_run, &plan);
+    if (err == EINVAL) cmd->message = "invalid pattern, or source and destination are the same directory";
+    if (err != 0) return err;
+
+    bulk_run(&plan, cmd->dry_run);
+    int first_error = 0;
+    for (size_t i = 0; i < plan.count; i++) {
+        const BulkFile *file = &plan.files[i];
+        if (file->result != 0) {
+            batch_printf(out, "FILE\t%ld\t%s\terror\t%d\t%s\n", cmd->line, file->source, file->result,
+                         strerror(file->result));
+            if (first_error == 0) first_error = file->result;
+        } else if (cmd->dry_run) {
+            batch_printf(out, "FILE\t%ld\t%s\tplanned%s\n", cmd->line, file->source, file->dest_exists ? "\treplace" : "");
+        } else {
+            batch_printf(out, "FILE\t%ld\t%s\tok\n", cmd->line, file->source);
+        }
+    }
+    if (plan.failed > 0) {
+        snprintf(cmd->message_text, sizeof(cmd->message_text), "%zu of %zu files failed", plan.failed, plan.count);
+        cmd->message = cmd->message_text;
+    }
+    bulk_plan_free(&plan);
+    return first_error;
+}
+
+// Output state for an orders listing
+typedef struct BatchOrderList {
+    BatchOutput *out;
+    long line;
+} BatchOrderList;
+
+static void batch_order_row(const OrderRecord *record, void *arg) {
+    BatchOrderList *list = arg;
+    batch_printf(list->out, "ORDER\t%ld\t%llu\t%s\t%u\t%lld\t%lld\n", list->line, (unsigned long long)record->id,
+                 order_status_name(record->status), record->warehouse, (long long)record->created,
+                 (long long)record->updated);
+}
+
+// Run an order store command. Import and export print one ORDERS line with
+// the files done and failed; a listing prints an ORDER line per order, and a
+// count a COUNT line per status.
+static int batch_orders(BatchCommand *cmd, BatchOutput *out) {
+    size_t done = 0, failed = 0;
+    int err;
+    switch (cmd->info->kind) {
+        case BATCH_ORDERS_IMPORT:
+        case BATCH_ORDERS_EXPORT:
+            err = cmd->info->kind == BATCH_ORDERS_IMPORT ? order_store_import(cmd->path, &done, &failed)
+                                                         : order_store_export(cmd->path, &done, &failed);
+            if (err != 0) return err;
+            batch_printf(out, "ORDERS\t%ld\t%zu\t%zu\n", cmd->line, done, failed);
+            if (failed == 0) return 0;
+            snprintf(cmd->message_text, sizeof(cmd->message_text), "%zu of %zu files failed", failed, done + failed);
+            cmd->message = cmd->message_text;
+            return EIO;
+        case BATCH_ORDERS: {
+            int status = order_status_parse(cmd->extra);
+            if (status < 0) {
+                cmd->message = "unknown order status";
+                return EINVAL;
+            }
+            BatchOrderList list = { .out = out, .line = cmd->line };
+            return order_store_scan(status, batch_order_row, &list, &done);
+        }
+        default: {
+            size_t counts[ORDER_STATUS_COUNT];
+            err = order_store_counts(counts, &done);
+            for (int s = 0; s < ORDER_STATUS_COUNT && err == 0; s++) {
+                batch_printf(out, "COUNT\t%ld\t%s\t%zu\n", cmd->line, order_status_name(s), counts[s]);
+            }
+            return err;
+        }
+    }
+}
+
+// Run a stock command and print the item's STOCK line
+static int batch_stock(BatchCommand *cmd, BatchOutput *out) {
+    long long quantity;
+    char name[256] = "";
+    int err = cmd->info->kind == BATCH_STOCK
+                  ? inventory_lookup(cmd->path, cmd->extra, &quantity, name, sizeof(name))
+                  : inventory_adjust(cmd->path, cmd->extra, cmd->delta, &quantity);
+    if (err == ENOENT) cmd->message = "no such SKU";
+    if (err == ERANGE) cmd->message = "not enough stock";
+    if (err == EINVAL) cmd->message = "invalid SKU";
+    if (err != 0) return err;
+    if (cmd->info->kind == BATCH_STOCK_ADJUST) {
+        // Only the name; the quantity is the one this adjustment produced
+        long long current;
+        inventory_lookup(cmd->path, cmd->extra, &current, name, sizeof(name));
+    }
+    batch_printf(out, "STOCK\t%ld\t%s\t%lld\t%s\n", cmd->line, cmd->extra, quantity, name);
+    return 0;
+}
+
+static void batch_delivery_row(const ScheduleRecord *record, void *arg) {
+    BatchOrderList *list = arg;
+    batch_printf(list->out, "DELIVERY\t%ld\t%lld\t%u\t%u\t%s\n", list->line, (long long)record->time, record->route,
+                 record->depot, record->note);
+}
+
+// Run a delivery schedule command; a listing prints a DELIVERY line per
+// delivery
+static int batch_schedule(BatchCommand *cmd, BatchOutput *out) {
+    int err;
+    size_t matched;
+    switch (cmd->info->kind) {
+        case BATCH_SCHEDULE_ADD:
+            return schedule_put(&cmd->delivery);
+        case BATCH_SCHEDULE_CANCEL:
+            err = schedule_cancel(cmd->delivery.time, cmd->delivery.route);
+            if (err == ENOENT) cmd->message = "no delivery on that route at that time";
+            return err;
+        default: {
+            BatchOrderList list = { .out = out, .line = cmd->line };
+            return schedule_range(cmd->delivery.time, cmd->until, cmd->delivery.depot, batch_delivery_row, &list,
+                                  &matched);
+        }
+    }
+}
+
+static void batch_shipment_row(const char *file, uint64_t line, const char *text, size_t len, void *arg) {
+    BatchOrderList *list = arg;
+    batch_printf(list->out, "SHIPMENT\t%ld\t%s\t%llu\t%.*s\n", list->line, file, (unsigned long long)line, (int)len,
+                 text);
+}
+
+// Run a shipment log command; a query prints a SHIPMENT line per entry and
+// shiplog-compress one SEGMENTS line with the files done and failed
+static int batch_shiplog(BatchCommand *cmd, BatchOutput *out) {
+    size_t done, failed;
+    int err;
+    switch (cmd->info->kind) {
+        case BATCH_SHIPLOG_APPEND:
+            err = shiplog_append(cmd->extra);
+            if (err == EINVAL) cmd->message = "entry empty or not on one line";
+            return err;
+        case BATCH_SHIPLOG_SEAL:
+            return shiplog_seal();
+        case BATCH_SHIPLOG_COMPRESS:
+            err = shiplog_compress(&done, &failed);
+            if (err != 0) return err;
+            batch_printf(out, "SEGMENTS\t%ld\t%zu\t%zu\n", cmd->line, done, failed);
+            if (failed == 0) return 0;
+            snprintf(cmd->message_text, sizeof(cmd->message_text), "%zu of %zu files failed", failed, done + failed);
+            cmd->message = cmd->message_text;
+            return EIO;
+        default: {
+            BatchOrderList list = { .out = out, .line = cmd->line };
+            return shiplog_query(cmd->delivery.time, cmd->until, cmd->extra, batch_shipment_row, &list, &done);
+        }
+    }
+}
+
+// Unpack the packed files a command is about to change, as the menu does
+static int batch_unpack(const BatchCommand *cmd) {
+    switch (cmd->info->kind) {
+        case BATCH_CHMOD:
+        case BATCH_DELETE:
+        case BATCH_APPEND:
+            return pack_unpack(cmd->path);
+        case BATCH_SYMLINK:
+        case BATCH_MOVE: {
+            int err = pack_unpack(cmd->path);
+            return err == 0 ? pack_unpack(cmd->path2) : err;
+        }
+        case BATCH_COPY:
+            return pack_unpack(cmd->path2);
+        default:
+            return 0;
+    }
+}
+
+// Run one parsed command; returns 0 or an errno value
+static int batch_execute(const UserContext *user_ctx, BatchCommand *cmd, BatchOutput *out) {
+    const BatchCommandInfo *info = cmd->info;
+    if (info->kind == BATCH_LIST) {
+        batch_flush(out);
+        return batch_list(user_ctx, cmd->list_base, out);
+    }
+    if (info->kind == BATCH_FIND || info->kind == BATCH_SEARCH) {
+        batch_flush(out);
+        return info->kind == BATCH_FIND ? batch_find(user_ctx, cmd, out) : batch_search(user_ctx, cmd, out);
+    }
+    if (info->kind == BATCH_ALIAS) return 0;
+
+    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, cmd->path) ||
+        (info->paths == 2 && !is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, cmd->path2))) {
+        cmd->message = "invalid path, operation not allowed";
+        return EACCES;
+    }
+
+    struct stat sb;
+    int err = batch_unpack(cmd);
+    if (err != 0) return err;
+    switch (info->kind) {
+        case BATCH_CHMOD: {
+            char *end;
+            long mode = strtol(cmd->extra, &end, 8);
+            if (*end != '\0' || mode < 0 || mode > 07777) {
+                cmd->message = "invalid permissions";
+                return EINVAL;
+            }
+            return fsop_chmod(cmd->path, (mode_t)mode);
+        }
+        case BATCH_MKDIR:
+            return fsop_mkdir(cmd->path, 0777);
+        case BATCH_RMDIR: {
+            if (stat(cmd->path, &sb) != 0) return errno;
+            if (!S_ISDIR(sb.st_mode)) return ENOTDIR;
+            err = trash_move(cmd->path);
+            if (err != EXDEV) return err;
+            uint64_t txn;
+            err = journal_begin(JOURNAL_OP_DELETE_TREE, cmd->path, NULL, 0, &txn);
+            if (err == 0) {
+                err = fsop_delete_tree(cmd->path);
+                journal_end(txn, err);
+            }
+            return err;
+        }
+        case BATCH_CREATE:
+            if (pack_stat(cmd->path, &sb) == 0 && S_ISREG(sb.st_mode)) return EEXIST;
+            return fsop_create_file(cmd->path, 0666);
+        case BATCH_DELETE:
+            if (lstat(cmd->path, &sb) != 0) return errno;
+            if (S_ISDIR(sb.st_mode)) return EISDIR;
+            err = trash_move(cmd->path);
+            return err == EXDEV ? fsop_delete_file(cmd->path) : err;
+        case BATCH_SYMLINK:
+            return fsop_symlink(cmd->path, cmd->path2);
+        case BATCH_COPY:
+            return fsop_copy_file(cmd->path, cmd->path2, NULL);
+        case BATCH_MOVE:
+            return fsop_rename(cmd->path, cmd->path2);
+        case BATCH_BULK_COPY:
+        case BATCH_BULK_MOVE:
+        case BATCH_BULK_DELETE:
+            return batch_bulk(user_ctx, cmd, out);
+        case BATCH_RESTORE:
+            err = trash_restore_path(user_ctx, cmd->path);
+            if (err == ENOENT) cmd->message = "nothing in the trash came from this path, or its directory is gone";
+            if (err == EEXIST) cmd->message = "something else now exists at this path";
+            return err;
+        case BATCH_ORDERS_IMPORT:
+        case BATCH_ORDERS_EXPORT:
+        case BATCH_ORDERS:
+        case BATCH_ORDERS_COUNT:
+            return batch_orders(cmd, out);
+        case BATCH_STOCK:
+        case BATCH_STOCK_ADJUST:
+            return batch_stock(cmd, out);
+        case BATCH_SCHEDULE_ADD:
+        case BATCH_SCHEDULE_CANCEL:
+        case BATCH_SCHEDULE:
+            return batch_schedule(cmd, out);
+        case BATCH_SHIPLOG_APPEND:
+        case BATCH_SHIPLOG:
+        case BATCH_SHIPLOG_SEAL:
+        case BATCH_SHIPLOG_COMPRESS:
+            return batch_shiplog(cmd, out);
+        case BATCH_PACK: {
+            PackStats stats;
+            err = pack_tree(cmd->path, &stats);
+            if (err != 0) return err;
+            batch_printf(out, "PACKED\t%ld\t%zu\t%zu\t%zu\n", cmd->line, stats.files, stats.packs, stats.failed);
+            if (stats.failed == 0) return 0;
+            snprintf(cmd->message_text, sizeof(cmd->message_text), "%zu directories could not be packed",
+                     stats.failed);
+            cmd->message = cmd->message_text;
+            return EIO;
+        }
+        case BATCH_APPEND: {
+            // Same record append_to_file writes: the text and a newline
+            if (segment_sealed(cmd->path)) {
+                cmd->message = "sealed shipment log segments are read-only";
+                return EROFS;
+            }
+            size_t len = strlen(cmd->extra);
+            char *record = malloc(len + 1);
+            if (record == NULL) return ENOMEM;
+            memcpy(record, cmd->extra, len);
+            record[len] = '\n';
+            err = append_record(cmd->path, record, len + 1, NULL);
+            free(record);
+            return err;
+        }
+        case BATCH_VIEW: {
+            int packed = 0;
+            int fd = confine_open(cmd->path, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+            if (fd < 0 && errno == ENOENT) {
+                fd = pack_open_member(cmd->path, NULL);
+                packed = fd >= 0;
+            }
+            if (fd < 0) return errno;
+            batch_flush(out);
+            if (segment_probe(fd)) {
+                long first = cmd->view_mode == 'r' ? cmd->view_first : cmd->view_last;
+                err = segment_view(fd, out->fd, cmd->view_mode, first, cmd->view_last);
+                if (err == ERANGE) err = 0;  // Like a plain file: nothing to show
+            } else if (cmd->view_mode == 'h') {
+                err = view_head(fd, out->fd, cmd->view_last);
+            } else if (cmd->view_mode == 't') {
+                err = view_tail(fd, out->fd, cmd->view_last);
+            } else if (cmd->view_mode == 'r') {
+                off_t start, end;
+                err = line_index_range(fd, packed ? NULL : LINE_INDEX_DIR, cmd->view_first, cmd->view_last, &start, &end);
+                if (err == 0) err = view_range(fd, out->fd, start, end);
+            } else {
+                err = view_whole(fd, out->fd);
+            }
+            close(fd);
+            return err;
+        }
+        default:
+            return EINVAL;
+    }
+}
+
+// Journal, run and report one window of commands. The intents share one
+// write, and each completion follows its own command, so a crash leaves
+// open only the commands that had not finished. Intents record the files
+// as they were before the window: recovery leaves alone a command whose
+// paths an earlier one in the window had already replaced.
+static void batch_run_window(BatchSession *session, BatchCommand *cmds, size_t count) {
+    JournalIntentSpec specs[BATCH_WINDOW];
+    uint64_t txns[BATCH_WINDOW];
+    size_t journaled[BATCH_WINDOW];
+    size_t spec_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (cmds[i].err != 0 || cmds[i].info->op == JOURNAL_OP_NONE) continue;
+        mode_t mode = cmds[i].info->kind == BATCH_CHMOD ? (mode_t)strtol(cmds[i].extra, NULL, 8) : 0;
+        specs[spec_count] = (JournalIntentSpec){
+            .op = cmds[i].info->op, .path = cmds[i].path,
+            .path2 = cmds[i].info->paths == 2 ? cmds[i].path2 : NULL, .mode = mode,
+        };
+        journaled[spec_count++] = i;
+    }
+    int err = journal_begin_many(specs, spec_count, txns);
+    if (err != 0) {
+        for (size_t j = 0; j < spec_count; j++) {
+            cmds[journaled[j]].err = err;
+            cmds[journaled[j]].message = "could not write the operation journal";
+        }
+    }
+
+    size_t next = 0;
+    for (size_t i = 0; i < count; i++) {
+        BatchCommand *cmd = &cmds[i];
+        int is_journaled = next < spec_count && journaled[next] == i;
+        if (cmd->err == 0) cmd->err = batch_execute(&session->user_ctx, cmd, &session->out);
+        if (is_journaled) {
+            if (err == 0) journal_end(txns[next], cmd->err);
+            next++;
+        }
+
+        const char *name = cmd->info != NULL ? cmd->info->name : cmd->argv[0];
+        if (cmd->err == 0) {
+            batch_printf(&session->out, "STATUS\t%ld\t%s\tok\n", cmd->line, name);
+        } else {
+            batch_printf(&session->out, "STATUS\t%ld\t%s\terror\t%d\t%s\n", cmd->line, name, cmd->err,
+                         cmd->message != NULL ? cmd->message : strerror(cmd->err));
+            session->failed++;
+        }
+        session->total++;
+    }
+}
+
+// Log a session in as role; returns 0 or an errno value
+static int batch_session_login(BatchSession *session, const char *role_name, const char *username, const char *password) {
+    if (!user_context_for_role(role_name, &session->user_ctx, session->aliases, &session->alias_count)) return EINVAL;
+    if (password == NULL || !check_credentials(username, password)) return EACCES;
+    session->role = strcmp(role_name, "admin") == 0 ? BATCH_ROLE_ADMIN
+                  : strcmp(role_name, "warehouse") == 0 ? BATCH_ROLE_WAREHOUSE : BATCH_ROLE_CUSTOMER;
+    return 0;
+}
+
+// Turn the session's next line into cmd. Returns 0 for blank lines and
+// comments, which are not commands. A line starting with one of the
+// session's aliases runs the alias's command line followed by the rest of
+// the line.
+static int batch_prepare(BatchSession *session, const char *line, BatchCommand *cmd) {
+    session->line_no++;
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->line = session->line_no;
+    const char *rest;
+    const Alias *alias = batch_find_alias(&session->user_ctx, line, &rest);
+    if (alias != NULL) {
+        size_t alias_len = strlen(alias->command), rest_len = strlen(rest);
+        cmd->text = malloc(alias_len + rest_len + 1);
+        if (cmd->text != NULL) {
+            memcpy(cmd->text, alias->command, alias_len);
+            memcpy(cmd->text + alias_len, rest, rest_len + 1);
+        }
+    } else {
+        cmd->text = strdup(line);
+    }
+    if (cmd->text == NULL) {
+        cmd->err = ENOMEM;
+        cmd->argv[0] = "?";
+        cmd->argc = 1;
+        return 1;
+    }
+    cmd->argc = batch_tokenize(cmd->text, cmd->argv, BATCH_MAX_ARGS);
+    if (cmd->argc == 0) {
+        free(cmd->text);
+        cmd->text = NULL;
+        return 0;
+    }
+    if (cmd->argc < 0) {
+        cmd->argv[0] = "?";
+        cmd->argc = 1;
+        cmd->err = EINVAL;
+        cmd->message = "unbalanced quotes or too many arguments";
     } else {
-        printf("Error moving file\n");
+        batch_parse(&session->user_ctx, session->role, cmd);
     }
+    return 1;
 }
 
-// Function to append to file
-void append_to_file(UserContext *user_ctx) {
-    char file_name[256];
-    if (get_input("Enter file name to append text: ", file_name, sizeof(file_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Entry point for --batch. Returns the process exit status: 0 when every
+// command succeeded, 1 when some failed, 2 for usage or login errors.
+int batch_main(int argc, char **argv) {
+    const char *script = "-", *role_name = NULL, *username = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) script = argv[++i];
+        } else if (strcmp(argv[i], "--role") == 0 && i + 1 < argc) {
+            role_name = argv[++i];
+        } else if (strcmp(argv[i], "--user") == 0 && i + 1 < argc) {
+            username = argv[++i];
+        } else {
+            role_name = NULL;
+            break;
+        }
     }
-    char sanitized_name[256];
-    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
-        printf("Invalid file name.\n");
-        return;
+    if (role_name == NULL || username == NULL) {
+        fprintf(stderr, "Usage: %s --batch [FILE] --role admin|warehouse|customer --user NAME\n", argv[0]);
+        return 2;
     }
 
-    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the file is located or will be created:");
-    if (base_path == NULL) return;
+    BatchSession session = { .out.fd = STDOUT_FILENO };
+    int err = batch_session_login(&session, role_name, username, getenv("LOGISTICS_PASSWORD"));
+    if (err == EINVAL) {
+        fprintf(stderr, "Unknown role %s.\n", role_name);
+        return 2;
+    }
+    if (err != 0) {
+        fprintf(stderr, "Invalid username or password (set LOGISTICS_PASSWORD).\n");
+        return 2;
+    }
 
-    char full_path[PATH_MAX];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
-        printf("Path is too long.\n");
-        return;
+    FILE *in = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", script, strerror(errno));
+        return 2;
     }
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
-        printf("Invalid path. Operation not allowed.\n");
-        return;
+    BatchCommand *cmds = calloc(BATCH_WINDOW, sizeof(*cmds));
+    if (cmds == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        if (in != stdin) fclose(in);
+        return 2;
     }
 
-    char text[1024];
-    if (get_input("Enter text to append: ", text, sizeof(text)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+    char *line = NULL;
+    size_t line_cap = 0;
+    size_t count = 0;
+    int eof = 0;
+    while (!eof) {
+        ssize_t n = getline(&line, &line_cap, in);
+        if (n < 0) {
+            eof = 1;
+        } else {
+            if (n > 0 && line[n - 1] == '\n') line[--n] = '\0';
+            count += (size_t)batch_prepare(&session, line, &cmds[count]);
+        }
+
+        if (count == BATCH_WINDOW || (eof && count > 0)) {
+            batch_run_window(&session, cmds, count);
+            for (size_t i = 0; i < count; i++) free(cmds[i].text);
+            count = 0;
+        }
+    }
+    batch_printf(&session.out, "SUMMARY\t%ld\t%ld\t%ld\n", session.total, session.total - session.failed, session.failed);
+    batch_flush(&session.out);
+    out_free(&session.out.pending);
+
+    free(line);
+    free(cmds);
+    if (in != stdin) fclose(in);
+    return session.failed == 0 ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// Server mode
+//
+// logistics_system --serve [SOCKET] keeps one process, with its indexes and
+// caches, serving many terminals over a Unix domain socket. An epoll loop
+// accepts connections and hands every readable one to a worker thread. A
+// connection's first line is "login ROLE USER PASSWORD", and after that each
+// line is a batch command answered with its output and a STATUS line.
+// Connection fds are armed EPOLLONESHOT, so only one worker touches a
+// connection at a time, and that worker re-arms it once it has run every
+// complete line. logistics_system --connect [SOCKET] is the matching thin
+// client.
+// ---------------------------------------------------------------------------
+
+typedef struct ServerConn {
+    struct ServerConn *next;     // Work queue link
+    int fd;
+    int logged_in;
+    int closed;                  // Peer finished sending
+    char *input;
+    size_t input_len;
+    size_t input_cap;
+    BatchSession session;
+} ServerConn;
+
+typedef struct Server {
+    int epoll_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    ServerConn *queue_head;
+    ServerConn **queue_tail;
+    int stopping;
+} Server;
+
+static Server server = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+
+static void server_close(ServerConn *conn) {
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    out_free(&conn->session.out.pending);
+    free(conn->input);
+    free(conn);
+}
+
+// Wait for the connection's next input
+static void server_rearm(ServerConn *conn) {
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// Handle the first line of a connection
+static void server_login(ServerConn *conn, char *line) {
+    char *argv[5];
+    int argc = batch_tokenize(line, argv, 5);
+    int err = EINVAL;
+    if (argc == 4 && strcmp(argv[0], "login") == 0) {
+        err = batch_session_login(&conn->session, argv[1], argv[2], argv[3]);
+    }
+    conn->session.line_no++;
+    if (err == 0) {
+        conn->logged_in = 1;
+        batch_printf(&conn->session.out, "STATUS\t%ld\tlogin\tok\n", conn->session.line_no);
+    } else {
+        batch_printf(&conn->session.out, "STATUS\t%ld\tlogin\terror\t%d\t%s\n", conn->session.line_no, err,
+                     err == EACCES ? "invalid username or password" : "expected: login ROLE USER PASSWORD");
+    }
+}
+
+// Run every complete line buffered for conn. Returns 0 when the connection
+// should be closed.
+static int server_serve(ServerConn *conn) {
+    BatchCommand cmd;
+    size_t start = 0;
+    char *newline;
+    while ((newline = memchr(conn->input + start, '\n', conn->input_len - start)) != NULL) {
+        *newline = '\0';
+        char *line = conn->input + start;
+        start = (size_t)(newline - conn->input) + 1;
+        if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+
+        if (strcmp(line, "quit") == 0) return 0;
+        if (!conn->logged_in) {
+            server_login(conn, line);
+            if (!conn->logged_in) {
+                batch_flush(&conn->session.out);
+                return 0;
+            }
+        } else if (batch_prepare(&conn->session, line, &cmd)) {
+            batch_run_window(&conn->session, &cmd, 1);
+            free(cmd.text);
+        }
+        if (batch_flush(&conn->session.out) != 0) return 0;
+    }
+    memmove(conn->input, conn->input + start, conn->input_len - start);
+    conn->input_len -= start;
+    return !conn->closed;
+}
+
+// Read what the peer has sent. Returns 1 when a complete line is waiting,
+// 0 to keep waiting, -1 when the connection is finished.
+static int server_read(ServerConn *conn) {
+    while (1) {
+        if (conn->input_cap - conn->input_len < 4096) {
+            if (conn->input_cap >= SERVER_MAX_LINE + 4096) {
+                // Serve the lines already here; the rest waits in the socket
+                if (memchr(conn->input, '\n', conn->input_len) != NULL) return 1;
+                return -1;  // No newline in sight
+            }
+            size_t cap = conn->input_cap == 0 ? 8192 : conn->input_cap * 2;
+            char *grown = realloc(conn->input, cap);
+            if (grown == NULL) return -1;
+            conn->input = grown;
+            conn->input_cap = cap;
+        }
+        ssize_t n = recv(conn->fd, conn->input + conn->input_len, conn->input_cap - conn->input_len, MSG_DONTWAIT);
+        if (n > 0) {
+            conn->input_len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) conn->closed = 1;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        break;
+    }
+    if (memchr(conn->input, '\n', conn->input_len) != NULL) return 1;
+    return conn->closed ? -1 : 0;
+}
+
+static void *server_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&server.lock);
+        while (server.queue_head == NULL && !server.stopping) pthread_cond_wait(&server.ready, &server.lock);
+        ServerConn *conn = server.queue_head;
+        if (conn == NULL) {
+            pthread_mutex_unlock(&server.lock);
+            return NULL;
+        }
+        server.queue_head = conn->next;
+        if (server.queue_head == NULL) server.queue_tail = &server.queue_head;
+        pthread_mutex_unlock(&server.lock);
+
+        int ready = server_read(conn);
+        if (ready > 0 && !server_serve(conn)) ready = -1;
+        if (ready < 0) server_close(conn);
+        else server_rearm(conn);
+    }
+}
+
+// Bind the listening socket, replacing a stale one left by a dead server
+static int server_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -errno;
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int alive = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (alive) {
+            close(fd);
+            return -EADDRINUSE;
+        }
+        unlink(path);
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if (!bound || chmod(path, 0660) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    return fd;
+}
+
+// Entry point for --serve: runs until SIGINT or SIGTERM
+int server_main(int argc, char **argv) {
+    const char *path = argc > 2 ? argv[2] : SERVER_SOCKET_NAME;
+
+    // Signals arrive through the event loop; workers never see them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);  // A client hanging up mid-reply is not fatal
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    int listen_fd = server_listen(path);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Error listening on %s: %s\n", path, strerror(-listen_fd));
+        return 1;
+    }
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.queue_tail = &server.queue_head;
+    if (server.epoll_fd < 0 || signal_fd < 0) {
+        perror("Error starting server");
+        return 1;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &server };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.ptr = &signal_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+
+    int worker_count = walk_default_workers();
+    pthread_t workers[WALK_MAX_WORKERS];
+    int started = 0;
+    while (started < worker_count && pthread_create(&workers[started], NULL, server_worker, NULL) == 0) started++;
+    printf("Serving on %s with %d workers.\n", path, started);
+    fflush(stdout);
+
+    struct epoll_event events[64];
+    int running = started > 0;
+    while (running) {
+        int n = epoll_wait(server.epoll_fd, events, 64, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &signal_fd) {
+                running = 0;
+            } else if (events[i].data.ptr == &server) {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                    ServerConn *conn = calloc(1, sizeof(*conn));
+                    if (conn == NULL) {
+                        close(fd);
+                        continue;
+                    }
+                    conn->fd = fd;
+                    conn->session.out.fd = fd;
+                    struct epoll_event conn_event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+                    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &conn_event) != 0) server_close(conn);
+                }
+            } else {
+                // Readable or hung up: a worker takes it from here
+                ServerConn *conn = events[i].data.ptr;
+                pthread_mutex_lock(&server.lock);
+                conn->next = NULL;
+                *server.queue_tail = conn;
+                server.queue_tail = &conn->next;
+                pthread_cond_signal(&server.ready);
+                pthread_mutex_unlock(&server.lock);
+            }
+        }
+    }
+
+    // Let the workers finish what is queued, then leave through exit() so
+    // the journal and index shut down as usual
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    close(listen_fd);
+    unlink(path);
+    printf("Server stopped.\n");
+    return 0;
+}
+
+// Entry point for --connect: forwards stdin to the server and its replies
+// to stdout. With --role and --user it logs in first, using
+// LOGISTICS_PASSWORD.
+int client_main(int argc, char **argv) {
+    const char *path = SERVER_SOCKET_NAME, *role_name = NULL, *username = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--role") == 0 && i + 1 < argc) role_name = argv[++i];
+        else if (strcmp(argv[i], "--user") == 0 && i + 1 < argc) username = argv[++i];
+        else path = argv[i];
     }
 
-    // Escape special characters in text
-    char escaped_text[2048];
-    char *src = text;
-    char *dst = escaped_text;
-    size_t escaped_text_size = sizeof(escaped_text);
-    size_t remaining_size = escaped_text_size - 1;  // Reserve space for null terminator
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error connecting to %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (role_name != NULL && username != NULL) {
+        // Quote the password for the server's tokenizer
+        const char *password = getenv("LOGISTICS_PASSWORD");
+        char quoted[512];
+        size_t q = 0;
+        for (const char *p = password != NULL ? password : ""; *p != '\0' && q + 2 < sizeof(quoted); p++) {
+            if (*p == '"' || *p == '\\') quoted[q++] = '\\';
+            quoted[q++] = *p;
+        }
+        quoted[q] = '\0';
+        char login[1024];
+        int len = snprintf(login, sizeof(login), "login %s %s \"%s\"\n", role_name, username, quoted);
+        if (len < 0 || (size_t)len >= sizeof(login) || fsop_write_all(fd, login, (size_t)len) != 0) {
+            fprintf(stderr, "Error sending login.\n");
+            return 2;
+        }
+    }
 
-    while (*src && remaining_size > 0) {
-        if (*src == '"' || *src == '\\' || *src == '$' || *src == '`') {
-            if (remaining_size < 2) {  // Need space for backslash and character
-                printf("Error: Escaped text is too long.\n");
-                return;
+    // Copy both directions until the server hangs up. The socket never
+    // blocks a write: input waits in its buffer until the server takes it,
+    // so replies keep being read while the server is busy sending them.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    struct pollfd fds[2] = { { .fd = STDIN_FILENO }, { .fd = fd } };
+    char buffer[VIEW_BLOCK_SIZE], input[VIEW_BLOCK_SIZE];
+    size_t pending = 0, sent = 0;
+    while (1) {
+        fds[0].events = pending == 0 ? POLLIN : 0;
+        fds[1].events = pending > 0 ? POLLIN | POLLOUT : POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n <= 0) break;
+            if (fsop_write_all(STDOUT_FILENO, buffer, (size_t)n) != 0) break;
+        }
+        if (pending > 0 && (fds[1].revents & POLLOUT)) {
+            ssize_t n = write(fd, input + sent, pending - sent);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) break;
+            if (n > 0) sent += (size_t)n;
+            if (sent == pending) pending = sent = 0;
+            if (pending == 0 && fds[0].fd < 0) shutdown(fd, SHUT_WR);
+        }
+        if (pending == 0 && fds[0].fd >= 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+            if (n < 0 && errno == EINTR) continue;
+            if (n > 0) {
+                pending = (size_t)n;
+                continue;
             }
-            *dst++ = '\\';
-            *dst++ = *src++;
-            remaining_size -= 2;
-        } else {
-            *dst++ = *src++;
-            remaining_size--;
+            shutdown(fd, SHUT_WR);  // Let the server finish and close
+            fds[0].fd = -1;
         }
     }
-    *dst = '\0';
+    close(fd);
+    return 0;
+}
 
-    // Calculate the required command buffer size
-    size_t command_size = strlen(escaped_text) + strlen(full_path) + 50;  // Additional space for command syntax
+// ---------------------------------------------------------------------------
+// Stress mode
+//
+// logistics_system --stress [SESSIONS [ROUNDS]] --user NAME runs many
+// sessions at once through the code that serves batch scripts and server
+// connections. Sessions log in as admin, warehouse and customer in turn
+// (password from LOGISTICS_PASSWORD). Each worker thread interleaves its
+// share of sessions one window per round, so every session stays live for
+// the whole run. A session works in its own directory, runs commands
+// through a session alias, reads through a symbolic link it made, and
+// appends to a log that all sessions share.
+// The run passes when every command succeeds and the shared log holds
+// exactly one line per append. A -fsanitize=thread build also checks the
+// core for data races.
+// ---------------------------------------------------------------------------
+
+#define STRESS_MAX_LINES 16
+#define STRESS_LINE_MAX 512
+
+typedef struct StressRun {
+    BatchSession *sessions;
+    int session_count;
+    int rounds;
+    int workers;
+    char dir[64];              // The run's directory under every base
+    atomic_long reported;      // Failures printed so far
+    atomic_int aborted;        // Workers that could not run their sessions
+} StressRun;
+
+static int stress_add(char (*lines)[STRESS_LINE_MAX], int count, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(lines[count], STRESS_LINE_MAX, format, args);
+    va_end(args);
+    return count + 1;
+}
 
-    if (command_size > PATH_MAX + 4096) {  // Set an upper limit to prevent excessively large allocations
-        printf("Error: Command is too long.\n");
-        return;
+// One round of session `index`'s script
+static int stress_script(const StressRun *run, int index, int round, char (*lines)[STRESS_LINE_MAX]) {
+    const char *dir = run->dir;
+    int n = 0;
+    switch (index % 3) {
+        case 0:  // admin
+            if (round == 0) {
+                n = stress_add(lines, n, "mkdir %s/s%d --in admin", dir, index);
+                n = stress_add(lines, n, "create %s/s%d/a.txt --in admin", dir, index);
+                n = stress_add(lines, n, "alias peek \"view %s/s%d/a.txt --in admin --tail\"", dir, index);
+            }
+            n = stress_add(lines, n, "append %s/s%d/a.txt \"round %d\" --in admin", dir, index, round);
+            n = stress_add(lines, n, "peek 1");
+            n = stress_add(lines, n, "copy %s/s%d/a.txt %s/s%d/c%d --in admin", dir, index, dir, index, round);
+            n = stress_add(lines, n, "chmod %s/s%d/c%d 640 --in admin", dir, index, round);
+            n = stress_add(lines, n, "move %s/s%d/c%d %s/s%d/m%d --in admin", dir, index, round, dir, index, round);
+            n = stress_add(lines, n, "view %s/s%d/m%d --lines 1-%d --in admin", dir, index, round, round + 1);
+            n = stress_add(lines, n, "delete %s/s%d/m%d --in admin", dir, index, round);
+            // Links store absolute targets, which confined lookups must still follow
+            n = stress_add(lines, n, "symlink %s/s%d/a.txt %s/s%d/l%d --in admin", dir, index, dir, index, round);
+            n = stress_add(lines, n, "view %s/s%d/l%d --tail 1 --in admin", dir, index, round);
+            if (round == run->rounds - 1) n = stress_add(lines, n, "list --in admin");
+            break;
+        case 1:  // warehouse
+            if (round == 0) {
+                n = stress_add(lines, n, "mkdir %s/s%d --in warehouse", dir, index);
+                n = stress_add(lines, n, "alias note \"append %s/s%d/notes.txt\"", dir, index);
+            }
+            n = stress_add(lines, n, "create %s/s%d/f%d --in warehouse", dir, index, round);
+            n = stress_add(lines, n, "note \"round %d\" --in warehouse", round);
+            n = stress_add(lines, n, "mkdir %s/s%d/d%d --in warehouse", dir, index, round);
+            n = stress_add(lines, n, "move %s/s%d/f%d %s/s%d/d%d/f --in warehouse", dir, index, round, dir, index, round);
+            n = stress_add(lines, n, "view %s/s%d/notes.txt --head 1 --in warehouse", dir, index);
+            n = stress_add(lines, n, "rmdir %s/s%d/d%d --in warehouse", dir, index, round);
+            break;
+        default:  // customer
+            n = stress_add(lines, n, "append %s/c%d.txt \"round %d\" --in customers", dir, index, round);
+            n = stress_add(lines, n, "view %s/c%d.txt --tail 1 --in customers", dir, index);
+            n = stress_add(lines, n, "copy %s/c%d.txt %s/c%d.%d --in customers", dir, index, dir, index, round);
+            n = stress_add(lines, n, "view %s/c%d.%d --lines 1-1 --in customers", dir, index, round);
+            break;
     }
+    n = stress_add(lines, n, "append %s/shared.log \"session %d round %d\" --in customers", dir, index, round);
+    return n;
+}
 
-    char *command = malloc(command_size);
-    if (command == NULL) {
-        printf("Memory allocation failed.\n");
-        return;
+// Run lines as one window of the session, reporting the first failures
+static void stress_run_lines(StressRun *run, int index, BatchSession *session, char (*lines)[STRESS_LINE_MAX], int n,
+                             BatchCommand *cmds) {
+    size_t count = 0;
+    for (int i = 0; i < n; i++) count += (size_t)batch_prepare(session, lines[i], &cmds[count]);
+    batch_run_window(session, cmds, count);
+    for (size_t i = 0; i < count; i++) {
+        if (cmds[i].err != 0 && atomic_fetch_add(&run->reported, 1) < 10) {
+            fprintf(stderr, "Session %d, line %ld, %s: %s\n", index, cmds[i].line,
+                    cmds[i].info != NULL ? cmds[i].info->name : cmds[i].argv[0],
+                    cmds[i].message != NULL ? cmds[i].message : strerror(cmds[i].err));
+        }
+        free(cmds[i].text);
     }
+    batch_flush(&session->out);
+}
 
-    int len = snprintf(command, command_size, "echo \"%s\" >> \"%s\"", escaped_text, full_path);
-    if (len < 0 || (size_t)len >= command_size) {
-        printf("Error: Command buffer size exceeded.\n");
-        free(command);
-        return;
+// Worker w owns sessions w, w + workers, ... and runs them round by round
+static void stress_worker(int worker, size_t index, void *arg) {
+    (void)worker;
+    StressRun *run = arg;
+    BatchCommand *cmds = calloc(STRESS_MAX_LINES, sizeof(*cmds));
+    char (*lines)[STRESS_LINE_MAX] = malloc(STRESS_MAX_LINES * STRESS_LINE_MAX);
+    if (cmds == NULL || lines == NULL) {
+        atomic_fetch_add(&run->aborted, 1);
+    } else {
+        for (int round = 0; round < run->rounds; round++) {
+            for (int i = (int)index; i < run->session_count; i += run->workers) {
+                int n = stress_script(run, i, round, lines);
+                stress_run_lines(run, i, &run->sessions[i], lines, n, cmds);
+            }
+        }
     }
+    free(lines);
+    free(cmds);
+}
 
-    int result = system(command);
-    free(command);
-    if (result == 0) {
-        printf("Text appended to %s\n", full_path);
-    } else {
-        printf("Error appending to file\n");
+// Number of lines in the run's shared log, or -1 if it cannot be read
+static long stress_count_lines(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char buffer[VIEW_BLOCK_SIZE];
+    long lines = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (const char *p = buffer; (p = memchr(p, '\n', (size_t)(buffer + n - p))) != NULL; p++) lines++;
     }
+    close(fd);
+    return n < 0 ? -1 : lines;
 }
 
-// Function to view file content
-void view_file_content(UserContext *user_ctx) {
-    char file_name[256];
-    if (get_input("Enter file name to view content: ", file_name, sizeof(file_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Entry point for --stress. Returns 0 when the run passed, 1 when it did
+// not, 2 for usage or login errors.
+int stress_main(int argc, char **argv) {
+    int session_count = 300, rounds = 8, positional = 0;
+    const char *username = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--user") == 0 && i + 1 < argc) {
+            username = argv[++i];
+        } else if (positional < 2 && isdigit((unsigned char)argv[i][0])) {
+            if (positional++ == 0) session_count = atoi(argv[i]);
+            else rounds = atoi(argv[i]);
+        } else {
+            username = NULL;
+            break;
+        }
     }
-    char sanitized_name[256];
-    if (!sanitize_filename(file_name, sanitized_name, sizeof(sanitized_name))) {
-        printf("Invalid file name.\n");
-        return;
+    if (username == NULL || session_count <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s --stress [SESSIONS [ROUNDS]] --user NAME\n", argv[0]);
+        return 2;
     }
 
-    const char *base_path = select_base_path_with_other(user_ctx, "Select the directory where the file is located:");
-    if (base_path == NULL) return;
-
-    char full_path[PATH_MAX];
-    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_path, sanitized_name) >= (int)sizeof(full_path)) {
-        printf("Path is too long.\n");
-        return;
+    const char *password = getenv("LOGISTICS_PASSWORD");
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd < 0) {
+        fprintf(stderr, "Error opening /dev/null: %s\n", strerror(errno));
+        return 2;
     }
-    if (!is_valid_path(user_ctx->base_paths, user_ctx->base_paths_count, full_path)) {
-        printf("Invalid path. Operation not allowed.\n");
-        return;
+    // Sessions spend much of their time waiting on the disk, so run as many
+    // threads as the task runner allows rather than one per CPU
+    StressRun run = { .session_count = session_count, .rounds = rounds, .workers = WALK_MAX_WORKERS };
+    if (run.workers > session_count) run.workers = session_count;
+    snprintf(run.dir, sizeof(run.dir), ".stress.%ld", (long)getpid());
+    run.sessions = calloc((size_t)session_count, sizeof(*run.sessions));
+    BatchCommand *cmds = calloc(STRESS_MAX_LINES, sizeof(*cmds));
+    char (*lines)[STRESS_LINE_MAX] = malloc(STRESS_MAX_LINES * STRESS_LINE_MAX);
+    if (run.sessions == NULL || cmds == NULL || lines == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(run.sessions);
+        free(cmds);
+        free(lines);
+        close(null_fd);
+        return 2;
     }
 
-    // Check if file exists
-    struct stat sb;
-    if (stat(full_path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
-        printf("File does not exist.\n");
-        return;
+    // The run's directories are made and removed by a session of its own
+    static const char *roles[] = { "admin", "warehouse", "customer" };
+    BatchSession admin = { .out.fd = null_fd };
+    int err = batch_session_login(&admin, "admin", username, password);
+    for (int i = 0; err == 0 && i < session_count; i++) {
+        run.sessions[i].out.fd = null_fd;
+        err = batch_session_login(&run.sessions[i], roles[i % 3], username, password);
     }
-
-    char option[10];
-    if (get_input("View whole file or (h)ead/(t)ail? (w/h/t): ", option, sizeof(option)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+    if (err != 0) {
+        fprintf(stderr, "Invalid username or password (set LOGISTICS_PASSWORD).\n");
+        free(run.sessions);
+        free(cmds);
+        free(lines);
+        close(null_fd);
+        return 2;
     }
+    int n = 0;
+    n = stress_add(lines, n, "mkdir %s --in admin", run.dir);
+    n = stress_add(lines, n, "mkdir %s --in warehouse", run.dir);
+    n = stress_add(lines, n, "mkdir %s --in customers", run.dir);
+    stress_run_lines(&run, -1, &admin, lines, n, cmds);
 
-    int num_lines = 0;
-    char num_str[10];
-    if (option[0] == 'h' || option[0] == 'H' || option[0] == 't' || option[0] == 'T') {
-        if (get_input("Enter number of lines to display: ", num_str, sizeof(num_str)) == NULL) {
-            printf("Error reading input.\n");
-            return;
-        }
-        num_lines = atoi(num_str);
-        if (num_lines <= 0) {
-            printf("Invalid number of lines.\n");
-            return;
-        }
+    printf("Running %d sessions x %d rounds on %d workers...\n", session_count, rounds, run.workers);
+    fflush(stdout);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ParallelJob job;
+    parallel_start(&job, (size_t)run.workers, run.workers, stress_worker, &run);
+    parallel_wait(&job);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    long total = 0, failed = 0;
+    for (int i = 0; i < session_count; i++) {
+        total += run.sessions[i].total;
+        failed += run.sessions[i].failed;
+        out_free(&run.sessions[i].out.pending);
     }
-
-    // Construct the command
-    char command[PATH_MAX + 50];
-    if (option[0] == 'w' || option[0] == 'W') {
-        snprintf(command, sizeof(command), "cat \"%s\"", full_path);
-    } else if (option[0] == 'h' || option[0] == 'H') {
-        snprintf(command, sizeof(command), "head -n %d \"%s\"", num_lines, full_path);
-    } else if (option[0] == 't' || option[0] == 'T') {
-        snprintf(command, sizeof(command), "tail -n %d \"%s\"", num_lines, full_path);
-    } else {
-        printf("Invalid option.\n");
-        return;
+    char shared_path[PATH_MAX];
+    long shared_lines = -1;
+    if (snprintf(shared_path, sizeof(shared_path), "%s/%s/shared.log", CUSTOMER_BASE_PATH, run.dir) < (int)sizeof(shared_path)) {
+        shared_lines = stress_count_lines(shared_path);
     }
-
-    // Execute the command
-    system(command);
+    long expected_lines = (long)session_count * rounds;
+
+    n = 0;
+    n = stress_add(lines, n, "rmdir %s --in admin", run.dir);
+    n = stress_add(lines, n, "rmdir %s --in warehouse", run.dir);
+    n = stress_add(lines, n, "rmdir %s --in customers", run.dir);
+    stress_run_lines(&run, -1, &admin, lines, n, cmds);
+    failed += admin.failed;  // Setup and cleanup count too
+    out_free(&admin.out.pending);
+
+    printf("Commands: %ld run, %ld failed, %.0f commands/s\n", total, failed, seconds > 0 ? (double)total / seconds : 0.0);
+    printf("Shared log: %ld of %ld lines\n", shared_lines, expected_lines);
+    int passed = failed == 0 && atomic_load(&run.aborted) == 0 && shared_lines == expected_lines;
+    printf("Stress test %s.\n", passed ? "passed" : "FAILED");
+
+    free(run.sessions);
+    free(cmds);
+    free(lines);
+    close(null_fd);
+    return passed ? 0 : 1;
 }
 
-// Function to find files with pattern
-void find_file(UserContext *user_ctx) {
-    char pattern[256];
-    if (get_input("Enter file name pattern to search (use '*' for wildcards): ", pattern, sizeof(pattern)) == NULL) {
-        printf("Error reading input.\n");
-        return;
-    }
+// ---------------------------------------------------------------------------
+// I/O benchmark
+//
+// logistics_system --bench-io [FILES [DIR]] builds a synthetic tree of FILES
+// empty files, a thousand per directory. It times each bulk operation over
+// the whole tree, first with the synchronous backend and then with
+// io_uring: create, stat, rename, copy (every tenth file) and delete. The
+// tree lives in DIR, by default .logistics_bench.PID in the working
+// directory. That is outside the indexed logistics tree, so the index does
+// not take part. The tree is removed afterwards.
+// ---------------------------------------------------------------------------
 
-    printf("Searching for files matching %s in allowed directories.\n", pattern);
+#define BENCH_CHUNK 65536
+#define BENCH_PER_DIR 1000
 
-    for (int i = 0; i < user_ctx->base_paths_count; i++) {
-        // Construct the find command
-        char command[PATH_MAX + 300];
-        snprintf(command, sizeof(command), "find \"%s\" -name \"%s\" -print", user_ctx->base_paths[i], pattern);
-        // Execute the command
-        system(command);
-    }
-}
+enum { BENCH_CREATE, BENCH_STAT, BENCH_RENAME, BENCH_COPY, BENCH_DELETE, BENCH_PHASES };
 
-// Function to search content in files
-void search_content(UserContext *user_ctx) {
-    char keyword[256];
-    if (get_input("Enter keyword to search in files: ", keyword, sizeof(keyword)) == NULL) {
-        printf("Error reading input.\n");
-        return;
-    }
+static const char *bench_phase_names[BENCH_PHASES] = { "create", "stat", "rename", "copy", "delete" };
 
-    printf("Searching for keyword '%s' in files under allowed directories.\n", keyword);
+static long bench_io_count(int phase, long files) {
+    long copies = (files + 9) / 10;
+    return phase == BENCH_COPY ? copies : phase == BENCH_DELETE ? files + copies : files;
+}
 
-    for (int i = 0; i < user_ctx->base_paths_count; i++) {
-        // Construct the grep command
-        char command[PATH_MAX + 300];
-        snprintf(command, sizeof(command), "grep -r \"%s\" \"%s\"", keyword, user_ctx->base_paths[i]);
-        // Execute the command
-        system(command);
+// Fill in item number i of a phase, with its paths written to path and path2
+static void bench_io_item(int phase, long i, long files, const char *dir, size_t size, char *path, char *path2,
+                          FsBulkItem *item) {
+    static const FsBulkOp ops[BENCH_PHASES] = { FSBULK_CREATE, FSBULK_STAT, FSBULK_RENAME, FSBULK_COPY, FSBULK_UNLINK };
+    char from = phase <= BENCH_STAT || phase == BENCH_RENAME ? 'f' : 'g', to = phase == BENCH_COPY ? 'c' : 'g';
+    if (phase == BENCH_COPY) i *= 10;
+    if (phase == BENCH_DELETE && i >= files) {
+        i = (i - files) * 10;
+        from = 'c';
     }
+    snprintf(path, size, "%s/d%ld/%c%ld", dir, i / BENCH_PER_DIR, from, i);
+    snprintf(path2, size, "%s/d%ld/%c%ld", dir, i / BENCH_PER_DIR, to, i);
+    *item = (FsBulkItem){ .op = ops[phase], .path = path,
+                          .path2 = phase == BENCH_RENAME || phase == BENCH_COPY ? path2 : NULL };
 }
 
-// Function to set alias
-void set_alias(UserContext *user_ctx) {
-    if (user_ctx->aliases == NULL || user_ctx->alias_count == NULL) {
-        printf("Aliases not available for this user.\n");
-        return;
+// Run one phase over the whole tree; returns the seconds spent in bulk runs
+static double bench_io_phase(FsBulk *bulk, int phase, long files, const char *dir, FsBulkItem *items, char *paths,
+                             size_t stride, long *failed, int *first_error) {
+    long total = bench_io_count(phase, files);
+    double seconds = 0;
+    for (long base = 0; base < total; base += BENCH_CHUNK) {
+        size_t count = (size_t)(total - base < BENCH_CHUNK ? total - base : BENCH_CHUNK);
+        for (size_t i = 0; i < count; i++) {
+            char *path = paths + 2 * i * stride;
+            bench_io_item(phase, base + (long)i, files, dir, stride, path, path + stride, &items[i]);
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fsop_bulk_run(bulk, items, count);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        seconds += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        for (size_t i = 0; i < count; i++) {
+            if (items[i].result == 0) continue;
+            if ((*failed)++ == 0) *first_error = items[i].result;
+        }
     }
+    return seconds;
+}
 
-    char alias_name[256];
-    char command[256];
-    if (get_input("Enter alias name: ", alias_name, sizeof(alias_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Entry point for --bench-io. Returns 0 when every operation succeeded, 1
+// when some failed, 2 for usage or setup errors.
+int bench_io_main(int argc, char **argv) {
+    long files = 1000000;
+    char dir[PATH_MAX] = "";
+    if (argc > 2) files = atol(argv[2]);
+    if (argc > 3) snprintf(dir, sizeof(dir), "%s", argv[3]);
+    if (files <= 0 || argc > 4) {
+        fprintf(stderr, "Usage: %s --bench-io [FILES [DIR]]\n", argv[0]);
+        return 2;
     }
-    if (get_input("Enter command to associate with the alias: ", command, sizeof(command)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+    if (dir[0] == '\0') snprintf(dir, sizeof(dir), ".logistics_bench.%ld", (long)getpid());
+    if (mkdir(dir, 0755) != 0) {
+        fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+        return 2;
     }
 
-    if (*(user_ctx->alias_count) < 10) {
-        strcpy(user_ctx->aliases[*(user_ctx->alias_count)].name, alias_name);
-        strcpy(user_ctx->aliases[*(user_ctx->alias_count)].command, command);
-        (*(user_ctx->alias_count))++;
-        printf("Alias '%s' set for command '%s'.\n", alias_name, command);
-    } else {
-        printf("Alias limit reached.\n");
+    long dirs = (files + BENCH_PER_DIR - 1) / BENCH_PER_DIR;
+    size_t stride = strlen(dir) + 48;
+    FsBulkItem *items = malloc(BENCH_CHUNK * sizeof(*items));
+    char *paths = malloc(2 * BENCH_CHUNK * stride);
+    int err = items == NULL || paths == NULL ? ENOMEM : 0;
+    char path[PATH_MAX];
+    for (long d = 0; d < dirs && err == 0; d++) {
+        snprintf(path, sizeof(path), "%s/d%ld", dir, d);
+        if (mkdir(path, 0755) != 0) err = errno;
     }
-}
 
-// Function to use alias
-void use_alias(UserContext *user_ctx) {
-    if (user_ctx->aliases == NULL || user_ctx->alias_count == NULL) {
-        printf("Aliases not available for this user.\n");
-        return;
+    static const FsBulkBackend backends[] = { FSBULK_SYNC, FSBULK_URING };
+    double rates[2][BENCH_PHASES] = { { 0 } };
+    int ran[2] = { 0, 0 };
+    long failed = 0;
+    if (err == 0) {
+        printf("Bulk I/O benchmark: %ld files in %ld directories under %s\n", files, dirs, dir);
+        fflush(stdout);
     }
-
-    char alias_name[256];
-    if (get_input("Enter alias to use: ", alias_name, sizeof(alias_name)) == NULL) {
-        printf("Error reading input.\n");
-        return;
+    for (int b = 0; b < 2 && err == 0; b++) {
+        FsBulk *bulk = fsop_bulk_open(backends[b]);
+        if (bulk == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        if (fsop_bulk_backend(bulk) != backends[b]) {
+            printf("io_uring is not available here; only the synchronous backend was timed.\n");
+            fsop_bulk_close(bulk);
+            break;
+        }
+        for (int phase = 0; phase < BENCH_PHASES; phase++) {
+            long phase_failed = 0;
+            int first_error = 0;
+            double seconds = bench_io_phase(bulk, phase, files, dir, items, paths, stride, &phase_failed, &first_error);
+            rates[b][phase] = seconds > 0 ? (double)bench_io_count(phase, files) / seconds : 0;
+            if (phase_failed > 0) {
+                fprintf(stderr, "%s %s: %ld operations failed (first: %s)\n", b == 0 ? "sync" : "io_uring",
+                        bench_phase_names[phase], phase_failed, strerror(first_error));
+            }
+            failed += phase_failed;
+        }
+        ran[b] = 1;
+        fsop_bulk_close(bulk);
     }
 
-    char command[256] = {0};
-    int found = 0;
-    for (int i = 0; i < *(user_ctx->alias_count); i++) {
-        if (strcmp(user_ctx->aliases[i].name, alias_name) == 0) {
-            strcpy(command, user_ctx->aliases[i].command);
-            found = 1;
-            break;
+    if (ran[0]) {
+        printf("%-8s %14s %14s %9s\n", "phase", "sync ops/s", "io_uring ops/s", "speedup");
+        for (int phase = 0; phase < BENCH_PHASES; phase++) {
+            if (ran[1]) {
+                printf("%-8s %14.0f %14.0f %8.2fx\n", bench_phase_names[phase], rates[0][phase], rates[1][phase],
+                       rates[0][phase] > 0 ? rates[1][phase] / rates[0][phase] : 0.0);
+            } else {
+                printf("%-8s %14.0f %14s %9s\n", bench_phase_names[phase], rates[0][phase], "-", "-");
+            }
         }
     }
-    if (!found) {
-        printf("Alias not found.\n");
-        return;
+
+    // Remove whatever is left, failed runs included
+    int cleanup = fsop_delete_tree(dir);
+    if (err != 0) fprintf(stderr, "Benchmark setup failed: %s\n", strerror(err));
+    if (cleanup != 0) fprintf(stderr, "Error removing %s: %s\n", dir, strerror(cleanup));
+    free(items);
+    free(paths);
+    return err != 0 ? 2 : failed > 0 ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Order store benchmark
+//
+// logistics_system --bench-orders [ORDERS [PATH]] fills a scratch order store
+// at PATH (by default .logistics_orders_bench.PID in the working directory)
+// with ORDERS synthetic orders, ten million by default, and times status
+// queries against it: counting one status, visiting every order in one
+// status, and the per-status summary. A plain sequential read of the status
+// column is timed as well, so the scan rates can be compared with what the
+// memory delivers. The store is removed afterwards.
+// ---------------------------------------------------------------------------
+
+#define BENCH_ORDERS_MIN_SECONDS 0.2
+
+// Keeps the timed reads from being optimized away
+static volatile uint64_t bench_orders_sink;
+
+static double bench_orders_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench_orders_visit(const OrderRecord *record, void *arg) {
+    *(uint64_t *)arg += record->id;
+}
+
+// Sum the status column a word at a time: the reference read rate
+static uint64_t bench_orders_read(const uint8_t *column, size_t n) {
+    uint64_t sum = 0, word;
+    size_t i = 0;
+    for (; i + sizeof(word) <= n; i += sizeof(word)) {
+        memcpy(&word, column + i, sizeof(word));
+        sum += word;
     }
+    for (; i < n; i++) sum += column[i];
+    return sum;
+}
 
-    // Map command to function
-    if (strcmp(command, "list") == 0) {
-        list_files(user_ctx);
-    } else if (strcmp(command, "move") == 0) {
-        move_file(user_ctx);
-    } else if (strcmp(command, "append") == 0) {
-        append_to_file(user_ctx);
-    } else if (strcmp(command, "view") == 0) {
-        view_file_content(user_ctx);
-    } else if (strcmp(command, "create_dir") == 0) {
-        create_directory(user_ctx);
-    } else if (strcmp(command, "delete_dir") == 0) {
-        delete_directory(user_ctx);
-    } else if (strcmp(command, "create_file") == 0) {
-        create_file(user_ctx);
-    } else if (strcmp(command, "delete_file") == 0) {
-        delete_file(user_ctx);
-    } else if (strcmp(command, "copy") == 0) {
-        copy_file(user_ctx);
-    } else if (strcmp(command, "find") == 0) {
-        find_file(user_ctx);
-    } else if (strcmp(command, "search") == 0) {
-        search_content(user_ctx);
-    } else if (strcmp(command, "change_perms") == 0) {
-        change_permissions(user_ctx);
-    } else {
-        printf("Command associated with alias '%s' is not recognized.\n", command);
+// Entry point for --bench-orders. Returns 0 on success, 2 for usage or
+// setup errors.
+int bench_orders_main(int argc, char **argv) {
+    long orders = 10000000;
+    char path[PATH_MAX] = "";
+    if (argc > 2) orders = atol(argv[2]);
+    if (argc > 3) snprintf(path, sizeof(path), "%s", argv[3]);
+    if (orders <= 0 || argc > 4) {
+        fprintf(stderr, "Usage: %s --bench-orders [ORDERS [PATH]]\n", argv[0]);
+        return 2;
+    }
+    if (path[0] == '\0') snprintf(path, sizeof(path), ".logistics_orders_bench.%ld", (long)getpid());
+    struct stat sb;
+    if (lstat(path, &sb) == 0) {
+        fprintf(stderr, "%s already exists; the benchmark needs a new store.\n", path);
+        return 2;
     }
+    order_store_open(path);
+
+    // Fill the store with a skewed mix of statuses, as a real backlog has
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int err = order_store_lock(1);
+    int locked = err == 0;
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (long i = 0; i < orders && err == 0; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        unsigned pick = (unsigned)(state % 100);
+        OrderRecord record = {
+            .id = (uint64_t)i + 1,
+            .status = pick < 60 ? ORDER_DELIVERED : pick < 75 ? ORDER_IN_TRANSIT : pick < 85 ? ORDER_SHIPPED
+                    : (uint8_t)(ORDER_PENDING + pick % 3),
+            .warehouse = (uint32_t)(state >> 40) % 64 + 1,
+            .created = 1700000000 + i,
+            .updated = 1700000000 + i,
+        };
+        err = order_store_put_locked(&record, NULL, 0);
+    }
+    if (locked) pthread_rwlock_unlock(&order_store.lock);
+    double fill = bench_orders_seconds(&start);
+
+    if (err == 0) {
+        printf("Order store benchmark: %ld orders in %s (filled in %.2f s)\n", orders, path, fill);
+        printf("%-22s %12s %12s\n", "query", "orders/s", "GB/s");
+        for (int query = 0; query < 4; query++) {
+            static const char *names[] = { "read status column", "count one status", "visit one status",
+                                           "summary (8 statuses)" };
+            long rounds = 0;
+            uint64_t sink = 0;
+            size_t matched;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            double seconds;
+            do {
+                if (query == 0) {
+                    pthread_rwlock_rdlock(&order_store.lock);
+                    sink += bench_orders_read(order_store.col.status, (size_t)order_store.live.count);
+                    pthread_rwlock_unlock(&order_store.lock);
+                } else if (query == 1) {
+                    order_store_scan(ORDER_SHIPPED, NULL, NULL, &matched);
+                    sink += matched;
+                } else if (query == 2) {
+                    order_store_scan(ORDER_SHIPPED, bench_orders_visit, &sink, &matched);
+                } else {
+                    size_t counts[ORDER_STATUS_COUNT];
+                    order_store_counts(counts, &matched);
+                    sink += counts[ORDER_PENDING];
+                }
+                rounds++;
+                seconds = bench_orders_seconds(&start);
+            } while (seconds < BENCH_ORDERS_MIN_SECONDS);
+            double rate = (double)orders * (double)rounds / seconds;
+            // The summary reads the column once per status
+            double bytes = query == 3 ? rate * ORDER_STATUS_COUNT : rate;
+            bench_orders_sink += sink;
+            printf("%-22s %12.0f %12.2f\n", names[query], rate, bytes / 1e9);
+        }
+    }
+
+    order_store_close();
+    char notes_path[PATH_MAX + 8];
+    snprintf(notes_path, sizeof(notes_path), "%s.notes", path);
+    unlink(path);
+    unlink(notes_path);
+    if (err != 0) fprintf(stderr, "Benchmark setup failed: %s\n", strerror(err));
+    return err != 0 ? 2 : 0;
+}
+
+// Is this a valid username/password pair?
+int check_credentials(const char *username, const char *password) {
+    return strcmp(username, "ali") == 0 && strcmp(password, "1") == 0;
 }
 
 // Login function
@@ -993,7 +14016,7 @@ int login_user() {
         return 0;
     }
 
-    if (strcmp(username, "ali") == 0 && strcmp(password, "1") == 0) {
+    if (check_credentials(username, password)) {
         printf("Login successful.\n");
         return 1;
     } else {
@@ -1022,7 +14045,16 @@ void main_menu(UserContext *user_ctx) {
             printf("13. Search file content\n");
             printf("14. Set alias\n");
             printf("15. Use alias\n");
-            printf("16. Logout\n");
+            printf("16. Bulk copy files\n");
+            printf("17. Bulk move files\n");
+            printf("18. Bulk delete files\n");
+            printf("19. Restore from trash\n");
+            printf("20. Order store\n");
+            printf("21. Stock\n");
+            printf("22. Delivery schedule\n");
+            printf("23. Shipment log\n");
+            printf("24. Pack small files\n");
+            printf("25. Logout\n");
         } else if (strcmp(user_ctx->user_type, "warehouse") == 0) {
             printf("1. List files\n");
             printf("2. Move file\n");
@@ -1034,13 +14066,21 @@ void main_menu(UserContext *user_ctx) {
             printf("8. Append to file\n");
             printf("9. Set alias\n");
             printf("10. Use alias\n");
-            printf("11. Logout\n");
+            printf("11. Bulk move files\n");
+            printf("12. Bulk delete files\n");
+            printf("13. Restore from trash\n");
+            printf("14. Order store\n");
+            printf("15. Stock\n");
+            printf("16. Shipment log\n");
+            printf("17. Pack small files\n");
+            printf("18. Logout\n");
         } else if (strcmp(user_ctx->user_type, "customer") == 0) {
             printf("1. List files\n");
             printf("2. Copy file\n");
             printf("3. Append to file\n");
             printf("4. View file content\n");
-            printf("5. Logout\n");
+            printf("5. Bulk copy files\n");
+            printf("6. Logout\n");
         }
 
         char choice_str[10];
@@ -1098,6 +14138,33 @@ void main_menu(UserContext *user_ctx) {
                     use_alias(user_ctx);
                     break;
                 case 16:
+                    bulk_copy_files(user_ctx);
+                    break;
+                case 17:
+                    bulk_move_files(user_ctx);
+                    break;
+                case 18:
+                    bulk_delete_files(user_ctx);
+                    break;
+                case 19:
+                    restore_from_trash(user_ctx);
+                    break;
+                case 20:
+                    order_store_menu(user_ctx);
+                    break;
+                case 21:
+                    stock_menu(user_ctx);
+                    break;
+                case 22:
+                    delivery_schedule_menu(user_ctx);
+                    break;
+                case 23:
+                    shipment_log_menu(user_ctx);
+                    break;
+                case 24:
+                    pack_small_files(user_ctx);
+                    break;
+                case 25:
                     printf("Logging out.\n");
                     return;
                 default:
@@ -1137,6 +14204,27 @@ void main_menu(UserContext *user_ctx) {
                     use_alias(user_ctx);
                     break;
                 case 11:
+                    bulk_move_files(user_ctx);
+                    break;
+                case 12:
+                    bulk_delete_files(user_ctx);
+                    break;
+                case 13:
+                    restore_from_trash(user_ctx);
+                    break;
+                case 14:
+                    order_store_menu(user_ctx);
+                    break;
+                case 15:
+                    stock_menu(user_ctx);
+                    break;
+                case 16:
+                    shipment_log_menu(user_ctx);
+                    break;
+                case 17:
+                    pack_small_files(user_ctx);
+                    break;
+                case 18:
                     printf("Logging out.\n");
                     return;
                 default:
@@ -1158,6 +14246,9 @@ void main_menu(UserContext *user_ctx) {
                     view_file_content(user_ctx);
                     break;
                 case 5:
+                    bulk_copy_files(user_ctx);
+                    break;
+                case 6:
                     printf("Logging out.\n");
                     return;
                 default:
@@ -1172,6 +14263,34 @@ void main_menu(UserContext *user_ctx) {
 }
 
 // User type selection
+// Fill in the context for a role name; returns 0 for an unknown role.
+// Roles with aliases get the caller's table of ALIAS_MAX entries.
+int user_context_for_role(const char *role, UserContext *user_ctx, Alias *aliases, int *alias_count) {
+    memset(user_ctx, 0, sizeof(UserContext));
+    if (strcmp(role, "admin") == 0) {
+        user_ctx->user_type = "admin";
+        user_ctx->base_paths = admin_base_paths;
+        user_ctx->base_paths_count = 3;
+        user_ctx->aliases = aliases;
+        user_ctx->alias_count = alias_count;
+    } else if (strcmp(role, "warehouse") == 0) {
+        user_ctx->user_type = "warehouse";
+        user_ctx->base_paths = warehouse_base_paths;
+        user_ctx->base_paths_count = 2;
+        user_ctx->aliases = aliases;
+        user_ctx->alias_count = alias_count;
+    } else if (strcmp(role, "customer") == 0) {
+        user_ctx->user_type = "customer";
+        user_ctx->base_paths = customer_base_paths;
+        user_ctx->base_paths_count = 1;
+        user_ctx->aliases = NULL;
+        user_ctx->alias_count = NULL;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 void select_user_type() {
     while (1) {
         printf("\nSelect User Type:\n");
@@ -1186,27 +14305,16 @@ void select_user_type() {
         }
         int choice = atoi(choice_str);
 
+        // Every login starts a session with its own aliases
         UserContext user_ctx;
-        memset(&user_ctx, 0, sizeof(UserContext));
-
+        Alias aliases[ALIAS_MAX];
+        int alias_count = 0;
         if (choice == 1) {
-            user_ctx.user_type = "admin";
-            user_ctx.base_paths = admin_base_paths;
-            user_ctx.base_paths_count = 3;
-            user_ctx.aliases = admin_aliases;
-            user_ctx.alias_count = &admin_alias_count;
+            user_context_for_role("admin", &user_ctx, aliases, &alias_count);
         } else if (choice == 2) {
-            user_ctx.user_type = "warehouse";
-            user_ctx.base_paths = warehouse_base_paths;
-            user_ctx.base_paths_count = 2;
-            user_ctx.aliases = warehouse_aliases;
-            user_ctx.alias_count = &warehouse_alias_count;
+            user_context_for_role("warehouse", &user_ctx, aliases, &alias_count);
         } else if (choice == 3) {
-            user_ctx.user_type = "customer";
-            user_ctx.base_paths = customer_base_paths;
-            user_ctx.base_paths_count = 1;
-            user_ctx.aliases = NULL;
-            user_ctx.alias_count = NULL;
+            user_context_for_role("customer", &user_ctx, aliases, &alias_count);
         } else if (choice == 4) {
             printf("Exiting.\n");
             break;
@@ -1302,20 +14410,14 @@ typedef struct Alias {
     char command[256];
 } Alias;
 
-Alias admin_aliases[10];
-int admin_alias_count = 0;
-Alias warehouse_aliases[10];
-int warehouse_alias_count = 0;
+#define ALIAS_MAX 10
 
 
 الغرض: يسمح للمستخدمين بإنشاء اختصارات مخصصة (أسماء مستعارة) للأوامر.
 الهيكل:
 Alias: هيكل يحتوي على اسم الأمر والأمر المرتبط به.
-المتغيرات:
-admin_aliases: مصفوفة من الأسماء المستعارة للمسؤول.
-admin_alias_count: عداد لعدد الأسماء المستعارة للمسؤول.
-warehouse_aliases: مصفوفة من الأسماء المستعارة لموظفي المستودع.
-warehouse_alias_count: عداد لعدد الأسماء المستعارة للمستودع.
+ALIAS_MAX: الحد الأقصى لعدد الأسماء المستعارة في الجلسة الواحدة.
+ملاحظة: لا توجد جداول أسماء مستعارة عامة. لكل جلسة جدولها الخاص: جلسة القائمة التفاعلية (مصفوفة محلية في select_user_type تُمرر إلى user_context_for_role)، وكل جلسة دفعية أو اتصال بالخادم (BatchSession). لذلك تعمل جلسات كثيرة في خيوط مختلفة دون مشاركة أي حالة قابلة للتغيير.
 ملاحظة: العملاء ليس لديهم أسماء مستعارة في هذا الإعداد.
 هيكل سياق المستخدم
 // هيكل سياق المستخدم
@@ -1345,8 +14447,14 @@ int sanitize_filename(const char *filename, char *sanitized, size_t size);
 الغرض: يعلن عن جميع الدوال المستخدمة في البرنامج قبل تعريفها، مما يسمح للمترجم بفهم استخدامها في الكود.
 ملاحظة: تصريحات الدوال مهمة في لغة C لإعلام المترجم بأسماء الدوال، وأنواع الإرجاع، وأنواع المعاملات.
 4. الدالة الرئيسية (main)
-int main() {
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--connect") == 0) return client_main(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--bench-io") == 0) return bench_io_main(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--bench-orders") == 0) return bench_orders_main(argc, argv);
     initialize_paths();
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) return server_main(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0) return stress_main(argc, argv);
+    if (argc > 1) return batch_main(argc, argv);
     select_user_type();
     return 0;
 }
@@ -1354,8 +14462,21 @@ int main() {
 
 الغرض: نقطة الدخول للبرنامج.
 العمليات:
+--connect [SOCKET]: عميل خفيف يتصل بالخادم دون تهيئة أي شيء محليًا؛ يرسل سطر الدخول (مع --role و --user) ثم ينقل الإدخال القياسي إلى الخادم والردود إلى الإخراج القياسي.
+--bench-orders [ORDERS [PATH]]: مقياس أداء مخزن الطلبات (bench_orders_main) يعمل قبل أي تهيئة. يملأ مخزنًا مؤقتًا بعدد ORDERS من الطلبات (عشرة ملايين افتراضيًا) ويقيس عدّ حالة واحدة وزيارة طلباتها والملخص الكامل، مع قراءة عمود الحالة كاملًا كمرجع لسرعة الذاكرة، ثم يحذف المخزن.
+--bench-io [FILES [DIR]]: مقياس أداء (bench_io_main) يعمل قبل أي تهيئة. ينشئ شجرة اصطناعية من FILES ملف (مليون افتراضيًا) ويقيس الإنشاء والفحص وإعادة التسمية والنسخ والحذف بالواجهة المتزامنة ثم عبر io_uring، ويطبع عدد العمليات في الثانية لكل منهما ثم يحذف الشجرة.
 يستدعي initialize_paths لإعداد هيكل الدليل.
-يستدعي select_user_type لبدء عملية تفاعل المستخدم.
+تختار initialize_paths أيضًا واجهة العمليات الجماعية (fsop_bulk) من المتغير LOGISTICS_IO (sync أو uring، أو الاختيار التلقائي). الوضع التلقائي يفحص النواة ويستخدم io_uring إذا كانت تدعم العمليات المطلوبة وكان هناك أكثر من معالج، وإلا ينفذ نفس العمليات باستدعاءات نظام عادية. مسح الفحص الذي يجريه محدّث الفهرس يرسل كل 256 مدخلًا دفعة واحدة. كل عملية فحص تُجرى نسبةً إلى واصف الدليل الأب المخزن مؤقتًا بدل المسار الكامل، والنسخ الأكبر من 1 ميغابايت تُسلَّم إلى خيوط نسخ منفصلة (حتى أربعة) تعلم الحلقة بانتهائها عبر eventfd، فلا تتوقف الحلقة عن معالجة بقية العمليات أثناء نسخ ملف كبير.
+وتحدد initialize_paths مسار مخزن الطلبات (.logistics_orders) الذي يُربط بالذاكرة عند أول استخدام ويُغلق عند الخروج.
+وتشغل initialize_paths أيضًا خيط تفريغ سلة المحذوفات (trash_init) وفق LOGISTICS_TRASH_RETENTION و LOGISTICS_PURGE_RATE.
+وتحدد initialize_paths مسار جدول التوصيل (admin/delivery_schedules.db) وسجله، وتشغل خيط الدمج الخاص به (schedule_open).
+وتحدد initialize_paths دليل سجل الشحنات (warehouse/shipment_logs) وتشغل خيط ختم مقاطعه (shiplog_open) وفق LOGISTICS_SEGMENT_BYTES و LOGISTICS_SEGMENT_SECONDS.
+وتقرأ initialize_paths حدود حزم الملفات الصغيرة (pack_init) من LOGISTICS_PACK_MAX_BYTES و LOGISTICS_PACK_AGE.
+وتسجل initialize_paths ملفي المخزون admin/inventory.txt و warehouse/stock.dat (inventory_init) وتشغل خيط حفظهما كل LOGISTICS_INVENTORY_SNAPSHOT ثانية، ويحفظ inventory_shutdown ما تغير عند الخروج.
+--serve [SOCKET]: وضع الخادم (server_main). يستمع على مقبس Unix (.logistics.sock افتراضيًا) ويدير جلسات كثيرة بحلقة epoll واحدة. كل اتصال له UserContext خاص به ويبدأ بسطر login ROLE USER PASSWORD ثم أوامر بنفس صيغة الوضع الدفعي. الاتصالات الجاهزة تُسلم إلى مجموعة من الخيوط العاملة، والفهارس والذاكرات المؤقتة مشتركة بين كل الجلسات. يتوقف بأمان عند SIGINT أو SIGTERM.
+--stress [SESSIONS [ROUNDS]] --user NAME: اختبار ضغط مدمج (stress_main). يشغل مئات الجلسات معًا على مجموعة من الخيوط عبر نفس الطبقة التي تخدم الوضع الدفعي والخادم، ولكل جلسة مجلد وأسماء مستعارة خاصة. يتحقق من نجاح كل الأوامر ومن أن السجل المشترك يحتوي سطرًا واحدًا لكل إضافة. عند البناء مع -fsanitize=thread يكشف أيضًا أي تسابق على البيانات.
+إذا مُررت وسائط سطر الأوامر يعمل في الوضع الدفعي (batch_main): --batch [FILE] --role ROLE --user NAME مع كلمة المرور في المتغير LOGISTICS_PASSWORD. يسجل الدخول مرة واحدة، ثم ينفذ أمرًا نصيًا في كل سطر (مثل copy SRC DST --from warehouse --to customers) بعد التحقق من أن الدور يسمح به، ويطبع سطر حالة STATUS مفصولًا بعلامات الجدولة لكل أمر وسطر SUMMARY في النهاية. الأمران find PATTERN (مع --size و--age و--ignore-case) وsearch KEYWORD يعملان مثل البحث عن ملف والبحث في المحتوى في القوائم ويطبعان المسارات أو الأسطر المطابقة بالشكل path:line:text. الأمر alias NAME "COMMAND" يعرّف اسمًا مستعارًا في الجلسة، والسطر الذي يبدأ به ينفذ الأمر مع بقية السطر. نوايا أوامر كل نافذة من 256 أمرًا تُكتب في السجل بكتابة واحدة و fdatasync واحد.
+وإلا يستدعي select_user_type لبدء عملية تفاعل المستخدم.
 يعيد القيمة 0، مما يشير إلى تنفيذ ناجح.
 5. دالة تهيئة المسارات (initialize_paths)
 void initialize_paths() {
@@ -1378,8 +14499,8 @@ void initialize_paths() {
 admin_base_paths: يحتوي على المسارات التي يمكن للمسؤول الوصول إليها.
 warehouse_base_paths: يحتوي على المسارات لموظفي المستودع.
 customer_base_paths: يحتوي على المسارات للعملاء.
-إنشاء الأدلة: يستخدم استدعاءات system مع mkdir -p لإنشاء الأدلة إذا لم تكن موجودة.
-ملاحظة: على الرغم من استخدام system هنا، يفضل استخدام دالة mkdir من sys/stat.h لأمان وتحكم أفضل.
+إنشاء الأدلة: يستخدم fsop_mkdir_p لإنشاء الأدلة إذا لم تكن موجودة، ويخرج برسالة خطأ عند الفشل.
+استعادة العمليات المنقطعة: يقرأ سجل العمليات .logistics_journal، وكل عملية لها سجل نية دون سجل اكتمال تُكمل (حذف شجرة، إعادة نسخ، إنهاء نقل) قبل بناء الفهرس، ثم يُفرغ السجل. سجل النية يحفظ الجهاز ورقم inode والحجم ووقت التعديل للمسارات عند كتابته، ولا تُكمل العملية إلا إذا كانت الملفات الحالية هي نفسها، فلا يُحذف ملف أو مجلد أُنشئ لاحقًا بالاسم نفسه. وسجل الاكتمال يُكتب بعد كل أمر مباشرة. كل أمر يغير الملفات يكتب نيته في السجل قبل التنفيذ، وتُجمع النوايا المتزامنة في كتابة واحدة مع fdatasync واحد. السجل ملك لعملية واحدة تحمل عليه قفل flock حصريًا؛ والعملية الثانية التي تبدأ أثناء تشغيل الأولى (مثل --batch بجانب --serve) لا تستعيد منه ولا تفرغه وتعمل دون سجل.
 6. دالة تنقية اسم الملف (sanitize_filename)
 int sanitize_filename(const char *filename, char *sanitized, size_t size) {
     // تحقق ونسخ اسم الملف إلى المخزن المنقح
@@ -1405,9 +14526,11 @@ int is_valid_path(const char **base_paths, int base_paths_count, const char *pat
 
 الغرض: يتأكد من أن أي عمليات على الملفات أو الأدلة تتم داخل الأدلة المسموح بها للمستخدم.
 العملية:
-حل المسار الحقيقي: يستخدم realpath لحل الروابط الرمزية والحصول على المسار المطلق.
-التحقق من الدليل الأصلي: إذا لم يكن المسار موجودًا بعد، يحل دليل الأصلي.
-المقارنة مع المسارات الأساسية: يتحقق مما إذا كان المسار المحلول يبدأ بأي من المسارات الأساسية المسموح بها.
+الأدلة الأساسية تُفتح مرة واحدة عند بدء التشغيل (confine_add_root) ويُحتفظ بواصفاتها.
+يرفض أولًا أي مسار داخل سلة المحذوفات (trash_contains)، فلا يُوصل إليها إلا عبر الاستعادة.
+المقارنة مع المسارات الأساسية: يتحقق نصيًا من أن المسار يقع تحت أحد المسارات المسموح بها للمستخدم.
+الحل داخل النواة: يفتح الهدف نسبةً إلى واصف الدليل الأساسي باستخدام openat2 مع RESOLVE_BENEATH و RESOLVE_NO_MAGICLINKS، فترفض النواة أي .. أو رابط رمزي يخرج من الدليل في نفس عملية البحث. إذا لم يكن الهدف موجودًا بعد، يفتح الدليل الأصلي بنفس الطريقة. لأن RESOLVE_BENEATH يرفض كل رابط رمزي هدفه مسار مطلق (والروابط التي ينشئها create_symbolic_link مطلقة)، يُحل المسار عند هذا الرفض بـ realpath ويُعاد فتحه مقيدًا تحت الدليل الأساسي الذي يقع فيه، بعد التحقق من أنه ضمن الأدلة المسموح بها للمستخدم.
+عمليات الملفات نفسها (fsop_open_parent، فتح مصدر النسخ، عرض الملف) تستخدم confine_open أيضًا، فلا توجد فجوة بين التحقق والاستخدام. على الأنوية التي لا تدعم openat2 يعود إلى المقارنة باستخدام realpath.
 أهمية للأمان: يمنع المستخدمين من الوصول أو تعديل الملفات خارج أدلتهم المخصصة.
 8. دالة الحصول على الإدخال من المستخدم (get_input)
 char *get_input(const char *prompt, char *buffer, size_t size) {
@@ -1422,7 +14545,7 @@ char *get_input(const char *prompt, char *buffer, size_t size) {
 يستخدم fgets لتجنب تجاوزات المخزن المؤقت.
 يستخدم strcspn لإزالة حرف السطر الجديد من الإدخال.
 9. دالة اختيار المسار الأساسي مع خيار "أخرى" (select_base_path_with_other)
-const char* select_base_path_with_other(UserContext *user_ctx, const char *prompt) {
+const char* select_base_path_with_other(UserContext *user_ctx, const char *prompt, char *path_buffer) {
     // يسمح للمستخدم باختيار مسار أساسي أو تحديد دليل فرعي داخل مسار أساسي مسموح به
     // يعيد المسار المحدد أو NULL عند الفشل
 }
@@ -1439,7 +14562,7 @@ const char* select_base_path_with_other(UserContext *user_ctx, const char *promp
 يطالب المستخدم باختيار دليل أساسي.
 يطلب اسم الدليل الفرعي.
 يتحقق من اسم الدليل الفرعي باستخدام sanitize_filename.
-ينشئ المسار الكامل ويتحقق مما إذا كان الدليل موجودًا.
+ينشئ المسار الكامل في path_buffer الذي يوفره المستدعي (بحجم PATH_MAX) ويتحقق مما إذا كان الدليل موجودًا. لا يوجد مخزن ثابت مشترك، فتبقى النتيجتان صحيحتين عندما تختار دوال مثل النسخ والنقل "أخرى" للمصدر والوجهة معًا، ويمكن استدعاء الدالة من عدة خيوط.
 الاستخدام في الدوال الأخرى: يتم استدعاء هذه الدالة كلما احتاج البرنامج إلى تحديد الدليل لعملية ما.
 10. دوال إجراءات المستخدم
 هذه الدوال تنفذ عمليات الملفات المختلفة المتاحة للمستخدمين.
@@ -1452,8 +14575,9 @@ void list_files(UserContext *user_ctx) {
 
 الغرض: يعرض قائمة بالملفات التي يمكن للمستخدم الوصول إليها.
 العملية:
-يتنقل عبر المسارات الأساسية للمستخدم.
-يستخدم أمر find عبر popen لعرض الملفات.
+يجيب من فهرس المسارات في الذاكرة (nsindex) الذي يُبنى عند بدء التشغيل أو يُحمّل من ملف اللقطة .logistics_index، ويبقى محدثًا عبر inotify. بعد التحميل من اللقطة تُفحص المجلدات فورًا، أما الملفات فتبقى غير مؤكدة حتى يمر عليها خيط التحديث في الخلفية، وكل بحث يحتاج حجم ملف غير مؤكد أو وقت تعديله يفحصه بنفسه بـ lstat.
+إذا لم يكن الفهرس متاحًا يمر على جميع المسارات الأساسية معًا باستخدام walk_trees، وهو مستعرض متوازٍ يقرأ الأدلة عبر getdents64 على مجموعة من الخيوط مع سرقة العمل بينها.
+يجمع مسارات الملفات في مخازن مؤقتة لكل خيط ثم يطبعها مجمعة تحت كل دليل أساسي.
 يعد ويعرض عدد الملفات في كل دليل.
 ب. تغيير الأذونات
 void change_permissions(UserContext *user_ctx) {
@@ -1490,8 +14614,9 @@ void delete_directory(UserContext *user_ctx) {
 
 
 العملية:
-مشابهة لـ create_directory، ولكن يستخدم system("rm -rf ...") لإزالة الدليل.
-ملاحظة: استخدام rm -rf يمكن أن يكون خطيرًا؛ من الأفضل استخدام rmdir للأدلة الفارغة أو remove بشكل متكرر.
+مشابهة لـ create_directory، ولكن ينقل الدليل أولًا إلى سلة المحذوفات بـ trash_move (إعادة تسمية واحدة مهما كان حجم الشجرة). إذا كانت السلة معطلة أو تعذر النقل (EXDEV) يستخدم rmtree_run لإزالة الدليل ومحتوياته باستخدام unlinkat على واصفات الأدلة دون تشغيل الصدفة.
+الأدلة الفرعية توضع في مكدس مشترك تأخذ منه مجموعة محدودة من الخيوط، فتُحذف الأشجار الفرعية المتجاورة بالتوازي. يُحذف كل دليل بعد آخر دليل فرعي فيه. الأدلة تُفتح نسبة إلى قمة الشجرة دون اتباع أي رابط رمزي (RESOLVE_NO_SYMLINKS)، والرابط الرمزي داخل الشجرة يُحذف كملف ولا يُمس ما يشير إليه.
+يعرض التقدم (عدد الملفات والأدلة المحذوفة) عدة مرات في الثانية. Ctrl-C يوقف الحذف بين مدخلين، فيبقى الجزء غير المحذوف سليمًا، ويُسجل الإلغاء في السجل حتى لا يكمله الاسترداد.
 هـ. إنشاء ملف
 void create_file(UserContext *user_ctx) {
     // يسمح للمستخدم بإنشاء ملف جديد داخل المسارات المسموح بها
@@ -1504,8 +14629,7 @@ void create_file(UserContext *user_ctx) {
 اختيار المسار الأساسي: يختار مكان إنشاء الملف.
 إنشاء المسار الكامل: يبني المسار الكامل.
 التحقق من صلاحية المسار: يتحقق من أن الملف غير موجود.
-إنشاء الملف: يستخدم system("touch ...") لإنشاء ملف فارغ.
-ملاحظة: من الأفضل استخدام fopen لإنشاء ملف.
+إنشاء الملف: يستخدم fsop_create_file (openat مع O_CREAT) لإنشاء ملف فارغ.
 و. حذف ملف
 void delete_file(UserContext *user_ctx) {
     // يسمح للمستخدم بحذف ملف داخل المسارات المسموح بها
@@ -1513,8 +14637,7 @@ void delete_file(UserContext *user_ctx) {
 
 
 العملية:
-مشابهة لـ create_file، ولكن يحذف الملف باستخدام system("rm ...").
-ملاحظة: من الأفضل استخدام remove من stdio.h.
+مشابهة لـ create_file، ولكن ينقل الملف إلى سلة المحذوفات بـ trash_move، ولا يحذفه مباشرة بـ fsop_delete_file (unlinkat) إلا إذا كانت السلة معطلة.
 ز. إنشاء رابط رمزي
 void create_symbolic_link(UserContext *user_ctx) {
     // يسمح للمسؤول بإنشاء رابط رمزي
@@ -1527,7 +14650,7 @@ void create_symbolic_link(UserContext *user_ctx) {
 اختيار الأدلة: يختار الأدلة للهدف والرابط.
 إنشاء المسارات: يبني المسارات الكاملة.
 التحقق من صلاحية المسارات: يتحقق من الصلاحية والوجود.
-إنشاء الرابط: يستخدم system("ln -s ...") لإنشاء الرابط الرمزي.
+إنشاء الرابط: يستخدم fsop_symlink (symlinkat) لإنشاء الرابط الرمزي.
 ح. نسخ ملف
 void copy_file(UserContext *user_ctx) {
     // يسمح للمستخدم بنسخ ملف داخل المسارات المسموح بها
@@ -1535,7 +14658,7 @@ void copy_file(UserContext *user_ctx) {
 
 
 العملية:
-مشابهة للدوال السابقة ولكن يستخدم system("cp ...") لنسخ الملف.
+مشابهة للدوال السابقة ولكن يستخدم fsop_copy_file لنسخ الملف مع الحفاظ على الأذونات: يحاول أولًا الاستنساخ (FICLONE)، ثم copy_file_range، ثم sendfile، وأخيرًا القراءة والكتابة العادية، ويعرض عدد البايتات وسرعة النسخ.
 التحقق:
 يتم التحقق من كلا المسارين المصدر والوجهة.
 وجود الملف المصدر.
@@ -1546,7 +14669,7 @@ void move_file(UserContext *user_ctx) {
 
 
 العملية:
-مشابهة لنسخ الملف، ولكن يستخدم system("mv ...").
+مشابهة لنسخ الملف، ولكن يستخدم fsop_rename (renameat2 مع RENAME_NOREPLACE) فلا يستبدل ملفًا موجودًا في الوجهة. عند النقل بين أنظمة ملفات مختلفة ينسخ البيانات إلى ملف مؤقت ثم fsync ثم يربطه في الوجهة وبعدها فقط يحذف المصدر.
 ملاحظة: ينقل الملف إلى موقع جديد، مما قد يغير مساره.
 ي. إضافة نص إلى ملف
 void append_to_file(UserContext *user_ctx) {
@@ -1559,8 +14682,8 @@ void append_to_file(UserContext *user_ctx) {
 تنقية الإدخال: يتحقق من صحة اسم الملف.
 اختيار المسار الأساسي: يختار مكان الملف.
 الحصول على النص: يطلب من المستخدم النص لإضافته.
-هروب الأحرف الخاصة: يضمن أن النص لن يكسر أمر الصدفة.
-إضافة النص: يستخدم system("echo ... >> file") لإضافة النص.
+إضافة النص: يستخدم append_record الذي يفتح الملف بـ O_APPEND ويكتب النص مع سطر جديد دون أي أمر صدفة.
+الطلبات المتزامنة على نفس الملف تُجمع في استدعاء writev واحد، وسياسة المزامنة يحددها المتغير LOGISTICS_APPEND_SYNC (none أو batch أو record، والافتراضي batch)، ويُبلغ المستخدم إذا وصل النص إلى القرص.
 ملاحظة: استخدام fopen في وضع الإلحاق "a" أكثر أمانًا وكفاءة.
 ك. عرض محتوى ملف
 void view_file_content(UserContext *user_ctx) {
@@ -1573,7 +14696,8 @@ void view_file_content(UserContext *user_ctx) {
 تنقية الإدخال: يتحقق من صحة اسم الملف.
 اختيار المسار الأساسي: يختار دليل الملف.
 اختيار خيار العرض: الملف بالكامل، أو البداية، أو النهاية.
-عرض المحتوى: يستخدم system("cat"، "head"، أو "tail") لعرض محتوى الملف.
+عرض المحتوى: يستخدم محرك العرض الداخلي بدلًا من cat وhead وtail: view_whole يرسل الملف كاملًا إلى المخرج عبر sendfile أو splice دون نسخه إلى ذاكرة البرنامج، وview_head يتوقف عند السطر الجديد رقم N، وview_tail يقرأ كتلًا ثابتة الحجم من نهاية الملف إلى الخلف حتى يجد بداية آخر N سطر.
+خيار نطاق الأسطر (r): يستخدم فهرسًا جانبيًا في .logistics_lines يحفظ موضع كل 4096 سطرًا، يُبنى عند أول استخدام ويُمدد عند إضافة أسطر جديدة إلى الملف، فيقفز مباشرة إلى أقرب نقطة ثم يقرأ مسافة قصيرة.
 ل. البحث عن ملف
 void find_file(UserContext *user_ctx) {
     // يسمح للمستخدم بالبحث عن ملفات تطابق نمطًا معينًا
@@ -1582,7 +14706,9 @@ void find_file(UserContext *user_ctx) {
 
 العملية:
 يطلب نمط اسم الملف (مثل "*.txt").
-يبحث داخل الأدلة المسموح بها باستخدام system("find ...").
+يسأل عن تجاهل حالة الأحرف، وعن مرشحات اختيارية للحجم (+10k، -2M) وتاريخ التعديل بالأيام (-7، +30).
+يترجم النمط مرة واحدة عبر glob_compile إلى رموز (نص حرفي، ?، *، [...]) ثم يطابق الأسماء باستخدام glob_match.
+يطبق النمط والمرشحات في مرور واحد على فهرس المسارات في الذاكرة، أو عبر walk_trees إذا لم يكن الفهرس متاحًا، ويعرض النتائج مرتبة لكل دليل أساسي.
 م. البحث في المحتوى
 void search_content(UserContext *user_ctx) {
     // يسمح للمستخدم بالبحث عن كلمة مفتاحية داخل الملفات
@@ -1591,7 +14717,98 @@ void search_content(UserContext *user_ctx) {
 
 العملية:
 يطلب كلمة مفتاحية.
-يبحث داخل الأدلة المسموح بها باستخدام system("grep -r ...").
+يجمع ملفات الأدلة المسموح بها مرتبة، ثم يبحث فيها بالتوازي عبر content_search_file: يربط كل ملف بالذاكرة (mmap) ويبحث عن الكلمة كنص حرفي باستخدام تعليمات SSE2 أو AVX2 لمقارنة أول وآخر حرف من الكلمة على 16 أو 32 بايتًا دفعة واحدة.
+يعرض كل سطر مطابق بالشكل path:line:text مع الحفاظ على ترتيب الملفات.
+للكلمات التي طولها 3 أحرف أو أكثر يستخدم فهرس الثلاثيات (.logistics_trigrams) لتضييق الملفات المرشحة: يتقاطع قوائم الملفات لكل ثلاثية في الكلمة، ويفحص دائمًا الملفات الجديدة أو التي تغير حجمها أو وقت تعديلها ويعيد فهرستها في نفس المرور. الملفات المعاد فهرستها تُضاف إلى السجل .logistics_trigrams.log بدل إعادة كتابة الفهرس كله، ويُكتب فهرس جديد فقط عندما يكبر السجل. يمكن تعطيله بضبط المتغير LOGISTICS_NO_TRIGRAMS.
+ن. النسخ والنقل والحذف الجماعي بنمط
+void bulk_copy_files(UserContext *user_ctx);
+void bulk_move_files(UserContext *user_ctx);
+void bulk_delete_files(UserContext *user_ctx) {
+    // تطبق العملية على كل الملفات التي تطابق نمطًا مثل *.ship في دليل واحد
+}
+
+
+العملية:
+يطلب النمط ثم دليل المصدر، ودليل الوجهة عند النسخ أو النقل، ثم يسأل عن التشغيل التجريبي.
+bulk_plan يتحقق من الدليلين مرة واحدة فقط، ثم يقرأ الدليل ويطابق أسماء الملفات العادية بالنمط (الأسماء التي تبدأ بنقطة لا تطابق إلا نمطًا يبدأ بنقطة) ويرفض أن يكون المصدر والوجهة نفس الدليل.
+bulk_run يقسم الملفات إلى مجموعات من 256 ملفًا توزع على مجموعة محدودة من الخيوط (عدد المعالجات، وأربعة على الأقل). كل خيط ينفذ مجموعاته عبر سياق fsop_bulk خاص به، وتُكتب نوايا كل مجموعة في السجل بكتابة واحدة.
+يطبع نتيجة كل ملف ثم ملخصًا بعدد الناجح والفاشل. التشغيل التجريبي لا يغير شيئًا: يفحص الوجهات فقط ويبين أي ملف سيُستبدل وأي نقل سيفشل لأن الوجهة موجودة.
+في الوضع الدفعي تتوفر نفس العمليات بالأوامر bulk-copy و bulk-move و bulk-delete مع الخيار --dry-run.
+س. سلة المحذوفات
+void restore_from_trash(UserContext *user_ctx) {
+    // يعرض المحذوفات من أحدثها ويعيد العنصر المختار إلى مكانه
+}
+
+
+العملية:
+لكل دليل أساسي دليل مخفي .trash في أعلاه. trash_move ينقل العنصر المحذوف إليه بـ renameat2 باسم SECONDS-PID-COUNTER، بعد أن يكتب ملفًا جانبيًا ID.origin فيه المسار النسبي الأصلي.
+trash_restore يعيده بـ renameat2 مع RENAME_NOREPLACE، فلا يستبدل شيئًا أُنشئ في نفس المسار بعد الحذف.
+is_valid_path يرفض أي مسار داخل .trash، والماشي المتوازي والفهرس يتجاهلانه، فلا يظهر في القوائم ولا البحث.
+خيط خلفي (trash_init و trash_shutdown) يحذف العناصر التي مضى عليها LOGISTICS_TRASH_RETENTION ثانية (ساعة افتراضيًا، و 0 يعطل السلة) عبر rmtree_run، بمعدل لا يتجاوز LOGISTICS_PURGE_RATE مدخلًا في الثانية (2000 افتراضيًا)، ويتوقف فورًا عند الخروج.
+في الوضع الدفعي يستخدم delete و rmdir السلة أيضًا، والأمر restore PATH يعيد أحدث عنصر حُذف من PATH. الحذف الجماعي يبقى فوريًا.
+ع. مخزن الطلبات
+void order_store_menu(UserContext *user_ctx) {
+    // استيراد وتصدير ملفات .track وملخص الحالات وعرض الطلبات
+}
+
+
+العملية:
+الطلبات محفوظة عمودًا عمودًا في الملف .logistics_orders المربوط بالذاكرة (mmap): صفحة ترويسة ثم مصفوفات ثابتة العرض لأرقام الطلبات والحالات (بايت واحد لكل طلب) وأرقام المستودعات وأوقات الإنشاء والتحديث ومواقع الملاحظات. عندما يمتلئ يُبنى ملف بضعف السعة ويُعاد تسميته فوق القديم.
+الملاحظات النصية في ملف منفصل .logistics_orders.notes يُضاف إليه فقط، والملاحظة التي لم تتغير تبقى في مكانها.
+order_store_scan يقرأ عمود الحالة وحده ويقارن 32 طلبًا بتعليمة AVX2 واحدة (أو 16 مع SSE2)، فيعمل بسرعة الذاكرة بدل فتح ملف لكل طلب. جدول تجزئة في الذاكرة يربط رقم الطلب بصفه.
+order_store_import يقرأ ملفات order_NNN.track بالتوازي: الأسطر status: و warehouse: و created: تحدد الحقول (الأخير يفوز، فإضافة "status: delivered" تحدّث الطلب)، وباقي الأسطر ملاحظات. order_store_export يكتب نفس الصيغة، كل ملف باسم مؤقت ثم إعادة تسمية.
+في الوضع الدفعي: orders-import و orders-export و orders STATUS و orders-count.
+للمخزن مالك واحد: أول عملية تستخدمه تأخذ قفل flock حصريًا على .logistics_orders حتى خروجها (ويُقفل الملف الجديد قبل إعادة تسميته عند التكبير)، وأي عملية أخرى تتلقى EBUSY من كل استدعاء وتصل إلى مخزن المالك عبر --connect.
+الإضافة تكتب الملاحظة والصف وتحدّث نسخة الترويسة في الذاكرة فقط؛ order_store_sync (في نهاية كل استيراد وعند الخروج) يزامن الملاحظات ثم الأعمدة ثم يكتب الترويسة ويزامنها، فلا تعدّ الترويسة بعد انقطاع مفاجئ صفًا أو ملاحظة لم تصل إلى القرص.
+ف. المخزون
+void stock_menu(UserContext *user_ctx) {
+    // الاستعلام عن صنف وزيادة مخزونه أو إنقاصه وعرض الأصناف المنخفضة
+}
+
+
+العملية:
+كل سطر في admin/inventory.txt و warehouse/stock.dat هو SKU ثم الكمية ثم اسم اختياري. يُحمّل الملف عند أول استخدام في جدول تجزئة بالعنونة المفتوحة مفتاحه SKU، وكل خانة فيه 64 بايتًا (سطر ذاكرة مخبئية واحد)، فالبحث O(1).
+inventory_adjust يغير الكمية بعملية ذرية (compare-and-swap) تحت قفل القراءة، فتعمل التعديلات من جلسات كثيرة بالتوازي، ويرفض إنقاص الكمية تحت الصفر (ERANGE). الصنف الجديد وحده يأخذ قفل الكتابة.
+التغييرات لا تعيد كتابة الملف مباشرة: لقطة (inventory_snapshot) تنسخ الجدول تحت قفل الكتابة، ثم تكتب النسخة في ملف مؤقت وتعيد تسميته فوق الأصلي. خيط خلفي يحفظ الملفات المتغيرة كل LOGISTICS_INVENTORY_SNAPSHOT ثانية (30 افتراضيًا، و 0 للحفظ عند الخروج فقط)، ويعيد تحميل الملف إذا عدّله غيره؛ وإن كانت هناك تغييرات غير محفوظة يُطبَّق تغيّر كل صنف منذ آخر حفظ على كميته في الملف المعدَّل (inventory_merge_locked) بدل الكتابة فوقه. أسطر التعليقات والأسطر غير المفهومة تبقى في مكانها.
+المسؤول يصل إلى الملفين، وموظف المستودع إلى stock.dat فقط. في الوضع الدفعي: stock SKU و stock-adjust SKU DELTA مع --in admin أو --in warehouse.
+ص. جدول التوصيل
+void delivery_schedule_menu(UserContext *user_ctx) {
+    // جدولة توصيل وإلغاؤه وعرض التوصيلات في فترة زمنية
+}
+
+
+العملية:
+الملف admin/delivery_schedules.db تشغيلة مرتبة (sorted run): ترويسة من 64 بايتًا ثم سجلات ثابتة الحجم (64 بايتًا) مرتبة حسب وقت التوصيل ثم رقم المسار، مربوطة بالذاكرة للقراءة فقط. الاستعلام عن فترة يجد بدايتها بالبحث الثنائي، فكلفته لوغاريتمية في حجم الجدول إضافة إلى عدد النتائج.
+التوصيلات الجديدة والإلغاءات تذهب إلى قائمة تخطي (skiplist) في الذاكرة وإلى السجل .logistics_schedule_log الذي يُعاد تشغيله بعد أي انهيار. عندما تبلغ القائمة 4096 عنصرًا يجمّدها خيط خلفي مع سجلها ويبدأ قائمة وسجلًا جديدين، ثم يدمج المجمدة مع التشغيلة في تشغيلة جديدة يعيد تسميتها فوق القديمة.
+الاستعلامات تدمج التشغيلة والقائمتين والأحدث يفوز، فلا تنتظر انتهاء الدمج. عند الخروج يُدمج ما تبقى (schedule_close).
+القوائم في ذاكرة عملية واحدة، لذا للسجل مالك واحد يأخذ عليه قفل flock حصريًا حتى خروجه، وأي عملية أخرى تتلقى EBUSY. عند الدمج يُجهّز السجل الجديد باسم .new ويُقفل قبل إعادة تسميته فوق القديم (الذي رُبط باسم .frozen أولًا)، فالمسار يشير دائمًا إلى ملف مقفل.
+الأوقات تُكتب YYYY-MM-DD HH:MM أو HH:MM لليوم أو بثوانٍ يونكس. في الوضع الدفعي (للمسؤول): schedule-add و schedule-cancel و schedule FROM TO DEPOT.
+ق. سجل الشحنات
+void shipment_log_menu(UserContext *user_ctx) {
+    // إضافة قيد وعرض القيود في فترة زمنية وعرض المقاطع وختمها وضغط الملفات القديمة
+}
+
+
+العملية:
+القيود الجديدة تُضاف (shiplog_append) إلى المقطع النشط warehouse/shipment_logs/current.log، وكل قيد سطر يبدأ بوقته YYYY-MM-DD HH:MM:SS.
+خيط خلفي يختم المقطع النشط عندما يبلغ LOGISTICS_SEGMENT_BYTES بايتًا (4 ميغابايت افتراضيًا) أو يمضي على أول قيد فيه LOGISTICS_SEGMENT_SECONDS ثانية (يوم افتراضيًا): يعيد تسميته sealing-NNNNNN.log ثم يضغطه في shipments-NNNNNN.lseg ويحذفه. إذا انقطع الختم يُعاد عند التشغيل التالي.
+يمكن لعدة عمليات مشاركة المجلد: من يضيف قيدًا يأخذ قفل flock مشتركًا على current.log ويعيد فتحه إذا صار المسار يشير إلى ملف آخر، والختم يأخذه حصريًا ويربطه بأول رقم sealing-NNNNNN.log متاح ثم يحذفه. ومن يضغط ملف sealing يأخذ عليه قفلًا حصريًا، ومن لا يحصل عليه يتركه لصاحبه. الاستعادة تمر على كل الملفات المعلقة مهما كان عددها.
+المقطع المختوم ترويسة من 64 بايتًا فيها المدى الزمني لقيوده، ثم كتل من نحو 64 كيلوبايت من أسطر كاملة مضغوطة كل منها وحدها بضاغط LZ77 مدمج، ثم فهرس الكتل (موضع كل كتلة وأول سطر فيها ومداها الزمني) ومرشح Bloom لثلاثيات كل كتلة.
+view_file_content والأمر view يعرضان المقطع كنصه الأصلي، لكن البداية والنهاية ومدى الأسطر لا تفك إلا الكتل التي تحتويها (segment_view). البحث في المحتوى (segment_search) يتجاوز الكتل التي ينفي مرشحها وجود الكلمة، وفهرس الثلاثيات يفهرس النص المفكوك لا البايتات المضغوطة. الاستعلام الزمني (shiplog_query) يتجاوز المقاطع والكتل خارج الفترة.
+المقاطع المختومة للقراءة فقط. shiplog_compress يضغط الملفات العادية القديمة في الدليل، فيصبح notes.log هو notes.log.lseg.
+في الوضع الدفعي (للمسؤول وموظف المستودع): shiplog-append و shiplog FROM TO TEXT و shiplog-seal و shiplog-compress.
+ر. حزم الملفات الصغيرة
+void pack_small_files(UserContext *user_ctx) {
+    // ينقل الملفات الصغيرة الباردة في الدليل المختار وما تحته إلى ملف حزمة في كل دليل
+}
+
+
+العملية:
+pack_tree يمر على الدليل وما تحته، ثم يحزم الأدلة بالتوازي. في كل دليل تُختار الملفات العادية غير المخفية ذات الرابط الواحد التي لا يتجاوز حجمها LOGISTICS_PACK_MAX_BYTES بايتًا (16384 افتراضيًا) ولم تتغير منذ LOGISTICS_PACK_AGE ثانية (سبعة أيام افتراضيًا).
+الحزمة .logistics_pack ترويسة من 64 بايتًا ثم محتويات الملفات ثم فهرس مرتب بالاسم (الموضع والحجم ووقت التعديل والصلاحيات و CRC-32 لكل ملف) ثم الأسماء. تُكتب في ملف مؤقت وتُعاد تسميتها فوق القديمة، ثم يُحذف كل ملف أصلي لم يتغير منذ قراءته. يُقرأ الملف من نفس الواصف الذي فُحص عليه ويبقى مفتوحًا حتى حذفه، مع عقد قراءة (F_SETLEASE) حين يسمح نظام الملفات: لا يُمنح العقد إذا كان الملف مفتوحًا للكتابة في أي مكان فيُترك الملف، وأي فتح جديد للكتابة ينتظر حتى يُحرر العقد، فلا يمكن إضافة بيانات بين الفحص الأخير والحذف. بدون العقد يُعاد فحص الملف بـ fstat قبل الحذف مباشرة.
+القراءة شفافة: العرض والنسخ والبحث عن الملفات وفي المحتوى واستيراد الطلبات تجد العضو بالبحث الثنائي في الفهرس وتتحقق من CRC، ويُقرأ عبر memfd (pack_openat).
+قبل أي تعديل (الصلاحيات، الحذف، الإلحاق، النقل، الروابط، النسخ فوق الملف، والعمليات الجماعية) يُفك العضو (pack_unpack) إلى ملف عادي ويُعلَّم في الفهرس ميتًا. الملف العادي بالاسم نفسه يحجب العضو دائمًا، والأعضاء الميتة تُحذف في الحزمة التالية.
+في الوضع الدفعي (للمسؤول وموظف المستودع): pack مع --in (customers افتراضيًا).
 11. دوال إدارة الأسماء المستعارة
 هذه الدوال تسمح للمستخدمين بتعيين واستخدام الأسماء المستعارة للأوامر، مما يوفر الوقت على المهام المتكررة.
 